@@ -0,0 +1,742 @@
+#include <mpi.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+#include "fast_ann/benchmark/recall.h"
+#include "fast_ann/benchmark/report.h"
+#include "fast_ann/benchmark/timer.h"
+#include "fast_ann/data_readers/xvecs_reader.h"
+#include "fast_ann/index_factory.h"
+#include "fast_ann/log_sinks/scoped_log_sink.h"
+#include "fast_ann/logger.h"
+#include "fast_ann/quantizers/half_precision.h"
+#include "fast_ann/search_algorithms/tiered_hnsw_search.h"
+#include "fast_ann/search_algorithms/vp_tree_hnsw_search.h"
+#include "fast_ann/search_algorithms/vp_tree_search.h"
+#include "hnswlib/hnswlib.h"
+
+typedef std::vector<std::vector<fast_ann::DatasetIndexType>> ResultIds;
+
+struct BenchmarkSetting {
+    BenchmarkSetting()
+        : M(0),
+          ef_construction(0),
+          ef(0),
+          patience(0),
+          distance_ratio(0),
+          beam_width(0),
+          group_size(0) {}
+
+    size_t M;
+    size_t ef_construction;
+    size_t ef;
+    size_t patience;
+    float distance_ratio;
+    size_t beam_width;
+    size_t group_size;
+    double build_seconds;
+    // Bytes the index allocated for its vectors or codes, ids and links over
+    // its whole capacity, from its own accounting rather than the resident
+    // size of the process. Tiered leaves out the graph and vectors on SSD.
+    size_t index_bytes;
+};
+
+const std::vector<std::string> kReportColumns = {
+    "algorithm",      "metric",         "precision",
+    "ranks",          "k",              "M",
+    "ef_construction", "ef",            "patience",
+    "distance_ratio", "beam_width",     "group_size",
+    "build_seconds",  "index_bytes",    "qps",
+    "p50_micros",     "p99_micros",     "p999_micros",
+    "recall_at_1",    "recall_at_10",   "recall_at_100"};
+
+// Storage precision of the indexed vectors, queries are converted to it.
+enum Precision { FLOAT32, FLOAT16, BFLOAT16 };
+
+// Queries used to learn the distance ratio of a target recall. They are
+// compared to a search with a larger ef, never to the ground truth.
+const size_t kCalibrationQueries = 100;
+
+// Interleaved searches get group_size * kBatchGroups queries at a time.
+const size_t kBatchGroups = 4;
+
+template <typename T>
+std::vector<T> ParseList(const std::string &list) {
+    std::vector<T> values;
+    std::stringstream stream(list);
+    std::string value;
+    while (std::getline(stream, value, ',')) {
+        std::stringstream value_stream(value);
+        T parsed;
+        value_stream >> parsed;
+        values.push_back(parsed);
+    }
+    return values;
+}
+
+double GetPercentile(const std::vector<double> &sorted, double percentile) {
+    size_t rank = std::ceil(percentile / 100 * sorted.size());
+    return sorted[std::min(sorted.size(), std::max(rank, (size_t)1)) - 1];
+}
+
+template <typename T>
+std::string GetSettingValue(T value) {
+    return value == 0 ? "" : fast_ann::BenchmarkReport::ToString(value);
+}
+
+// Cosine spaces expect the vectors to be normalized before conversion.
+hnswlib::SpaceInterface<float> *CreateSpace(bool cosine, Precision precision,
+                                            size_t dimension) {
+    switch (precision) {
+        case FLOAT16:
+            if (cosine) {
+                return new fast_ann::HalfCosineSpace<fast_ann::Float16>(
+                    dimension);
+            }
+            return new fast_ann::HalfL2Space<fast_ann::Float16>(dimension);
+        case BFLOAT16:
+            if (cosine) {
+                return new fast_ann::HalfCosineSpace<fast_ann::BFloat16>(
+                    dimension);
+            }
+            return new fast_ann::HalfL2Space<fast_ann::BFloat16>(dimension);
+        default:
+            if (cosine) {
+                return new hnswlib::CosineSpace(dimension);
+            }
+            return new hnswlib::L2Space(dimension);
+    }
+}
+
+// Returns vector in the storage precision, converted into out, which holds
+// the data size of the space, unless it is stored as float.
+const void *EncodeVector(Precision precision, const float *vector,
+                         size_t dimension, char *out) {
+    switch (precision) {
+        case FLOAT16:
+            fast_ann::ConvertVector(vector, (fast_ann::Float16 *)out,
+                                    dimension);
+            return out;
+        case BFLOAT16:
+            fast_ann::ConvertVector(vector, (fast_ann::BFloat16 *)out,
+                                    dimension);
+            return out;
+        default:
+            return vector;
+    }
+}
+
+// The first count queries in the storage precision, one after another.
+std::vector<char> EncodeQueries(Precision precision,
+                                fast_ann::Dataset<float> &query_dataset,
+                                size_t count, size_t data_size) {
+    std::vector<char> queries(count * data_size);
+    for (size_t i = 0; i < count; i++) {
+        char *out = queries.data() + i * data_size;
+        const void *vector =
+            EncodeVector(precision, query_dataset.item_at(i).second,
+                         query_dataset.dimension(), out);
+        memmove(out, vector, data_size);
+    }
+    return queries;
+}
+
+// Runs the queries, stored one after another, through search in batches of
+// batch_size. Search returns the result heaps of a batch, every query of a
+// batch gets its latency.
+template <typename SearchFunction>
+void RunQueryBatches(const std::vector<char> &queries, size_t data_size,
+                     size_t k, size_t batch_size, SearchFunction search,
+                     ResultIds &results, std::vector<double> &latencies) {
+    size_t num_queries = queries.size() / data_size;
+    results.assign(num_queries, std::vector<fast_ann::DatasetIndexType>());
+    latencies.assign(num_queries, 0);
+    for (size_t first = 0; first < num_queries; first += batch_size) {
+        size_t count = std::min(batch_size, num_queries - first);
+        fast_ann::Timer timer;
+        auto batch_results =
+            search(queries.data() + first * data_size, count, k);
+        double micros = timer.GetElapsedMicros();
+        for (size_t i = 0; i < count; i++) {
+            latencies[first + i] = micros;
+            results[first + i] = fast_ann::GetSortedIds(batch_results[i]);
+        }
+    }
+}
+
+// Runs every query through search, which returns the result heap, timing
+// each one separately.
+template <typename SearchFunction>
+void RunQueries(fast_ann::Dataset<float> &query_dataset, size_t k,
+                SearchFunction search, ResultIds &results,
+                std::vector<double> &latencies) {
+    fast_ann::DatasetIndexType num_queries = query_dataset.size();
+    results.assign(num_queries, std::vector<fast_ann::DatasetIndexType>());
+    latencies.assign(num_queries, 0);
+    for (fast_ann::DatasetIndexType i = 0; i < num_queries; i++) {
+        fast_ann::Timer timer;
+        auto result = search(query_dataset.item_at(i).second, k);
+        latencies[i] = timer.GetElapsedMicros();
+        results[i] = fast_ann::GetSortedIds(result);
+    }
+}
+
+void AddReportRow(fast_ann::BenchmarkReport &report,
+                  const std::string &algorithm, const std::string &metric,
+                  const std::string &precision, int ranks, size_t k,
+                  const BenchmarkSetting &setting, const ResultIds &results,
+                  std::vector<double> latencies,
+                  fast_ann::Dataset<int> &gt_dataset) {
+    // The queries of a batch share its latency, count it once.
+    size_t batch_size =
+        setting.group_size > 0 ? setting.group_size * kBatchGroups : 1;
+    double total_micros = 0;
+    for (size_t i = 0; i < latencies.size(); i += batch_size) {
+        total_micros += latencies[i];
+    }
+    std::sort(latencies.begin(), latencies.end());
+    std::vector<std::string> row = {
+        algorithm,
+        metric,
+        precision,
+        fast_ann::BenchmarkReport::ToString(ranks),
+        fast_ann::BenchmarkReport::ToString(k),
+        GetSettingValue(setting.M),
+        GetSettingValue(setting.ef_construction),
+        GetSettingValue(setting.ef),
+        GetSettingValue(setting.patience),
+        GetSettingValue(setting.distance_ratio),
+        GetSettingValue(setting.beam_width),
+        GetSettingValue(setting.group_size),
+        fast_ann::BenchmarkReport::ToString(setting.build_seconds),
+        fast_ann::BenchmarkReport::ToString(setting.index_bytes),
+        fast_ann::BenchmarkReport::ToString(latencies.size() * 1e6 /
+                                            total_micros),
+        fast_ann::BenchmarkReport::ToString(GetPercentile(latencies, 50)),
+        fast_ann::BenchmarkReport::ToString(GetPercentile(latencies, 99)),
+        fast_ann::BenchmarkReport::ToString(GetPercentile(latencies, 99.9))};
+    size_t gt_k = gt_dataset.dimension();
+    for (size_t at_k : {1, 10, 100}) {
+        row.push_back(at_k > k || at_k > gt_k
+                          ? ""
+                          : fast_ann::BenchmarkReport::ToString(
+                                fast_ann::ComputeRecall(results, gt_dataset,
+                                                        at_k)));
+    }
+    report.AddRow(row);
+}
+
+// Builds a VP-tree over dataset, stored as data_t, and runs the queries
+// converted to that precision.
+template <typename data_t>
+void RunVPTree(hnswlib::SpaceInterface<float> *space,
+               fast_ann::Dataset<data_t> dataset, bool cosine,
+               Precision precision, fast_ann::Dataset<float> &query_dataset,
+               size_t k, BenchmarkSetting &setting, ResultIds &results,
+               std::vector<double> &latencies) {
+    if (cosine) {
+        dataset.Normalize();
+    }
+    fast_ann::Timer build_timer;
+    fast_ann::VPTreeSearch<float, data_t> search_algo(space, dataset);
+    setting.build_seconds = build_timer.GetElapsedMicros() / 1e6;
+    size_t data_size = space->get_data_size();
+    // The tree searches the vectors of dataset in place.
+    setting.index_bytes =
+        search_algo.memory_bytes() + dataset.size() * data_size;
+    if (setting.group_size > 0) {
+        RunQueryBatches(
+            EncodeQueries(precision, query_dataset, query_dataset.size(),
+                          data_size),
+            data_size, k, setting.group_size * kBatchGroups,
+            [&](const char *batch, size_t count, size_t num_results) {
+                return search_algo.searchKnnBatch((const data_t *)batch,
+                                                  count, num_results,
+                                                  setting.group_size);
+            },
+            results, latencies);
+        return;
+    }
+    std::vector<char> query_buffer(data_size);
+    RunQueries(
+        query_dataset, k,
+        [&](const float *query, size_t num_results) {
+            return search_algo.searchKnn(
+                (const data_t *)EncodeVector(precision, query,
+                                             query_dataset.dimension(),
+                                             query_buffer.data()),
+                num_results);
+        },
+        results, latencies);
+}
+
+// Builds the index of a CreateSearchAlgorithm description over the base
+// vectors and reports a row per ef, or a single one if it has no ef.
+void RunSearchAlgorithm(const std::string &description,
+                        fast_ann::Dataset<float> &base_dataset,
+                        fast_ann::Dataset<float> &query_dataset, size_t k,
+                        int num_threads, const std::vector<size_t> &ef_list,
+                        BenchmarkSetting &setting,
+                        fast_ann::BenchmarkReport &report,
+                        const std::string &metric_name,
+                        const std::string &precision_name,
+                        fast_ann::Dataset<int> &gt_dataset) {
+    size_t data_size = base_dataset.dimension() * sizeof(float);
+    std::vector<char> base_vectors =
+        EncodeQueries(FLOAT32, base_dataset, base_dataset.size(), data_size);
+    std::vector<fast_ann::DatasetIndexType> base_ids(base_dataset.size());
+    for (int i = 0; i < base_dataset.size(); i++) {
+        base_ids[i] = base_dataset.item_at(i).first;
+    }
+    std::unique_ptr<fast_ann::SearchAlgorithm> search_algo;
+    try {
+        search_algo.reset(fast_ann::CreateSearchAlgorithm(
+            description, base_dataset.dimension()));
+    } catch (const std::exception &e) {
+        std::cerr << "main() : " << e.what() << "\n";
+        exit(1);
+    }
+    if (setting.group_size > 0 &&
+        !search_algo->SetOption("group", setting.group_size)) {
+        std::cerr << "main() : " << description
+                  << " does not interleave queries\n";
+        exit(1);
+    }
+    search_algo->SetOption("threads", num_threads);
+
+    fast_ann::Timer build_timer;
+    search_algo->Add((const float *)base_vectors.data(), base_ids.data(),
+                     base_ids.size());
+    // Indexes built on the first search, such as VPTree, are built here.
+    search_algo->Search((const float *)base_vectors.data(), 1, k);
+    setting.build_seconds = build_timer.GetElapsedMicros() / 1e6;
+    setting.index_bytes = search_algo->memory_bytes();
+
+    std::vector<char> queries =
+        EncodeQueries(FLOAT32, query_dataset, query_dataset.size(), data_size);
+    size_t batch_size =
+        setting.group_size > 0 ? setting.group_size * kBatchGroups : 1;
+    bool has_ef = search_algo->SetOption("ef", ef_list[0]);
+    for (size_t ef : has_ef ? ef_list : std::vector<size_t>(1, 0)) {
+        if (has_ef) {
+            search_algo->SetOption("ef", ef);
+        }
+        setting.ef = ef;
+        ResultIds results;
+        std::vector<double> latencies;
+        RunQueryBatches(
+            queries, data_size, k, batch_size,
+            [&](const char *batch, size_t num_batch, size_t num_results) {
+                return search_algo->Search((const float *)batch, num_batch,
+                                           num_results);
+            },
+            results, latencies);
+        AddReportRow(report, description, metric_name, precision_name, 1, k,
+                     setting, results, latencies, gt_dataset);
+    }
+}
+
+int main(int argc, char **argv) {
+    MPI_Init(&argc, &argv);
+    int rank, count;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &count);
+
+    std::string algorithm = "hnsw", base_vectors_file_name,
+                query_vectors_file_name, ground_truth_file_name,
+                log_file_name, vector_file_name, output_file_name,
+                format_name = "csv", precision_name = "float",
+                metric_name = "l2";
+    std::vector<size_t> ef_list = {10, 20, 40, 80, 160, 320};
+    std::vector<size_t> M_list = {16};
+    std::vector<size_t> ef_construction_list = {200};
+    std::vector<size_t> beam_width_list = {fast_ann::kTieredDefaultBeamWidth};
+    std::vector<size_t> patience_list = {0};
+    std::vector<float> target_recall_list = {0};
+    size_t k = 100;
+    int num_threads = 0;
+    size_t group_size = 0;
+    bool async_logging = false;
+    int cmd_flag;
+    while ((cmd_flag = getopt(argc, argv, "Aa:b:q:g:l:k:e:m:c:w:p:x:s:d:i:v:t:f:o:")) != -1) {
+        switch (cmd_flag) {
+            case 'a':
+                algorithm.assign(optarg);
+                break;
+            case 'b':
+                base_vectors_file_name.assign(optarg);
+                break;
+            case 'q':
+                query_vectors_file_name.assign(optarg);
+                break;
+            case 'g':
+                ground_truth_file_name.assign(optarg);
+                break;
+            case 'A':
+                async_logging = true;
+                break;
+            case 'l':
+                log_file_name.assign(optarg);
+                break;
+            case 'k':
+                k = std::stoul(optarg);
+                break;
+            case 'e':
+                ef_list = ParseList<size_t>(optarg);
+                break;
+            case 'm':
+                M_list = ParseList<size_t>(optarg);
+                break;
+            case 'c':
+                ef_construction_list = ParseList<size_t>(optarg);
+                break;
+            case 'w':
+                beam_width_list = ParseList<size_t>(optarg);
+                break;
+            case 'p':
+                patience_list = ParseList<size_t>(optarg);
+                break;
+            case 'x':
+                target_recall_list = ParseList<float>(optarg);
+                break;
+            case 's':
+                precision_name.assign(optarg);
+                break;
+            case 'd':
+                metric_name.assign(optarg);
+                break;
+            case 'i':
+                group_size = std::stoul(optarg);
+                break;
+            case 'v':
+                vector_file_name.assign(optarg);
+                break;
+            case 't':
+                num_threads = std::stoi(optarg);
+                break;
+            case 'f':
+                format_name.assign(optarg);
+                break;
+            case 'o':
+                output_file_name.assign(optarg);
+                break;
+            default:
+                std::cerr << "main() : Invalid command line argument"
+                          << std::endl;
+                exit(1);
+        }
+    }
+    if (base_vectors_file_name.empty() || query_vectors_file_name.empty() ||
+        ground_truth_file_name.empty()) {
+        std::cerr << "main() : Base vector file, query vector file and ground"
+                     "truth file must be specified (use -b -q -g flags)\n";
+        exit(1);
+    }
+    // Any other algorithm is a description for CreateSearchAlgorithm.
+    bool factory = algorithm != "brute_force" && algorithm != "hnsw" &&
+                   algorithm != "vp_tree" && algorithm != "tiered" &&
+                   algorithm != "vp_tree_hnsw";
+    if (metric_name != "l2" && metric_name != "cosine") {
+        std::cerr << "main() : Metric must be l2 or cosine\n";
+        exit(1);
+    }
+    bool cosine = metric_name == "cosine";
+    if (cosine && algorithm == "tiered") {
+        std::cerr << "main() : Tiered search only supports l2\n";
+        exit(1);
+    }
+    Precision precision;
+    if (precision_name == "float") {
+        precision = FLOAT32;
+    } else if (precision_name == "fp16") {
+        precision = FLOAT16;
+    } else if (precision_name == "bf16") {
+        precision = BFLOAT16;
+    } else {
+        std::cerr << "main() : Precision must be one of float, fp16, bf16\n";
+        exit(1);
+    }
+    if (precision != FLOAT32 &&
+        (algorithm == "tiered" || algorithm == "vp_tree_hnsw")) {
+        std::cerr << "main() : Only brute_force, hnsw and vp_tree store half "
+                     "precision vectors\n";
+        exit(1);
+    }
+    if (group_size > 0 && algorithm != "hnsw" &&
+        algorithm != "vp_tree" && !factory) {
+        std::cerr << "main() : Only hnsw, vp_tree and factory indexes "
+                     "interleave queries\n";
+        exit(1);
+    }
+    if (algorithm == "tiered" && vector_file_name.empty()) {
+        std::cerr << "main() : Tiered search needs an on-disk vector file "
+                     "(use -v flag)\n";
+        exit(1);
+    }
+    if (algorithm != "vp_tree_hnsw" && count > 1) {
+        std::cerr << "main() : Only vp_tree_hnsw runs on more than one rank\n";
+        exit(1);
+    }
+    if (format_name != "csv" && format_name != "json") {
+        std::cerr << "main() : Output format must be csv or json\n";
+        exit(1);
+    }
+    fast_ann::ScopedLogSink log_sink(log_file_name, async_logging);
+    if (!log_sink.is_open()) {
+        std::cerr << "main() : Error opening log file\n";
+        exit(1);
+    }
+    fast_ann::SetLogLevel(fast_ann::LogLevel::INFO);
+
+    // Only the last rank, which merges distributed results, reports.
+    bool reporting = rank == count - 1;
+    std::ofstream output_stream;
+    if (reporting && !output_file_name.empty()) {
+        output_stream.open(output_file_name);
+        if (!output_stream) {
+            std::cerr << "main() : Error opening output file\n";
+            exit(1);
+        }
+    }
+    std::ostringstream discarded;
+    std::ostream &output = !reporting                 ? discarded
+                           : output_file_name.empty() ? std::cout
+                                                      : output_stream;
+    fast_ann::BenchmarkReport report(
+        output,
+        format_name == "csv" ? fast_ann::ReportFormat::CSV
+                             : fast_ann::ReportFormat::JSON,
+        kReportColumns);
+
+    fast_ann::XvecsReader<float> float_reader;
+    fast_ann::Dataset<float> base_dataset =
+        float_reader.read(base_vectors_file_name);
+    fast_ann::Dataset<float> query_dataset =
+        float_reader.read(query_vectors_file_name);
+    fast_ann::XvecsReader<int> gt_reader;
+    fast_ann::Dataset<int> gt_dataset = gt_reader.read(ground_truth_file_name);
+    // Cosine vectors are normalized once here and stored normalized.
+    if (cosine) {
+        base_dataset.Normalize();
+        query_dataset.Normalize();
+    }
+    hnswlib::SpaceInterface<float> *space =
+        CreateSpace(cosine, precision, base_dataset.dimension());
+    size_t data_size = space->get_data_size();
+    // Base vectors in the storage precision for the indexes copying them.
+    std::vector<char> base_storage;
+    std::vector<const void *> base_points(base_dataset.size());
+    std::vector<hnswlib::labeltype> base_labels(base_dataset.size());
+    if (algorithm == "brute_force" || algorithm == "hnsw") {
+        if (precision != FLOAT32) {
+            base_storage.resize(base_dataset.size() * data_size);
+        }
+        for (int i = 0; i < base_dataset.size(); i++) {
+            base_points[i] = EncodeVector(
+                precision, base_dataset.item_at(i).second,
+                base_dataset.dimension(), base_storage.data() + i * data_size);
+            base_labels[i] = base_dataset.item_at(i).first;
+        }
+    }
+    std::vector<char> query_buffer(data_size);
+
+    ResultIds results;
+    std::vector<double> latencies;
+    BenchmarkSetting setting;
+    setting.group_size = group_size;
+    if (algorithm == "brute_force") {
+        fast_ann::Timer build_timer;
+        hnswlib::BruteforceSearch<float> search_algo(space,
+                                                     base_dataset.size());
+        for (int i = 0; i < base_dataset.size(); i++) {
+            search_algo.addPoint(base_points[i], base_labels[i]);
+        }
+        setting.build_seconds = build_timer.GetElapsedMicros() / 1e6;
+        setting.index_bytes = search_algo.getMemoryBytes();
+        RunQueries(
+            query_dataset, k,
+            [&](const float *query, size_t num_results) {
+                return search_algo.searchKnn(
+                    EncodeVector(precision, query, query_dataset.dimension(),
+                                 query_buffer.data()),
+                    num_results);
+            },
+            results, latencies);
+    } else if (algorithm == "vp_tree") {
+        // The VP-tree keeps the vectors of the dataset it is given, half
+        // precision ones are converted while reading the base file and
+        // normalized after it, base_dataset is normalized already.
+        if (precision == FLOAT16) {
+            fast_ann::XvecsReader<fast_ann::Float16, float> half_reader;
+            RunVPTree(space, half_reader.read(base_vectors_file_name),
+                      cosine, precision, query_dataset, k, setting, results,
+                      latencies);
+        } else if (precision == BFLOAT16) {
+            fast_ann::XvecsReader<fast_ann::BFloat16, float> half_reader;
+            RunVPTree(space, half_reader.read(base_vectors_file_name),
+                      cosine, precision, query_dataset, k, setting, results,
+                      latencies);
+        } else {
+            RunVPTree(space, base_dataset, false, precision, query_dataset,
+                      k, setting, results, latencies);
+        }
+    }
+    if (factory) {
+        // The metric and precision flags complete the description.
+        std::string description = algorithm;
+        if (cosine) {
+            description += ",Cosine";
+        }
+        if (precision == FLOAT16) {
+            description += ",FP16";
+        } else if (precision == BFLOAT16) {
+            description += ",BF16";
+        }
+        RunSearchAlgorithm(description, base_dataset, query_dataset, k,
+                           num_threads, ef_list, setting, report, metric_name,
+                           precision_name, gt_dataset);
+        M_list.clear();
+    }
+    if (algorithm == "brute_force" || algorithm == "vp_tree") {
+        AddReportRow(report, algorithm, metric_name, precision_name, count,
+                     k, setting, results, latencies, gt_dataset);
+        // Only the graph based algorithms have build parameters to sweep.
+        M_list.clear();
+    }
+    for (size_t M : M_list) {
+        for (size_t ef_construction : ef_construction_list) {
+            setting.M = M;
+            setting.ef_construction = ef_construction;
+            MPI_Barrier(MPI_COMM_WORLD);
+            fast_ann::Timer build_timer;
+            if (algorithm == "hnsw") {
+                hnswlib::HierarchicalNSW<float> search_algo(
+                    space, base_dataset.size(), M, ef_construction);
+                search_algo.addPoints(base_points.data(), base_labels.data(),
+                                      base_dataset.size(), num_threads);
+                setting.build_seconds = build_timer.GetElapsedMicros() / 1e6;
+                setting.index_bytes = search_algo.getMemoryBytes();
+                size_t num_calibration_queries = std::min(
+                    (size_t)query_dataset.size(), kCalibrationQueries);
+                std::vector<char> calibration_queries =
+                    EncodeQueries(precision, query_dataset,
+                                  num_calibration_queries, data_size);
+                std::vector<char> batch_queries;
+                if (setting.group_size > 0) {
+                    batch_queries =
+                        EncodeQueries(precision, query_dataset,
+                                      query_dataset.size(), data_size);
+                }
+                for (size_t ef : ef_list) {
+                    for (size_t patience : patience_list) {
+                        for (float target_recall : target_recall_list) {
+                            hnswlib::SearchParams params(ef);
+                            params.patience = patience;
+                            if (target_recall > 0) {
+                                params.distance_ratio =
+                                    search_algo.calibrateDistanceRatio(
+                                        calibration_queries.data(),
+                                        num_calibration_queries, k,
+                                        target_recall, ef);
+                            }
+                            setting.ef = ef;
+                            setting.patience = patience;
+                            setting.distance_ratio = params.distance_ratio;
+                            if (setting.group_size > 0) {
+                                RunQueryBatches(
+                                    batch_queries, data_size, k,
+                                    setting.group_size * kBatchGroups,
+                                    [&](const char *batch, size_t num_batch,
+                                        size_t num_results) {
+                                        return search_algo.searchKnnBatch(
+                                            batch, num_batch, num_results,
+                                            params, setting.group_size);
+                                    },
+                                    results, latencies);
+                            } else {
+                                RunQueries(
+                                    query_dataset, k,
+                                    [&](const float *query,
+                                        size_t num_results) {
+                                        return search_algo.searchKnn(
+                                            EncodeVector(
+                                                precision, query,
+                                                query_dataset.dimension(),
+                                                query_buffer.data()),
+                                            num_results, params);
+                                    },
+                                    results, latencies);
+                            }
+                            AddReportRow(report, algorithm, metric_name,
+                                         precision_name, count, k, setting,
+                                         results, latencies, gt_dataset);
+                        }
+                    }
+                }
+            } else if (algorithm == "tiered") {
+                fast_ann::TieredHNSWSearch<float> search_algo(
+                    space, base_dataset, vector_file_name, M,
+                    ef_construction);
+                setting.build_seconds = build_timer.GetElapsedMicros() / 1e6;
+                setting.index_bytes = search_algo.memory_bytes();
+                for (size_t ef : ef_list) {
+                    for (size_t beam_width : beam_width_list) {
+                        setting.ef = ef;
+                        setting.beam_width = beam_width;
+                        search_algo.set_ef(ef);
+                        search_algo.set_beam_width(beam_width);
+                        RunQueries(
+                            query_dataset, k,
+                            [&](const float *query, size_t num_results) {
+                                return search_algo.searchKnn(query,
+                                                             num_results);
+                            },
+                            results, latencies);
+                        AddReportRow(report, algorithm, metric_name,
+                                     precision_name, count, k, setting,
+                                     results, latencies, gt_dataset);
+                    }
+                }
+            } else {
+                fast_ann::VPTreeHNSWSearch<float> search_algo(
+                    space, base_dataset, M, ef_construction);
+                MPI_Barrier(MPI_COMM_WORLD);
+                setting.build_seconds = build_timer.GetElapsedMicros() / 1e6;
+                // Summed over the ranks, each holding a part of the index.
+                unsigned long long rank_bytes = search_algo.memory_bytes();
+                unsigned long long index_bytes = 0;
+                MPI_Allreduce(&rank_bytes, &index_bytes, 1,
+                              MPI_UNSIGNED_LONG_LONG, MPI_SUM,
+                              MPI_COMM_WORLD);
+                setting.index_bytes = index_bytes;
+                for (size_t ef : ef_list) {
+                    setting.ef = ef;
+                    search_algo.set_ef(ef);
+                    MPI_Barrier(MPI_COMM_WORLD);
+                    RunQueries(
+                        query_dataset, k,
+                        [&](const float *query, size_t num_results) {
+                            return search_algo.searchKnn(query, num_results);
+                        },
+                        results, latencies);
+                    if (reporting) {
+                        AddReportRow(report, algorithm, metric_name,
+                                     precision_name, count, k, setting,
+                                     results, latencies, gt_dataset);
+                    }
+                }
+            }
+        }
+    }
+    report.Finish();
+    delete space;
+
+    MPI_Finalize();
+    return 0;
+}
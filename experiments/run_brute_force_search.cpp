@@ -4,17 +4,18 @@
 #include <iostream>
 #include <vector>
 
+#include "fast_ann/benchmark/recall.h"
 #include "fast_ann/data_readers/xvecs_reader.h"
-#include "fast_ann/log_sinks/console_sink.h"
-#include "fast_ann/log_sinks/file_sink.h"
+#include "fast_ann/log_sinks/scoped_log_sink.h"
 #include "fast_ann/logger.h"
 #include "hnswlib/hnswlib.h"
 
 int main(int argc, char **argv) {
     std::string base_vectors_file_name, query_vectors_file_name,
         ground_truth_file_name, log_file_name;
+    bool async_logging = false;
     int cmd_flag;
-    while ((cmd_flag = getopt(argc, argv, "b:q:g:l:")) != -1) {
+    while ((cmd_flag = getopt(argc, argv, "Ab:q:g:l:")) != -1) {
         switch (cmd_flag) {
             case 'b':
                 base_vectors_file_name.assign(optarg);
@@ -25,6 +26,9 @@ int main(int argc, char **argv) {
             case 'g':
                 ground_truth_file_name.assign(optarg);
                 break;
+            case 'A':
+                async_logging = true;
+                break;
             case 'l':
                 log_file_name.assign(optarg);
                 break;
@@ -40,15 +44,10 @@ int main(int argc, char **argv) {
                      "truth file must be specified (use -b -q -g flags)\n";
         exit(1);
     }
-    if (log_file_name.empty()) {
-        fast_ann::SetLogSink(new fast_ann::ConsoleSink());
-    } else {
-        std::ofstream log_stream(log_file_name);
-        if (!log_stream) {
-            std::cerr << "main() : Error opening log file\n";
-            exit(1);
-        }
-        fast_ann::SetLogSink(new fast_ann::FileSink(log_stream));
+    fast_ann::ScopedLogSink log_sink(log_file_name, async_logging);
+    if (!log_sink.is_open()) {
+        std::cerr << "main() : Error opening log file\n";
+        exit(1);
     }
     fast_ann::SetLogLevel(fast_ann::LogLevel::DEBUG);
 
@@ -71,33 +70,13 @@ int main(int argc, char **argv) {
     std::vector<std::vector<fast_ann::DatasetIndexType>> results(num_queries);
     for (fast_ann::DatasetIndexType i = 0; i < num_queries; i++) {
         auto result = search_algo.searchKnn(query_dataset.item_at(i).second, k);
-        results[i].reserve(k);
-        while (!result.empty()) {
-            results[i].push_back(result.top().second);
-            result.pop();
-        }
+        results[i] = fast_ann::GetSortedIds(result);
     }
 
     fast_ann::XvecsReader<int> gt_reader;
     fast_ann::Dataset<int> gt_dataset = gt_reader.read(ground_truth_file_name);
-    float sum_recall = 0;
-    for (fast_ann::DatasetIndexType i = 0; i < num_queries; i++) {
-        auto algo_result = results[i];
-        std::vector<fast_ann::DatasetIndexType> gt_result;
-        gt_result.reserve(k);
-        auto ptr = gt_dataset.item_at(i).second;
-        for (int j = 0; j < k; j++) {
-            gt_result.push_back(ptr[j]);
-        }
-        std::sort(algo_result.begin(), algo_result.end());
-        std::sort(gt_result.begin(), gt_result.end());
-        std::vector<fast_ann::DatasetIndexType> common_el(k);
-        auto it = std::set_intersection(algo_result.begin(), algo_result.end(),
-                                        gt_result.begin(), gt_result.end(),
-                                        common_el.begin());
-        sum_recall += (float)(it - common_el.begin()) / k;
-    }
-    std::cout << "Average recall is : " << sum_recall / num_queries << "\n";
+    std::cout << "Average recall is : "
+              << fast_ann::ComputeRecall(results, gt_dataset, k) << "\n";
 
     return 0;
 }
@@ -2,19 +2,26 @@
 #include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <vector>
 
+#include "fast_ann/benchmark/recall.h"
+#include "fast_ann/benchmark/timer.h"
 #include "fast_ann/data_readers/xvecs_reader.h"
-#include "fast_ann/log_sinks/console_sink.h"
-#include "fast_ann/log_sinks/file_sink.h"
+#include "fast_ann/log_sinks/scoped_log_sink.h"
 #include "fast_ann/logger.h"
+#include "fast_ann/numa.h"
+#include "fast_ann/search_stats.h"
 #include "hnswlib/hnswlib.h"
 
 int main(int argc, char **argv) {
     std::string base_vectors_file_name, query_vectors_file_name,
-        ground_truth_file_name, log_file_name;
+        ground_truth_file_name, log_file_name, reorder_name, index_file_name,
+        numa_mode;
+    int num_threads = 0;
+    bool async_logging = false;
     int cmd_flag;
-    while ((cmd_flag = getopt(argc, argv, "b:q:g:l:")) != -1) {
+    while ((cmd_flag = getopt(argc, argv, "Ab:q:g:l:r:s:t:n:")) != -1) {
         switch (cmd_flag) {
             case 'b':
                 base_vectors_file_name.assign(optarg);
@@ -25,9 +32,24 @@ int main(int argc, char **argv) {
             case 'g':
                 ground_truth_file_name.assign(optarg);
                 break;
+            case 'A':
+                async_logging = true;
+                break;
             case 'l':
                 log_file_name.assign(optarg);
                 break;
+            case 'r':
+                reorder_name.assign(optarg);
+                break;
+            case 's':
+                index_file_name.assign(optarg);
+                break;
+            case 't':
+                num_threads = std::stoi(optarg);
+                break;
+            case 'n':
+                numa_mode.assign(optarg);
+                break;
             default:
                 std::cerr << "main() : Invalid command line argument"
                           << std::endl;
@@ -40,15 +62,21 @@ int main(int argc, char **argv) {
                      "truth file must be specified (use -b -q -g flags)\n";
         exit(1);
     }
-    if (log_file_name.empty()) {
-        fast_ann::SetLogSink(new fast_ann::ConsoleSink());
-    } else {
-        std::ofstream log_stream(log_file_name);
-        if (!log_stream) {
-            std::cerr << "main() : Error opening log file\n";
-            exit(1);
-        }
-        fast_ann::SetLogSink(new fast_ann::FileSink(log_stream));
+    if (!numa_mode.empty() && numa_mode != "interleave" &&
+        numa_mode != "replicate") {
+        std::cerr << "main() : NUMA mode must be one of interleave, "
+                     "replicate\n";
+        exit(1);
+    }
+    if (numa_mode == "replicate" && index_file_name.empty()) {
+        std::cerr << "main() : Replicas are loaded from the index file, "
+                     "specify it with -s\n";
+        exit(1);
+    }
+    fast_ann::ScopedLogSink log_sink(log_file_name, async_logging);
+    if (!log_sink.is_open()) {
+        std::cerr << "main() : Error opening log file\n";
+        exit(1);
     }
     fast_ann::SetLogLevel(fast_ann::LogLevel::DEBUG);
 
@@ -58,9 +86,38 @@ int main(int argc, char **argv) {
 
     hnswlib::L2Space l2space(base_dataset.dimension());
     hnswlib::HierarchicalNSW<float> search_algo(&l2space, base_dataset.size());
+    if (numa_mode == "interleave") {
+        // Before the build touches the pages, none have to move.
+        for (size_t i = 0; i < search_algo.getSegmentCount(); i++) {
+            fast_ann::InterleaveMemory(search_algo.getSegmentLevel0(i),
+                                       search_algo.getSegmentBytes());
+        }
+    }
+
+    std::vector<const void *> base_points(base_dataset.size());
+    std::vector<hnswlib::labeltype> base_labels(base_dataset.size());
+    for (int i = 0; i < base_dataset.size(); i++) {
+        base_points[i] = base_dataset.item_at(i).second;
+        base_labels[i] = i;
+    }
+    search_algo.addPoints(base_points.data(), base_labels.data(),
+                          base_dataset.size(), num_threads);
 
-    for (int i=0; i<base_dataset.size(); i++) {
-        search_algo.addPoint(base_dataset.item_at(i).second, i);
+    if (!reorder_name.empty()) {
+        if (reorder_name == "bfs") {
+            search_algo.reorderGraph(hnswlib::REORDER_BFS);
+        } else if (reorder_name == "rcm") {
+            search_algo.reorderGraph(hnswlib::REORDER_RCM);
+        } else if (reorder_name == "gorder") {
+            search_algo.reorderGraph(hnswlib::REORDER_GORDER);
+        } else {
+            std::cerr << "main() : Reorder type must be one of bfs, rcm, "
+                         "gorder\n";
+            exit(1);
+        }
+    }
+    if (!index_file_name.empty()) {
+        search_algo.saveIndex(index_file_name);
     }
 
     int k = 100;
@@ -69,35 +126,52 @@ int main(int argc, char **argv) {
         float_reader.read(query_vectors_file_name);
     fast_ann::DatasetIndexType num_queries = query_dataset.size();
     std::vector<std::vector<fast_ann::DatasetIndexType>> results(num_queries);
-    for (fast_ann::DatasetIndexType i = 0; i < num_queries; i++) {
-        auto result = search_algo.searchKnn(query_dataset.item_at(i).second, k);
-        results[i].reserve(k);
-        while (!result.empty()) {
-            results[i].push_back(result.top().second);
-            result.pop();
+    std::vector<fast_ann::SearchStats> stats(num_queries);
+    if (numa_mode.empty()) {
+        for (fast_ann::DatasetIndexType i = 0; i < num_queries; i++) {
+            auto result = search_algo.searchKnn(
+                query_dataset.item_at(i).second, k, nullptr, &stats[i]);
+            results[i] = fast_ann::GetSortedIds(result);
+        }
+    } else {
+        // Query threads are spread over the sockets and search the replica
+        // of their own, or the interleaved index.
+        std::unique_ptr<
+            fast_ann::NumaReplicas<hnswlib::HierarchicalNSW<float>>>
+            replicas;
+        if (numa_mode == "replicate") {
+            replicas.reset(
+                new fast_ann::NumaReplicas<hnswlib::HierarchicalNSW<float>>(
+                    [&](int) {
+                        return new hnswlib::HierarchicalNSW<float>(
+                            &l2space, index_file_name);
+                    }));
         }
+        fast_ann::Timer timer;
+        fast_ann::NumaParallelFor(
+            0, num_queries, num_threads, [&](size_t i, int node) {
+                hnswlib::HierarchicalNSW<float> &index =
+                    replicas ? replicas->at(node) : search_algo;
+                auto result = index.searchKnn(query_dataset.item_at(i).second,
+                                              k, nullptr, &stats[i]);
+                results[i] = fast_ann::GetSortedIds(result);
+            });
+        std::cout << "Queries per second : "
+                  << num_queries * 1e6 / timer.GetElapsedMicros() << " on "
+                  << fast_ann::NumaNodeCount() << " NUMA node(s)\n";
+    }
+    fast_ann::SearchStatsSummary stats_summary;
+    for (const fast_ann::SearchStats &query_stats : stats) {
+        stats_summary.Add(query_stats);
     }
 
     fast_ann::XvecsReader<int> gt_reader;
     fast_ann::Dataset<int> gt_dataset = gt_reader.read(ground_truth_file_name);
-    float sum_recall = 0;
-    for (fast_ann::DatasetIndexType i = 0; i < num_queries; i++) {
-        auto algo_result = results[i];
-        std::vector<fast_ann::DatasetIndexType> gt_result;
-        gt_result.reserve(k);
-        auto ptr = gt_dataset.item_at(i).second;
-        for (int j = 0; j < k; j++) {
-            gt_result.push_back(ptr[j]);
-        }
-        std::sort(algo_result.begin(), algo_result.end());
-        std::sort(gt_result.begin(), gt_result.end());
-        std::vector<fast_ann::DatasetIndexType> common_el(k);
-        auto it = std::set_intersection(algo_result.begin(), algo_result.end(),
-                                        gt_result.begin(), gt_result.end(),
-                                        common_el.begin());
-        sum_recall += (float)(it - common_el.begin()) / k;
-    }
-    std::cout << "Average recall is : " << sum_recall / num_queries << "\n";
+    std::cout << "Average recall is : "
+              << fast_ann::ComputeRecall(results, gt_dataset, k) << "\n";
+#ifdef FAST_ANN_SEARCH_STATS
+    stats_summary.Print(std::cout);
+#endif
 
     return 0;
 }
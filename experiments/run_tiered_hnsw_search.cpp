@@ -0,0 +1,89 @@
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include "fast_ann/benchmark/recall.h"
+#include "fast_ann/data_readers/xvecs_reader.h"
+#include "fast_ann/log_sinks/scoped_log_sink.h"
+#include "fast_ann/logger.h"
+#include "fast_ann/search_algorithms/tiered_hnsw_search.h"
+#include "hnswlib/hnswlib.h"
+
+int main(int argc, char **argv) {
+    std::string base_vectors_file_name, query_vectors_file_name,
+        ground_truth_file_name, log_file_name, vector_file_name;
+    size_t beam_width = fast_ann::kTieredDefaultBeamWidth;
+    bool async_logging = false;
+    int cmd_flag;
+    while ((cmd_flag = getopt(argc, argv, "Ab:q:g:l:v:w:")) != -1) {
+        switch (cmd_flag) {
+            case 'b':
+                base_vectors_file_name.assign(optarg);
+                break;
+            case 'q':
+                query_vectors_file_name.assign(optarg);
+                break;
+            case 'g':
+                ground_truth_file_name.assign(optarg);
+                break;
+            case 'A':
+                async_logging = true;
+                break;
+            case 'l':
+                log_file_name.assign(optarg);
+                break;
+            case 'v':
+                vector_file_name.assign(optarg);
+                break;
+            case 'w':
+                beam_width = std::stoul(optarg);
+                break;
+            default:
+                std::cerr << "main() : Invalid command line argument"
+                          << std::endl;
+                exit(1);
+        }
+    }
+    if (base_vectors_file_name.empty() || query_vectors_file_name.empty() ||
+        ground_truth_file_name.empty() || vector_file_name.empty()) {
+        std::cerr << "main() : Base vector file, query vector file, ground "
+                     "truth file and on-disk vector file must be specified "
+                     "(use -b -q -g -v flags)\n";
+        exit(1);
+    }
+    fast_ann::ScopedLogSink log_sink(log_file_name, async_logging);
+    if (!log_sink.is_open()) {
+        std::cerr << "main() : Error opening log file\n";
+        exit(1);
+    }
+    fast_ann::SetLogLevel(fast_ann::LogLevel::DEBUG);
+
+    fast_ann::XvecsReader<float> float_reader;
+    fast_ann::Dataset<float> base_dataset =
+        float_reader.read(base_vectors_file_name);
+
+    hnswlib::L2Space l2space(base_dataset.dimension());
+    fast_ann::TieredHNSWSearch<float> search_algo(&l2space, base_dataset,
+                                                  vector_file_name);
+    search_algo.set_beam_width(beam_width);
+
+    int k = 100;
+
+    fast_ann::Dataset<float> query_dataset =
+        float_reader.read(query_vectors_file_name);
+    fast_ann::DatasetIndexType num_queries = query_dataset.size();
+    std::vector<std::vector<fast_ann::DatasetIndexType>> results(num_queries);
+    for (fast_ann::DatasetIndexType i = 0; i < num_queries; i++) {
+        auto result = search_algo.searchKnn(query_dataset.item_at(i).second, k);
+        results[i] = fast_ann::GetSortedIds(result);
+    }
+
+    fast_ann::XvecsReader<int> gt_reader;
+    fast_ann::Dataset<int> gt_dataset = gt_reader.read(ground_truth_file_name);
+    std::cout << "Average recall is : "
+              << fast_ann::ComputeRecall(results, gt_dataset, k) << "\n";
+
+    return 0;
+}
@@ -1,34 +1,20 @@
 #include <mpi.h>
 #include <unistd.h>
 #include <algorithm>
-#include <chrono>
 #include <fstream>
 #include <iostream>
 #include <vector>
 
+#include "fast_ann/benchmark/recall.h"
+#include "fast_ann/benchmark/timer.h"
 #include "fast_ann/data_readers/xvecs_reader.h"
-#include "fast_ann/log_sinks/console_sink.h"
-#include "fast_ann/log_sinks/file_sink.h"
+#include "fast_ann/log_sinks/scoped_log_sink.h"
 #include "fast_ann/logger.h"
+#include "fast_ann/query_cache.h"
+#include "fast_ann/search_stats.h"
 #include "hnswlib/hnswlib.h"
 #include "fast_ann/search_algorithms/vp_tree_hnsw_search.h"
 
-class Timer {
-   public:
-    Timer() { start_time = std::chrono::steady_clock::now(); };
-    float GetElapsedTime() {
-        std::chrono::steady_clock::time_point end_time =
-            std::chrono::steady_clock::now();
-        return (std::chrono::duration_cast<std::chrono::milliseconds>(
-                    end_time - start_time)
-                    .count());
-    };
-    void reset() { start_time = std::chrono::steady_clock::now(); };
-
-   private:
-    std::chrono::steady_clock::time_point start_time;
-};
-
 int main(int argc, char **argv) {
     MPI_Init(&argc, &argv);
     int rank, count;
@@ -37,8 +23,14 @@ int main(int argc, char **argv) {
 
     std::string base_vectors_file_name, query_vectors_file_name,
         ground_truth_file_name, log_file_name;
+    size_t cache_capacity = 0;
+    float cache_grid = 0, cache_tolerance = 0;
+    int num_passes = 1;
+    size_t num_shards = 0, max_replicas = 1, rebalance_interval = 0;
+    fast_ann::ShardRouting routing = fast_ann::ROUND_ROBIN;
+    bool async_logging = false;
     int cmd_flag;
-    while ((cmd_flag = getopt(argc, argv, "b:q:g:l:")) != -1) {
+    while ((cmd_flag = getopt(argc, argv, "Ab:q:g:l:c:G:T:r:s:p:i:w:")) != -1) {
         switch (cmd_flag) {
             case 'b':
                 base_vectors_file_name.assign(optarg);
@@ -49,9 +41,42 @@ int main(int argc, char **argv) {
             case 'g':
                 ground_truth_file_name.assign(optarg);
                 break;
+            case 'A':
+                async_logging = true;
+                break;
             case 'l':
                 log_file_name.assign(optarg);
                 break;
+            case 'c':
+                cache_capacity = std::stoul(optarg);
+                break;
+            case 'G':
+                cache_grid = std::stof(optarg);
+                break;
+            case 'T':
+                cache_tolerance = std::stof(optarg);
+                break;
+            case 'r':
+                num_passes = std::stoi(optarg);
+                break;
+            case 's':
+                num_shards = std::stoul(optarg);
+                break;
+            case 'p':
+                max_replicas = std::stoul(optarg);
+                break;
+            case 'i':
+                rebalance_interval = std::stoul(optarg);
+                break;
+            case 'w':
+                if (std::string(optarg) == "least_loaded") {
+                    routing = fast_ann::LEAST_LOADED;
+                } else if (std::string(optarg) != "round_robin") {
+                    std::cerr << "main() : Routing must be round_robin or "
+                                 "least_loaded\n";
+                    exit(1);
+                }
+                break;
             default:
                 std::cerr << "main() : Invalid command line argument"
                           << std::endl;
@@ -64,15 +89,10 @@ int main(int argc, char **argv) {
                      "truth file must be specified (use -b -q -g flags)\n";
         exit(1);
     }
-    if (log_file_name.empty()) {
-        fast_ann::SetLogSink(new fast_ann::ConsoleSink());
-    } else {
-        std::ofstream log_stream(log_file_name);
-        if (!log_stream) {
-            std::cerr << "main() : Error opening log file\n";
-            exit(1);
-        }
-        fast_ann::SetLogSink(new fast_ann::FileSink(log_stream));
+    fast_ann::ScopedLogSink log_sink(log_file_name, async_logging);
+    if (!log_sink.is_open()) {
+        std::cerr << "main() : Error opening log file\n";
+        exit(1);
     }
     fast_ann::SetLogLevel(fast_ann::LogLevel::INFO);
 
@@ -82,17 +102,68 @@ int main(int argc, char **argv) {
 
     int k = 100;
     hnswlib::L2Space l2space(base_dataset.dimension());
-    fast_ann::VPTreeHNSWSearch<float> search_algo(&l2space, base_dataset);
+    fast_ann::VPTreeHNSWSearch<float> search_algo(&l2space, base_dataset, 16,
+                                                  200, num_shards);
+    search_algo.set_routing(routing);
+    search_algo.set_max_replicas(max_replicas);
+    search_algo.set_rebalance_interval(rebalance_interval);
+    // Repeated passes over the queries, with -r, show the effect of the
+    // cache on a stream of recurring queries. -G rounds queries to a grid and
+    // -T answers near duplicates within that L2 distance.
+    fast_ann::QueryCache<float> query_cache(base_dataset.dimension(),
+                                            cache_capacity, cache_grid,
+                                            cache_tolerance);
+    if (cache_capacity > 0) {
+        search_algo.set_query_cache(&query_cache);
+    }
 
     fast_ann::Dataset<float> query_dataset =
         float_reader.read(query_vectors_file_name);
     fast_ann::DatasetIndexType num_queries = query_dataset.size();
     MPI_Barrier(MPI_COMM_WORLD);
-    Timer timer;
-    for (fast_ann::DatasetIndexType i = 0; i < num_queries; i++) {
-        auto result = search_algo.searchKnn(query_dataset.item_at(i).second, k);
+    fast_ann::Timer timer;
+    std::vector<std::vector<fast_ann::DatasetIndexType>> results(num_queries);
+    fast_ann::SearchStatsSummary stats_summary;
+    for (int pass = 0; pass < num_passes; pass++) {
+        for (fast_ann::DatasetIndexType i = 0; i < num_queries; i++) {
+            fast_ann::SearchStats stats;
+            auto result = search_algo.searchKnn(
+                query_dataset.item_at(i).second, k, &stats);
+            stats_summary.Add(stats);
+            results[i] = fast_ann::GetSortedIds(result);
+        }
     }
     std::cout << "Elapsed Time: " << timer.GetElapsedTime() << "\n";
+    if (cache_capacity > 0 && rank == count - 1) {
+        fast_ann::QueryCacheStats cache_stats = query_cache.stats();
+        std::cout << "Cache hit rate : " << cache_stats.HitRate() << " ("
+                  << cache_stats.hits << " hits, " << cache_stats.near_hits
+                  << " near hits, " << cache_stats.evictions
+                  << " evictions)\n";
+    }
+
+    if (rebalance_interval > 0 && rank == count - 1) {
+        const auto& shard_ranks = search_algo.shard_ranks();
+        for (size_t shard = 0; shard < shard_ranks.size(); shard++) {
+            std::cout << "Shard " << shard << " on ranks";
+            for (int shard_rank : shard_ranks[shard]) {
+                std::cout << " " << shard_rank;
+            }
+            std::cout << "\n";
+        }
+    }
+
+    if (rank == count - 1) {
+        fast_ann::XvecsReader<int> gt_reader;
+        fast_ann::Dataset<int> gt_dataset =
+            gt_reader.read(ground_truth_file_name);
+        std::cout << "Average recall is : "
+                  << fast_ann::ComputeRecall(results, gt_dataset, k) << "\n";
+    }
+#ifdef FAST_ANN_SEARCH_STATS
+    std::cout << "Search stats of rank " << rank << "\n";
+    stats_summary.Print(std::cout);
+#endif
 
     MPI_Finalize();
     return 0;
@@ -31,6 +31,13 @@ namespace hnswlib {
             free(data_);
         }
 
+        /**
+         * Bytes allocated for the vectors and labels of the whole capacity.
+         */
+        size_t getMemoryBytes() const {
+            return maxelements_ * size_per_element_;
+        }
+
         char *data_;
         size_t maxelements_;
         size_t cur_element_count;
@@ -88,30 +95,62 @@ namespace hnswlib {
 
 
         std::priority_queue<std::pair<dist_t, labeltype >>
-        searchKnn(const void *query_data, size_t k) const {
+        searchKnn(const void *query_data, size_t k, const BaseFilterFunctor *filter = nullptr,
+                  SearchStats *stats = nullptr) const {
             std::priority_queue<std::pair<dist_t, labeltype >> topResults;
-            if (cur_element_count == 0) return topResults;
-            for (int i = 0; i < k; i++) {
-                dist_t dist = fstdistfunc_(query_data, data_ + size_per_element_ * i, dist_func_param_);
-                topResults.push(std::pair<dist_t, labeltype>(dist, *((labeltype *) (data_ + size_per_element_ * i +
-                                                                                    data_size_))));
-            }
-            dist_t lastdist = topResults.top().first;
-            for (int i = k; i < cur_element_count; i++) {
+            if (cur_element_count == 0 || k == 0) return topResults;
+            for (size_t i = 0; i < cur_element_count; i++) {
+                labeltype label = *((labeltype *) (data_ + size_per_element_ * i + data_size_));
+                if (filter && !(*filter)(label))
+                    continue;
                 dist_t dist = fstdistfunc_(query_data, data_ + size_per_element_ * i, dist_func_param_);
-                if (dist <= lastdist) {
-                    topResults.push(std::pair<dist_t, labeltype>(dist, *((labeltype *) (data_ + size_per_element_ * i +
-                                                                                        data_size_))));
+                HNSWLIB_STATS_ADD(stats, distance_computations, 1);
+                if (topResults.size() < k || dist <= topResults.top().first) {
+                    topResults.push(std::pair<dist_t, labeltype>(dist, label));
                     if (topResults.size() > k)
                         topResults.pop();
-                    lastdist = topResults.top().first;
                 }
-
             }
             return topResults;
         };
 
-        template <typename Comp>
+        /**
+         * Passes every element within radius of the query to callback(dist, label) as it is found, at
+         * most max_results of them. Returns the number of results.
+         */
+        template <typename Callback, typename = typename std::enable_if<isRangeCallback<Callback>::value>::type>
+        size_t searchRange(const void *query_data, dist_t radius, size_t max_results, Callback callback,
+                           const BaseFilterFunctor *filter = nullptr, SearchStats *stats = nullptr) const {
+            size_t num_results = 0;
+            for (size_t i = 0; i < cur_element_count && num_results < max_results; i++) {
+                labeltype label = *((labeltype *) (data_ + size_per_element_ * i + data_size_));
+                if (filter && !(*filter)(label))
+                    continue;
+                dist_t dist = fstdistfunc_(query_data, data_ + size_per_element_ * i, dist_func_param_);
+                HNSWLIB_STATS_ADD(stats, distance_computations, 1);
+                if (dist <= radius) {
+                    callback(dist, label);
+                    num_results++;
+                }
+            }
+            return num_results;
+        }
+
+        /**
+         * Elements within radius of the query, nearest first, at most max_results of them.
+         */
+        std::vector<std::pair<dist_t, labeltype>>
+        searchRange(const void *query_data, dist_t radius, size_t max_results,
+                    const BaseFilterFunctor *filter = nullptr, SearchStats *stats = nullptr) const {
+            std::vector<std::pair<dist_t, labeltype>> result;
+            searchRange(query_data, radius, max_results,
+                        [&result](dist_t dist, labeltype label) { result.emplace_back(dist, label); },
+                        filter, stats);
+            std::sort(result.begin(), result.end());
+            return result;
+        }
+
+        template <typename Comp, typename = typename std::enable_if<!std::is_pointer<Comp>::value>::type>
         std::vector<std::pair<dist_t, labeltype>>
         searchKnn(const void* query_data, size_t k, Comp comp) {
             std::vector<std::pair<dist_t, labeltype>> result;
@@ -2,8 +2,13 @@
 
 #include "visited_list_pool.h"
 #include "hnswlib.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
 #include <random>
 #include <stdlib.h>
+#include <thread>
 #include <unordered_set>
 #include <list>
 
@@ -12,6 +17,14 @@ namespace hnswlib {
     typedef unsigned int tableint;
     typedef unsigned int linklistsizeint;
 
+    /**
+     * Orderings of internal ids supported by HierarchicalNSW::reorderGraph.
+     * BFS - breadth first traversal of level 0 starting at the enter point.
+     * RCM - reverse Cuthill-McKee, BFS from low degree elements visiting neighbors by increasing degree.
+     * GORDER - greedy placement maximizing shared and direct links within a sliding window (Gorder-style).
+     */
+    enum ReorderType { REORDER_BFS, REORDER_RCM, REORDER_GORDER };
+
     template<typename dist_t>
     class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     public:
@@ -24,8 +37,7 @@ namespace hnswlib {
             loadIndex(location, s, max_elements);
         }
 
-        HierarchicalNSW(SpaceInterface<dist_t> *s, size_t max_elements, size_t M = 16, size_t ef_construction = 200, size_t random_seed = 100) :
-                link_list_locks_(max_elements), element_levels_(max_elements) {
+        HierarchicalNSW(SpaceInterface<dist_t> *s, size_t max_elements, size_t M = 16, size_t ef_construction = 200, size_t random_seed = 100) {
             max_elements_ = max_elements;
 
             has_deletions_=false;
@@ -37,6 +49,8 @@ namespace hnswlib {
             maxM0_ = M_ * 2;
             ef_construction_ = std::max(ef_construction,M_);
             ef_ = 10;
+            filter_sample_size_ = 256;
+            filter_brute_force_threshold_ = 0.01;
 
             level_generator_.seed(random_seed);
 
@@ -46,9 +60,7 @@ namespace hnswlib {
             label_offset_ = size_links_level0_ + data_size_;
             offsetLevel0_ = 0;
 
-            data_level0_memory_ = (char *) malloc(max_elements_ * size_data_per_element_);
-            if (data_level0_memory_ == nullptr)
-                throw std::runtime_error("Not enough memory");
+            initSegments(max_elements_);
 
             cur_element_count = 0;
 
@@ -57,12 +69,8 @@ namespace hnswlib {
 
 
             //initializations for special treatment of the first node
-            enterpoint_node_ = -1;
-            maxlevel_ = -1;
+            setEntryPoint(-1, -1);
 
-            linkLists_ = (char **) malloc(sizeof(void *) * max_elements_);
-            if (linkLists_ == nullptr)
-                throw std::runtime_error("Not enough memory: HierarchicalNSW failed to allocate linklists");
             size_links_per_element_ = maxM_ * sizeof(tableint) + sizeof(linklistsizeint);
             mult_ = 1 / log(1.0 * M_);
             revSize_ = 1.0 / mult_;
@@ -77,12 +85,13 @@ namespace hnswlib {
 
         ~HierarchicalNSW() {
 
-            free(data_level0_memory_);
-            for (tableint i = 0; i < cur_element_count; i++) {
-                if (element_levels_[i] > 0)
-                    free(linkLists_[i]);
-            }
-            free(linkLists_);
+            for (tableint i = 0; i < cur_element_count; i++)
+                free(upperLinkLists(i));
+            for (char *link_lists : retired_link_lists_)
+                free(link_lists);
+            freeSegments(segments_.load(), num_segments_);
+            for (Segment *table : segment_tables_)
+                delete[] table;
             delete visited_list_pool_;
         }
 
@@ -97,52 +106,289 @@ namespace hnswlib {
         size_t ef_construction_;
 
         double mult_, revSize_;
-        int maxlevel_;
+
+        /**
+         * The enter point in the low 32 bits and the maximum level in the high ones, published together
+         * so that a search never pairs an enter point with a level it does not have.
+         */
+        std::atomic<uint64_t> entry_point_;
 
 
         VisitedListPool *visited_list_pool_;
         std::mutex cur_element_count_guard_;
 
-        std::vector<std::mutex> link_list_locks_;
-        tableint enterpoint_node_;
-
 
         size_t size_links_level0_;
         size_t offsetData_, offsetLevel0_;
 
-
-        char *data_level0_memory_;
-        char **linkLists_;
-        std::vector<int> element_levels_;
+        /**
+         * Elements are stored in segments of 2^segment_shift_ elements that never move once allocated,
+         * so searches and insertions keep running while resizeIndex adds capacity. A segment holds the
+         * level 0 memory (links, vector and label of each element), the upper level link lists, levels,
+         * the number of levels the upper link lists have room for, locks and link list versions of its
+         * elements. Growing replaces the segment table, the tables
+         * replaced are kept until destruction since searches may still be reading them.
+         */
+        struct Segment {
+            char *level0;
+            char **link_lists;
+            int *levels;
+            int *capacities;
+            std::mutex *locks;
+            std::atomic<unsigned int> *versions;
+        };
+        size_t segment_shift_;
+        std::atomic<Segment *> segments_{nullptr};
+        size_t num_segments_ = 0;
+        std::vector<Segment *> segment_tables_;
+        std::mutex resize_guard_;
 
         size_t data_size_;
 
-        bool has_deletions_;
+        std::atomic<bool> has_deletions_;
 
 
         size_t label_offset_;
         DISTFUNC<dist_t> fstdistfunc_;
         void *dist_func_param_;
         std::unordered_map<labeltype, tableint> label_lookup_;
+        std::vector<tableint> free_slots_;
+        /**
+         * Upper link lists of reused slots that were too small for the new element. Searches that still
+         * hold the old id may be reading them, so they are only freed on destruction.
+         */
+        std::vector<char *> retired_link_lists_;
+        std::mutex consolidate_guard_;
+        /**
+         * Keeps insertions and consolidateDeletes apart. Insertions count themselves in active_insertions_
+         * and wait while consolidating_ is set, consolidateDeletes sets it and waits for the count to drop
+         * to 0. See InsertionScope.
+         */
+        std::mutex insertion_gate_;
+        std::condition_variable insertion_gate_cv_;
+        size_t active_insertions_ = 0;
+        bool consolidating_ = false;
+
+        /**
+         * Held by addPoint and addPoints for the whole insertion, so that they wait for a running
+         * consolidateDeletes and it waits for them.
+         */
+        class InsertionScope {
+        public:
+            explicit InsertionScope(HierarchicalNSW *index) : index_(index) {
+                std::unique_lock <std::mutex> lock(index_->insertion_gate_);
+                index_->insertion_gate_cv_.wait(lock, [this] { return !index_->consolidating_; });
+                index_->active_insertions_++;
+            }
+
+            ~InsertionScope() {
+                std::unique_lock <std::mutex> lock(index_->insertion_gate_);
+                if (--index_->active_insertions_ == 0)
+                    index_->insertion_gate_cv_.notify_all();
+            }
+
+        private:
+            HierarchicalNSW *index_;
+        };
 
         std::default_random_engine level_generator_;
 
+        inline const Segment &getSegment(tableint internal_id) const {
+            return segments_.load(std::memory_order_acquire)[internal_id >> segment_shift_];
+        }
+
+        inline size_t getSegmentOffset(tableint internal_id) const {
+            return internal_id & (((size_t) 1 << segment_shift_) - 1);
+        }
+
+        inline char *getElementPtr(tableint internal_id) const {
+            return getSegment(internal_id).level0 + getSegmentOffset(internal_id) * size_data_per_element_;
+        }
+
+        inline char *&upperLinkLists(tableint internal_id) const {
+            return getSegment(internal_id).link_lists[getSegmentOffset(internal_id)];
+        }
+
+        inline int &elementLevel(tableint internal_id) const {
+            return getSegment(internal_id).levels[getSegmentOffset(internal_id)];
+        }
+
+        inline int &linkListCapacity(tableint internal_id) const {
+            return getSegment(internal_id).capacities[getSegmentOffset(internal_id)];
+        }
+
+        inline std::mutex &linkListLock(tableint internal_id) const {
+            return getSegment(internal_id).locks[getSegmentOffset(internal_id)];
+        }
+
+        inline std::atomic<unsigned int> &linkListVersion(tableint internal_id) const {
+            return getSegment(internal_id).versions[getSegmentOffset(internal_id)];
+        }
+
+        size_t getSegmentCount() const {
+            return num_segments_;
+        }
+
+        /**
+         * Level 0 memory of a segment, getSegmentBytes() long.
+         */
+        char *getSegmentLevel0(size_t segment) const {
+            return segments_.load(std::memory_order_acquire)[segment].level0;
+        }
+
+        size_t getSegmentBytes() const {
+            return ((size_t) 1 << segment_shift_) * size_data_per_element_;
+        }
+
+        /**
+         * Bytes allocated for the elements: the segments, level 0 records and per element state for the
+         * whole capacity, and the upper link lists, retired ones counted as one level. The label lookup is
+         * left out.
+         * Not to be called concurrently with insertions.
+         */
+        size_t getMemoryBytes() const {
+            size_t per_element = size_data_per_element_ + sizeof(char *) + 2 * sizeof(int) + sizeof(std::mutex) +
+                                 sizeof(std::atomic<unsigned int>);
+            size_t bytes = num_segments_ * ((size_t) 1 << segment_shift_) * per_element;
+            for (tableint i = 0; i < cur_element_count; i++) {
+                if (linkListCapacity(i) > 0)
+                    bytes += size_links_per_element_ * linkListCapacity(i) + 1;
+            }
+            return bytes + retired_link_lists_.size() * size_links_per_element_;
+        }
+
+        /**
+         * Sizes segments for the initial capacity, up to 2^16 elements each, and allocates them.
+         */
+        void initSegments(size_t max_elements) {
+            segment_shift_ = 0;
+            while (segment_shift_ < 16 && ((size_t) 1 << segment_shift_) < max_elements)
+                segment_shift_++;
+            num_segments_ = 0;
+            addSegments(max_elements);
+        }
+
+        /**
+         * Allocates the segments missing to hold max_elements elements and publishes a new table with
+         * them. Existing segments stay where they are.
+         */
+        void addSegments(size_t max_elements) {
+            size_t segment_elements = (size_t) 1 << segment_shift_;
+            size_t num_segments = std::max((max_elements + segment_elements - 1) >> segment_shift_, (size_t) 1);
+            if (num_segments <= num_segments_)
+                return;
+            Segment *table = new Segment[num_segments];
+            Segment *old_table = segments_.load();
+            for (size_t i = 0; i < num_segments_; i++)
+                table[i] = old_table[i];
+            for (size_t i = num_segments_; i < num_segments; i++) {
+                table[i].level0 = (char *) malloc(segment_elements * size_data_per_element_);
+                if (table[i].level0 == nullptr) {
+                    freeSegments(table + num_segments_, i - num_segments_);
+                    delete[] table;
+                    throw std::runtime_error("Not enough memory: HierarchicalNSW failed to allocate a segment");
+                }
+                table[i].link_lists = new char *[segment_elements]();
+                table[i].levels = new int[segment_elements]();
+                table[i].capacities = new int[segment_elements]();
+                table[i].locks = new std::mutex[segment_elements];
+                table[i].versions = new std::atomic<unsigned int>[segment_elements]();
+            }
+            segment_tables_.push_back(table);
+            num_segments_ = num_segments;
+            segments_.store(table, std::memory_order_release);
+        }
+
+        static void freeSegments(Segment *table, size_t num_segments) {
+            for (size_t i = 0; i < num_segments; i++) {
+                free(table[i].level0);
+                delete[] table[i].link_lists;
+                delete[] table[i].levels;
+                delete[] table[i].capacities;
+                delete[] table[i].locks;
+                delete[] table[i].versions;
+            }
+        }
+
+        static uint64_t packEntryPoint(tableint node, int level) {
+            return ((uint64_t) (uint32_t) level << 32) | node;
+        }
+
+        void getEntryPoint(tableint &node, int &level) const {
+            uint64_t entry_point = entry_point_.load(std::memory_order_acquire);
+            node = (tableint) entry_point;
+            level = (int) (uint32_t) (entry_point >> 32);
+        }
+
+        tableint getEnterPoint() const {
+            return (tableint) entry_point_.load(std::memory_order_acquire);
+        }
+
+        /**
+         * Publishes a new enter point once its link lists on every level up to level are written.
+         */
+        void setEntryPoint(tableint node, int level) {
+            entry_point_.store(packEntryPoint(node, level), std::memory_order_release);
+        }
+
+        /**
+         * Link lists are rewritten in place, under the element's lock, between beginLinkListWrite and
+         * endLinkListWrite. The element's version is odd while a write is in progress: searches copy a
+         * list without locking and retry when the version changed meanwhile (a seqlock), so they never
+         * block insertions and never use a list written halfway.
+         */
+        void beginLinkListWrite(tableint internal_id) const {
+            std::atomic<unsigned int> &version = linkListVersion(internal_id);
+            version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+        }
+
+        void endLinkListWrite(tableint internal_id) const {
+            std::atomic<unsigned int> &version = linkListVersion(internal_id);
+            version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+
+        /**
+         * Copies the links of an element on level into links, which has room for maxM0_ + 1 entries, and
+         * returns their number. The entry after the last link repeats the element itself, so that
+         * prefetching one link ahead stays within the index.
+         */
+        size_t readLinkList(tableint internal_id, int level, tableint *links) const {
+            const std::atomic<unsigned int> &version = linkListVersion(internal_id);
+            size_t max_size = level == 0 ? maxM0_ : maxM_;
+            while (true) {
+                unsigned int before = version.load(std::memory_order_acquire);
+                if (before & 1) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                linklistsizeint *ll = level == 0 ? get_linklist0(internal_id) : get_linklist(internal_id, level);
+                size_t size = std::min((size_t) getListCount(ll), max_size);
+                memcpy(links, ll + 1, size * sizeof(tableint));
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (version.load(std::memory_order_relaxed) == before) {
+                    links[size] = internal_id;
+                    return size;
+                }
+            }
+        }
+
         inline labeltype getExternalLabel(tableint internal_id) const {
             labeltype return_label;
-            memcpy(&return_label,(data_level0_memory_ + internal_id * size_data_per_element_ + label_offset_), sizeof(labeltype));
+            memcpy(&return_label, getElementPtr(internal_id) + label_offset_, sizeof(labeltype));
             return return_label;
         }
 
         inline void setExternalLabel(tableint internal_id, labeltype label) const {
-            memcpy((data_level0_memory_ + internal_id * size_data_per_element_ + label_offset_), &label, sizeof(labeltype));
+            memcpy(getElementPtr(internal_id) + label_offset_, &label, sizeof(labeltype));
         }
 
         inline labeltype *getExternalLabeLp(tableint internal_id) const {
-            return (labeltype *) (data_level0_memory_ + internal_id * size_data_per_element_ + label_offset_);
+            return (labeltype *) (getElementPtr(internal_id) + label_offset_);
         }
 
         inline char *getDataByInternalId(tableint internal_id) const {
-            return (data_level0_memory_ + internal_id * size_data_per_element_ + offsetData_);
+            return getElementPtr(internal_id) + offsetData_;
         }
 
         int getRandomLevel(double reverse_size) {
@@ -171,6 +417,8 @@ namespace hnswlib {
                 candidateSet.emplace(-lowerBound, ep_id);
             }
             visited_array[ep_id] = visited_array_tag;
+            std::vector<tableint> links(maxM0_ + 1);
+            tableint *datal = links.data();
 
             while (!candidateSet.empty()) {
                 std::pair<dist_t, tableint> curr_el_pair = candidateSet.top();
@@ -180,23 +428,12 @@ namespace hnswlib {
                 candidateSet.pop();
 
                 tableint curNodeNum = curr_el_pair.second;
-
-                std::unique_lock <std::mutex> lock(link_list_locks_[curNodeNum]);
-
-                int *data;// = (int *)(linkList0_ + curNodeNum * size_links_per_element0_);
-                if (layer == 0) {
-                    data = (int*)get_linklist0(curNodeNum);
-                } else {
-                    data = (int*)get_linklist(curNodeNum, layer);
-//                    data = (int *) (linkLists_[curNodeNum] + (layer - 1) * size_links_per_element_);
-                }
-                size_t size = getListCount((linklistsizeint*)data);
-                tableint *datal = (tableint *) (data + 1);
+                size_t size = readLinkList(curNodeNum, layer, datal);
 #ifdef USE_SSE
-                _mm_prefetch((char *) (visited_array + *(data + 1)), _MM_HINT_T0);
-                _mm_prefetch((char *) (visited_array + *(data + 1) + 64), _MM_HINT_T0);
+                _mm_prefetch((char *) (visited_array + *datal), _MM_HINT_T0);
+                _mm_prefetch((char *) (visited_array + *datal + 64), _MM_HINT_T0);
                 _mm_prefetch(getDataByInternalId(*datal), _MM_HINT_T0);
-                _mm_prefetch(getDataByInternalId(*(datal + 1)), _MM_HINT_T0);
+                _mm_prefetch(getDataByInternalId(*(datal + std::min(size, (size_t) 1))), _MM_HINT_T0);
 #endif
 
                 for (size_t j = 0; j < size; j++) {
@@ -206,7 +443,7 @@ namespace hnswlib {
                     _mm_prefetch((char *) (visited_array + *(datal + j + 1)), _MM_HINT_T0);
                     _mm_prefetch(getDataByInternalId(*(datal + j + 1)), _MM_HINT_T0);
 #endif
-                    if (visited_array[candidate_id] == visited_array_tag) continue;
+                    if (candidate_id >= vl->numelements || visited_array[candidate_id] == visited_array_tag) continue;
                     visited_array[candidate_id] = visited_array_tag;
                     char *currObj1 = (getDataByInternalId(candidate_id));
 
@@ -233,9 +470,15 @@ namespace hnswlib {
             return top_candidates;
         }
 
-        template <bool has_deletions>
+        /**
+         * With adaptive set, the search also tracks the k nearest results and stops early as soon as one
+         * of the criteria of params is met.
+         */
+        template <bool has_deletions, bool adaptive = false>
         std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst>
-        searchBaseLayerST(tableint ep_id, const void *data_point, size_t ef) const {
+        searchBaseLayerST(tableint ep_id, const void *data_point, size_t ef,
+                          const BaseFilterFunctor *filter = nullptr, SearchStats *stats = nullptr,
+                          size_t k = 0, const SearchParams *params = nullptr) const {
             VisitedList *vl = visited_list_pool_->getFreeVisitedList();
             vl_type *visited_array = vl->mass;
             vl_type visited_array_tag = vl->curV;
@@ -244,8 +487,9 @@ namespace hnswlib {
             std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> candidate_set;
 
             dist_t lowerBound;
-            if (!has_deletions || !isMarkedDeleted(ep_id)) {
+            if ((!has_deletions || !isMarkedDeleted(ep_id)) && isAllowed(ep_id, filter)) {
                 dist_t dist = fstdistfunc_(data_point, getDataByInternalId(ep_id), dist_func_param_);
+                HNSWLIB_STATS_ADD(stats, distance_computations, 1);
                 lowerBound = dist;
                 top_candidates.emplace(dist, ep_id);
                 candidate_set.emplace(-dist, ep_id);
@@ -255,53 +499,82 @@ namespace hnswlib {
             }
 
             visited_array[ep_id] = visited_array_tag;
+            HNSWLIB_STATS_ADD(stats, visited_nodes, 1);
+
+            // Distances of the k nearest results and the number of expansions since they last changed.
+            std::priority_queue<dist_t> nearest_k;
+            size_t stale_expansions = 0;
+            if (adaptive && !top_candidates.empty())
+                nearest_k.push(lowerBound);
+
+            // Elements inserted after the visited list was sized are not searched.
+            tableint num_visitable = vl->numelements;
+            std::vector<tableint> links(maxM0_ + 1);
+            tableint *data = links.data();
 
             while (!candidate_set.empty()) {
 
                 std::pair<dist_t, tableint> current_node_pair = candidate_set.top();
 
-                if ((-current_node_pair.first) > lowerBound) {
+                // Rejected elements never enter top_candidates, so keep expanding until it holds ef results.
+                if ((-current_node_pair.first) > lowerBound &&
+                    (top_candidates.size() == ef || (!has_deletions && filter == nullptr))) {
+                    break;
+                }
+                if (adaptive && nearest_k.size() == k &&
+                    ((params->patience > 0 && stale_expansions >= params->patience) ||
+                     (params->distance_ratio > 0 &&
+                      (-current_node_pair.first) > params->distance_ratio * nearest_k.top()))) {
+                    HNSWLIB_STATS_ADD(stats, early_terminations, 1);
                     break;
                 }
+                stale_expansions++;
                 candidate_set.pop();
+                HNSWLIB_STATS_ADD(stats, base_layer_hops, 1);
 
                 tableint current_node_id = current_node_pair.second;
-                int *data = (int *) get_linklist0(current_node_id);
-                size_t size = getListCount((linklistsizeint*)data);
+                size_t size = readLinkList(current_node_id, 0, data);
 //                bool cur_node_deleted = isMarkedDeleted(current_node_id);
 
 #ifdef USE_SSE
-                _mm_prefetch((char *) (visited_array + *(data + 1)), _MM_HINT_T0);
-                _mm_prefetch((char *) (visited_array + *(data + 1) + 64), _MM_HINT_T0);
-                _mm_prefetch(data_level0_memory_ + (*(data + 1)) * size_data_per_element_ + offsetData_, _MM_HINT_T0);
-                _mm_prefetch((char *) (data + 2), _MM_HINT_T0);
+                _mm_prefetch((char *) (visited_array + *data), _MM_HINT_T0);
+                _mm_prefetch((char *) (visited_array + *data + 64), _MM_HINT_T0);
+                _mm_prefetch(getDataByInternalId(*data), _MM_HINT_T0);
 #endif
 
-                for (size_t j = 1; j <= size; j++) {
-                    int candidate_id = *(data + j);
+                for (size_t j = 0; j < size; j++) {
+                    tableint candidate_id = *(data + j);
 //                    if (candidate_id == 0) continue;
 #ifdef USE_SSE
                     _mm_prefetch((char *) (visited_array + *(data + j + 1)), _MM_HINT_T0);
-                    _mm_prefetch(data_level0_memory_ + (*(data + j + 1)) * size_data_per_element_ + offsetData_,
-                                 _MM_HINT_T0);////////////
+                    _mm_prefetch(getDataByInternalId(*(data + j + 1)), _MM_HINT_T0);////////////
 #endif
-                    if (!(visited_array[candidate_id] == visited_array_tag)) {
+                    if (candidate_id < num_visitable && !(visited_array[candidate_id] == visited_array_tag)) {
 
                         visited_array[candidate_id] = visited_array_tag;
 
                         char *currObj1 = (getDataByInternalId(candidate_id));
                         dist_t dist = fstdistfunc_(data_point, currObj1, dist_func_param_);
+                        HNSWLIB_STATS_ADD(stats, visited_nodes, 1);
+                        HNSWLIB_STATS_ADD(stats, distance_computations, 1);
 
                         if (top_candidates.size() < ef || lowerBound > dist) {
                             candidate_set.emplace(-dist, candidate_id);
 #ifdef USE_SSE
-                            _mm_prefetch(data_level0_memory_ + candidate_set.top().second * size_data_per_element_ +
-                                         offsetLevel0_,///////////
+                            _mm_prefetch(getElementPtr(candidate_set.top().second) + offsetLevel0_,///////////
                                          _MM_HINT_T0);////////////////////////
+                            _mm_prefetch((char *) &linkListVersion(candidate_set.top().second), _MM_HINT_T0);
 #endif
 
-                            if (!has_deletions || !isMarkedDeleted(candidate_id))
+                            if ((!has_deletions || !isMarkedDeleted(candidate_id)) && isAllowed(candidate_id, filter)) {
                                 top_candidates.emplace(dist, candidate_id);
+                                if (adaptive && (nearest_k.size() < k || dist < nearest_k.top())) {
+                                    nearest_k.push(dist);
+                                    if (nearest_k.size() > k)
+                                        nearest_k.pop();
+                                    stale_expansions = 0;
+                                }
+                            }
 
                             if (top_candidates.size() > ef)
                                 top_candidates.pop();
@@ -317,6 +590,165 @@ namespace hnswlib {
             return top_candidates;
         }
 
+        /**
+         * Searches the base layer for the elements within radius of the query. The candidate list keeps
+         * the ef nearest elements like searchBaseLayerST, but every element found within radius is
+         * expanded as well, so ef adapts to the number of elements in the ball instead of having to be
+         * sized for it up front. Results are passed to the callback as they are found.
+         */
+        template <bool has_deletions, typename Callback>
+        size_t searchBaseLayerRange(tableint ep_id, const void *data_point, dist_t radius, size_t max_results,
+                                    Callback &callback, const BaseFilterFunctor *filter,
+                                    SearchStats *stats) const {
+            VisitedList *vl = visited_list_pool_->getFreeVisitedList();
+            vl_type *visited_array = vl->mass;
+            vl_type visited_array_tag = vl->curV;
+
+            std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> top_candidates;
+            std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> candidate_set;
+            size_t num_results = 0;
+
+            dist_t dist = fstdistfunc_(data_point, getDataByInternalId(ep_id), dist_func_param_);
+            HNSWLIB_STATS_ADD(stats, distance_computations, 1);
+            HNSWLIB_STATS_ADD(stats, visited_nodes, 1);
+            dist_t lowerBound = dist;
+            top_candidates.emplace(dist, ep_id);
+            candidate_set.emplace(-dist, ep_id);
+            visited_array[ep_id] = visited_array_tag;
+            if (dist <= radius && (!has_deletions || !isMarkedDeleted(ep_id)) && isAllowed(ep_id, filter)) {
+                callback(dist, getExternalLabel(ep_id));
+                num_results++;
+            }
+            tableint num_visitable = vl->numelements;
+            std::vector<tableint> links(maxM0_ + 1);
+            tableint *data = links.data();
+
+            while (!candidate_set.empty() && num_results < max_results) {
+                std::pair<dist_t, tableint> current_node_pair = candidate_set.top();
+                dist_t current_dist = -current_node_pair.first;
+                if (current_dist > lowerBound && current_dist > radius) {
+                    break;
+                }
+                candidate_set.pop();
+                HNSWLIB_STATS_ADD(stats, base_layer_hops, 1);
+
+                size_t size = readLinkList(current_node_pair.second, 0, data);
+#ifdef USE_SSE
+                _mm_prefetch((char *) (visited_array + *data), _MM_HINT_T0);
+                _mm_prefetch(getDataByInternalId(*data), _MM_HINT_T0);
+#endif
+                for (size_t j = 0; j < size && num_results < max_results; j++) {
+                    tableint candidate_id = *(data + j);
+#ifdef USE_SSE
+                    _mm_prefetch((char *) (visited_array + *(data + j + 1)), _MM_HINT_T0);
+                    _mm_prefetch(getDataByInternalId(*(data + j + 1)), _MM_HINT_T0);
+#endif
+                    if (candidate_id >= num_visitable || visited_array[candidate_id] == visited_array_tag)
+                        continue;
+                    visited_array[candidate_id] = visited_array_tag;
+
+                    dist = fstdistfunc_(data_point, getDataByInternalId(candidate_id), dist_func_param_);
+                    HNSWLIB_STATS_ADD(stats, visited_nodes, 1);
+                    HNSWLIB_STATS_ADD(stats, distance_computations, 1);
+
+                    bool in_range = dist <= radius;
+                    if (in_range || top_candidates.size() < ef_ || dist < lowerBound) {
+                        candidate_set.emplace(-dist, candidate_id);
+                        top_candidates.emplace(dist, candidate_id);
+                        if (top_candidates.size() > ef_)
+                            top_candidates.pop();
+                        lowerBound = top_candidates.top().first;
+                    }
+                    if (in_range && (!has_deletions || !isMarkedDeleted(candidate_id)) &&
+                        isAllowed(candidate_id, filter)) {
+                        callback(dist, getExternalLabel(candidate_id));
+                        num_results++;
+                    }
+                }
+            }
+
+            visited_list_pool_->releaseVisitedList(vl);
+            return num_results;
+        }
+
+        /**
+         * Reads the label of a live element, then calls read with its id, without locking and retrying
+         * while an insertion rewrites the slot, as readLinkList does. Returns false for deleted elements and for
+         * slots counted in cur_element_count whose first insertion has not written them yet: their
+         * version is still 0, which is why loadIndex sets the versions of the elements it loads.
+         */
+        template<typename Read>
+        bool readSlot(tableint internal_id, labeltype &label, Read read) const {
+            const std::atomic<unsigned int> &version = linkListVersion(internal_id);
+            while (true) {
+                unsigned int before = version.load(std::memory_order_acquire);
+                if (before == 0)
+                    return false;
+                if (before & 1) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                bool deleted = isMarkedDeleted(internal_id);
+                label = getExternalLabel(internal_id);
+                if (!deleted)
+                    read(internal_id);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (version.load(std::memory_order_relaxed) == before)
+                    return !deleted;
+            }
+        }
+
+        inline bool isAllowed(tableint internal_id, const BaseFilterFunctor *filter) const {
+            return filter == nullptr || (*filter)(getExternalLabel(internal_id));
+        }
+
+        /**
+         * Fraction of live elements accepted by the filter, estimated on a strided sample of internal ids.
+         */
+        double estimateFilterSelectivity(const BaseFilterFunctor &filter) const {
+            size_t count = cur_element_count;
+            size_t step = std::max((size_t) 1, count / filter_sample_size_);
+            size_t sampled = 0, accepted = 0;
+            for (size_t i = 0; i < count; i += step) {
+                labeltype label;
+                if (!readSlot(i, label, [](tableint) {}))
+                    continue;
+                sampled++;
+                if (filter(label))
+                    accepted++;
+            }
+            return sampled == 0 ? 0.0 : (double) accepted / sampled;
+        }
+
+        /**
+         * Exact scan over the elements accepted by the filter, used when too few of them are
+         * reachable for the graph search to fill its candidate list cheaply.
+         */
+        std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst>
+        searchFilteredBruteForce(const void *query_data, size_t k, const BaseFilterFunctor &filter,
+                                 SearchStats *stats) const {
+            std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> top_candidates;
+            size_t count = cur_element_count;
+            for (tableint i = 0; i < count; i++) {
+                labeltype label;
+                bool accepted = false;
+                dist_t dist = 0;
+                if (!readSlot(i, label, [&](tableint id) {
+                        accepted = filter(label);
+                        if (accepted)
+                            dist = fstdistfunc_(query_data, getDataByInternalId(id), dist_func_param_);
+                    }) || !accepted)
+                    continue;
+                HNSWLIB_STATS_ADD(stats, distance_computations, 1);
+                if (top_candidates.size() < k || dist < top_candidates.top().first) {
+                    top_candidates.emplace(dist, i);
+                    if (top_candidates.size() > k)
+                        top_candidates.pop();
+                }
+            }
+            return top_candidates;
+        }
+
         void getNeighborsByHeuristic2(
                 std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> &top_candidates,
                 const size_t M) {
@@ -362,15 +794,11 @@ namespace hnswlib {
 
 
         linklistsizeint *get_linklist0(tableint internal_id) const {
-            return (linklistsizeint *) (data_level0_memory_ + internal_id * size_data_per_element_ + offsetLevel0_);
-        };
-
-        linklistsizeint *get_linklist0(tableint internal_id, char *data_level0_memory_) const {
-            return (linklistsizeint *) (data_level0_memory_ + internal_id * size_data_per_element_ + offsetLevel0_);
+            return (linklistsizeint *) (getElementPtr(internal_id) + offsetLevel0_);
         };
 
         linklistsizeint *get_linklist(tableint internal_id, int level) const {
-            return (linklistsizeint *) (linkLists_[internal_id] + (level - 1) * size_links_per_element_);
+            return (linklistsizeint *) (upperLinkLists(internal_id) + (level - 1) * size_links_per_element_);
         };
 
         void mutuallyConnectNewElement(const void *data_point, tableint cur_c,
@@ -390,90 +818,119 @@ namespace hnswlib {
             }
 
             {
+                std::unique_lock <std::mutex> lock(linkListLock(cur_c));
                 linklistsizeint *ll_cur;
                 if (level == 0)
                     ll_cur = get_linklist0(cur_c);
                 else
                     ll_cur = get_linklist(cur_c, level);
 
-                if (*ll_cur) {
-                    throw std::runtime_error("The newly inserted element should have blank link list");
-                }
-                setListCount(ll_cur,selectedNeighbors.size());
-                tableint *data = (tableint *) (ll_cur + 1);
-
-
                 for (size_t idx = 0; idx < selectedNeighbors.size(); idx++) {
-                    if (data[idx])
-                        throw std::runtime_error("Possible memory corruption");
-                    if (level > element_levels_[selectedNeighbors[idx]])
+                    if (level > elementLevel(selectedNeighbors[idx]))
                         throw std::runtime_error("Trying to make a link on a non-existent level");
+                }
 
-                    data[idx] = selectedNeighbors[idx];
-
+                size_t sz_link_list_cur = getListCount(ll_cur);
+                tableint *data = (tableint *) (ll_cur + 1);
+                if (sz_link_list_cur == 0) {
+                    for (size_t idx = 0; idx < selectedNeighbors.size(); idx++) {
+                        if (data[idx])
+                            throw std::runtime_error("Possible memory corruption");
+                    }
+                    beginLinkListWrite(cur_c);
+                    for (size_t idx = 0; idx < selectedNeighbors.size(); idx++)
+                        data[idx] = selectedNeighbors[idx];
+                    setListCount(ll_cur,selectedNeighbors.size());
+                    endLinkListWrite(cur_c);
+                } else {
+                    // Concurrent insertions already linked back to this element, merge them with the selection
+                    std::unordered_set<tableint> merged(data, data + sz_link_list_cur);
+                    merged.insert(selectedNeighbors.begin(), selectedNeighbors.end());
+                    std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> candidates;
+                    for (tableint neighbor : merged) {
+                        candidates.emplace(fstdistfunc_(data_point, getDataByInternalId(neighbor), dist_func_param_),
+                                           neighbor);
+                    }
+                    getNeighborsByHeuristic2(candidates, Mcurmax);
+                    beginLinkListWrite(cur_c);
+                    int indx = 0;
+                    while (candidates.size() > 0) {
+                        data[indx] = candidates.top().second;
+                        candidates.pop();
+                        indx++;
+                    }
+                    setListCount(ll_cur, indx);
+                    endLinkListWrite(cur_c);
                 }
             }
             for (size_t idx = 0; idx < selectedNeighbors.size(); idx++) {
-
-                std::unique_lock <std::mutex> lock(link_list_locks_[selectedNeighbors[idx]]);
-
-
-                linklistsizeint *ll_other;
-                if (level == 0)
-                    ll_other = get_linklist0(selectedNeighbors[idx]);
-                else
-                    ll_other = get_linklist(selectedNeighbors[idx], level);
-
-                size_t sz_link_list_other = getListCount(ll_other);
-
-                if (sz_link_list_other > Mcurmax)
-                    throw std::runtime_error("Bad value of sz_link_list_other");
-                if (selectedNeighbors[idx] == cur_c)
+                tableint neighbor = selectedNeighbors[idx];
+                if (neighbor == cur_c)
                     throw std::runtime_error("Trying to connect an element to itself");
-                if (level > element_levels_[selectedNeighbors[idx]])
-                    throw std::runtime_error("Trying to make a link on a non-existent level");
 
-                tableint *data = (tableint *) (ll_other + 1);
-                if (sz_link_list_other < Mcurmax) {
-                    data[sz_link_list_other] = cur_c;
-                    setListCount(ll_other, sz_link_list_other + 1);
-                } else {
+                // Optimistic update: a full list is pruned from a snapshot without holding the lock and
+                // only written back if no other insertion changed the list in the meantime.
+                std::vector<tableint> snapshot;
+                std::vector<tableint> pruned;
+                while (true) {
+                    {
+                        std::unique_lock <std::mutex> lock(linkListLock(neighbor));
+                        linklistsizeint *ll_other;
+                        if (level == 0)
+                            ll_other = get_linklist0(neighbor);
+                        else
+                            ll_other = get_linklist(neighbor, level);
+
+                        size_t sz_link_list_other = getListCount(ll_other);
+
+                        if (sz_link_list_other > Mcurmax)
+                            throw std::runtime_error("Bad value of sz_link_list_other");
+
+                        tableint *data = (tableint *) (ll_other + 1);
+                        if (std::find(data, data + sz_link_list_other, cur_c) != data + sz_link_list_other)
+                            break;
+                        if (sz_link_list_other < Mcurmax) {
+                            beginLinkListWrite(neighbor);
+                            data[sz_link_list_other] = cur_c;
+                            setListCount(ll_other, sz_link_list_other + 1);
+                            endLinkListWrite(neighbor);
+                            break;
+                        }
+                        if (!snapshot.empty() && snapshot.size() == sz_link_list_other &&
+                            std::equal(snapshot.begin(), snapshot.end(), data)) {
+                            // snapshot still valid, write the pruned list computed below in the previous round
+                            beginLinkListWrite(neighbor);
+                            int indx = 0;
+                            for (; indx < (int) pruned.size(); indx++)
+                                data[indx] = pruned[indx];
+                            setListCount(ll_other, indx);
+                            endLinkListWrite(neighbor);
+                            break;
+                        }
+                        snapshot.assign(data, data + sz_link_list_other);
+                    }
+
                     // finding the "weakest" element to replace it with the new one
-                    dist_t d_max = fstdistfunc_(getDataByInternalId(cur_c), getDataByInternalId(selectedNeighbors[idx]),
+                    dist_t d_max = fstdistfunc_(getDataByInternalId(cur_c), getDataByInternalId(neighbor),
                                                 dist_func_param_);
                     // Heuristic:
                     std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> candidates;
                     candidates.emplace(d_max, cur_c);
 
-                    for (size_t j = 0; j < sz_link_list_other; j++) {
+                    for (size_t j = 0; j < snapshot.size(); j++) {
                         candidates.emplace(
-                                fstdistfunc_(getDataByInternalId(data[j]), getDataByInternalId(selectedNeighbors[idx]),
-                                             dist_func_param_), data[j]);
+                                fstdistfunc_(getDataByInternalId(snapshot[j]), getDataByInternalId(neighbor),
+                                             dist_func_param_), snapshot[j]);
                     }
 
                     getNeighborsByHeuristic2(candidates, Mcurmax);
 
-                    int indx = 0;
+                    pruned.clear();
                     while (candidates.size() > 0) {
-                        data[indx] = candidates.top().second;
+                        pruned.push_back(candidates.top().second);
                         candidates.pop();
-                        indx++;
-                    }
-                    setListCount(ll_other, indx);
-                    // Nearest K:
-                    /*int indx = -1;
-                    for (int j = 0; j < sz_link_list_other; j++) {
-                        dist_t d = fstdistfunc_(getDataByInternalId(data[j]), getDataByInternalId(rez[idx]), dist_func_param_);
-                        if (d > d_max) {
-                            indx = j;
-                            d_max = d;
-                        }
                     }
-                    if (indx >= 0) {
-                        data[indx] = cur_c;
-                    } */
                 }
-
             }
         }
 
@@ -484,35 +941,23 @@ namespace hnswlib {
             ef_ = ef;
         }
 
+        size_t filter_sample_size_;
+        double filter_brute_force_threshold_;
 
-        std::priority_queue<std::pair<dist_t, tableint>> searchKnnInternal(void *query_data, int k) {
-            std::priority_queue<std::pair<dist_t, tableint  >> top_candidates;
-            if (cur_element_count == 0) return top_candidates;
-            tableint currObj = enterpoint_node_;
-            dist_t curdist = fstdistfunc_(query_data, getDataByInternalId(enterpoint_node_), dist_func_param_);
+        /**
+         * Filtered searches whose estimated selectivity is below threshold scan the accepted elements
+         * exactly instead of walking the graph. Selectivity is estimated on sample_size elements.
+         */
+        void setFilterBruteForceThreshold(double threshold, size_t sample_size = 256) {
+            filter_brute_force_threshold_ = threshold;
+            filter_sample_size_ = std::max(sample_size, (size_t) 1);
+        }
 
-            for (size_t level = maxlevel_; level > 0; level--) {
-                bool changed = true;
-                while (changed) {
-                    changed = false;
-                    int *data;
-                    data = (int *) get_linklist(currObj,level);
-                    int size = getListCount(data);
-                    tableint *datal = (tableint *) (data + 1);
-                    for (int i = 0; i < size; i++) {
-                        tableint cand = datal[i];
-                        if (cand < 0 || cand > max_elements_)
-                            throw std::runtime_error("cand error");
-                        dist_t d = fstdistfunc_(query_data, getDataByInternalId(cand), dist_func_param_);
 
-                        if (d < curdist) {
-                            curdist = d;
-                            currObj = cand;
-                            changed = true;
-                        }
-                    }
-                }
-            }
+        std::priority_queue<std::pair<dist_t, tableint>> searchKnnInternal(void *query_data, int k) {
+            std::priority_queue<std::pair<dist_t, tableint  >> top_candidates;
+            if ((signed) getEnterPoint() == -1) return top_candidates;
+            tableint currObj = searchUpperLayers(query_data, nullptr);
 
             if (has_deletions_) {
                 std::priority_queue<std::pair<dist_t, tableint  >> top_candidates1=searchBaseLayerST<true>(currObj, query_data,
@@ -531,39 +976,22 @@ namespace hnswlib {
             return top_candidates;
         };
 
+        /**
+         * Changes the maximum number of elements. Growing adds segments and never moves the elements
+         * stored, so searches and insertions can run meanwhile; an insertion only throws for lack of
+         * room until the new capacity is published. Shrinking only lowers the limit.
+         */
         void resizeIndex(size_t new_max_elements){
+            std::unique_lock <std::mutex> resize_lock(resize_guard_);
+            addSegments(new_max_elements);
+            // Searches reading elements beyond the old capacity get visited lists that cover them
+            if (new_max_elements > max_elements_)
+                visited_list_pool_->resize(new_max_elements);
+
+            std::unique_lock <std::mutex> lock(cur_element_count_guard_);
             if (new_max_elements<cur_element_count)
                 throw std::runtime_error("Cannot resize, max element is less than the current number of elements");
-
-
-            delete visited_list_pool_;
-            visited_list_pool_ = new VisitedListPool(1, new_max_elements);
-
-
-
-            element_levels_.resize(new_max_elements);
-
-            std::vector<std::mutex>(new_max_elements).swap(link_list_locks_);
-
-
-            // Reallocate base layer
-            char * data_level0_memory_new = (char *) malloc(new_max_elements * size_data_per_element_);
-            if (data_level0_memory_new == nullptr)
-                throw std::runtime_error("Not enough memory: resizeIndex failed to allocate base layer");
-            memcpy(data_level0_memory_new, data_level0_memory_,cur_element_count * size_data_per_element_);
-            free(data_level0_memory_);
-            data_level0_memory_=data_level0_memory_new;
-
-            // Reallocate all other layers
-            char ** linkLists_new = (char **) malloc(sizeof(void *) * new_max_elements);
-            if (linkLists_new == nullptr)
-                throw std::runtime_error("Not enough memory: resizeIndex failed to allocate other layers");
-            memcpy(linkLists_new, linkLists_,cur_element_count * sizeof(void *));
-            free(linkLists_);
-            linkLists_=linkLists_new;
-
             max_elements_=new_max_elements;
-
         }
 
         void saveIndex(const std::string &location) {
@@ -576,8 +1004,11 @@ namespace hnswlib {
             writeBinaryPOD(output, size_data_per_element_);
             writeBinaryPOD(output, label_offset_);
             writeBinaryPOD(output, offsetData_);
-            writeBinaryPOD(output, maxlevel_);
-            writeBinaryPOD(output, enterpoint_node_);
+            tableint enterpoint_node;
+            int maxlevel;
+            getEntryPoint(enterpoint_node, maxlevel);
+            writeBinaryPOD(output, maxlevel);
+            writeBinaryPOD(output, enterpoint_node);
             writeBinaryPOD(output, maxM_);
 
             writeBinaryPOD(output, maxM0_);
@@ -585,13 +1016,17 @@ namespace hnswlib {
             writeBinaryPOD(output, mult_);
             writeBinaryPOD(output, ef_construction_);
 
-            output.write(data_level0_memory_, cur_element_count * size_data_per_element_);
+            // The level 0 memory of the segments, back to back
+            size_t segment_elements = (size_t) 1 << segment_shift_;
+            for (size_t i = 0; i < cur_element_count; i += segment_elements) {
+                output.write(getElementPtr(i), std::min(segment_elements, cur_element_count - i) * size_data_per_element_);
+            }
 
             for (size_t i = 0; i < cur_element_count; i++) {
-                unsigned int linkListSize = element_levels_[i] > 0 ? size_links_per_element_ * element_levels_[i] : 0;
+                unsigned int linkListSize = elementLevel(i) > 0 ? size_links_per_element_ * elementLevel(i) : 0;
                 writeBinaryPOD(output, linkListSize);
                 if (linkListSize)
-                    output.write(linkLists_[i], linkListSize);
+                    output.write(upperLinkLists(i), linkListSize);
             }
             output.close();
         }
@@ -621,8 +1056,11 @@ namespace hnswlib {
             readBinaryPOD(input, size_data_per_element_);
             readBinaryPOD(input, label_offset_);
             readBinaryPOD(input, offsetData_);
-            readBinaryPOD(input, maxlevel_);
-            readBinaryPOD(input, enterpoint_node_);
+            int maxlevel;
+            tableint enterpoint_node;
+            readBinaryPOD(input, maxlevel);
+            readBinaryPOD(input, enterpoint_node);
+            setEntryPoint(enterpoint_node, maxlevel);
 
             readBinaryPOD(input, maxM_);
             readBinaryPOD(input, maxM0_);
@@ -664,10 +1102,11 @@ namespace hnswlib {
             input.seekg(pos,input.beg);
 
 
-            data_level0_memory_ = (char *) malloc(max_elements * size_data_per_element_);
-            if (data_level0_memory_ == nullptr)
-                throw std::runtime_error("Not enough memory: loadIndex failed to allocate level0");
-            input.read(data_level0_memory_, cur_element_count * size_data_per_element_);
+            initSegments(max_elements);
+            size_t segment_elements = (size_t) 1 << segment_shift_;
+            for (size_t i = 0; i < cur_element_count; i += segment_elements) {
+                input.read(getElementPtr(i), std::min(segment_elements, cur_element_count - i) * size_data_per_element_);
+            }
 
             
 
@@ -676,33 +1115,33 @@ namespace hnswlib {
 
 
             size_links_level0_ = maxM0_ * sizeof(tableint) + sizeof(linklistsizeint);
-            std::vector<std::mutex>(max_elements).swap(link_list_locks_);
 
 
             visited_list_pool_ = new VisitedListPool(1, max_elements);
 
 
-            linkLists_ = (char **) malloc(sizeof(void *) * max_elements);
-            if (linkLists_ == nullptr)
-                throw std::runtime_error("Not enough memory: loadIndex failed to allocate linklists");
-            element_levels_ = std::vector<int>(max_elements);
             revSize_ = 1.0 / mult_;
             ef_ = 10;
+            filter_sample_size_ = 256;
+            filter_brute_force_threshold_ = 0.01;
             for (size_t i = 0; i < cur_element_count; i++) {
                 label_lookup_[getExternalLabel(i)]=i;
                 unsigned int linkListSize;
                 readBinaryPOD(input, linkListSize);
                 if (linkListSize == 0) {
-                    element_levels_[i] = 0;
+                    elementLevel(i) = 0;
 
-                    linkLists_[i] = nullptr;
+                    upperLinkLists(i) = nullptr;
                 } else {
-                    element_levels_[i] = linkListSize / size_links_per_element_;
-                    linkLists_[i] = (char *) malloc(linkListSize);
-                    if (linkLists_[i] == nullptr)
+                    elementLevel(i) = linkListSize / size_links_per_element_;
+                    linkListCapacity(i) = elementLevel(i);
+                    upperLinkLists(i) = (char *) malloc(linkListSize);
+                    if (upperLinkLists(i) == nullptr)
                         throw std::runtime_error("Not enough memory: loadIndex failed to allocate linklist");
-                    input.read(linkLists_[i], linkListSize);
+                    input.read(upperLinkLists(i), linkListSize);
                 }
+                // Loaded elements count as written once, see readSlot
+                linkListVersion(i).store(2, std::memory_order_relaxed);
             }
 
             has_deletions_=false;
@@ -742,6 +1181,7 @@ namespace hnswlib {
 //        static const unsigned char REUSE_MARK = 0x10;
         /**
          * Marks an element with the given label deleted, does NOT really change the current graph.
+         * consolidateDeletes removes marked elements from the graph and frees their slots for reuse.
          * @param label
          */
         void markDelete(labeltype label)
@@ -791,60 +1231,249 @@ namespace hnswlib {
             *((unsigned short int*)(ptr))=*((unsigned short int *)&size);
         }
 
+        /**
+         * Returns an internal id for a new element, reusing slots released by consolidateDeletes first.
+         * A reused slot keeps its upper link lists, which insertElement rewrites when they have room.
+         * Must be called with cur_element_count_guard_ held.
+         */
+        tableint allocateSlot() {
+            if (!free_slots_.empty()) {
+                tableint id = free_slots_.back();
+                free_slots_.pop_back();
+                elementLevel(id) = 0;
+                return id;
+            }
+            if (cur_element_count >= max_elements_) {
+                throw std::runtime_error("The number of elements exceeds the specified limit");
+            }
+            return cur_element_count++;
+        }
+
+        /**
+         * Removes elements marked deleted from the graph: every live element linking to a deleted one has
+         * its link lists rebuilt from its live neighbors and the live neighbors of its deleted neighbors,
+         * the enter point is moved to a live element, and the deleted slots are put on a free list that
+         * addPoint and addPoints reuse. Afterwards searches no longer spend distance computations on the
+         * deleted elements.
+         * Can run in a background thread while searches continue. Insertions are held back: it waits for
+         * those running to finish, and those started meanwhile wait for it.
+         * @param num_threads threads used for repairing link lists (hardware concurrency if not positive)
+         * @return number of slots released to the free list
+         */
+        size_t consolidateDeletes(int num_threads = 1) {
+            std::unique_lock <std::mutex> consolidate_lock(consolidate_guard_);
+            {
+                std::unique_lock <std::mutex> gate_lock(insertion_gate_);
+                consolidating_ = true;
+                insertion_gate_cv_.wait(gate_lock, [this] { return active_insertions_ == 0; });
+            }
+            struct ConsolidationEnd {
+                HierarchicalNSW *index;
+                ~ConsolidationEnd() {
+                    std::unique_lock <std::mutex> gate_lock(index->insertion_gate_);
+                    index->consolidating_ = false;
+                    index->insertion_gate_cv_.notify_all();
+                }
+            } consolidation_end = {this};
+            std::vector<tableint> released;
+            size_t n;
+            {
+                std::unique_lock <std::mutex> lock(cur_element_count_guard_);
+                n = cur_element_count;
+                std::unordered_set<tableint> free_set(free_slots_.begin(), free_slots_.end());
+                for (tableint i = 0; i < n; i++) {
+                    if (isMarkedDeleted(i) && !free_set.count(i))
+                        released.push_back(i);
+                }
+            }
+            if (released.empty())
+                return 0;
+
+            replaceDeletedEnterPoint();
+
+            parallelFor(0, n, num_threads, [&](size_t i) {
+                if (!isMarkedDeleted(i))
+                    repairConnections(i);
+            });
+
+            std::unique_lock <std::mutex> lock(cur_element_count_guard_);
+            size_t num_released = 0;
+            for (tableint id : released) {
+                // Without a live element left the enter point has to stay in place
+                if (id == getEnterPoint())
+                    continue;
+                auto search = label_lookup_.find(getExternalLabel(id));
+                if (search != label_lookup_.end() && search->second == id)
+                    label_lookup_.erase(search);
+                free_slots_.push_back(id);
+                num_released++;
+            }
+            return num_released;
+        }
+
+        size_t getFreeSlotCount() {
+            std::unique_lock <std::mutex> lock(cur_element_count_guard_);
+            return free_slots_.size();
+        }
+
+        void replaceDeletedEnterPoint() {
+            std::unique_lock <std::mutex> lock(global);
+            tableint enterpoint_node = getEnterPoint();
+            if ((signed) enterpoint_node == -1 || !isMarkedDeleted(enterpoint_node))
+                return;
+            int best_level = -1;
+            tableint best = enterpoint_node;
+            for (tableint i = 0; i < cur_element_count; i++) {
+                if (!isMarkedDeleted(i) && elementLevel(i) > best_level) {
+                    best_level = elementLevel(i);
+                    best = i;
+                }
+            }
+            if (best_level < 0)
+                return;
+            setEntryPoint(best, best_level);
+        }
+
+        /**
+         * Rebuilds the link lists of a live element that point to deleted elements.
+         */
+        void repairConnections(tableint id) {
+            for (int level = 0; level <= elementLevel(id); level++) {
+                size_t Mcurmax = level ? maxM_ : maxM0_;
+                std::vector<tableint> snapshot;
+                {
+                    std::unique_lock <std::mutex> lock(linkListLock(id));
+                    linklistsizeint *ll = level == 0 ? get_linklist0(id) : get_linklist(id, level);
+                    tableint *data = (tableint *) (ll + 1);
+                    snapshot.assign(data, data + getListCount(ll));
+                }
+                bool has_deleted = false;
+                for (tableint neighbor : snapshot)
+                    has_deleted = has_deleted || isMarkedDeleted(neighbor);
+                if (!has_deleted)
+                    continue;
+
+                std::unordered_set<tableint> candidate_ids;
+                for (tableint neighbor : snapshot) {
+                    if (!isMarkedDeleted(neighbor)) {
+                        candidate_ids.insert(neighbor);
+                        continue;
+                    }
+                    std::unique_lock <std::mutex> lock(linkListLock(neighbor));
+                    linklistsizeint *ll = level == 0 ? get_linklist0(neighbor) : get_linklist(neighbor, level);
+                    size_t size = getListCount(ll);
+                    tableint *data = (tableint *) (ll + 1);
+                    for (size_t j = 0; j < size; j++) {
+                        if (data[j] != id && !isMarkedDeleted(data[j]))
+                            candidate_ids.insert(data[j]);
+                    }
+                }
+                std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> candidates;
+                for (tableint candidate : candidate_ids) {
+                    candidates.emplace(fstdistfunc_(getDataByInternalId(id), getDataByInternalId(candidate),
+                                                    dist_func_param_), candidate);
+                }
+                getNeighborsByHeuristic2(candidates, Mcurmax);
+                while (candidates.size() > Mcurmax)
+                    candidates.pop();
+
+                std::unique_lock <std::mutex> lock(linkListLock(id));
+                linklistsizeint *ll = level == 0 ? get_linklist0(id) : get_linklist(id, level);
+                tableint *data = (tableint *) (ll + 1);
+                if (getListCount(ll) != snapshot.size() || !std::equal(snapshot.begin(), snapshot.end(), data)) {
+                    // changed while the candidates were collected, repair this level again
+                    level--;
+                    continue;
+                }
+                beginLinkListWrite(id);
+                int indx = 0;
+                while (candidates.size() > 0) {
+                    data[indx] = candidates.top().second;
+                    candidates.pop();
+                    indx++;
+                }
+                setListCount(ll, indx);
+                endLinkListWrite(id);
+            }
+        }
+
+        /**
+         * Inserts a point. Can be called from several threads while other threads search and resizeIndex
+         * grows the index: the enter point is published atomically once the point is linked, and searches
+         * read link lists through readLinkList. Searches that started before may not find the point.
+         */
         void addPoint(const void *data_point, labeltype label) {
             addPoint(data_point, label,-1);
         }
 
         tableint addPoint(const void *data_point, labeltype label, int level) {
+            InsertionScope insertion(this);
             tableint cur_c = 0;
             {
                 std::unique_lock <std::mutex> lock(cur_element_count_guard_);
-                if (cur_element_count >= max_elements_) {
-                    throw std::runtime_error("The number of elements exceeds the specified limit");
-                };
-
-                cur_c = cur_element_count;
-                cur_element_count++;
+                cur_c = allocateSlot();
 
                 auto search = label_lookup_.find(label);
                 if (search != label_lookup_.end()) {
-                    std::unique_lock <std::mutex> lock_el(link_list_locks_[search->second]);
+                    std::unique_lock <std::mutex> lock_el(linkListLock(search->second));
                     has_deletions_ = true;
                     markDeletedInternal(search->second);
                 }
                 label_lookup_[label] = cur_c;
             }
 
-            std::unique_lock <std::mutex> lock_el(link_list_locks_[cur_c]);
             int curlevel = getRandomLevel(mult_);
             if (level > 0)
                 curlevel = level;
 
-            element_levels_[cur_c] = curlevel;
-
+            insertElement(data_point, label, cur_c, curlevel, true);
+            return cur_c;
+        };
 
-            std::unique_lock <std::mutex> templock(global);
-            int maxlevelcopy = maxlevel_;
-            if (curlevel <= maxlevelcopy)
+        /**
+         * Inserts a point into a slot whose internal id and level were already assigned.
+         * @param lock_global whether the global lock has to be taken; can only be skipped when the level
+         * does not exceed the level of the enter point, so that the enter point never changes
+         */
+        void insertElement(const void *data_point, labeltype label, tableint cur_c, int curlevel, bool lock_global) {
+            elementLevel(cur_c) = curlevel;
+
+            std::unique_lock <std::mutex> templock(global, std::defer_lock);
+            if (lock_global)
+                templock.lock();
+            tableint enterpoint_copy;
+            int maxlevelcopy;
+            getEntryPoint(enterpoint_copy, maxlevelcopy);
+            if (!lock_global && curlevel > maxlevelcopy)
+                throw std::runtime_error("Element above the maximum level inserted without the global lock");
+            if (lock_global && curlevel <= maxlevelcopy)
                 templock.unlock();
-            tableint currObj = enterpoint_node_;
-            tableint enterpoint_copy = enterpoint_node_;
+            tableint currObj = enterpoint_copy;
 
+            if (curlevel > linkListCapacity(cur_c)) {
+                char *link_lists = (char *) malloc(size_links_per_element_ * curlevel + 1);
+                if (link_lists == nullptr)
+                    throw std::runtime_error("Not enough memory: addPoint failed to allocate linklist");
+                memset(link_lists, 0, size_links_per_element_ * curlevel + 1);
+                if (upperLinkLists(cur_c) != nullptr) {
+                    std::unique_lock <std::mutex> lock(cur_element_count_guard_);
+                    retired_link_lists_.push_back(upperLinkLists(cur_c));
+                }
+                upperLinkLists(cur_c) = link_lists;
+                linkListCapacity(cur_c) = curlevel;
+            }
 
-            memset(data_level0_memory_ + cur_c * size_data_per_element_ + offsetLevel0_, 0, size_data_per_element_);
+            beginLinkListWrite(cur_c);
+            memset(getElementPtr(cur_c) + offsetLevel0_, 0, size_data_per_element_);
+            if (curlevel)
+                memset(upperLinkLists(cur_c), 0, size_links_per_element_ * curlevel);
 
             // Initialisation of the data and label
             memcpy(getExternalLabeLp(cur_c), &label, sizeof(labeltype));
             memcpy(getDataByInternalId(cur_c), data_point, data_size_);
+            endLinkListWrite(cur_c);
 
 
-            if (curlevel) {
-                linkLists_[cur_c] = (char *) malloc(size_links_per_element_ * curlevel + 1);
-                if (linkLists_[cur_c] == nullptr)
-                    throw std::runtime_error("Not enough memory: addPoint failed to allocate linklist");
-                memset(linkLists_[cur_c], 0, size_links_per_element_ * curlevel + 1);
-            }
-
             if ((signed)currObj != -1) {
 
                 if (curlevel < maxlevelcopy) {
@@ -857,7 +1486,7 @@ namespace hnswlib {
                         while (changed) {
                             changed = false;
                             unsigned int *data;
-                            std::unique_lock <std::mutex> lock(link_list_locks_[currObj]);
+                            std::unique_lock <std::mutex> lock(linkListLock(currObj));
                             data = get_linklist(currObj,level);
                             int size = getListCount(data);
 
@@ -897,38 +1526,149 @@ namespace hnswlib {
 
             } else {
                 // Do nothing for the first element
-                enterpoint_node_ = 0;
-                maxlevel_ = curlevel;
+                setEntryPoint(cur_c, curlevel);
 
             }
 
             //Releasing lock for the maximum level
             if (curlevel > maxlevelcopy) {
-                enterpoint_node_ = cur_c;
-                maxlevel_ = curlevel;
+                setEntryPoint(cur_c, curlevel);
             }
-            return cur_c;
-        };
+        }
 
-        std::priority_queue<std::pair<dist_t, labeltype >>
-        searchKnn(const void *query_data, size_t k) const {
-            std::priority_queue<std::pair<dist_t, labeltype >> result;
-            if (cur_element_count == 0) return result;
+        /**
+         * Runs fn(i) for i in [start, end) on num_threads threads (hardware concurrency if not positive)
+         * and rethrows the last exception raised by any of them.
+         */
+        template<class Function>
+        static void parallelFor(size_t start, size_t end, int num_threads, Function fn) {
+            if (num_threads <= 0)
+                num_threads = std::thread::hardware_concurrency();
+            std::atomic<size_t> next(start);
+            std::exception_ptr last_exception = nullptr;
+            std::mutex last_exception_guard;
+            auto worker = [&]() {
+                while (true) {
+                    size_t i = next.fetch_add(1);
+                    if (i >= end)
+                        break;
+                    try {
+                        fn(i);
+                    } catch (...) {
+                        std::unique_lock <std::mutex> lock(last_exception_guard);
+                        last_exception = std::current_exception();
+                        next = end;
+                        break;
+                    }
+                }
+            };
+            if (num_threads <= 1) {
+                worker();
+            } else {
+                std::vector<std::thread> threads;
+                for (int t = 0; t < num_threads; t++)
+                    threads.push_back(std::thread(worker));
+                for (auto &thread : threads)
+                    thread.join();
+            }
+            if (last_exception)
+                std::rethrow_exception(last_exception);
+        }
+
+        /**
+         * Bulk insertion of n points stored contiguously, data_size_ bytes apart.
+         * See the overload taking an array of pointers.
+         */
+        void addPoints(const void *data, const labeltype *labels, size_t n, int num_threads = 0,
+                       bool shuffle = false) {
+            std::vector<const void *> data_points(n);
+            for (size_t i = 0; i < n; i++)
+                data_points[i] = (const char *) data + i * data_size_;
+            addPoints(data_points.data(), labels, n, num_threads, shuffle);
+        }
+
+        /**
+         * Bulk insertion of n points using num_threads threads (hardware concurrency if not positive).
+         * Internal ids and levels are assigned up front under a single lock. The point with the highest
+         * level is inserted first, so the remaining ones never change the enter point and are inserted in
+         * parallel without the global lock. Must not be mixed with concurrent addPoint calls.
+         * @param shuffle insert in random order, which helps graph quality on sorted input
+         */
+        void addPoints(const void *const *data_points, const labeltype *labels, size_t n, int num_threads = 0,
+                       bool shuffle = false) {
+            if (n == 0)
+                return;
+            InsertionScope insertion(this);
+            std::vector<tableint> ids(n);
+            std::vector<int> levels(n);
+            std::vector<tableint> replaced;
+            {
+                std::unique_lock <std::mutex> lock(cur_element_count_guard_);
+                if (cur_element_count + n > max_elements_ + free_slots_.size()) {
+                    throw std::runtime_error("The number of elements exceeds the specified limit");
+                }
+                std::unordered_set<tableint> batch_ids;
+                for (size_t i = 0; i < n; i++) {
+                    ids[i] = allocateSlot();
+                    batch_ids.insert(ids[i]);
+
+                    auto search = label_lookup_.find(labels[i]);
+                    if (search != label_lookup_.end()) {
+                        has_deletions_ = true;
+                        if (batch_ids.count(search->second)) {
+                            // duplicate within the batch, marked once its slot is initialized
+                            replaced.push_back(search->second);
+                        } else {
+                            std::unique_lock <std::mutex> lock_el(linkListLock(search->second));
+                            markDeletedInternal(search->second);
+                        }
+                    }
+                    label_lookup_[labels[i]] = ids[i];
+                    levels[i] = getRandomLevel(mult_);
+                }
+            }
+
+            std::vector<size_t> order(n);
+            for (size_t i = 0; i < n; i++)
+                order[i] = i;
+            if (shuffle)
+                std::shuffle(order.begin(), order.end(), level_generator_);
+            size_t top = std::max_element(levels.begin(), levels.end()) - levels.begin();
+            std::swap(order[0], *std::find(order.begin(), order.end(), top));
+
+            insertElement(data_points[top], labels[top], ids[top], levels[top], true);
 
-            tableint currObj = enterpoint_node_;
-            dist_t curdist = fstdistfunc_(query_data, getDataByInternalId(enterpoint_node_), dist_func_param_);
+            parallelFor(1, n, num_threads, [&](size_t j) {
+                size_t i = order[j];
+                insertElement(data_points[i], labels[i], ids[i], levels[i], false);
+            });
 
-            for (int level = maxlevel_; level > 0; level--) {
+            for (tableint id : replaced)
+                markDeletedInternal(id);
+        }
+
+        /**
+         * Greedy descent from the enter point through the upper layers, returns the closest element found
+         * on layer 1 to start the base layer search from.
+         */
+        tableint searchUpperLayers(const void *query_data, SearchStats *stats) const {
+            tableint currObj;
+            int maxlevel;
+            getEntryPoint(currObj, maxlevel);
+            dist_t curdist = fstdistfunc_(query_data, getDataByInternalId(currObj), dist_func_param_);
+            HNSWLIB_STATS_ADD(stats, distance_computations, 1);
+
+            std::vector<tableint> links(maxM0_ + 1);
+            for (int level = maxlevel; level > 0; level--) {
                 bool changed = true;
                 while (changed) {
                     changed = false;
-                    unsigned int *data;
 
-                    data = (unsigned int *) get_linklist(currObj, level);
-                    int size = getListCount(data);
-                    tableint *datal = (tableint *) (data + 1);
+                    int size = readLinkList(currObj, level, links.data());
+                    HNSWLIB_STATS_ADD(stats, upper_layer_hops, 1);
+                    HNSWLIB_STATS_ADD(stats, distance_computations, size);
                     for (int i = 0; i < size; i++) {
-                        tableint cand = datal[i];
+                        tableint cand = links[i];
                         if (cand < 0 || cand > max_elements_)
                             throw std::runtime_error("cand error");
                         dist_t d = fstdistfunc_(query_data, getDataByInternalId(cand), dist_func_param_);
@@ -941,17 +1681,47 @@ namespace hnswlib {
                     }
                 }
             }
+            return currObj;
+        }
 
-            std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> top_candidates;
-            if (has_deletions_) {
-                std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> top_candidates1=searchBaseLayerST<true>(
-                        currObj, query_data, std::max(ef_, k));
-                top_candidates.swap(top_candidates1);
+        std::priority_queue<std::pair<dist_t, labeltype >>
+        searchKnn(const void *query_data, size_t k, const BaseFilterFunctor *filter = nullptr,
+                  SearchStats *stats = nullptr) const {
+            return searchKnn(query_data, k, SearchParams(), filter, stats);
+        }
+
+        /**
+         * Search with per query ef and early termination, see SearchParams.
+         */
+        std::priority_queue<std::pair<dist_t, labeltype >>
+        searchKnn(const void *query_data, size_t k, const SearchParams &params,
+                  const BaseFilterFunctor *filter = nullptr, SearchStats *stats = nullptr) const {
+            std::priority_queue<std::pair<dist_t, labeltype >> result;
+            if ((signed) getEnterPoint() == -1) return result;
+
+            if (filter != nullptr && estimateFilterSelectivity(*filter) < filter_brute_force_threshold_) {
+                auto top_candidates = searchFilteredBruteForce(query_data, k, *filter, stats);
+                while (top_candidates.size() > 0) {
+                    std::pair<dist_t, tableint> rez = top_candidates.top();
+                    result.push(std::pair<dist_t, labeltype>(rez.first, getExternalLabel(rez.second)));
+                    top_candidates.pop();
+                }
+                return result;
             }
-            else{
-                std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> top_candidates1=searchBaseLayerST<false>(
-                        currObj, query_data, std::max(ef_, k));
-                top_candidates.swap(top_candidates1);
+
+            tableint currObj = searchUpperLayers(query_data, stats);
+
+            size_t ef = std::max(params.ef == 0 ? ef_ : params.ef, k);
+            bool adaptive = params.patience > 0 || params.distance_ratio > 0;
+            std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> top_candidates;
+            if (has_deletions_ && adaptive) {
+                top_candidates = searchBaseLayerST<true, true>(currObj, query_data, ef, filter, stats, k, &params);
+            } else if (has_deletions_) {
+                top_candidates = searchBaseLayerST<true>(currObj, query_data, ef, filter, stats);
+            } else if (adaptive) {
+                top_candidates = searchBaseLayerST<false, true>(currObj, query_data, ef, filter, stats, k, &params);
+            } else {
+                top_candidates = searchBaseLayerST<false>(currObj, query_data, ef, filter, stats);
             }
             while (top_candidates.size() > k) {
                 top_candidates.pop();
@@ -964,7 +1734,213 @@ namespace hnswlib {
             return result;
         };
 
-        template <typename Comp>
+        /**
+         * Searches num_queries queries, stored one after another, on the calling thread. The base layer
+         * walks of group_size queries are interleaved: every step of a query prefetches what its next
+         * step reads, the neighbor list of the next candidate or the vectors of its neighbors, and the
+         * steps of the other queries of the group run while those cache lines arrive. A single walk is a
+         * chain of dependent cache misses, so this raises the throughput of a core on indexes much larger
+         * than its cache. The upper layers are searched query by query. Results are those of searchKnn
+         * with the same params. Stats, when given, holds one entry per query, of the type the array was
+         * declared with so that arrays of a type extending SearchStats are stepped through correctly.
+         */
+        template <typename Stats = SearchStats>
+        std::vector<std::priority_queue<std::pair<dist_t, labeltype>>>
+        searchKnnBatch(const void *queries, size_t num_queries, size_t k,
+                       const SearchParams &params = SearchParams(), size_t group_size = 8,
+                       const BaseFilterFunctor *filter = nullptr, Stats *stats = nullptr) const {
+            static_assert(std::is_base_of<SearchStats, Stats>::value, "Stats must extend SearchStats");
+            std::vector<std::priority_queue<std::pair<dist_t, labeltype>>> results(num_queries);
+            if ((signed) getEnterPoint() == -1 || num_queries == 0) return results;
+
+            if (filter != nullptr && estimateFilterSelectivity(*filter) < filter_brute_force_threshold_) {
+                for (size_t i = 0; i < num_queries; i++) {
+                    results[i] = searchKnn((const char *) queries + i * data_size_, k, params, filter,
+                                           stats ? stats + i : nullptr);
+                }
+                return results;
+            }
+
+            size_t ef = std::max(params.ef == 0 ? ef_ : params.ef, k);
+            std::vector<BatchSearchState> group(std::min(std::max(group_size, (size_t) 1), num_queries));
+            size_t next_query = 0;
+            size_t active = group.size();
+            // Starts queries in the slot until one has a candidate to expand, or retires the slot.
+            auto refill = [&](BatchSearchState &state) {
+                while (next_query < num_queries) {
+                    size_t query_id = next_query++;
+                    if (startBatchSearch(state, query_id, (const char *) queries + query_id * data_size_, ef, k,
+                                         params, filter, stats ? stats + query_id : nullptr))
+                        return;
+                    finishBatchSearch(state, k, results);
+                }
+                state.done = true;
+                active--;
+            };
+            for (BatchSearchState &state : group)
+                refill(state);
+
+            while (active > 0) {
+                for (BatchSearchState &state : group) {
+                    if (state.done)
+                        continue;
+                    if (state.expanding) {
+                        expandBatchCandidate(state);
+                    } else if (!scoreBatchCandidate(state, ef, k, params, filter)) {
+                        finishBatchSearch(state, k, results);
+                        refill(state);
+                    }
+                }
+            }
+            return results;
+        }
+
+        /**
+         * Base layer search of one query of searchKnnBatch. A step either expands the candidate whose
+         * neighbor list was prefetched, prefetching the neighbors, or scores those neighbors and selects
+         * the next candidate.
+         */
+        struct BatchSearchState {
+            size_t query_id;
+            const void *query_data;
+            SearchStats *stats;
+            VisitedList *vl;
+            std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> top_candidates;
+            std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> candidate_set;
+            std::priority_queue<dist_t> nearest_k;
+            size_t stale_expansions;
+            dist_t lowerBound;
+            tableint current_node_id;
+            std::vector<tableint> links;
+            size_t num_links;
+            bool expanding;
+            bool done;
+        };
+
+        static void prefetchBytes(const char *ptr, size_t size) {
+#ifdef USE_SSE
+            for (size_t offset = 0; offset < size; offset += 64)
+                _mm_prefetch(ptr + offset, _MM_HINT_T0);
+#endif
+        }
+
+        bool startBatchSearch(BatchSearchState &state, size_t query_id, const void *query_data, size_t ef,
+                              size_t k, const SearchParams &params, const BaseFilterFunctor *filter,
+                              SearchStats *stats) const {
+            state.query_id = query_id;
+            state.query_data = query_data;
+            state.stats = stats;
+            tableint ep_id = searchUpperLayers(query_data, stats);
+            state.vl = visited_list_pool_->getFreeVisitedList();
+            state.top_candidates = decltype(state.top_candidates)();
+            state.candidate_set = decltype(state.candidate_set)();
+            state.nearest_k = std::priority_queue<dist_t>();
+            state.stale_expansions = 0;
+            state.links.resize(maxM0_ + 1);
+            state.done = false;
+
+            if ((!has_deletions_ || !isMarkedDeleted(ep_id)) && isAllowed(ep_id, filter)) {
+                dist_t dist = fstdistfunc_(query_data, getDataByInternalId(ep_id), dist_func_param_);
+                HNSWLIB_STATS_ADD(stats, distance_computations, 1);
+                state.lowerBound = dist;
+                state.top_candidates.emplace(dist, ep_id);
+                state.candidate_set.emplace(-dist, ep_id);
+                state.nearest_k.push(dist);
+            } else {
+                state.lowerBound = std::numeric_limits<dist_t>::max();
+                state.candidate_set.emplace(-state.lowerBound, ep_id);
+            }
+            state.vl->mass[ep_id] = state.vl->curV;
+            HNSWLIB_STATS_ADD(stats, visited_nodes, 1);
+            return selectBatchCandidate(state, ef, k, params, filter);
+        }
+
+        /**
+         * Pops the next candidate and prefetches its neighbor list, with the stop criteria of
+         * searchBaseLayerST. Returns false when the search is over.
+         */
+        bool selectBatchCandidate(BatchSearchState &state, size_t ef, size_t k, const SearchParams &params,
+                                  const BaseFilterFunctor *filter) const {
+            if (state.candidate_set.empty())
+                return false;
+            dist_t candidate_dist = -state.candidate_set.top().first;
+            if (candidate_dist > state.lowerBound &&
+                (state.top_candidates.size() == ef || (!has_deletions_ && filter == nullptr)))
+                return false;
+            if (state.nearest_k.size() == k &&
+                ((params.patience > 0 && state.stale_expansions >= params.patience) ||
+                 (params.distance_ratio > 0 && candidate_dist > params.distance_ratio * state.nearest_k.top()))) {
+                HNSWLIB_STATS_ADD(state.stats, early_terminations, 1);
+                return false;
+            }
+            state.stale_expansions++;
+            state.current_node_id = state.candidate_set.top().second;
+            state.candidate_set.pop();
+            HNSWLIB_STATS_ADD(state.stats, base_layer_hops, 1);
+            prefetchBytes((const char *) get_linklist0(state.current_node_id), size_links_level0_);
+            state.expanding = true;
+            return true;
+        }
+
+        void expandBatchCandidate(BatchSearchState &state) const {
+            state.num_links = readLinkList(state.current_node_id, 0, state.links.data());
+            for (size_t j = 0; j < state.num_links; j++) {
+                tableint candidate_id = state.links[j];
+#ifdef USE_SSE
+                _mm_prefetch((char *) (state.vl->mass + candidate_id), _MM_HINT_T0);
+#endif
+                prefetchBytes(getDataByInternalId(candidate_id), data_size_);
+            }
+            state.expanding = false;
+        }
+
+        bool scoreBatchCandidate(BatchSearchState &state, size_t ef, size_t k, const SearchParams &params,
+                                 const BaseFilterFunctor *filter) const {
+            vl_type *visited_array = state.vl->mass;
+            vl_type visited_array_tag = state.vl->curV;
+            for (size_t j = 0; j < state.num_links; j++) {
+                tableint candidate_id = state.links[j];
+                if (candidate_id >= state.vl->numelements || visited_array[candidate_id] == visited_array_tag)
+                    continue;
+                visited_array[candidate_id] = visited_array_tag;
+                dist_t dist = fstdistfunc_(state.query_data, getDataByInternalId(candidate_id), dist_func_param_);
+                HNSWLIB_STATS_ADD(state.stats, visited_nodes, 1);
+                HNSWLIB_STATS_ADD(state.stats, distance_computations, 1);
+                if (state.top_candidates.size() < ef || state.lowerBound > dist) {
+                    state.candidate_set.emplace(-dist, candidate_id);
+                    if ((!has_deletions_ || !isMarkedDeleted(candidate_id)) && isAllowed(candidate_id, filter)) {
+                        state.top_candidates.emplace(dist, candidate_id);
+                        if (state.nearest_k.size() < k || dist < state.nearest_k.top()) {
+                            state.nearest_k.push(dist);
+                            if (state.nearest_k.size() > k)
+                                state.nearest_k.pop();
+                            state.stale_expansions = 0;
+                        }
+                    }
+                    if (state.top_candidates.size() > ef)
+                        state.top_candidates.pop();
+                    if (!state.top_candidates.empty())
+                        state.lowerBound = state.top_candidates.top().first;
+                }
+            }
+            return selectBatchCandidate(state, ef, k, params, filter);
+        }
+
+        void finishBatchSearch(BatchSearchState &state, size_t k,
+                               std::vector<std::priority_queue<std::pair<dist_t, labeltype>>> &results) const {
+            visited_list_pool_->releaseVisitedList(state.vl);
+            while (state.top_candidates.size() > k)
+                state.top_candidates.pop();
+            auto &result = results[state.query_id];
+            while (!state.top_candidates.empty()) {
+                std::pair<dist_t, tableint> rez = state.top_candidates.top();
+                result.push(std::pair<dist_t, labeltype>(rez.first, getExternalLabel(rez.second)));
+                state.top_candidates.pop();
+            }
+        }
+
+        template <typename Comp, typename = typename std::enable_if<!std::is_pointer<Comp>::value &&
+                                                                    !std::is_same<Comp, SearchParams>::value>::type>
         std::vector<std::pair<dist_t, labeltype>>
         searchKnn(const void* query_data, size_t k, Comp comp) {
             std::vector<std::pair<dist_t, labeltype>> result;
@@ -982,6 +1958,362 @@ namespace hnswlib {
             return result;
         }
 
+        /**
+         * Learns the distance ratio of SearchParams that reaches target_recall on average over sample
+         * queries, stored one after another in queries. The results of a search with reference_ef stand
+         * in for the exact neighbors. Returns the smallest ratio found by bisection, or 0 (no early
+         * termination) when even a large ratio misses the target. Distances must be non negative.
+         */
+        float calibrateDistanceRatio(const void *queries, size_t num_queries, size_t k, float target_recall,
+                                     size_t ef = 0, size_t reference_ef = 0) const {
+            if (num_queries == 0 || k == 0)
+                return 0;
+            if (ef == 0)
+                ef = ef_;
+            if (reference_ef == 0)
+                reference_ef = std::max(4 * ef, 10 * k);
+            std::vector<std::vector<labeltype>> reference(num_queries);
+            for (size_t i = 0; i < num_queries; i++) {
+                auto result = searchKnn((const char *) queries + i * data_size_, k, SearchParams(reference_ef));
+                while (!result.empty()) {
+                    reference[i].push_back(result.top().second);
+                    result.pop();
+                }
+                std::sort(reference[i].begin(), reference[i].end());
+            }
+
+            auto get_recall = [&](float ratio) {
+                SearchParams params(ef);
+                params.distance_ratio = ratio;
+                size_t found = 0, total = 0;
+                for (size_t i = 0; i < num_queries; i++) {
+                    auto result = searchKnn((const char *) queries + i * data_size_, k, params);
+                    total += reference[i].size();
+                    while (!result.empty()) {
+                        found += std::binary_search(reference[i].begin(), reference[i].end(), result.top().second);
+                        result.pop();
+                    }
+                }
+                return total == 0 ? 1.0f : (float) found / total;
+            };
+
+            const float max_ratio = 1e6f;
+            float low = 1, high = 2;
+            while (get_recall(high) < target_recall) {
+                low = high;
+                high *= 2;
+                if (high > max_ratio)
+                    return 0;
+            }
+            for (int i = 0; i < 12; i++) {
+                float mid = (low + high) / 2;
+                if (get_recall(mid) < target_recall)
+                    low = mid;
+                else
+                    high = mid;
+            }
+            return high;
+        }
+
+        /**
+         * Approximate range search, passes the elements within radius of the query to
+         * callback(dist, label) as they are found, at most max_results of them. The cost grows with the
+         * number of elements in the ball rather than with a k chosen large enough to cover it. Returns
+         * the number of results.
+         */
+        template <typename Callback, typename = typename std::enable_if<isRangeCallback<Callback>::value>::type>
+        size_t searchRange(const void *query_data, dist_t radius, size_t max_results, Callback callback,
+                           const BaseFilterFunctor *filter = nullptr, SearchStats *stats = nullptr) const {
+            if ((signed) getEnterPoint() == -1 || max_results == 0) return 0;
+
+            tableint currObj = searchUpperLayers(query_data, stats);
+            if (has_deletions_)
+                return searchBaseLayerRange<true>(currObj, query_data, radius, max_results, callback, filter, stats);
+            return searchBaseLayerRange<false>(currObj, query_data, radius, max_results, callback, filter, stats);
+        }
+
+        /**
+         * Elements within radius of the query, nearest first, at most max_results of them.
+         */
+        std::vector<std::pair<dist_t, labeltype>>
+        searchRange(const void *query_data, dist_t radius, size_t max_results,
+                    const BaseFilterFunctor *filter = nullptr, SearchStats *stats = nullptr) const {
+            std::vector<std::pair<dist_t, labeltype>> result;
+            searchRange(query_data, radius, max_results,
+                        [&result](dist_t dist, labeltype label) { result.emplace_back(dist, label); },
+                        filter, stats);
+            std::sort(result.begin(), result.end());
+            return result;
+        }
+
+        /**
+         * Permutes internal ids so that elements linked in the level 0 graph are stored close to each other,
+         * which reduces cache and TLB misses per hop of searchBaseLayerST.
+         * Level 0 and upper level link lists, element levels, label_lookup_ and the enter point are rewritten
+         * consistently, so the index can be saved with saveIndex afterwards.
+         * Needs a second copy of the level 0 memory while running. Must not run concurrently with
+         * insertions or searches.
+         * @param type ordering used to assign new internal ids
+         * @param window size of the sliding window for REORDER_GORDER
+         */
+        void reorderGraph(ReorderType type, size_t window = 5) {
+            if (cur_element_count < 2)
+                return;
+            std::vector<tableint> new_to_old;
+            switch (type) {
+                case REORDER_BFS:
+                    new_to_old = getBfsOrder(false);
+                    break;
+                case REORDER_RCM:
+                    new_to_old = getBfsOrder(true);
+                    std::reverse(new_to_old.begin(), new_to_old.end());
+                    break;
+                case REORDER_GORDER:
+                    new_to_old = getGorderOrder(window);
+                    break;
+                default:
+                    throw std::runtime_error("Unknown reorder type");
+            }
+            applyPermutation(new_to_old);
+        }
+
+        std::vector<tableint> getBfsOrder(bool by_degree) const {
+            size_t n = cur_element_count;
+            std::vector<tableint> order;
+            order.reserve(n);
+            std::vector<bool> visited(n, false);
+
+            std::vector<tableint> seeds;
+            seeds.reserve(n + 1);
+            if (by_degree) {
+                for (tableint i = 0; i < n; i++)
+                    seeds.push_back(i);
+                std::stable_sort(seeds.begin(), seeds.end(), [this](tableint a, tableint b) {
+                    return getListCount(get_linklist0(a)) < getListCount(get_linklist0(b));
+                });
+            } else {
+                seeds.push_back(getEnterPoint());
+                for (tableint i = 0; i < n; i++)
+                    seeds.push_back(i);
+            }
+
+            std::vector<tableint> neighbors;
+            for (tableint seed : seeds) {
+                if (visited[seed])
+                    continue;
+                size_t head = order.size();
+                visited[seed] = true;
+                order.push_back(seed);
+                while (head < order.size()) {
+                    tableint cur = order[head++];
+                    linklistsizeint *ll = get_linklist0(cur);
+                    size_t size = getListCount(ll);
+                    tableint *datal = (tableint *) (ll + 1);
+                    neighbors.clear();
+                    for (size_t j = 0; j < size; j++) {
+                        if (!visited[datal[j]]) {
+                            visited[datal[j]] = true;
+                            neighbors.push_back(datal[j]);
+                        }
+                    }
+                    if (by_degree) {
+                        std::stable_sort(neighbors.begin(), neighbors.end(), [this](tableint a, tableint b) {
+                            return getListCount(get_linklist0(a)) < getListCount(get_linklist0(b));
+                        });
+                    }
+                    order.insert(order.end(), neighbors.begin(), neighbors.end());
+                }
+            }
+            return order;
+        }
+
+        /**
+         * Bucket priority queue over small integer scores with O(1) increments and decrements,
+         * used by the Gorder placement.
+         */
+        class OrderHeap {
+        public:
+            OrderHeap(size_t n) : key_(n, 0), prev_(n), next_(n), head_(1, none), top_(0) {
+                for (tableint i = 0; i < n; i++)
+                    link(i);
+            }
+
+            void add(tableint v, int delta) {
+                unlink(v);
+                key_[v] += delta;
+                link(v);
+            }
+
+            void remove(tableint v) {
+                unlink(v);
+            }
+
+            tableint popMax() {
+                while (head_[top_] == none)
+                    top_--;
+                tableint v = head_[top_];
+                unlink(v);
+                return v;
+            }
+
+        private:
+            enum : tableint { none = (tableint) -1 };
+
+            void link(tableint v) {
+                size_t k = key_[v];
+                if (k >= head_.size())
+                    head_.resize(k + 1, none);
+                prev_[v] = none;
+                next_[v] = head_[k];
+                if (head_[k] != none)
+                    prev_[head_[k]] = v;
+                head_[k] = v;
+                if (k > top_)
+                    top_ = k;
+            }
+
+            void unlink(tableint v) {
+                if (prev_[v] != none)
+                    next_[prev_[v]] = next_[v];
+                else
+                    head_[key_[v]] = next_[v];
+                if (next_[v] != none)
+                    prev_[next_[v]] = prev_[v];
+            }
+
+            std::vector<int> key_;
+            std::vector<tableint> prev_;
+            std::vector<tableint> next_;
+            std::vector<tableint> head_;
+            size_t top_;
+        };
+
+        std::vector<tableint> getGorderOrder(size_t window) const {
+            size_t n = cur_element_count;
+
+            // Reverse level 0 adjacency in CSR form
+            std::vector<size_t> in_offsets(n + 1, 0);
+            for (tableint i = 0; i < n; i++) {
+                linklistsizeint *ll = get_linklist0(i);
+                size_t size = getListCount(ll);
+                tableint *datal = (tableint *) (ll + 1);
+                for (size_t j = 0; j < size; j++)
+                    in_offsets[datal[j] + 1]++;
+            }
+            for (size_t i = 0; i < n; i++)
+                in_offsets[i + 1] += in_offsets[i];
+            std::vector<tableint> in_links(in_offsets[n]);
+            std::vector<size_t> in_fill(in_offsets.begin(), in_offsets.end() - 1);
+            for (tableint i = 0; i < n; i++) {
+                linklistsizeint *ll = get_linklist0(i);
+                size_t size = getListCount(ll);
+                tableint *datal = (tableint *) (ll + 1);
+                for (size_t j = 0; j < size; j++)
+                    in_links[in_fill[datal[j]]++] = i;
+            }
+
+            // Sibling scores through hub elements are skipped, as in the original Gorder
+            size_t hub_in_degree = std::max((size_t) 4 * maxM0_, (size_t) std::sqrt((double) n));
+
+            std::vector<bool> placed(n, false);
+            OrderHeap heap(n);
+            auto update = [&](tableint v, int delta) {
+                linklistsizeint *ll = get_linklist0(v);
+                size_t size = getListCount(ll);
+                tableint *datal = (tableint *) (ll + 1);
+                for (size_t j = 0; j < size; j++) {
+                    tableint x = datal[j];
+                    if (!placed[x])
+                        heap.add(x, delta);
+                    if (in_offsets[x + 1] - in_offsets[x] > hub_in_degree)
+                        continue;
+                    for (size_t l = in_offsets[x]; l < in_offsets[x + 1]; l++) {
+                        tableint u = in_links[l];
+                        if (u != v && !placed[u])
+                            heap.add(u, delta);
+                    }
+                }
+                for (size_t l = in_offsets[v]; l < in_offsets[v + 1]; l++) {
+                    if (!placed[in_links[l]])
+                        heap.add(in_links[l], delta);
+                }
+            };
+
+            std::vector<tableint> order;
+            order.reserve(n);
+            tableint start = getEnterPoint();
+            heap.remove(start);
+            placed[start] = true;
+            order.push_back(start);
+            for (size_t i = 1; i < n; i++) {
+                update(order[i - 1], 1);
+                if (i > window)
+                    update(order[i - 1 - window], -1);
+                tableint next = heap.popMax();
+                placed[next] = true;
+                order.push_back(next);
+            }
+            return order;
+        }
+
+        void applyPermutation(const std::vector<tableint> &new_to_old) {
+            size_t n = cur_element_count;
+            if (new_to_old.size() != n)
+                throw std::runtime_error("Permutation size does not match the number of elements");
+            std::vector<tableint> old_to_new(n);
+            for (tableint i = 0; i < n; i++)
+                old_to_new[new_to_old[i]] = i;
+
+            // Elements move between segments, so the base layer is copied out once and written back
+            // in the new order.
+            char *data_level0_memory_old = (char *) malloc(n * size_data_per_element_);
+            if (data_level0_memory_old == nullptr)
+                throw std::runtime_error("Not enough memory: reorderGraph failed to allocate base layer");
+            std::vector<char *> link_lists_old(n);
+            std::vector<int> element_levels_old(n);
+            std::vector<int> capacities_old(n);
+            for (tableint old_id = 0; old_id < n; old_id++) {
+                memcpy(data_level0_memory_old + old_id * size_data_per_element_, getElementPtr(old_id),
+                       size_data_per_element_);
+                link_lists_old[old_id] = upperLinkLists(old_id);
+                element_levels_old[old_id] = elementLevel(old_id);
+                capacities_old[old_id] = linkListCapacity(old_id);
+            }
+
+            auto remap = [&old_to_new](linklistsizeint *ll, size_t size) {
+                tableint *datal = (tableint *) (ll + 1);
+                for (size_t j = 0; j < size; j++)
+                    datal[j] = old_to_new[datal[j]];
+            };
+
+            for (tableint new_id = 0; new_id < n; new_id++) {
+                tableint old_id = new_to_old[new_id];
+                memcpy(getElementPtr(new_id), data_level0_memory_old + old_id * size_data_per_element_,
+                       size_data_per_element_);
+                linklistsizeint *ll0 = get_linklist0(new_id);
+                remap(ll0, getListCount(ll0));
+
+                elementLevel(new_id) = element_levels_old[old_id];
+                upperLinkLists(new_id) = link_lists_old[old_id];
+                linkListCapacity(new_id) = capacities_old[old_id];
+                for (int level = 1; level <= element_levels_old[old_id]; level++) {
+                    linklistsizeint *ll = get_linklist(new_id, level);
+                    remap(ll, getListCount(ll));
+                }
+            }
+
+            free(data_level0_memory_old);
+
+            for (auto &entry : label_lookup_)
+                entry.second = old_to_new[entry.second];
+            for (auto &id : free_slots_)
+                id = old_to_new[id];
+            tableint enterpoint_node;
+            int maxlevel;
+            getEntryPoint(enterpoint_node, maxlevel);
+            setEntryPoint(old_to_new[enterpoint_node], maxlevel);
+        }
+
     };
 
 }
@@ -23,9 +23,12 @@
 #endif
 #endif
 
+#include <cstddef>
 #include <queue>
+#include <type_traits>
 #include <vector>
 
+#include <stdint.h>
 #include <string.h>
 
 namespace hnswlib {
@@ -49,9 +52,103 @@ namespace hnswlib {
         in.read((char *) &podRef, sizeof(T));
     }
 
+    /**
+     * Predicate over labels restricting the results of a search. Elements whose label is rejected
+     * are still used to navigate the index but are never returned. Implementations must be safe to
+     * call concurrently when the index is searched from several threads.
+     */
+    class BaseFilterFunctor {
+    public:
+        virtual bool operator()(labeltype label) const { return true; }
+        virtual ~BaseFilterFunctor() {}
+    };
+
+    /**
+     * Filter accepting the labels set in a bitset, for dense label ranges such as those of a tenant.
+     */
+    class BitsetFilter : public BaseFilterFunctor {
+    public:
+        /** Labels up to max_label can be allowed, larger ones are always rejected. */
+        explicit BitsetFilter(size_t max_label) : bits_(max_label / 64 + 1, 0) {}
+
+        void allow(labeltype label) {
+            if (label / 64 >= bits_.size())
+                throw std::runtime_error("Label above the maximum of the bitset filter");
+            bits_[label / 64] |= (uint64_t) 1 << (label % 64);
+        }
+
+        bool operator()(labeltype label) const {
+            size_t word = label / 64;
+            return word < bits_.size() && ((bits_[word] >> (label % 64)) & 1);
+        }
+
+    private:
+        std::vector<uint64_t> bits_;
+    };
+
+    /**
+     * True for the callables accepted by the streaming searchRange overloads, so that they are not
+     * picked for calls passing a filter pointer or nullptr instead.
+     */
+    template <typename Callback>
+    struct isRangeCallback {
+        static const bool value = !std::is_pointer<Callback>::value &&
+                                  !std::is_same<Callback, std::nullptr_t>::value;
+    };
+
+    /**
+     * Per query settings of a graph search. An ef of 0 uses the ef of the index. Patience stops the base
+     * layer search once that many consecutive expansions left the k nearest results unchanged, and a
+     * distance ratio stops it once the nearest unexpanded candidate is farther than ratio times the k-th
+     * nearest result (for non negative distances). Both are off when 0, the search then ends when no
+     * candidate can improve the ef nearest results.
+     */
+    struct SearchParams {
+        explicit SearchParams(size_t ef = 0) : ef(ef), patience(0), distance_ratio(0) {}
+
+        size_t ef;
+        size_t patience;
+        float distance_ratio;
+    };
+
+    /**
+     * Work done by one query. Counting is compiled in only when HNSWLIB_SEARCH_STATS is defined,
+     * otherwise the stats passed to a search are left untouched.
+     */
+    struct SearchStats {
+        SearchStats() { reset(); }
+
+        void reset() {
+            distance_computations = 0;
+            visited_nodes = 0;
+            upper_layer_hops = 0;
+            base_layer_hops = 0;
+            early_terminations = 0;
+        }
+
+        size_t distance_computations;
+        size_t visited_nodes;
+        size_t upper_layer_hops;
+        size_t base_layer_hops;
+        // Set when the adaptive criteria of SearchParams stopped the search, queries without it are the
+        // hard ones that ran until the candidates were exhausted.
+        size_t early_terminations;
+    };
+
+#ifdef HNSWLIB_SEARCH_STATS
+#define HNSWLIB_STATS_ADD(stats, field, value) \
+    do { if (stats) (stats)->field += (value); } while (0)
+#else
+// The cast keeps stats parameters used only here from being reported unused.
+#define HNSWLIB_STATS_ADD(stats, field, value) do { (void) (stats); } while (0)
+#endif
+
     template<typename MTYPE>
     using DISTFUNC = MTYPE(*)(const void *, const void *, const void *);
 
+    template<typename MTYPE>
+    using METRICFUNC = MTYPE(*)(MTYPE);
+
 
     template<typename MTYPE>
     class SpaceInterface {
@@ -63,6 +160,13 @@ namespace hnswlib {
 
         virtual void *get_dist_func_param() = 0;
 
+        /**
+         * Monotone map from the distances of the space to a metric, for the indexes that prune with the
+         * triangle inequality, e.g. the square root of squared L2. nullptr when the distances are used
+         * as they are.
+         */
+        virtual METRICFUNC<MTYPE> get_metric_func() { return nullptr; }
+
         virtual ~SpaceInterface() {}
     };
 
@@ -70,8 +174,10 @@ namespace hnswlib {
     class AlgorithmInterface {
     public:
         virtual void addPoint(const void *datapoint, labeltype label)=0;
-        virtual std::priority_queue<std::pair<dist_t, labeltype >> searchKnn(const void *, size_t) const = 0;
-        template <typename Comp>
+        virtual std::priority_queue<std::pair<dist_t, labeltype >>
+            searchKnn(const void *, size_t, const BaseFilterFunctor *filter = nullptr,
+                      SearchStats *stats = nullptr) const = 0;
+        template <typename Comp, typename = typename std::enable_if<!std::is_pointer<Comp>::value>::type>
         std::vector<std::pair<dist_t, labeltype>> searchKnn(const void*, size_t, Comp) {
         }
         virtual void saveIndex(const std::string &location)=0;
@@ -1,4 +1,6 @@
 #pragma once
+#include <algorithm>
+#include <cmath>
 #include "hnswlib.h"
 
 namespace hnswlib {
@@ -209,6 +211,34 @@ namespace hnswlib {
         return 1.0f - sum;
     }
 
+#endif
+
+#if defined(USE_AVX) || defined(USE_SSE)
+
+    /**
+     * SIMD kernels for dimensions that are not a multiple of the block size, the tail is summed by the
+     * scalar kernel. Both parts return one minus their inner product, hence the added one.
+     */
+    static float
+    InnerProductSIMD16ExtResiduals(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
+        size_t qty = *((size_t *) qty_ptr);
+        size_t qty16 = qty >> 4 << 4;
+        float res = InnerProductSIMD16Ext(pVect1v, pVect2v, &qty16);
+        size_t qty_left = qty - qty16;
+        float res_tail = InnerProduct((float *) pVect1v + qty16, (float *) pVect2v + qty16, &qty_left);
+        return res + res_tail - 1.0f;
+    }
+
+    static float
+    InnerProductSIMD4ExtResiduals(const void *pVect1v, const void *pVect2v, const void *qty_ptr) {
+        size_t qty = *((size_t *) qty_ptr);
+        size_t qty4 = qty >> 2 << 2;
+        float res = InnerProductSIMD4Ext(pVect1v, pVect2v, &qty4);
+        size_t qty_left = qty - qty4;
+        float res_tail = InnerProduct((float *) pVect1v + qty4, (float *) pVect2v + qty4, &qty_left);
+        return res + res_tail - 1.0f;
+    }
+
 #endif
 
     class InnerProductSpace : public SpaceInterface<float> {
@@ -220,10 +250,14 @@ namespace hnswlib {
         InnerProductSpace(size_t dim) {
             fstdistfunc_ = InnerProduct;
     #if defined(USE_AVX) || defined(USE_SSE)
-            if (dim % 4 == 0)
-                fstdistfunc_ = InnerProductSIMD4Ext;
             if (dim % 16 == 0)
                 fstdistfunc_ = InnerProductSIMD16Ext;
+            else if (dim > 16)
+                fstdistfunc_ = InnerProductSIMD16ExtResiduals;
+            else if (dim % 4 == 0)
+                fstdistfunc_ = InnerProductSIMD4Ext;
+            else if (dim > 4)
+                fstdistfunc_ = InnerProductSIMD4ExtResiduals;
 #endif
             dim_ = dim;
             data_size_ = dim * sizeof(float);
@@ -244,5 +278,42 @@ namespace hnswlib {
     ~InnerProductSpace() {}
     };
 
+    /**
+     * Scales vector to unit length into out, which may be vector itself. Zero vectors are left as they are.
+     */
+    static inline void
+    normalizeVector(const float *vector, float *out, size_t dim) {
+        float norm = 0;
+        for (size_t i = 0; i < dim; i++) {
+            norm += vector[i] * vector[i];
+        }
+        float scale = norm > 0 ? 1.0f / std::sqrt(norm) : 1.0f;
+        for (size_t i = 0; i < dim; i++) {
+            out[i] = vector[i] * scale;
+        }
+    }
+
+    /**
+     * The angle between unit vectors, a metric, from one minus their inner product. Rounding can push
+     * the inner product slightly out of [-1, 1].
+     */
+    static float
+    CosineToAngle(float dist) {
+        return std::acos(std::max(-1.0f, std::min(1.0f, 1.0f - dist)));
+    }
+
+    /**
+     * Cosine distance, one minus the cosine similarity, for vectors normalized with normalizeVector
+     * before they are added or searched. The distance is then a plain inner product.
+     */
+    class CosineSpace : public InnerProductSpace {
+    public:
+        CosineSpace(size_t dim) : InnerProductSpace(dim) {}
+
+        METRICFUNC<float> get_metric_func() {
+            return CosineToAngle;
+        }
+    };
+
 
 }
@@ -1,4 +1,5 @@
 #pragma once
+#include <cmath>
 #include "hnswlib.h"
 
 namespace hnswlib {
@@ -142,6 +143,14 @@ namespace hnswlib {
     }
 #endif
 
+    /**
+     * Squared L2 breaks the triangle inequality, its square root is the metric.
+     */
+    static float
+    L2SqrToMetric(float dist) {
+        return std::sqrt(dist);
+    }
+
     class L2Space : public SpaceInterface<float> {
 
         DISTFUNC<float> fstdistfunc_;
@@ -175,6 +184,10 @@ namespace hnswlib {
             return &dim_;
         }
 
+        METRICFUNC<float> get_metric_func() {
+            return L2SqrToMetric;
+        }
+
         ~L2Space() {}
     };
 
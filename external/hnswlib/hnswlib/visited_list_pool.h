@@ -63,9 +63,26 @@ namespace hnswlib {
 
         void releaseVisitedList(VisitedList *vl) {
             std::unique_lock <std::mutex> lock(poolguard);
+            if (vl->numelements < (unsigned int) numelements) {
+                delete vl;
+                return;
+            }
             pool.push_front(vl);
         };
 
+        /**
+         * Sizes the lists handed out from now on for numelements1 elements. Lists in use keep their
+         * size and are dropped when released.
+         */
+        void resize(int numelements1) {
+            std::unique_lock <std::mutex> lock(poolguard);
+            numelements = numelements1;
+            while (pool.size()) {
+                delete pool.front();
+                pool.pop_front();
+            }
+        };
+
         ~VisitedListPool() {
             while (pool.size()) {
                 VisitedList *rez = pool.front();
@@ -0,0 +1,24 @@
+#ifndef FAST_ANN_BENCHMARK_MEMORY_USAGE_H_
+#define FAST_ANN_BENCHMARK_MEMORY_USAGE_H_
+
+#include <fstream>
+#include <string>
+
+namespace fast_ann {
+
+// Resident set size of the calling process in bytes, 0 where /proc is not
+// available. The difference across an index build approximates its size.
+inline size_t GetResidentBytes() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 6, "VmRSS:") == 0) {
+            return std::stoull(line.substr(6)) * 1024;
+        }
+    }
+    return 0;
+}
+
+}  // namespace fast_ann
+
+#endif  // FAST_ANN_BENCHMARK_MEMORY_USAGE_H_
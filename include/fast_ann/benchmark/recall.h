@@ -0,0 +1,55 @@
+#ifndef FAST_ANN_BENCHMARK_RECALL_H_
+#define FAST_ANN_BENCHMARK_RECALL_H_
+
+#include <algorithm>
+#include <queue>
+#include <utility>
+#include <vector>
+
+#include "fast_ann/dataset.h"
+
+namespace fast_ann {
+
+// Turns a search result heap into ids ordered from nearest to farthest.
+template <typename dist_t, typename label_t>
+std::vector<DatasetIndexType> GetSortedIds(
+    std::priority_queue<std::pair<dist_t, label_t> > result) {
+    std::vector<DatasetIndexType> ids(result.size());
+    for (size_t i = ids.size(); i > 0; i--) {
+        ids[i - 1] = result.top().second;
+        result.pop();
+    }
+    return ids;
+}
+
+// Average over queries of the fraction of the true at_k nearest neighbors
+// found among the first at_k results. Results must be sorted from nearest to
+// farthest, as are the rows of the ground truth file, which must hold at
+// least at_k neighbors per query.
+inline double ComputeRecall(
+    const std::vector<std::vector<DatasetIndexType> >& results,
+    Dataset<int>& ground_truth, size_t at_k) {
+    if (results.empty() || at_k == 0) {
+        return 0;
+    }
+    double sum_recall = 0;
+    for (size_t i = 0; i < results.size(); i++) {
+        size_t num_results = std::min(at_k, results[i].size());
+        std::vector<DatasetIndexType> algo_result(
+            results[i].begin(), results[i].begin() + num_results);
+        const int* gt_ptr = ground_truth.item_at(i).second;
+        std::vector<DatasetIndexType> gt_result(gt_ptr, gt_ptr + at_k);
+        std::sort(algo_result.begin(), algo_result.end());
+        std::sort(gt_result.begin(), gt_result.end());
+        std::vector<DatasetIndexType> common_el(at_k);
+        auto it = std::set_intersection(algo_result.begin(), algo_result.end(),
+                                        gt_result.begin(), gt_result.end(),
+                                        common_el.begin());
+        sum_recall += (double)(it - common_el.begin()) / at_k;
+    }
+    return sum_recall / results.size();
+}
+
+}  // namespace fast_ann
+
+#endif  // FAST_ANN_BENCHMARK_RECALL_H_
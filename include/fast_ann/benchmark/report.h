@@ -0,0 +1,152 @@
+#ifndef FAST_ANN_BENCHMARK_REPORT_H_
+#define FAST_ANN_BENCHMARK_REPORT_H_
+
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace fast_ann {
+
+enum class ReportFormat { CSV, JSON };
+
+// Writes benchmark results as they are produced, one row per parameter
+// setting, so that partial results survive an interrupted sweep. Values are
+// given as strings, empty values mean the column does not apply to the row.
+class BenchmarkReport {
+   public:
+    BenchmarkReport(std::ostream& output, ReportFormat format,
+                    const std::vector<std::string>& columns)
+        : output_(output), format_(format), columns_(columns), num_rows_(0) {
+        if (format_ == ReportFormat::CSV) {
+            for (size_t i = 0; i < columns_.size(); i++) {
+                output_ << (i == 0 ? "" : ",") << columns_[i];
+            }
+            output_ << "\n";
+        } else {
+            output_ << "[";
+        }
+        output_.flush();
+    }
+
+    void AddRow(const std::vector<std::string>& values) {
+        if (format_ == ReportFormat::CSV) {
+            for (size_t i = 0; i < columns_.size(); i++) {
+                output_ << (i == 0 ? "" : ",") << GetCsvValue(values[i]);
+            }
+            output_ << "\n";
+        } else {
+            output_ << (num_rows_ == 0 ? "\n  {" : ",\n  {");
+            for (size_t i = 0; i < columns_.size(); i++) {
+                output_ << (i == 0 ? "" : ", ") << Quote(columns_[i]) << ": "
+                        << GetJsonValue(values[i]);
+            }
+            output_ << "}";
+        }
+        num_rows_++;
+        output_.flush();
+    }
+
+    void Finish() {
+        if (format_ == ReportFormat::JSON) {
+            output_ << "\n]\n";
+        }
+        output_.flush();
+    }
+
+    template <typename T>
+    static std::string ToString(T value) {
+        std::ostringstream stream;
+        stream << value;
+        return stream.str();
+    }
+
+   private:
+    // Values holding a comma or a quote are quoted, quotes doubled.
+    static std::string GetCsvValue(const std::string& value) {
+        if (value.find_first_of(",\"") == std::string::npos) {
+            return value;
+        }
+        std::string quoted = "\"";
+        for (char c : value) {
+            if (c == '"') {
+                quoted.push_back('"');
+            }
+            quoted.push_back(c);
+        }
+        quoted.push_back('"');
+        return quoted;
+    }
+
+    // Only numbers in JSON syntax are written bare, anything else, including
+    // inf, nan or hexadecimal numbers, is quoted.
+    static std::string GetJsonValue(const std::string& value) {
+        if (value.empty()) {
+            return "null";
+        }
+        if (IsJsonNumber(value)) {
+            return value;
+        }
+        return Quote(value);
+    }
+
+    // -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+    static bool IsJsonNumber(const std::string& value) {
+        size_t pos = 0;
+        if (pos < value.size() && value[pos] == '-') {
+            pos++;
+        }
+        if (pos < value.size() && value[pos] == '0') {
+            pos++;
+        } else if (!SkipDigits(value, pos)) {
+            return false;
+        }
+        if (pos < value.size() && value[pos] == '.') {
+            pos++;
+            if (!SkipDigits(value, pos)) {
+                return false;
+            }
+        }
+        if (pos < value.size() && (value[pos] == 'e' || value[pos] == 'E')) {
+            pos++;
+            if (pos < value.size() &&
+                (value[pos] == '+' || value[pos] == '-')) {
+                pos++;
+            }
+            if (!SkipDigits(value, pos)) {
+                return false;
+            }
+        }
+        return pos == value.size();
+    }
+
+    // Advances pos past the digits there, false if there are none.
+    static bool SkipDigits(const std::string& value, size_t& pos) {
+        size_t start = pos;
+        while (pos < value.size() && value[pos] >= '0' && value[pos] <= '9') {
+            pos++;
+        }
+        return pos > start;
+    }
+
+    static std::string Quote(const std::string& value) {
+        std::string quoted = "\"";
+        for (char c : value) {
+            if (c == '"' || c == '\\') {
+                quoted.push_back('\\');
+            }
+            quoted.push_back(c);
+        }
+        quoted.push_back('"');
+        return quoted;
+    }
+
+    std::ostream& output_;
+    ReportFormat format_;
+    std::vector<std::string> columns_;
+    size_t num_rows_;
+};
+
+}  // namespace fast_ann
+
+#endif  // FAST_ANN_BENCHMARK_REPORT_H_
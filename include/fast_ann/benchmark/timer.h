@@ -0,0 +1,29 @@
+#ifndef FAST_ANN_BENCHMARK_TIMER_H_
+#define FAST_ANN_BENCHMARK_TIMER_H_
+
+#include <chrono>
+
+namespace fast_ann {
+
+class Timer {
+   public:
+    Timer() { reset(); }
+
+    void reset() { start_time_ = std::chrono::steady_clock::now(); }
+
+    // Milliseconds since construction or the last reset.
+    float GetElapsedTime() const { return GetElapsedMicros() / 1000; }
+
+    double GetElapsedMicros() const {
+        return std::chrono::duration<double, std::micro>(
+                   std::chrono::steady_clock::now() - start_time_)
+            .count();
+    }
+
+   private:
+    std::chrono::steady_clock::time_point start_time_;
+};
+
+}  // namespace fast_ann
+
+#endif  // FAST_ANN_BENCHMARK_TIMER_H_
@@ -2,13 +2,17 @@
 #define FAST_ANN_DATA_READERS_XVECS_READER_H_
 
 #include <fstream>
+#include <type_traits>
+#include <vector>
 
 #include "fast_ann/data_reader.h"
 #include "fast_ann/logger.h"
 
 namespace fast_ann {
 
-template <typename T>
+// Reads a whole xvecs file whose components are of type FileT, converting
+// them to T on load, e.g. fvecs into Float16 vectors.
+template <typename T, typename FileT = T>
 class XvecsReader : public DataReader<T> {
    public:
     Dataset<T> read(const std::string file_name) {
@@ -20,12 +24,20 @@ class XvecsReader : public DataReader<T> {
         file_stream.seekg(0, file_stream.end);
         unsigned long long num_bytes_in_file = file_stream.tellg();
         DatasetIndexType dataset_size =
-            num_bytes_in_file / (sizeof(int) + dim * sizeof(T));
+            num_bytes_in_file / (sizeof(int) + dim * sizeof(FileT));
         LOG_DEBUG("Dataset size is " << dataset_size << "\n");
         T* data_ptr = new T[dim * dataset_size];
+        std::vector<FileT> record(std::is_same<T, FileT>::value ? 0 : dim);
         file_stream.seekg(sizeof(dim), file_stream.beg);
         for (DatasetIndexType i = 0; i < dataset_size; i++) {
-            file_stream.read((char*)data_ptr, dim * sizeof(T));
+            if (record.empty()) {
+                file_stream.read((char*)data_ptr, dim * sizeof(T));
+            } else {
+                file_stream.read((char*)record.data(), dim * sizeof(FileT));
+                for (DimensionType j = 0; j < dim; j++) {
+                    data_ptr[j] = static_cast<T>(record[j]);
+                }
+            }
             DataReader<T>::PushData(dataset, i, data_ptr);
             data_ptr += dim;
             file_stream.seekg(sizeof(dim), file_stream.cur);
@@ -0,0 +1,87 @@
+#ifndef FAST_ANN_DATA_READERS_XVECS_STREAM_READER_H_
+#define FAST_ANN_DATA_READERS_XVECS_STREAM_READER_H_
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "fast_ann/dataset.h"
+#include "fast_ann/logger.h"
+
+namespace fast_ann {
+
+// Reads an xvecs file block by block, for files larger than memory. Values
+// are stored as T in the file and converted to the output type on reading,
+// so that for instance bvecs can be read into float buffers.
+template <typename T>
+class XvecsStreamReader {
+   public:
+    XvecsStreamReader(const std::string& file_name)
+        : file_stream_(file_name, std::ios::binary), position_(0) {
+        if (!file_stream_) {
+            throw std::runtime_error("Cannot open xvecs file " + file_name);
+        }
+        file_stream_.read((char*)&dimension_, sizeof(dimension_));
+        if (!file_stream_ || dimension_ <= 0) {
+            throw std::runtime_error("Not an xvecs file " + file_name);
+        }
+        file_stream_.seekg(0, file_stream_.end);
+        unsigned long long num_bytes_in_file = file_stream_.tellg();
+        size_ = num_bytes_in_file / GetRecordBytes();
+        file_stream_.seekg(0, file_stream_.beg);
+        LOG_DEBUG("Streaming " << size_ << " vectors of dimension "
+                               << dimension_ << " from " << file_name);
+    }
+
+    // Moves to the vector at the given position.
+    void Seek(size_t position) {
+        position_ = std::min(position, size_);
+        file_stream_.clear();
+        file_stream_.seekg(position_ * GetRecordBytes(), file_stream_.beg);
+    }
+
+    // Reads up to max_count vectors into out, one after another, and returns
+    // the number read, 0 at the end of the file.
+    template <typename OutT>
+    size_t ReadBlock(OutT* out, size_t max_count) {
+        size_t count = std::min(max_count, size_ - position_);
+        buffer_.resize(count * GetRecordBytes());
+        file_stream_.read(buffer_.data(), buffer_.size());
+        if (!file_stream_) {
+            throw std::runtime_error("Failed reading from xvecs file");
+        }
+        for (size_t i = 0; i < count; i++) {
+            const T* record =
+                (const T*)(buffer_.data() + i * GetRecordBytes() +
+                           sizeof(DimensionType));
+            for (DimensionType j = 0; j < dimension_; j++) {
+                out[i * dimension_ + j] = static_cast<OutT>(record[j]);
+            }
+        }
+        position_ += count;
+        return count;
+    }
+
+    inline DimensionType dimension() const { return dimension_; }
+
+    inline size_t size() const { return size_; }
+
+    inline size_t position() const { return position_; }
+
+   private:
+    inline size_t GetRecordBytes() const {
+        return sizeof(DimensionType) + dimension_ * sizeof(T);
+    }
+
+    std::ifstream file_stream_;
+    std::vector<char> buffer_;
+    DimensionType dimension_;
+    size_t size_;
+    size_t position_;
+};
+
+}  // namespace fast_ann
+
+#endif  // FAST_ANN_DATA_READERS_XVECS_STREAM_READER_H_
@@ -0,0 +1,46 @@
+#ifndef FAST_ANN_DATA_WRITERS_XVECS_WRITER_H_
+#define FAST_ANN_DATA_WRITERS_XVECS_WRITER_H_
+
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+#include "fast_ann/dataset.h"
+
+namespace fast_ann {
+
+// Appends vectors to an xvecs file (fvecs for float, ivecs for int, bvecs
+// for unsigned char), each record prefixed with its dimension.
+template <typename T>
+class XvecsWriter {
+   public:
+    XvecsWriter(const std::string& file_name)
+        : file_name_(file_name), file_stream_(file_name, std::ios::binary) {
+        if (!file_stream_) {
+            throw std::runtime_error("Cannot create xvecs file " + file_name);
+        }
+    }
+
+    void Write(const T* data_ptr, DimensionType dimension) {
+        file_stream_.write((const char*)&dimension, sizeof(dimension));
+        file_stream_.write((const char*)data_ptr, dimension * sizeof(T));
+        if (!file_stream_) {
+            throw std::runtime_error("Failed writing xvecs file " +
+                                     file_name_);
+        }
+    }
+
+    void Write(Dataset<T>& dataset) {
+        for (DatasetIndexType i = 0; i < dataset.size(); i++) {
+            Write(dataset.item_at(i).second, dataset.dimension());
+        }
+    }
+
+   private:
+    std::string file_name_;
+    std::ofstream file_stream_;
+};
+
+}  // namespace fast_ann
+
+#endif  // FAST_ANN_DATA_WRITERS_XVECS_WRITER_H_
@@ -2,6 +2,8 @@
 #define FAST_ANN_DATASET_H_
 
 #include <mpi.h>
+#include <algorithm>
+#include <cmath>
 #include <string>
 #include <vector>
 
@@ -21,13 +23,16 @@ class Dataset {
    public:
     typedef std::pair<DatasetIndexType, T*> DataType;
 
-    inline DatasetIndexType size() { return data_.size(); }
+    inline DatasetIndexType size() const { return data_.size(); }
 
     inline DataType item_at(DatasetIndexType index) { return data_[index]; }
 
     inline DimensionType dimension() { return dimension_; }
 
     inline void LogData(DatasetIndexType index) {
+        if (!LOG_ENABLED(LogLevel::INFO)) {
+            return;
+        }
         T* ptr = data_[index].second;
         std::string data_str;
         for (int i = 0; i < dimension_; i++) {
@@ -37,14 +42,35 @@ class Dataset {
         LOG_INFO("Data at index " << index << " : " << data_str);
     }
 
+    // Scales every vector to unit length in place, once at ingest, for
+    // cosine distances. Zero vectors are left as they are.
+    inline void Normalize() {
+        for (DataType& item : data_) {
+            float norm = 0;
+            for (DimensionType i = 0; i < dimension_; i++) {
+                norm += (float)item.second[i] * (float)item.second[i];
+            }
+            if (norm == 0) {
+                continue;
+            }
+            float scale = 1 / std::sqrt(norm);
+            for (DimensionType i = 0; i < dimension_; i++) {
+                item.second[i] = static_cast<T>(item.second[i] * scale);
+            }
+        }
+    }
+
     inline void SwapData(DatasetIndexType a, DatasetIndexType b) {
         std::swap(data_[a], data_[b]);
     }
 
+    // The distance type differs from T when vectors are stored at a lower
+    // precision than they are compared in.
+    template <typename dist_t>
     inline void PartitionByDistance(DatasetIndexType lower,
                                     DatasetIndexType pos,
                                     DatasetIndexType upper,
-                                    hnswlib::DISTFUNC<T> fstdistfunc_,
+                                    hnswlib::DISTFUNC<dist_t> fstdistfunc_,
                                     void* dist_func_param_) {
         std::nth_element(data_.begin() + lower + 1, data_.begin() + pos,
                          data_.begin() + upper,
@@ -57,39 +83,85 @@ class Dataset {
                          });
     }
 
+    // The same with a distance policy, see fast_ann/distance.h.
+    template <typename Distance>
+    inline void PartitionByDistance(DatasetIndexType lower,
+                                    DatasetIndexType pos,
+                                    DatasetIndexType upper,
+                                    const Distance& distance) {
+        DimensionType dimension = dimension_;
+        std::nth_element(data_.begin() + lower + 1, data_.begin() + pos,
+                         data_.begin() + upper,
+                         [lower, this, &distance, dimension](
+                             const DataType& lhs, const DataType& rhs) {
+                             return distance(data_[lower].second, lhs.second,
+                                             dimension) <
+                                    distance(data_[lower].second, rhs.second,
+                                             dimension);
+                         });
+    }
+
     inline Dataset<T>* GetSubset(DatasetIndexType lower,
                                  DatasetIndexType upper) {
         auto start = data_.begin() + lower;
         auto end = data_.begin() + upper;
-        Dataset<T>* result_ptr = new Dataset<T>(dimension_, upper - lower);
-        result_ptr->data_.insert(result_ptr->data_.end(), start, end);
+        Dataset<T>* result_ptr = new Dataset<T>(dimension_);
+        result_ptr->data_.assign(start, end);
         return result_ptr;
     }
 
-    void sendData(int rank, MPI_Request &req) {
+    // Sends the ids and vectors of the dataset, the vectors are copied into
+    // one buffer owned by the receiving side.
+    void sendData(int rank) {
         int size = data_.size();
-        MPI_Isend(&size, 1, MPI_INT, rank, 0, MPI_COMM_WORLD, &req);
-        MPI_Isend(
-            data_.data(),
-            (sizeof(DataType) * data_.size()),
-            MPI_BYTE, rank, 0, MPI_COMM_WORLD, &req);
+        std::vector<DatasetIndexType> ids(size);
+        std::vector<T> values((size_t)size * dimension_);
+        for (int i = 0; i < size; i++) {
+            ids[i] = data_[i].first;
+            std::copy(data_[i].second, data_[i].second + dimension_,
+                      values.begin() + (size_t)i * dimension_);
+        }
+        MPI_Send(&size, 1, MPI_INT, rank, 0, MPI_COMM_WORLD);
+        MPI_Send(ids.data(), sizeof(DatasetIndexType) * size, MPI_BYTE, rank,
+                 0, MPI_COMM_WORLD);
+        MPI_Send(values.data(), sizeof(T) * values.size(), MPI_BYTE, rank, 0,
+                 MPI_COMM_WORLD);
     }
 
     static Dataset<T>* recvData(int rank, int dim) {
         MPI_Status status;
         int size;
         MPI_Recv(&size, 1, MPI_INT, rank, 0, MPI_COMM_WORLD, &status);
-        DataType* data = new DataType[size];
-        MPI_Recv(data,
-                 (sizeof(DataType) * size),
-                 MPI_BYTE, rank, 0, MPI_COMM_WORLD, &status);
+        std::vector<DatasetIndexType> ids(size);
+        T* values = new T[(size_t)size * dim];
+        MPI_Recv(ids.data(), sizeof(DatasetIndexType) * size, MPI_BYTE, rank,
+                 0, MPI_COMM_WORLD, &status);
+        MPI_Recv(values, sizeof(T) * size * dim, MPI_BYTE, rank, 0,
+                 MPI_COMM_WORLD, &status);
         Dataset<T>* new_dataset_ = new Dataset<T>(dim);
-        std::vector<DataType> vec_data(data, data + size);
-        new_dataset_ -> data_ = vec_data;
-        new_dataset_ -> LogData(0);
+        new_dataset_->data_.reserve(size);
+        for (int i = 0; i < size; i++) {
+            new_dataset_->data_.push_back({ids[i], values + (size_t)i * dim});
+        }
+        if (size > 0) {
+            new_dataset_->LogData(0);
+        }
         return new_dataset_;
     }
 
+    // Wraps size vectors stored one after another at data, with the given
+    // ids, without copying them. The buffer must outlive the dataset.
+    static Dataset<T> FromBuffer(T* data, const DatasetIndexType* ids,
+                                 DatasetIndexType size,
+                                 DimensionType dimension) {
+        Dataset<T> dataset(dimension);
+        dataset.data_.reserve(size);
+        for (DatasetIndexType i = 0; i < size; i++) {
+            dataset.data_.push_back({ids[i], data + (size_t)i * dimension});
+        }
+        return dataset;
+    }
+
    private:
     Dataset(DimensionType dimension) : dimension_(dimension) {}
 
@@ -5,12 +5,17 @@ namespace fast_ann {
 
 typedef int DimensionType;
 
-template <typename T, typename R>
-class Distance {
-   public:
-    virtual R operator()(const T* ptr_l, const T* ptr_r,
-                         DimensionType dimension) = 0;
-};
+// Distances are policies passed to the algorithms as template parameters, so
+// that the compiler sees the call and inlines it into the search loops. A
+// policy over vectors of data_type is a copyable functor with
+//
+//     R operator()(const data_type* l, const data_type* r,
+//                  DimensionType dimension) const;
+//     R ToMetric(R dist) const;
+//
+// where ToMetric maps a distance to one that satisfies the triangle
+// inequality, for the algorithms that prune with it, e.g. the square root
+// of a squared L2 distance.
 
 }  // namespace fast_ann
 
@@ -0,0 +1,40 @@
+#ifndef FAST_ANN_DISTANCES_COSINE_H_
+#define FAST_ANN_DISTANCES_COSINE_H_
+
+#include <algorithm>
+#include <cmath>
+
+#include "fast_ann/distance.h"
+
+namespace fast_ann {
+
+// One minus the cosine similarity. hnswlib::CosineSpace computes the same
+// distance as a single inner product over normalized vectors.
+template <typename T, typename R>
+class CosineDistanceNaive {
+   public:
+    typedef T data_type;
+
+    R operator()(const T* ptr_l, const T* ptr_r,
+                 DimensionType dimension) const {
+        R dot = 0, norm_l = 0, norm_r = 0;
+        for (DimensionType i = 0; i < dimension; i++) {
+            dot += (R)ptr_l[i] * ptr_r[i];
+            norm_l += (R)ptr_l[i] * ptr_l[i];
+            norm_r += (R)ptr_r[i] * ptr_r[i];
+        }
+        if (norm_l == 0 || norm_r == 0) {
+            return 1;
+        }
+        return 1 - dot / std::sqrt(norm_l * norm_r);
+    }
+
+    // The angle between the vectors.
+    static R ToMetric(R dist) {
+        return std::acos(std::max((R)-1, std::min((R)1, 1 - dist)));
+    }
+};
+
+}  // namespace fast_ann
+
+#endif  // FAST_ANN_DISTANCES_COSINE_H_
@@ -1,21 +1,28 @@
 #ifndef FAST_ANN_DISTANCES_L2_NORM_H_
 #define FAST_ANN_DISTANCES_L2_NORM_H_
 
+#include <cmath>
+
 #include "fast_ann/distance.h"
 
 namespace fast_ann {
 
 template <typename T, typename R>
-class L2SquaredNaive : public Distance<T, R> {
+class L2SquaredNaive {
    public:
-    R operator()(const T* ptr_l, const T* ptr_r, DimensionType dimension) {
+    typedef T data_type;
+
+    R operator()(const T* ptr_l, const T* ptr_r,
+                 DimensionType dimension) const {
         R result = 0;
         for(DimensionType i = 0; i < dimension; i++) {
-            T diff = ptr_l[i] - ptr_r[i];
+            R diff = (R)ptr_l[i] - (R)ptr_r[i];
             result += (diff * diff);
         }
         return result;
     }
+
+    static R ToMetric(R dist) { return std::sqrt(dist); }
 };
 
 }  // namespace fast_ann
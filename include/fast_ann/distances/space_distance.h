@@ -0,0 +1,79 @@
+#ifndef FAST_ANN_DISTANCES_SPACE_DISTANCE_H_
+#define FAST_ANN_DISTANCES_SPACE_DISTANCE_H_
+
+#include <cstddef>
+
+#include "fast_ann/distance.h"
+#include "hnswlib/hnswlib.h"
+
+namespace fast_ann {
+
+// Distance policy calling the kernel of an hnswlib space through its function
+// pointer. The kernel is picked at run time, e.g. by dimension, at the cost
+// of an indirect call per distance.
+template <typename data_t, typename dist_t>
+class SpaceDistance {
+   public:
+    typedef data_t data_type;
+
+    explicit SpaceDistance(hnswlib::SpaceInterface<dist_t>* s)
+        : fstdistfunc_(s->get_dist_func()),
+          dist_func_param_(s->get_dist_func_param()),
+          metricfunc_(s->get_metric_func()) {}
+
+    dist_t operator()(const data_t* ptr_l, const data_t* ptr_r,
+                      DimensionType) const {
+        return fstdistfunc_(ptr_l, ptr_r, dist_func_param_);
+    }
+
+    dist_t ToMetric(dist_t dist) const {
+        return metricfunc_ == nullptr ? dist : metricfunc_(dist);
+    }
+
+   private:
+    hnswlib::DISTFUNC<dist_t> fstdistfunc_;
+    void* dist_func_param_;
+    hnswlib::METRICFUNC<dist_t> metricfunc_;
+};
+
+// The reverse, an hnswlib space over a distance policy with a static
+// ToMetric, for the hnswlib indexes. The policy is inlined into the function
+// the space hands out.
+template <typename Distance>
+class DistanceSpace : public hnswlib::SpaceInterface<float> {
+   public:
+    typedef typename Distance::data_type data_type;
+
+    DistanceSpace(const Distance& distance, DimensionType dimension)
+        : param_(distance, dimension) {}
+
+    size_t get_data_size() { return param_.dimension * sizeof(data_type); }
+
+    hnswlib::DISTFUNC<float> get_dist_func() { return Compute; }
+
+    void* get_dist_func_param() { return &param_; }
+
+    hnswlib::METRICFUNC<float> get_metric_func() { return Distance::ToMetric; }
+
+   private:
+    struct Param {
+        Param(const Distance& distance_t, DimensionType dimension_t)
+            : distance(distance_t), dimension(dimension_t) {}
+
+        Distance distance;
+        DimensionType dimension;
+    };
+
+    static float Compute(const void* vector_l, const void* vector_r,
+                         const void* param_ptr) {
+        const Param* param = (const Param*)param_ptr;
+        return param->distance((const data_type*)vector_l,
+                               (const data_type*)vector_r, param->dimension);
+    }
+
+    Param param_;
+};
+
+}  // namespace fast_ann
+
+#endif  // FAST_ANN_DISTANCES_SPACE_DISTANCE_H_
@@ -0,0 +1,124 @@
+#ifndef FAST_ANN_DISTANCES_VECTOR_DISTANCES_H_
+#define FAST_ANN_DISTANCES_VECTOR_DISTANCES_H_
+
+#include <stdint.h>
+#include <cstddef>
+
+#include "fast_ann/distance.h"
+#include "fast_ann/quantizers/half_precision.h"
+#include "fast_ann/quantizers/scalar_quantizer.h"
+#include "hnswlib/hnswlib.h"
+
+namespace fast_ann {
+
+// Distance policies over the storage types of fast_ann, computed in float.
+// kNormalized tells whether vectors and queries have to be scaled to unit
+// length before they are stored or searched.
+
+#if defined(__AVX__)
+struct LoadFloatx8 {
+    __m256 operator()(const float* ptr) const { return _mm256_loadu_ps(ptr); }
+};
+#endif
+
+inline float FloatL2Sqr(const float* l, const float* r, size_t dimension) {
+    float result = 0;
+    size_t d = 0;
+#if defined(__AVX__)
+    d = L2SqrBlocks8(l, r, dimension, result, LoadFloatx8());
+#endif
+    for (; d < dimension; d++) {
+        float diff = l[d] - r[d];
+        result += diff * diff;
+    }
+    return result;
+}
+
+inline float FloatInnerProduct(const float* l, const float* r,
+                               size_t dimension) {
+    float result = 0;
+    size_t d = 0;
+#if defined(__AVX__)
+    d = InnerProductBlocks8(l, r, dimension, result, LoadFloatx8());
+#endif
+    for (; d < dimension; d++) {
+        result += l[d] * r[d];
+    }
+    return result;
+}
+
+// Squared L2 distance over float, Float16 or BFloat16 vectors.
+template <typename data_t>
+class L2Distance {
+   public:
+    typedef data_t data_type;
+    static const bool kNormalized = false;
+
+    float operator()(const data_t* ptr_l, const data_t* ptr_r,
+                     DimensionType dimension) const {
+        size_t size = dimension;
+        return HalfL2Sqr<data_t>(ptr_l, ptr_r, &size);
+    }
+
+    static float ToMetric(float dist) { return hnswlib::L2SqrToMetric(dist); }
+};
+
+template <>
+inline float L2Distance<float>::operator()(const float* ptr_l,
+                                           const float* ptr_r,
+                                           DimensionType dimension) const {
+    return FloatL2Sqr(ptr_l, ptr_r, dimension);
+}
+
+// Cosine distance, one minus the inner product of normalized vectors.
+template <typename data_t>
+class CosineDistance {
+   public:
+    typedef data_t data_type;
+    static const bool kNormalized = true;
+
+    float operator()(const data_t* ptr_l, const data_t* ptr_r,
+                     DimensionType dimension) const {
+        size_t size = dimension;
+        return HalfInnerProduct<data_t>(ptr_l, ptr_r, &size);
+    }
+
+    static float ToMetric(float dist) { return hnswlib::CosineToAngle(dist); }
+};
+
+template <>
+inline float CosineDistance<float>::operator()(const float* ptr_l,
+                                               const float* ptr_r,
+                                               DimensionType dimension) const {
+    return 1.0f - FloatInnerProduct(ptr_l, ptr_r, dimension);
+}
+
+// Squared L2 distance over ScalarQuantizer codes, as ScalarQuantizerL2Space.
+// The quantizer must outlive the policy.
+class ScalarQuantizerL2Distance {
+   public:
+    typedef uint8_t data_type;
+    static const bool kNormalized = false;
+
+    explicit ScalarQuantizerL2Distance(const ScalarQuantizer& quantizer)
+        : scales_(quantizer.scales()) {}
+
+    float operator()(const uint8_t* code_l, const uint8_t* code_r,
+                     DimensionType dimension) const {
+        float result = 0;
+        for (DimensionType d = 0; d < dimension; d++) {
+            float diff = ((int)code_l[d] - (int)code_r[d]) * scales_[d];
+            result += diff * diff;
+        }
+        return result;
+    }
+
+    static float ToMetric(float dist) { return hnswlib::L2SqrToMetric(dist); }
+
+   private:
+    const float* scales_;
+};
+
+}  // namespace fast_ann
+
+#endif  // FAST_ANN_DISTANCES_VECTOR_DISTANCES_H_
@@ -0,0 +1,669 @@
+#ifndef FAST_ANN_INDEX_FACTORY_H_
+#define FAST_ANN_INDEX_FACTORY_H_
+
+#include <ctype.h>
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "fast_ann/distances/space_distance.h"
+#include "fast_ann/distances/vector_distances.h"
+#include "fast_ann/quantizers/codecs.h"
+#include "fast_ann/query_cache.h"
+#include "fast_ann/search_algorithm.h"
+#include "fast_ann/search_algorithms/vp_tree_search.h"
+#include "hnswlib/hnswlib.h"
+
+namespace fast_ann {
+
+// Indexes behind SearchAlgorithm, with the distance policy and the codec of
+// the stored vectors as template parameters.
+template <typename Distance, typename Codec>
+class CodecSearchAlgorithm : public SearchAlgorithm {
+   public:
+    typedef typename Codec::data_type data_t;
+
+    explicit CodecSearchAlgorithm(DimensionType dimension)
+        : dimension_(dimension) {}
+
+    DimensionType dimension() const { return dimension_; }
+
+   protected:
+    // Converts count vectors to codes, normalizing them first when the
+    // policy needs it. An untrained codec is trained on them.
+    std::vector<data_t> Encode(const float* vectors, size_t count) {
+        std::vector<float> normalized;
+        if (Distance::kNormalized) {
+            normalized.assign(vectors, vectors + count * dimension_);
+            for (size_t i = 0; i < count; i++) {
+                Normalize(normalized.data() + i * dimension_);
+            }
+            vectors = normalized.data();
+        }
+        if (!codec_.trained()) {
+            codec_.Train(vectors, count, dimension_);
+        }
+        std::vector<data_t> codes(count * dimension_);
+        for (size_t i = 0; i < count; i++) {
+            codec_.Encode(vectors + i * dimension_,
+                          codes.data() + i * dimension_, dimension_);
+        }
+        return codes;
+    }
+
+    Codec codec_;
+    DimensionType dimension_;
+
+   private:
+    // As Dataset::Normalize, zero vectors are left as they are.
+    void Normalize(float* vector) const {
+        float norm = 0;
+        for (DimensionType d = 0; d < dimension_; d++) {
+            norm += vector[d] * vector[d];
+        }
+        if (norm == 0) {
+            return;
+        }
+        float scale = 1 / std::sqrt(norm);
+        for (DimensionType d = 0; d < dimension_; d++) {
+            vector[d] *= scale;
+        }
+    }
+};
+
+// hnswlib::HierarchicalNSW over a DistanceSpace, growing as vectors are
+// added. Options: ef, group (interleaved batch search when positive) and
+// threads (of addPoints, hardware concurrency when 0). Trained codecs are
+// saved next to the index, in file_name.codec.
+template <typename Distance, typename Codec>
+class HNSWIndex : public CodecSearchAlgorithm<Distance, Codec> {
+   public:
+    typedef typename Codec::data_type data_t;
+
+    HNSWIndex(DimensionType dimension, size_t M, size_t ef_construction)
+        : CodecSearchAlgorithm<Distance, Codec>(dimension),
+          M_(M),
+          ef_construction_(ef_construction),
+          ef_(10),
+          group_size_(0),
+          num_threads_(0) {}
+
+    void Add(const float* vectors, const DatasetIndexType* ids,
+             size_t count) {
+        if (count == 0) {
+            return;
+        }
+        std::vector<data_t> codes = this->Encode(vectors, count);
+        if (!index_) {
+            CreateSpace();
+            index_.reset(new hnswlib::HierarchicalNSW<float>(
+                space_.get(), count, M_, ef_construction_));
+        }
+        size_t needed = index_->cur_element_count + count;
+        if (needed > index_->max_elements_) {
+            index_->resizeIndex(std::max(needed, 2 * index_->max_elements_));
+        }
+        std::vector<hnswlib::labeltype> labels(ids, ids + count);
+        index_->addPoints(codes.data(), labels.data(), count, num_threads_);
+    }
+
+    std::vector<SearchAlgorithm::ResultType> Search(const float* queries,
+                                                    size_t count, size_t k) {
+        std::vector<SearchAlgorithm::ResultType> results(count);
+        if (size() == 0) {
+            return results;
+        }
+        std::vector<data_t> codes = this->Encode(queries, count);
+        hnswlib::SearchParams params(ef_);
+        if (group_size_ > 0) {
+            auto found = index_->searchKnnBatch(codes.data(), count, k, params,
+                                                group_size_);
+            for (size_t i = 0; i < count; i++) {
+                CopyResult(found[i], results[i]);
+            }
+        } else {
+            for (size_t i = 0; i < count; i++) {
+                auto found = index_->searchKnn(
+                    codes.data() + i * this->dimension_, k, params);
+                CopyResult(found, results[i]);
+            }
+        }
+        return results;
+    }
+
+    void Save(const std::string& file_name) {
+        if (!index_) {
+            throw std::runtime_error("Cannot save an empty index");
+        }
+        index_->saveIndex(file_name);
+        std::ofstream output(file_name + ".codec", std::ios::binary);
+        if (!output) {
+            throw std::runtime_error("Cannot open file " + file_name +
+                                     ".codec");
+        }
+        this->codec_.Save(output);
+        output.flush();
+        if (!output) {
+            throw std::runtime_error("Failed writing file " + file_name +
+                                     ".codec");
+        }
+    }
+
+    void Load(const std::string& file_name) {
+        std::ifstream input(file_name + ".codec", std::ios::binary);
+        if (!input) {
+            throw std::runtime_error("Cannot open file " + file_name +
+                                     ".codec");
+        }
+        index_.reset();
+        this->codec_.Load(input);
+        if (!input) {
+            throw std::runtime_error("Truncated file " + file_name +
+                                     ".codec");
+        }
+        CreateSpace();
+        index_.reset(
+            new hnswlib::HierarchicalNSW<float>(space_.get(), file_name));
+    }
+
+    bool SetOption(const std::string& name, size_t value) {
+        if (name == "ef") {
+            ef_ = value;
+        } else if (name == "group") {
+            group_size_ = value;
+        } else if (name == "threads") {
+            num_threads_ = value;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    size_t size() const { return index_ ? index_->cur_element_count : 0; }
+
+    size_t memory_bytes() const {
+        return index_ ? index_->getMemoryBytes() : 0;
+    }
+
+   private:
+    void CreateSpace() {
+        space_.reset(new DistanceSpace<Distance>(
+            this->codec_.template CreateDistance<Distance>(),
+            this->dimension_));
+    }
+
+    static void CopyResult(
+        std::priority_queue<std::pair<float, hnswlib::labeltype> >& found,
+        SearchAlgorithm::ResultType& result) {
+        while (!found.empty()) {
+            result.push(std::make_pair(found.top().first,
+                                       (DatasetIndexType)found.top().second));
+            found.pop();
+        }
+    }
+
+    size_t M_;
+    size_t ef_construction_;
+    size_t ef_;
+    size_t group_size_;
+    int num_threads_;
+    std::unique_ptr<DistanceSpace<Distance> > space_;
+    std::unique_ptr<hnswlib::HierarchicalNSW<float> > index_;
+};
+
+// Indexes keeping the codes and ids of their vectors in memory, saved as the
+// codec followed by the count, the ids and the codes.
+template <typename Distance, typename Codec>
+class StoredCodesSearchAlgorithm : public CodecSearchAlgorithm<Distance, Codec> {
+   public:
+    typedef typename Codec::data_type data_t;
+
+    explicit StoredCodesSearchAlgorithm(DimensionType dimension)
+        : CodecSearchAlgorithm<Distance, Codec>(dimension) {}
+
+    void Add(const float* vectors, const DatasetIndexType* ids,
+             size_t count) {
+        if (count == 0) {
+            return;
+        }
+        std::vector<data_t> codes = this->Encode(vectors, count);
+        codes_.insert(codes_.end(), codes.begin(), codes.end());
+        ids_.insert(ids_.end(), ids, ids + count);
+        Invalidate();
+    }
+
+    void Save(const std::string& file_name) {
+        std::ofstream output(file_name, std::ios::binary);
+        if (!output) {
+            throw std::runtime_error("Cannot open file " + file_name);
+        }
+        this->codec_.Save(output);
+        size_t count = ids_.size();
+        hnswlib::writeBinaryPOD(output, count);
+        output.write((const char*)ids_.data(),
+                     count * sizeof(DatasetIndexType));
+        output.write((const char*)codes_.data(),
+                     codes_.size() * sizeof(data_t));
+        output.flush();
+        if (!output) {
+            throw std::runtime_error("Failed writing file " + file_name);
+        }
+    }
+
+    void Load(const std::string& file_name) {
+        std::ifstream input(file_name, std::ios::binary);
+        if (!input) {
+            throw std::runtime_error("Cannot open file " + file_name);
+        }
+        Invalidate();
+        this->codec_.Load(input);
+        size_t count;
+        hnswlib::readBinaryPOD(input, count);
+        if (!input) {
+            throw std::runtime_error("Truncated file " + file_name);
+        }
+        ids_.resize(count);
+        codes_.resize(count * this->dimension_);
+        input.read((char*)ids_.data(), count * sizeof(DatasetIndexType));
+        input.read((char*)codes_.data(), codes_.size() * sizeof(data_t));
+        if (!input) {
+            ids_.clear();
+            codes_.clear();
+            throw std::runtime_error("Truncated file " + file_name);
+        }
+    }
+
+    size_t size() const { return ids_.size(); }
+
+    size_t memory_bytes() const {
+        return codes_.capacity() * sizeof(data_t) +
+               ids_.capacity() * sizeof(DatasetIndexType);
+    }
+
+   protected:
+    // Drops what was built over the codes, they changed.
+    virtual void Invalidate() {}
+
+    std::vector<data_t> codes_;
+    std::vector<DatasetIndexType> ids_;
+};
+
+// Exact search, a scan of all codes per query.
+template <typename Distance, typename Codec>
+class FlatIndex : public StoredCodesSearchAlgorithm<Distance, Codec> {
+   public:
+    typedef typename Codec::data_type data_t;
+
+    explicit FlatIndex(DimensionType dimension)
+        : StoredCodesSearchAlgorithm<Distance, Codec>(dimension) {}
+
+    std::vector<SearchAlgorithm::ResultType> Search(const float* queries,
+                                                    size_t count, size_t k) {
+        std::vector<SearchAlgorithm::ResultType> results(count);
+        if (this->size() == 0 || k == 0) {
+            return results;
+        }
+        std::vector<data_t> codes = this->Encode(queries, count);
+        Distance distance = this->codec_.template CreateDistance<Distance>();
+        DimensionType dimension = this->dimension_;
+        for (size_t i = 0; i < count; i++) {
+            const data_t* query = codes.data() + i * dimension;
+            SearchAlgorithm::ResultType& result = results[i];
+            for (size_t j = 0; j < this->ids_.size(); j++) {
+                float dist = distance(
+                    query, this->codes_.data() + j * dimension, dimension);
+                if (result.size() < k || dist < result.top().first) {
+                    result.push(std::make_pair(dist, this->ids_[j]));
+                    if (result.size() > k) {
+                        result.pop();
+                    }
+                }
+            }
+        }
+        return results;
+    }
+
+    bool SetOption(const std::string&, size_t) { return false; }
+};
+
+// VPTreeSearch over the codes, built on the first search after they change.
+// Options: group (interleaved batch search when positive).
+template <typename Distance, typename Codec>
+class VPTreeIndex : public StoredCodesSearchAlgorithm<Distance, Codec> {
+   public:
+    typedef typename Codec::data_type data_t;
+
+    explicit VPTreeIndex(DimensionType dimension)
+        : StoredCodesSearchAlgorithm<Distance, Codec>(dimension),
+          group_size_(0) {}
+
+    std::vector<SearchAlgorithm::ResultType> Search(const float* queries,
+                                                    size_t count, size_t k) {
+        if (this->size() == 0) {
+            return std::vector<SearchAlgorithm::ResultType>(count);
+        }
+        {
+            std::unique_lock<std::mutex> lock(tree_guard_);
+            if (!tree_) {
+                tree_.reset(new VPTreeSearch<float, data_t, Distance>(
+                    Dataset<data_t>::FromBuffer(this->codes_.data(),
+                                                this->ids_.data(),
+                                                this->ids_.size(),
+                                                this->dimension_),
+                    this->codec_.template CreateDistance<Distance>()));
+            }
+        }
+        std::vector<data_t> codes = this->Encode(queries, count);
+        if (group_size_ > 0) {
+            return tree_->searchKnnBatch(codes.data(), count, k, group_size_);
+        }
+        std::vector<SearchAlgorithm::ResultType> results(count);
+        for (size_t i = 0; i < count; i++) {
+            results[i] =
+                tree_->searchKnn(codes.data() + i * this->dimension_, k);
+        }
+        return results;
+    }
+
+    bool SetOption(const std::string& name, size_t value) {
+        if (name != "group") {
+            return false;
+        }
+        group_size_ = value;
+        return true;
+    }
+
+    // The tree is only counted once a search has built it.
+    size_t memory_bytes() const {
+        return StoredCodesSearchAlgorithm<Distance, Codec>::memory_bytes() +
+               (tree_ ? tree_->memory_bytes() : 0);
+    }
+
+   protected:
+    void Invalidate() { tree_.reset(); }
+
+   private:
+    size_t group_size_;
+    std::mutex tree_guard_;
+    std::unique_ptr<VPTreeSearch<float, data_t, Distance> > tree_;
+};
+
+// Answers repeated queries from a QueryCache and searches the others, in one
+// batch, with the index it wraps. Changes to the index or to its options
+// invalidate the cache.
+class CachedSearchAlgorithm : public SearchAlgorithm {
+   public:
+    // Takes ownership of search_algorithm.
+    CachedSearchAlgorithm(SearchAlgorithm* search_algorithm, size_t capacity,
+                          float grid = 0, float tolerance = 0)
+        : search_algorithm_(search_algorithm),
+          cache_(search_algorithm->dimension(), capacity, grid, tolerance) {}
+
+    void Add(const float* vectors, const DatasetIndexType* ids,
+             size_t count) {
+        search_algorithm_->Add(vectors, ids, count);
+        cache_.Invalidate();
+    }
+
+    std::vector<ResultType> Search(const float* queries, size_t count,
+                                   size_t k) {
+        std::vector<ResultType> results(count);
+        DimensionType dimension = this->dimension();
+        size_t epoch = cache_.Epoch();
+        std::vector<size_t> missed;
+        std::vector<float> missed_queries;
+        for (size_t i = 0; i < count; i++) {
+            const float* query = queries + i * dimension;
+            if (!cache_.Lookup(query, k, results[i])) {
+                missed.push_back(i);
+                missed_queries.insert(missed_queries.end(), query,
+                                      query + dimension);
+            }
+        }
+        if (missed.empty()) {
+            return results;
+        }
+        std::vector<ResultType> found = search_algorithm_->Search(
+            missed_queries.data(), missed.size(), k);
+        for (size_t i = 0; i < missed.size(); i++) {
+            cache_.Insert(missed_queries.data() + i * dimension, k, found[i],
+                          epoch);
+            results[missed[i]].swap(found[i]);
+        }
+        return results;
+    }
+
+    void Save(const std::string& file_name) {
+        search_algorithm_->Save(file_name);
+    }
+
+    void Load(const std::string& file_name) {
+        search_algorithm_->Load(file_name);
+        cache_.Invalidate();
+    }
+
+    bool SetOption(const std::string& name, size_t value) {
+        bool known = search_algorithm_->SetOption(name, value);
+        cache_.Invalidate();
+        return known;
+    }
+
+    size_t size() const { return search_algorithm_->size(); }
+
+    DimensionType dimension() const {
+        return search_algorithm_->dimension();
+    }
+
+    // That of the wrapped index, the cache is left out.
+    size_t memory_bytes() const { return search_algorithm_->memory_bytes(); }
+
+    QueryCache<float>& cache() { return cache_; }
+
+   private:
+    std::unique_ptr<SearchAlgorithm> search_algorithm_;
+    QueryCache<float> cache_;
+};
+
+template <typename Distance, typename Codec>
+SearchAlgorithm* CreateSearchAlgorithm(const std::string& algorithm,
+                                       DimensionType dimension, size_t M,
+                                       size_t ef_construction) {
+    if (algorithm == "HNSW") {
+        return new HNSWIndex<Distance, Codec>(dimension, M, ef_construction);
+    }
+    if (algorithm == "VPTree") {
+        return new VPTreeIndex<Distance, Codec>(dimension);
+    }
+    return new FlatIndex<Distance, Codec>(dimension);
+}
+
+// Parses the decimal number text, part of the description token, and throws
+// std::runtime_error naming the token when it is not one or is too large.
+inline size_t ParseDescriptionNumber(const std::string& token,
+                                     const std::string& text) {
+    if (text.empty() || !isdigit((unsigned char)text[0])) {
+        throw std::runtime_error(
+            "Expected a number in index description token " + token);
+    }
+    size_t end = 0;
+    unsigned long value = 0;
+    try {
+        value = std::stoul(text, &end);
+    } catch (const std::out_of_range&) {
+        throw std::runtime_error(
+            "Number out of range in index description token " + token);
+    }
+    if (end != text.size()) {
+        throw std::runtime_error(
+            "Expected a number in index description token " + token);
+    }
+    return value;
+}
+
+// The same for a non negative decimal number with a fraction, such as 0.05.
+inline float ParseDescriptionFloat(const std::string& token,
+                                   const std::string& text) {
+    if (text.empty() || !(isdigit((unsigned char)text[0]) || text[0] == '.')) {
+        throw std::runtime_error(
+            "Expected a number in index description token " + token);
+    }
+    size_t end = 0;
+    float value = 0;
+    try {
+        value = std::stof(text, &end);
+    } catch (const std::out_of_range&) {
+        throw std::runtime_error(
+            "Number out of range in index description token " + token);
+    } catch (const std::invalid_argument&) {
+        throw std::runtime_error(
+            "Expected a number in index description token " + token);
+    }
+    if (end != text.size() || !std::isfinite(value)) {
+        throw std::runtime_error(
+            "Expected a number in index description token " + token);
+    }
+    return value;
+}
+
+// Builds an index from a comma separated description, the algorithm first:
+//
+//     HNSW<M>              hnswlib graph, M at least 2, 16 when left out
+//     VPTree               VPTreeSearch
+//     Flat                 exact scan
+//
+// followed by any of
+//
+//     L2, Cosine           metric, L2 when left out
+//     FP16, BF16, SQ8      storage, float when left out, SQ8 only with L2
+//     ef_construction=N    HNSW build beam width, 200 when left out
+//     cache=N              QueryCache of N results in front of the index,
+//                          see CachedSearchAlgorithm
+//     cache_grid=X         grid the cache rounds queries to, exact repeats
+//                          only when left out
+//     cache_tolerance=X    L2 distance within which the cache answers a near
+//                          duplicate, 0 when left out
+//     name=N               search option, see SearchAlgorithm::SetOption
+//
+// e.g. "HNSW32,Cosine,FP16,ef=128" or "VPTree,group=8". Throws
+// std::runtime_error on anything else.
+inline SearchAlgorithm* CreateSearchAlgorithm(const std::string& description,
+                                              DimensionType dimension) {
+    std::vector<std::string> tokens;
+    std::stringstream stream(description);
+    std::string token;
+    while (std::getline(stream, token, ',')) {
+        tokens.push_back(token);
+    }
+    if (tokens.empty()) {
+        throw std::runtime_error("Empty index description");
+    }
+    std::string algorithm = tokens[0];
+    size_t M = 16, ef_construction = 200, cache_capacity = 0;
+    float cache_grid = 0, cache_tolerance = 0;
+    if (algorithm.compare(0, 4, "HNSW") == 0) {
+        if (algorithm.size() > 4) {
+            M = ParseDescriptionNumber(algorithm, algorithm.substr(4));
+            // The level multiplier of hnswlib is 1 / log(M).
+            if (M < 2) {
+                throw std::runtime_error("HNSW needs M of at least 2 in " +
+                                         algorithm);
+            }
+        }
+        algorithm = "HNSW";
+    } else if (algorithm != "VPTree" && algorithm != "Flat") {
+        throw std::runtime_error("Unknown index algorithm " + algorithm);
+    }
+    bool cosine = false;
+    std::string storage = "float";
+    std::vector<std::pair<std::string, size_t> > options;
+    for (size_t i = 1; i < tokens.size(); i++) {
+        size_t equals = tokens[i].find('=');
+        if (equals != std::string::npos) {
+            std::string name = tokens[i].substr(0, equals);
+            if (name == "cache_grid") {
+                cache_grid = ParseDescriptionFloat(
+                    tokens[i], tokens[i].substr(equals + 1));
+                continue;
+            }
+            if (name == "cache_tolerance") {
+                cache_tolerance = ParseDescriptionFloat(
+                    tokens[i], tokens[i].substr(equals + 1));
+                continue;
+            }
+            size_t value =
+                ParseDescriptionNumber(tokens[i], tokens[i].substr(equals + 1));
+            if (name == "ef_construction") {
+                ef_construction = value;
+            } else if (name == "cache") {
+                cache_capacity = value;
+            } else {
+                options.push_back(std::make_pair(name, value));
+            }
+        } else if (tokens[i] == "L2" || tokens[i] == "Cosine") {
+            cosine = tokens[i] == "Cosine";
+        } else if (tokens[i] == "FP16" || tokens[i] == "BF16" ||
+                   tokens[i] == "SQ8") {
+            storage = tokens[i];
+        } else {
+            throw std::runtime_error("Unknown index option " + tokens[i]);
+        }
+    }
+    if (cosine && storage == "SQ8") {
+        throw std::runtime_error("SQ8 storage only supports L2");
+    }
+    if (cache_capacity == 0 && (cache_grid > 0 || cache_tolerance > 0)) {
+        throw std::runtime_error("cache_grid and cache_tolerance need cache=N");
+    }
+
+    SearchAlgorithm* search_algorithm;
+    if (storage == "FP16") {
+        search_algorithm =
+            cosine ? CreateSearchAlgorithm<CosineDistance<Float16>,
+                                           HalfCodec<Float16> >(
+                         algorithm, dimension, M, ef_construction)
+                   : CreateSearchAlgorithm<L2Distance<Float16>,
+                                           HalfCodec<Float16> >(
+                         algorithm, dimension, M, ef_construction);
+    } else if (storage == "BF16") {
+        search_algorithm =
+            cosine ? CreateSearchAlgorithm<CosineDistance<BFloat16>,
+                                           HalfCodec<BFloat16> >(
+                         algorithm, dimension, M, ef_construction)
+                   : CreateSearchAlgorithm<L2Distance<BFloat16>,
+                                           HalfCodec<BFloat16> >(
+                         algorithm, dimension, M, ef_construction);
+    } else if (storage == "SQ8") {
+        search_algorithm =
+            CreateSearchAlgorithm<ScalarQuantizerL2Distance,
+                                  ScalarQuantizerCodec>(
+                algorithm, dimension, M, ef_construction);
+    } else {
+        search_algorithm =
+            cosine ? CreateSearchAlgorithm<CosineDistance<float>, FloatCodec>(
+                         algorithm, dimension, M, ef_construction)
+                   : CreateSearchAlgorithm<L2Distance<float>, FloatCodec>(
+                         algorithm, dimension, M, ef_construction);
+    }
+    for (const auto& option : options) {
+        if (!search_algorithm->SetOption(option.first, option.second)) {
+            delete search_algorithm;
+            throw std::runtime_error("Unknown option " + option.first +
+                                     " for " + algorithm);
+        }
+    }
+    if (cache_capacity > 0) {
+        search_algorithm = new CachedSearchAlgorithm(
+            search_algorithm, cache_capacity, cache_grid, cache_tolerance);
+    }
+    return search_algorithm;
+}
+
+}  // namespace fast_ann
+
+#endif  // FAST_ANN_INDEX_FACTORY_H_
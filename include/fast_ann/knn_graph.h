@@ -0,0 +1,354 @@
+#ifndef FAST_ANN_KNN_GRAPH_H_
+#define FAST_ANN_KNN_GRAPH_H_
+
+#include <algorithm>
+#include <functional>
+#include <atomic>
+#include <limits>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "fast_ann/data_writers/xvecs_writer.h"
+#include "fast_ann/logger.h"
+#include "hnswlib/hnswlib.h"
+
+namespace fast_ann {
+
+const size_t kKnnGraphLockStripes = 4096;
+
+// Builds the k nearest neighbor graph of every element of an HNSW index. The
+// lists start from a level 0 search of the index from each element, which
+// needs no upper layer descent and reuses its heaps across elements, and are
+// refined by NN-descent local joins, which compare the neighbors of each
+// element with each other.
+template <typename dist_t>
+class KnnGraph {
+   public:
+    // Ids are internal ids of the index, which must not change while the
+    // graph is built.
+    struct Neighbor {
+        dist_t dist;
+        hnswlib::tableint id;
+        bool is_new;
+    };
+
+    KnnGraph(hnswlib::HierarchicalNSW<dist_t>* index, size_t k)
+        : index_(index),
+          num_elements_(index->cur_element_count),
+          k_(std::min(k, num_elements_ > 0 ? num_elements_ - 1 : 0)),
+          neighbors_(num_elements_ * k_),
+          sizes_(num_elements_, 0),
+          worst_(num_elements_),
+          locks_(kKnnGraphLockStripes) {
+        for (std::atomic<dist_t>& worst : worst_) {
+            worst.store(std::numeric_limits<dist_t>::max(),
+                        std::memory_order_relaxed);
+        }
+        fstdistfunc_ = index->fstdistfunc_;
+        dist_func_param_ = index->dist_func_param_;
+    }
+
+    // ef is the beam width of the initial searches, k by default. Local joins
+    // then run until fewer than min_update_rate * n * k list entries change
+    // in an iteration. sample_size bounds the new and old candidates joined
+    // per element.
+    void Build(size_t ef = 0, size_t max_iterations = 2,
+               double min_update_rate = 0.001, size_t sample_size = 0) {
+        if (k_ == 0) {
+            return;
+        }
+        if (ef == 0) {
+            ef = k_;
+        }
+        if (sample_size == 0) {
+            sample_size = k_;
+        }
+        Initialize(ef);
+        for (size_t iteration = 0; iteration < max_iterations; iteration++) {
+            size_t updates = Join(sample_size);
+            LOG_INFO("NN-descent iteration " << iteration << " updated "
+                                             << updates << " neighbors");
+            if (updates < min_update_rate * num_elements_ * k_) {
+                break;
+            }
+        }
+    }
+
+    // Neighbors of an element, nearest first.
+    inline const Neighbor* neighbors(hnswlib::tableint id) const {
+        return neighbors_.data() + id * k_;
+    }
+
+    inline size_t size(hnswlib::tableint id) const { return sizes_[id]; }
+
+    inline size_t k() const { return k_; }
+
+    // Writes the neighbor labels of labels 0 to n - 1, one row per label, and
+    // optionally their distances. Rows are streamed, shorter lists are padded
+    // with -1 and the max distance.
+    void WriteIvecs(const std::string& ids_file_name,
+                    const std::string& distances_file_name = "") const {
+        XvecsWriter<int> ids_writer(ids_file_name);
+        XvecsWriter<float>* distances_writer = nullptr;
+        if (!distances_file_name.empty()) {
+            distances_writer = new XvecsWriter<float>(distances_file_name);
+        }
+        std::vector<int> ids(k_);
+        std::vector<float> distances(k_);
+        size_t num_labels = index_->label_lookup_.size();
+        for (size_t label = 0; label < num_labels; label++) {
+            auto search = index_->label_lookup_.find(label);
+            if (search == index_->label_lookup_.end()) {
+                delete distances_writer;
+                throw std::runtime_error(
+                    "k-NN graph rows need labels from 0 to n - 1");
+            }
+            const Neighbor* row = neighbors(search->second);
+            for (size_t i = 0; i < k_; i++) {
+                bool valid = i < sizes_[search->second];
+                ids[i] = valid ? index_->getExternalLabel(row[i].id) : -1;
+                distances[i] = valid ? row[i].dist
+                                     : std::numeric_limits<float>::max();
+            }
+            ids_writer.Write(ids.data(), k_);
+            if (distances_writer != nullptr) {
+                distances_writer->Write(distances.data(), k_);
+            }
+        }
+        delete distances_writer;
+    }
+
+   private:
+    typedef std::pair<dist_t, hnswlib::tableint> Candidate;
+
+    inline bool IsLive(hnswlib::tableint id) const {
+        return !index_->isMarkedDeleted(id);
+    }
+
+    inline dist_t GetDistance(hnswlib::tableint a, hnswlib::tableint b) const {
+        return fstdistfunc_(index_->getDataByInternalId(a),
+                            index_->getDataByInternalId(b), dist_func_param_);
+    }
+
+    inline std::mutex& GetLock(hnswlib::tableint id) {
+        return locks_[id % kKnnGraphLockStripes];
+    }
+
+    // Inserts v in the sorted list of u unless it is already there or farther
+    // than every current neighbor of a full list. Returns whether the list
+    // changed.
+    bool Insert(hnswlib::tableint u, hnswlib::tableint v, dist_t dist) {
+        // Most candidates are rejected by this check, which needs no lock.
+        if (dist >= worst_[u].load(std::memory_order_relaxed)) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(GetLock(u));
+        Neighbor* list = neighbors_.data() + u * k_;
+        size_t size = sizes_[u];
+        if (size == k_ && dist >= list[k_ - 1].dist) {
+            return false;
+        }
+        for (size_t i = 0; i < size; i++) {
+            if (list[i].id == v) {
+                return false;
+            }
+        }
+        size_t pos = size == k_ ? k_ - 1 : sizes_[u]++;
+        while (pos > 0 && list[pos - 1].dist > dist) {
+            list[pos] = list[pos - 1];
+            pos--;
+        }
+        list[pos] = {dist, v, true};
+        if (sizes_[u] == k_) {
+            worst_[u].store(list[k_ - 1].dist, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    // Fills the lists with a search from every element, topped up with random
+    // elements when fewer than k were reached.
+    void Initialize(size_t ef) {
+#pragma omp parallel
+        {
+            // Heaps of the searches, reused for every element of a thread.
+            std::vector<Candidate> top;
+            std::vector<Candidate> candidates;
+#pragma omp for schedule(dynamic, 256)
+            for (size_t u = 0; u < num_elements_; u++) {
+                if (IsLive(u)) {
+                    SearchFromSelf(u, ef, top, candidates);
+                }
+            }
+        }
+#pragma omp parallel for schedule(dynamic, 256)
+        for (size_t u = 0; u < num_elements_; u++) {
+            if (!IsLive(u)) {
+                continue;
+            }
+            std::minstd_rand rng(u + 1);
+            std::uniform_int_distribution<size_t> uniform(0,
+                                                          num_elements_ - 1);
+            for (size_t attempt = 0; sizes_[u] < k_ && attempt < 4 * k_;
+                 attempt++) {
+                hnswlib::tableint v = uniform(rng);
+                if (v != u && IsLive(v)) {
+                    Insert(u, v, GetDistance(u, v));
+                }
+            }
+        }
+    }
+
+    // Level 0 beam search of the index started from the element itself, so
+    // no upper layer descent and no walk from the enter point are needed.
+    // top is a max heap of the ef nearest elements found, candidates a min
+    // heap of the elements to expand.
+    void SearchFromSelf(hnswlib::tableint u, size_t ef,
+                        std::vector<Candidate>& top,
+                        std::vector<Candidate>& candidates) {
+        std::greater<Candidate> nearest_first;
+        hnswlib::VisitedList* vl =
+            index_->visited_list_pool_->getFreeVisitedList();
+        hnswlib::vl_type* visited = vl->mass;
+        hnswlib::vl_type tag = vl->curV;
+        top.clear();
+        candidates.clear();
+        visited[u] = tag;
+        candidates.emplace_back(0, u);
+        while (!candidates.empty()) {
+            Candidate current = candidates.front();
+            if (top.size() == ef && current.first > top.front().first) {
+                break;
+            }
+            std::pop_heap(candidates.begin(), candidates.end(),
+                          nearest_first);
+            candidates.pop_back();
+            hnswlib::linklistsizeint* links =
+                index_->get_linklist0(current.second);
+            size_t num_links = index_->getListCount(links);
+            hnswlib::tableint* link_ids = (hnswlib::tableint*)(links + 1);
+            for (size_t i = 0; i < num_links; i++) {
+                hnswlib::tableint v = link_ids[i];
+                if (visited[v] == tag) {
+                    continue;
+                }
+                visited[v] = tag;
+                dist_t dist = GetDistance(u, v);
+                if (top.size() < ef || dist < top.front().first) {
+                    candidates.emplace_back(dist, v);
+                    std::push_heap(candidates.begin(), candidates.end(),
+                                   nearest_first);
+                    top.emplace_back(dist, v);
+                    std::push_heap(top.begin(), top.end());
+                    if (top.size() > ef) {
+                        std::pop_heap(top.begin(), top.end());
+                        top.pop_back();
+                    }
+                }
+                if (IsLive(v)) {
+                    Insert(u, v, dist);
+                }
+            }
+        }
+        index_->visited_list_pool_->releaseVisitedList(vl);
+    }
+
+    // One NN-descent iteration: every element joins a sample of its new
+    // neighbors with each other and with its old neighbors, both in the
+    // forward and reverse direction. Returns the number of list changes.
+    size_t Join(size_t sample_size) {
+        std::vector<std::vector<hnswlib::tableint> > new_candidates(
+            num_elements_);
+        std::vector<std::vector<hnswlib::tableint> > old_candidates(
+            num_elements_);
+        std::vector<std::vector<hnswlib::tableint> > reverse_new(
+            num_elements_);
+        std::vector<std::vector<hnswlib::tableint> > reverse_old(
+            num_elements_);
+
+        // New entries are joined once, sampled ones become old.
+#pragma omp parallel for schedule(dynamic, 256)
+        for (size_t u = 0; u < num_elements_; u++) {
+            std::lock_guard<std::mutex> lock(GetLock(u));
+            Neighbor* list = neighbors_.data() + u * k_;
+            for (size_t i = 0; i < sizes_[u]; i++) {
+                if (!list[i].is_new) {
+                    old_candidates[u].push_back(list[i].id);
+                } else if (new_candidates[u].size() < sample_size) {
+                    new_candidates[u].push_back(list[i].id);
+                    list[i].is_new = false;
+                }
+            }
+        }
+#pragma omp parallel for schedule(dynamic, 256)
+        for (size_t u = 0; u < num_elements_; u++) {
+            AddReverse(u, new_candidates[u], reverse_new, sample_size);
+            AddReverse(u, old_candidates[u], reverse_old, sample_size);
+        }
+
+        size_t updates = 0;
+#pragma omp parallel for schedule(dynamic, 256) reduction(+ : updates)
+        for (size_t u = 0; u < num_elements_; u++) {
+            std::vector<hnswlib::tableint>& new_list = new_candidates[u];
+            std::vector<hnswlib::tableint>& old_list = old_candidates[u];
+            Merge(new_list, reverse_new[u]);
+            Merge(old_list, reverse_old[u]);
+            for (size_t i = 0; i < new_list.size(); i++) {
+                hnswlib::tableint a = new_list[i];
+                for (size_t j = i + 1; j < new_list.size(); j++) {
+                    updates += Update(a, new_list[j]);
+                }
+                for (hnswlib::tableint b : old_list) {
+                    updates += Update(a, b);
+                }
+            }
+        }
+        return updates;
+    }
+
+    void AddReverse(hnswlib::tableint u,
+                    const std::vector<hnswlib::tableint>& list,
+                    std::vector<std::vector<hnswlib::tableint> >& reverse,
+                    size_t sample_size) {
+        for (hnswlib::tableint v : list) {
+            std::lock_guard<std::mutex> lock(GetLock(v));
+            if (reverse[v].size() < sample_size) {
+                reverse[v].push_back(u);
+            }
+        }
+    }
+
+    static void Merge(std::vector<hnswlib::tableint>& list,
+                      std::vector<hnswlib::tableint>& extra) {
+        list.insert(list.end(), extra.begin(), extra.end());
+        std::sort(list.begin(), list.end());
+        list.erase(std::unique(list.begin(), list.end()), list.end());
+        std::vector<hnswlib::tableint>().swap(extra);
+    }
+
+    size_t Update(hnswlib::tableint a, hnswlib::tableint b) {
+        if (a == b) {
+            return 0;
+        }
+        dist_t dist = GetDistance(a, b);
+        return Insert(a, b, dist) + Insert(b, a, dist);
+    }
+
+    hnswlib::HierarchicalNSW<dist_t>* index_;
+    size_t num_elements_;
+    size_t k_;
+    std::vector<Neighbor> neighbors_;
+    std::vector<size_t> sizes_;
+    // Distance of the k-th neighbor, or the max distance while the list is
+    // not full.
+    std::vector<std::atomic<dist_t> > worst_;
+    std::vector<std::mutex> locks_;
+    hnswlib::DISTFUNC<dist_t> fstdistfunc_;
+    void* dist_func_param_;
+};
+
+}  // namespace fast_ann
+
+#endif  // FAST_ANN_KNN_GRAPH_H_
@@ -8,6 +8,8 @@ namespace fast_ann {
 class LogSink {
    public:
     virtual void write(const std::string& message) = 0;
+    // Blocks until everything written so far has reached its destination.
+    virtual void flush() {}
     virtual ~LogSink() {}
 };
 
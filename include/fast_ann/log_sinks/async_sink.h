@@ -0,0 +1,153 @@
+#ifndef FAST_ANN_LOG_SINKS_ASYNC_SINK_H_
+#define FAST_ANN_LOG_SINKS_ASYNC_SINK_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "fast_ann/log_sink.h"
+
+namespace fast_ann {
+
+const size_t kAsyncSinkDefaultCapacity = 8192;
+const size_t kAsyncSinkMaxBatchLines = 256;
+const int kAsyncSinkIdleSleepMicros = 200;
+
+// Moves log lines off the calling thread. Writers claim a slot in a bounded
+// lock free multi producer ring buffer and copy the line into it, a
+// background thread drains the buffer and hands whole batches to the wrapped
+// sink. A full buffer drops the line instead of blocking, the number of
+// dropped lines is reported with the next batch. Takes ownership of the
+// wrapped sink.
+class AsyncSink : public LogSink {
+   public:
+    AsyncSink(LogSink* sink_ptr, size_t capacity = kAsyncSinkDefaultCapacity)
+        : sink_ptr_(sink_ptr),
+          enqueue_pos_(0),
+          dequeue_pos_(0),
+          written_pos_(0),
+          dropped_(0),
+          stop_(false) {
+        size_t rounded = 1;
+        while (rounded < capacity) {
+            rounded <<= 1;
+        }
+        slots_ = std::vector<Slot>(rounded);
+        for (size_t i = 0; i < rounded; i++) {
+            slots_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        mask_ = rounded - 1;
+        worker_ = std::thread(&AsyncSink::Run, this);
+    }
+
+    ~AsyncSink() {
+        stop_.store(true, std::memory_order_release);
+        worker_.join();
+        sink_ptr_->flush();
+        delete sink_ptr_;
+    }
+
+    AsyncSink(const AsyncSink&) = delete;
+    AsyncSink& operator=(const AsyncSink&) = delete;
+
+    void write(const std::string& message) {
+        size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+        Slot* slot;
+        while (true) {
+            slot = &slots_[pos & mask_];
+            size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+            if (diff == 0) {
+                if (enqueue_pos_.compare_exchange_weak(
+                        pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return;
+            } else {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+        slot->message.assign(message);
+        slot->sequence.store(pos + 1, std::memory_order_release);
+    }
+
+    void flush() {
+        size_t target = enqueue_pos_.load(std::memory_order_acquire);
+        while (written_pos_.load(std::memory_order_acquire) < target) {
+            std::this_thread::yield();
+        }
+        sink_ptr_->flush();
+    }
+
+   private:
+    struct Slot {
+        Slot() : sequence(0) {}
+        Slot(const Slot&) : sequence(0) {}
+
+        std::atomic<size_t> sequence;
+        std::string message;
+    };
+
+    void Run() {
+        std::string batch;
+        while (true) {
+            bool stopping = stop_.load(std::memory_order_acquire);
+            if (WriteBatch(batch) == 0) {
+                if (stopping) {
+                    return;
+                }
+                std::this_thread::sleep_for(
+                    std::chrono::microseconds(kAsyncSinkIdleSleepMicros));
+            }
+        }
+    }
+
+    // Only called from the background thread, which is the single consumer.
+    size_t WriteBatch(std::string& batch) {
+        batch.clear();
+        size_t pos = dequeue_pos_;
+        size_t lines = 0;
+        while (lines < kAsyncSinkMaxBatchLines) {
+            Slot& slot = slots_[pos & mask_];
+            if (slot.sequence.load(std::memory_order_acquire) != pos + 1) {
+                break;
+            }
+            batch.append(slot.message);
+            // Keeps the capacity of the string for the next writer.
+            slot.message.clear();
+            slot.sequence.store(pos + mask_ + 1, std::memory_order_release);
+            pos++;
+            lines++;
+        }
+        dequeue_pos_ = pos;
+        size_t dropped = dropped_.exchange(0, std::memory_order_relaxed);
+        if (dropped > 0) {
+            batch.append("[WARN] Async log sink dropped " +
+                         std::to_string(dropped) + " lines\n");
+        }
+        if (!batch.empty()) {
+            sink_ptr_->write(batch);
+        }
+        written_pos_.store(pos, std::memory_order_release);
+        return lines;
+    }
+
+    LogSink* sink_ptr_;
+    std::vector<Slot> slots_;
+    size_t mask_;
+    std::atomic<size_t> enqueue_pos_;
+    size_t dequeue_pos_;
+    std::atomic<size_t> written_pos_;
+    std::atomic<size_t> dropped_;
+    std::atomic<bool> stop_;
+    std::thread worker_;
+};
+
+}  // namespace fast_ann
+
+#endif  // FAST_ANN_LOG_SINKS_ASYNC_SINK_H_
@@ -15,6 +15,8 @@ class ConsoleSink : public LogSink {
         // Flushes can interleave.
         std::cout.flush();
     }
+
+    void flush() { std::cout.flush(); }
 };
 
 }  // namespace fast_ann
@@ -10,17 +10,29 @@ namespace fast_ann {
 
 class FileSink : public LogSink {
    public:
-    FileSink(std::ofstream &stream) : stream_(stream) {}
+    // Without flush_every_write lines reach the file when the stream buffer
+    // fills or flush is called, as when wrapped in an AsyncSink.
+    FileSink(std::ofstream &stream, bool flush_every_write = true)
+        : stream_(stream), flush_every_write_(flush_every_write) {}
 
     void write(const std::string& message) {
         lock_.lock();
         stream_ << message;
+        if (flush_every_write_) {
+            stream_.flush();
+        }
+        lock_.unlock();
+    }
+
+    void flush() {
+        lock_.lock();
         stream_.flush();
         lock_.unlock();
     }
 
    private:
     std::ofstream& stream_;
+    bool flush_every_write_;
     std::mutex lock_;
 };
 
@@ -0,0 +1,59 @@
+#ifndef FAST_ANN_LOG_SINKS_SCOPED_LOG_SINK_H_
+#define FAST_ANN_LOG_SINKS_SCOPED_LOG_SINK_H_
+
+#include <fstream>
+#include <string>
+
+#include "fast_ann/log_sinks/async_sink.h"
+#include "fast_ann/log_sinks/console_sink.h"
+#include "fast_ann/log_sinks/file_sink.h"
+#include "fast_ann/logger.h"
+
+namespace fast_ann {
+
+// Sends the global logger to the console, or to log_file_name when it is
+// not empty, through an AsyncSink when async is set, until destruction. The
+// sink is flushed and removed before the file it writes to is closed. When
+// the file cannot be created nothing is installed and is_open is false.
+class ScopedLogSink {
+   public:
+    ScopedLogSink(const std::string& log_file_name, bool async) {
+        LogSink* log_sink;
+        if (log_file_name.empty()) {
+            log_sink = new ConsoleSink();
+        } else {
+            log_stream_.open(log_file_name);
+            if (!log_stream_) {
+                is_open_ = false;
+                return;
+            }
+            // Lines reach the file in batches when a thread writes them.
+            log_sink = new FileSink(log_stream_, !async);
+        }
+        if (async) {
+            log_sink = new AsyncSink(log_sink);
+        }
+        SetLogSink(log_sink);
+        is_open_ = true;
+    }
+
+    ~ScopedLogSink() {
+        if (is_open_) {
+            ResetLogSink();
+        }
+    }
+
+    ScopedLogSink(const ScopedLogSink&) = delete;
+    ScopedLogSink& operator=(const ScopedLogSink&) = delete;
+
+    bool is_open() const { return is_open_; }
+
+   private:
+    // The file sink keeps a reference, the stream must outlive it.
+    std::ofstream log_stream_;
+    bool is_open_;
+};
+
+}  // namespace fast_ann
+
+#endif  // FAST_ANN_LOG_SINKS_SCOPED_LOG_SINK_H_
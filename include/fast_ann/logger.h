@@ -7,6 +7,16 @@
 #include "fast_ann/log_sink.h"
 #include "fast_ann/log_sinks/null_sink.h"
 
+// Levels below FAST_ANN_MIN_LOG_LEVEL are removed at compile time, messages
+// included. Release builds keep warnings and errors unless a level is given.
+#ifndef FAST_ANN_MIN_LOG_LEVEL
+#ifdef NDEBUG
+#define FAST_ANN_MIN_LOG_LEVEL 2
+#else
+#define FAST_ANN_MIN_LOG_LEVEL 0
+#endif
+#endif
+
 namespace fast_ann {
 
 const int kLogLineExtraReserveBytes = 64;
@@ -21,15 +31,23 @@ class Logger {
     Logger()
         : log_sink_ptr_(new NullSink()), log_level_cutoff_(LogLevel::NONE) {}
 
+    ~Logger() { delete log_sink_ptr_; }
+
     void set_log_sink(LogSink* ls_ptr) {
         delete log_sink_ptr_;
         log_sink_ptr_ = ls_ptr;
     }
 
+    void flush() { log_sink_ptr_->flush(); }
+
     void set_log_level_cutoff(LogLevel ll_cutoff) {
         log_level_cutoff_ = ll_cutoff;
     }
 
+    inline bool enabled(LogLevel log_level) const {
+        return log_level >= log_level_cutoff_;
+    }
+
     void log(LogLevel log_level, const char* file_name, int line_no,
              const char* function_name, const std::string& message) {
         if (log_level < log_level_cutoff_) {
@@ -48,6 +66,7 @@ class Logger {
         log_line.push_back('\n');
         log_sink_ptr_->write(log_line);
         if (log_level == LogLevel::FATAL) {
+            log_sink_ptr_->flush();
             exit(1);
         }
     }
@@ -64,38 +83,63 @@ Logger& GetGlobalLogger() {
 
 void SetLogSink(LogSink* ls_ptr) { GetGlobalLogger().set_log_sink(ls_ptr); }
 
+// Flushes and deletes the sink, to be called before the streams it writes
+// to are destroyed. The global logger outlives main, and so would its sink.
+void ResetLogSink() {
+    GetGlobalLogger().flush();
+    GetGlobalLogger().set_log_sink(new NullSink());
+}
+
 void SetLogLevel(LogLevel ll_cutoff) {
     GetGlobalLogger().set_log_level_cutoff(ll_cutoff);
 }
 
-#define LOG(Level_, Message_)                                              \
-    GetGlobalLogger().log(Level_, __FILE__, __LINE__, __PRETTY_FUNCTION__, \
-                          static_cast<std::ostringstream&>(                \
-                              std::ostringstream().flush() << Message_)    \
-                              .str())
-
-#ifdef NDEBUG
-#define LOG_DEBUG(_) \
-    do {             \
+// True if a message of the given level would reach the sink. Lets callers
+// skip building expensive messages.
+#define LOG_ENABLED(Level_)                \
+    ((Level_) >= FAST_ANN_MIN_LOG_LEVEL && \
+     fast_ann::GetGlobalLogger().enabled(Level_))
+
+// The message is only formatted once the level has passed the cutoff.
+#define LOG(Level_, Message_)                                                 \
+    do {                                                                      \
+        if (LOG_ENABLED(Level_)) {                                            \
+            std::ostringstream log_message_stream_;                           \
+            log_message_stream_ << Message_;                                  \
+            fast_ann::GetGlobalLogger().log(Level_, __FILE__, __LINE__,       \
+                                            __PRETTY_FUNCTION__,              \
+                                            log_message_stream_.str());       \
+        }                                                                     \
     } while (0)
-#define LOG_INFO(_) \
-    do {            \
-    } while (0)
-#define LOG_WARN(_) \
-    do {            \
-    } while (0)
-#define LOG_ERROR(_) \
-    do {             \
-    } while (0)
-#define LOG_FATAL(_) \
-    do {             \
+
+#define LOG_DISABLED(_) \
+    do {                \
     } while (0)
+
+#if FAST_ANN_MIN_LOG_LEVEL <= 0
+#define LOG_DEBUG(Message_) LOG(fast_ann::LogLevel::DEBUG, Message_)
+#else
+#define LOG_DEBUG(Message_) LOG_DISABLED(Message_)
+#endif
+#if FAST_ANN_MIN_LOG_LEVEL <= 1
+#define LOG_INFO(Message_) LOG(fast_ann::LogLevel::INFO, Message_)
+#else
+#define LOG_INFO(Message_) LOG_DISABLED(Message_)
+#endif
+#if FAST_ANN_MIN_LOG_LEVEL <= 2
+#define LOG_WARN(Message_) LOG(fast_ann::LogLevel::WARN, Message_)
+#else
+#define LOG_WARN(Message_) LOG_DISABLED(Message_)
+#endif
+#if FAST_ANN_MIN_LOG_LEVEL <= 3
+#define LOG_ERROR(Message_) LOG(fast_ann::LogLevel::ERROR, Message_)
+#else
+#define LOG_ERROR(Message_) LOG_DISABLED(Message_)
+#endif
+#if FAST_ANN_MIN_LOG_LEVEL <= 4
+#define LOG_FATAL(Message_) LOG(fast_ann::LogLevel::FATAL, Message_)
 #else
-#define LOG_DEBUG(Message_) LOG(LogLevel::DEBUG, Message_)
-#define LOG_INFO(Message_) LOG(LogLevel::INFO, Message_)
-#define LOG_WARN(Message_) LOG(LogLevel::WARN, Message_)
-#define LOG_ERROR(Message_) LOG(LogLevel::ERROR, Message_)
-#define LOG_FATAL(Message_) LOG(LogLevel::FATAL, Message_)
+#define LOG_FATAL(Message_) LOG_DISABLED(Message_)
 #endif
 
 }  // namespace fast_ann
@@ -0,0 +1,198 @@
+#ifndef FAST_ANN_NUMA_H_
+#define FAST_ANN_NUMA_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef FAST_ANN_NUMA
+#include <numa.h>
+#include <numaif.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+namespace fast_ann {
+
+// Placement of indexes and query threads on multi-socket hosts. Without
+// FAST_ANN_NUMA, or when the kernel has no NUMA support, the host is a single
+// node and placement calls do nothing.
+
+inline bool NumaAvailable() {
+#ifdef FAST_ANN_NUMA
+    static const bool available = numa_available() >= 0;
+    return available;
+#else
+    return false;
+#endif
+}
+
+inline int NumaNodeCount() {
+#ifdef FAST_ANN_NUMA
+    if (NumaAvailable()) {
+        return numa_max_node() + 1;
+    }
+#endif
+    return 1;
+}
+
+// Node of the CPU the calling thread is running on.
+inline int CurrentNumaNode() {
+#ifdef FAST_ANN_NUMA
+    if (NumaAvailable()) {
+        int node = numa_node_of_cpu(sched_getcpu());
+        return node < 0 ? 0 : node;
+    }
+#endif
+    return 0;
+}
+
+// Runs the calling thread on the CPUs of node only, its first touches then
+// allocate from the node's memory. Returns false if it could not be pinned.
+inline bool PinThreadToNumaNode(int node) {
+#ifdef FAST_ANN_NUMA
+    if (NumaAvailable()) {
+        return numa_run_on_node(node) == 0;
+    }
+#else
+    (void)node;
+#endif
+    return false;
+}
+
+#ifdef FAST_ANN_NUMA
+// Sets the policy of the pages overlapping [ptr, ptr + size) and migrates
+// those already touched.
+inline void BindNumaPages(void* ptr, size_t size, int mode,
+                          struct bitmask* nodes) {
+    uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    uintptr_t begin = (uintptr_t)ptr & ~(page_size - 1);
+    uintptr_t end = ((uintptr_t)ptr + size + page_size - 1) & ~(page_size - 1);
+    mbind((void*)begin, end - begin, mode, nodes->maskp, nodes->size + 1,
+          MPOL_MF_MOVE);
+}
+#endif
+
+// Spreads the pages of a buffer round-robin over all nodes, so that threads
+// on every socket share the bandwidth of every memory controller instead of
+// queueing on the one that first touched it.
+inline void InterleaveMemory(void* ptr, size_t size) {
+#ifdef FAST_ANN_NUMA
+    if (NumaNodeCount() > 1) {
+        BindNumaPages(ptr, size, MPOL_INTERLEAVE, numa_all_nodes_ptr);
+    }
+#else
+    (void)ptr;
+    (void)size;
+#endif
+}
+
+// Moves the pages of a buffer to the memory of node.
+inline void MoveMemoryToNumaNode(void* ptr, size_t size, int node) {
+#ifdef FAST_ANN_NUMA
+    if (NumaNodeCount() > 1) {
+        struct bitmask* nodes = numa_allocate_nodemask();
+        numa_bitmask_setbit(nodes, node);
+        BindNumaPages(ptr, size, MPOL_BIND, nodes);
+        numa_free_nodemask(nodes);
+    }
+#else
+    (void)ptr;
+    (void)size;
+    (void)node;
+#endif
+}
+
+// One copy of a read-only index per node. build(node) runs on a thread
+// pinned to the node, so the memory the copy allocates and fills is local to
+// it, e.g. an hnswlib index loaded from a file. Query threads search the copy
+// of their own node.
+template <typename IndexT>
+class NumaReplicas {
+   public:
+    explicit NumaReplicas(std::function<IndexT*(int)> build)
+        : replicas_(NumaNodeCount()) {
+        std::exception_ptr last_exception = nullptr;
+        std::mutex last_exception_guard;
+        std::vector<std::thread> threads;
+        for (int node = 0; node < (int)replicas_.size(); node++) {
+            threads.push_back(std::thread([&, node]() {
+                try {
+                    PinThreadToNumaNode(node);
+                    replicas_[node].reset(build(node));
+                } catch (...) {
+                    std::unique_lock<std::mutex> lock(last_exception_guard);
+                    last_exception = std::current_exception();
+                }
+            }));
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        if (last_exception) {
+            std::rethrow_exception(last_exception);
+        }
+    }
+
+    int size() const { return replicas_.size(); }
+
+    IndexT& at(int node) { return *replicas_[node]; }
+
+    IndexT& Local() { return at(CurrentNumaNode()); }
+
+   private:
+    std::vector<std::unique_ptr<IndexT> > replicas_;
+};
+
+// Runs fn(i, node) for i in [begin, end) on num_threads threads (hardware
+// concurrency if not positive). Thread t is pinned to node t modulo the node
+// count and passes it on, to route its queries to the local replica or
+// shard. Rethrows the last exception raised by any of them.
+template <typename Function>
+void NumaParallelFor(size_t begin, size_t end, int num_threads, Function fn) {
+    if (num_threads <= 0) {
+        num_threads = std::thread::hardware_concurrency();
+    }
+    int num_nodes = NumaNodeCount();
+    std::atomic<size_t> next(begin);
+    std::exception_ptr last_exception = nullptr;
+    std::mutex last_exception_guard;
+    auto worker = [&](int node) {
+        if (num_nodes > 1) {
+            PinThreadToNumaNode(node);
+        }
+        while (true) {
+            size_t i = next.fetch_add(1);
+            if (i >= end) {
+                break;
+            }
+            try {
+                fn(i, node);
+            } catch (...) {
+                std::unique_lock<std::mutex> lock(last_exception_guard);
+                last_exception = std::current_exception();
+                next = end;
+                break;
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; t++) {
+        threads.push_back(std::thread(worker, t % num_nodes));
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    if (last_exception) {
+        std::rethrow_exception(last_exception);
+    }
+}
+
+}  // namespace fast_ann
+
+#endif  // FAST_ANN_NUMA_H_
@@ -0,0 +1,107 @@
+#ifndef FAST_ANN_QUANTIZERS_CODECS_H_
+#define FAST_ANN_QUANTIZERS_CODECS_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <istream>
+#include <ostream>
+
+#include "fast_ann/distance.h"
+#include "fast_ann/quantizers/half_precision.h"
+#include "fast_ann/quantizers/scalar_quantizer.h"
+
+namespace fast_ann {
+
+// Codecs convert float vectors to the data_type the indexes of
+// CreateSearchAlgorithm store and search. Codecs with parameters learn them
+// from the first vectors they are trained on, and save them with the index.
+// CreateDistance builds a distance policy over their codes.
+
+class FloatCodec {
+   public:
+    typedef float data_type;
+
+    bool trained() const { return true; }
+
+    void Train(const float*, size_t, DimensionType) {}
+
+    void Encode(const float* vector, float* code,
+                DimensionType dimension) const {
+        memcpy(code, vector, dimension * sizeof(float));
+    }
+
+    template <typename Distance>
+    Distance CreateDistance() const {
+        return Distance();
+    }
+
+    void Save(std::ostream&) const {}
+
+    void Load(std::istream&) {}
+};
+
+template <typename half_t>
+class HalfCodec {
+   public:
+    typedef half_t data_type;
+
+    bool trained() const { return true; }
+
+    void Train(const float*, size_t, DimensionType) {}
+
+    void Encode(const float* vector, half_t* code,
+                DimensionType dimension) const {
+        ConvertVector(vector, code, dimension);
+    }
+
+    template <typename Distance>
+    Distance CreateDistance() const {
+        return Distance();
+    }
+
+    void Save(std::ostream&) const {}
+
+    void Load(std::istream&) {}
+};
+
+// 8 bit codes of a ScalarQuantizer, whose ranges are those of the training
+// vectors. Later vectors outside of them are clamped.
+class ScalarQuantizerCodec {
+   public:
+    typedef uint8_t data_type;
+
+    ScalarQuantizerCodec() : trained_(false) {}
+
+    bool trained() const { return trained_; }
+
+    void Train(const float* vectors, size_t count, DimensionType dimension) {
+        quantizer_.Train(vectors, count, dimension);
+        trained_ = true;
+    }
+
+    void Encode(const float* vector, uint8_t* code, DimensionType) const {
+        quantizer_.Encode(vector, code);
+    }
+
+    // The policy points into the quantizer, which must not be trained or
+    // loaded again while it is used.
+    template <typename Distance>
+    Distance CreateDistance() const {
+        return Distance(quantizer_);
+    }
+
+    void Save(std::ostream& output) const { quantizer_.Save(output); }
+
+    void Load(std::istream& input) {
+        quantizer_.Load(input);
+        trained_ = true;
+    }
+
+   private:
+    ScalarQuantizer quantizer_;
+    bool trained_;
+};
+
+}  // namespace fast_ann
+
+#endif  // FAST_ANN_QUANTIZERS_CODECS_H_
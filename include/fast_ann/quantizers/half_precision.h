@@ -0,0 +1,289 @@
+#ifndef FAST_ANN_QUANTIZERS_HALF_PRECISION_H_
+#define FAST_ANN_QUANTIZERS_HALF_PRECISION_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <cstddef>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+#include "hnswlib/hnswlib.h"
+
+namespace fast_ann {
+
+// IEEE 754 binary16: 5 exponent and 10 mantissa bits, finite up to 65504.
+// Conversions round to nearest even.
+struct Float16 {
+    Float16() {}
+    explicit Float16(float value) : bits(FromFloat(value)) {}
+    operator float() const { return ToFloat(bits); }
+
+    static uint16_t FromFloat(float value) {
+        uint32_t input;
+        memcpy(&input, &value, sizeof(input));
+        uint32_t sign = (input >> 16) & 0x8000;
+        uint32_t magnitude = input & 0x7fffffff;
+        if (magnitude >= 0x7f800000) {
+            // Infinity stays infinity, NaN stays a quiet NaN.
+            return sign | 0x7c00 | (magnitude > 0x7f800000 ? 0x200 : 0);
+        }
+        if (magnitude >= 0x477ff000) {
+            // At or above 65520, halfway past the largest finite value.
+            return sign | 0x7c00;
+        }
+        uint32_t result, remainder, halfway;
+        if (magnitude < 0x38800000) {
+            // Below 2^-14 the result is subnormal, in units of 2^-24.
+            if (magnitude < 0x33000000) {
+                return sign;
+            }
+            uint32_t shift = 126 - (magnitude >> 23);
+            uint32_t mantissa = (magnitude & 0x7fffff) | 0x800000;
+            result = mantissa >> shift;
+            remainder = mantissa & ((1u << shift) - 1);
+            halfway = 1u << (shift - 1);
+        } else {
+            result = (magnitude - 0x38000000) >> 13;
+            remainder = magnitude & 0x1fff;
+            halfway = 0x1000;
+        }
+        if (remainder > halfway || (remainder == halfway && (result & 1))) {
+            result++;
+        }
+        return sign | result;
+    }
+
+    static float ToFloat(uint16_t bits) {
+        uint32_t sign = (uint32_t)(bits & 0x8000) << 16;
+        uint32_t exponent = (bits >> 10) & 0x1f;
+        uint32_t mantissa = bits & 0x3ff;
+        uint32_t output;
+        if (exponent == 0x1f) {
+            output = sign | 0x7f800000 | (mantissa << 13);
+        } else if (exponent != 0) {
+            output = sign | ((exponent + 112) << 23) | (mantissa << 13);
+        } else {
+            float value = mantissa * (1.0f / 16777216.0f);
+            memcpy(&output, &value, sizeof(output));
+            output |= sign;
+        }
+        float value;
+        memcpy(&value, &output, sizeof(value));
+        return value;
+    }
+
+    uint16_t bits;
+};
+
+// bfloat16: the upper half of a float, 8 exponent and 7 mantissa bits. Keeps
+// the float range at a coarser resolution than Float16.
+struct BFloat16 {
+    BFloat16() {}
+    explicit BFloat16(float value) : bits(FromFloat(value)) {}
+    operator float() const { return ToFloat(bits); }
+
+    static uint16_t FromFloat(float value) {
+        uint32_t input;
+        memcpy(&input, &value, sizeof(input));
+        if ((input & 0x7fffffff) > 0x7f800000) {
+            return (input >> 16) | 0x40;
+        }
+        input += 0x7fff + ((input >> 16) & 1);
+        return input >> 16;
+    }
+
+    static float ToFloat(uint16_t bits) {
+        uint32_t output = (uint32_t)bits << 16;
+        float value;
+        memcpy(&value, &output, sizeof(value));
+        return value;
+    }
+
+    uint16_t bits;
+};
+
+// Converts a float vector, e.g. a query, to the storage type of the index.
+template <typename half_t>
+void ConvertVector(const float* vector, half_t* out, size_t dimension) {
+    for (size_t d = 0; d < dimension; d++) {
+        out[d] = half_t(vector[d]);
+    }
+}
+
+// Distance kernels widen the halves to float and compute in float. The
+// generic blocks handle nothing and leave the whole vector to the scalar
+// loop, the overloads below cover the 8 wide blocks with AVX when the target
+// can widen the type in registers: F16C for Float16, AVX2 for BFloat16.
+template <typename half_t>
+inline size_t HalfL2SqrBlocks(const half_t*, const half_t*, size_t,
+                              float& result) {
+    result = 0;
+    return 0;
+}
+
+template <typename half_t>
+inline size_t HalfInnerProductBlocks(const half_t*, const half_t*, size_t,
+                                     float& result) {
+    result = 0;
+    return 0;
+}
+
+#if defined(__AVX__)
+inline float HorizontalSum(__m256 sum) {
+    __m128 half_sum = _mm_add_ps(_mm256_castps256_ps128(sum),
+                                 _mm256_extractf128_ps(sum, 1));
+    half_sum = _mm_add_ps(half_sum, _mm_movehl_ps(half_sum, half_sum));
+    half_sum = _mm_add_ss(half_sum, _mm_shuffle_ps(half_sum, half_sum, 1));
+    return _mm_cvtss_f32(half_sum);
+}
+
+template <typename half_t, typename Load>
+inline size_t L2SqrBlocks8(const half_t* l, const half_t* r, size_t dimension,
+                           float& result, Load load) {
+    size_t blocks_end = dimension & ~(size_t)7;
+    __m256 sum = _mm256_setzero_ps();
+    for (size_t d = 0; d < blocks_end; d += 8) {
+        __m256 diff = _mm256_sub_ps(load(l + d), load(r + d));
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(diff, diff));
+    }
+    result = HorizontalSum(sum);
+    return blocks_end;
+}
+
+template <typename half_t, typename Load>
+inline size_t InnerProductBlocks8(const half_t* l, const half_t* r,
+                                  size_t dimension, float& result, Load load) {
+    size_t blocks_end = dimension & ~(size_t)7;
+    __m256 sum = _mm256_setzero_ps();
+    for (size_t d = 0; d < blocks_end; d += 8) {
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(load(l + d), load(r + d)));
+    }
+    result = HorizontalSum(sum);
+    return blocks_end;
+}
+#endif
+
+#if defined(__AVX__) && defined(__F16C__)
+struct LoadFloat16x8 {
+    __m256 operator()(const Float16* ptr) const {
+        return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)ptr));
+    }
+};
+
+inline size_t HalfL2SqrBlocks(const Float16* l, const Float16* r,
+                              size_t dimension, float& result) {
+    return L2SqrBlocks8(l, r, dimension, result, LoadFloat16x8());
+}
+
+inline size_t HalfInnerProductBlocks(const Float16* l, const Float16* r,
+                                     size_t dimension, float& result) {
+    return InnerProductBlocks8(l, r, dimension, result, LoadFloat16x8());
+}
+#endif
+
+#if defined(__AVX2__)
+struct LoadBFloat16x8 {
+    __m256 operator()(const BFloat16* ptr) const {
+        __m256i widened =
+            _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)ptr));
+        return _mm256_castsi256_ps(_mm256_slli_epi32(widened, 16));
+    }
+};
+
+inline size_t HalfL2SqrBlocks(const BFloat16* l, const BFloat16* r,
+                              size_t dimension, float& result) {
+    return L2SqrBlocks8(l, r, dimension, result, LoadBFloat16x8());
+}
+
+inline size_t HalfInnerProductBlocks(const BFloat16* l, const BFloat16* r,
+                                     size_t dimension, float& result) {
+    return InnerProductBlocks8(l, r, dimension, result, LoadBFloat16x8());
+}
+#endif
+
+template <typename half_t>
+float HalfL2Sqr(const void* vector_l, const void* vector_r,
+                const void* dimension_ptr) {
+    const half_t* l = (const half_t*)vector_l;
+    const half_t* r = (const half_t*)vector_r;
+    size_t dimension = *(const size_t*)dimension_ptr;
+    float result;
+    for (size_t d = HalfL2SqrBlocks(l, r, dimension, result); d < dimension;
+         d++) {
+        float diff = (float)l[d] - (float)r[d];
+        result += diff * diff;
+    }
+    return result;
+}
+
+// One minus the inner product, as hnswlib::InnerProductSpace.
+template <typename half_t>
+float HalfInnerProduct(const void* vector_l, const void* vector_r,
+                       const void* dimension_ptr) {
+    const half_t* l = (const half_t*)vector_l;
+    const half_t* r = (const half_t*)vector_r;
+    size_t dimension = *(const size_t*)dimension_ptr;
+    float result;
+    for (size_t d = HalfInnerProductBlocks(l, r, dimension, result);
+         d < dimension; d++) {
+        result += (float)l[d] * (float)r[d];
+    }
+    return 1.0f - result;
+}
+
+// hnswlib spaces over vectors stored as Float16 or BFloat16, half the size of
+// float vectors. Queries must be converted with ConvertVector first.
+template <typename half_t>
+class HalfL2Space : public hnswlib::SpaceInterface<float> {
+   public:
+    HalfL2Space(size_t dimension) : dimension_(dimension) {}
+
+    size_t get_data_size() { return dimension_ * sizeof(half_t); }
+
+    hnswlib::DISTFUNC<float> get_dist_func() { return HalfL2Sqr<half_t>; }
+
+    void* get_dist_func_param() { return &dimension_; }
+
+    hnswlib::METRICFUNC<float> get_metric_func() {
+        return hnswlib::L2SqrToMetric;
+    }
+
+   private:
+    size_t dimension_;
+};
+
+template <typename half_t>
+class HalfInnerProductSpace : public hnswlib::SpaceInterface<float> {
+   public:
+    HalfInnerProductSpace(size_t dimension) : dimension_(dimension) {}
+
+    size_t get_data_size() { return dimension_ * sizeof(half_t); }
+
+    hnswlib::DISTFUNC<float> get_dist_func() {
+        return HalfInnerProduct<half_t>;
+    }
+
+    void* get_dist_func_param() { return &dimension_; }
+
+   private:
+    size_t dimension_;
+};
+
+// Cosine distance over half vectors normalized before conversion, see
+// hnswlib::CosineSpace.
+template <typename half_t>
+class HalfCosineSpace : public HalfInnerProductSpace<half_t> {
+   public:
+    HalfCosineSpace(size_t dimension)
+        : HalfInnerProductSpace<half_t>(dimension) {}
+
+    hnswlib::METRICFUNC<float> get_metric_func() {
+        return hnswlib::CosineToAngle;
+    }
+};
+
+}  // namespace fast_ann
+
+#endif  // FAST_ANN_QUANTIZERS_HALF_PRECISION_H_
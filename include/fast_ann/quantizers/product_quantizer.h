@@ -0,0 +1,208 @@
+#ifndef FAST_ANN_QUANTIZERS_PRODUCT_QUANTIZER_H_
+#define FAST_ANN_QUANTIZERS_PRODUCT_QUANTIZER_H_
+
+#include <stdint.h>
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#include "fast_ann/dataset.h"
+#include "hnswlib/hnswlib.h"
+
+namespace fast_ann {
+
+const size_t kProductQuantizerCentroids = 256;
+// Training runs k-means on at most this many vectors, spread evenly over
+// the dataset.
+const size_t kProductQuantizerTrainingSize = 16384;
+const int kProductQuantizerIterations = 8;
+
+// Product quantizer for squared L2 distances. Vectors are split into
+// code_size parts of equal dimension, each encoded in one byte as the
+// nearest of 256 centroids trained with k-means on that part. The distance
+// from a query to a code is a sum of code_size lookups in a table computed
+// once per query, see ComputeDistanceTable.
+class ProductQuantizer {
+   public:
+    ProductQuantizer() : dimension_(0), code_size_(0), sub_dimension_(0) {}
+
+    // code_size must divide the dimension of the dataset.
+    template <typename T>
+    void Train(Dataset<T>& dataset, size_t code_size) {
+        dimension_ = dataset.dimension();
+        if (code_size == 0 || dimension_ % code_size != 0) {
+            throw std::runtime_error(
+                "Product quantizer code size must divide the dimension");
+        }
+        code_size_ = code_size;
+        sub_dimension_ = dimension_ / code_size_;
+        size_t count = std::min<size_t>(dataset.size(),
+                                        kProductQuantizerTrainingSize);
+        std::vector<float> samples(count * dimension_);
+        for (size_t i = 0; i < count; i++) {
+            const T* vector =
+                dataset.item_at(i * dataset.size() / count).second;
+            for (DimensionType d = 0; d < dimension_; d++) {
+                samples[i * dimension_ + d] = (float)vector[d];
+            }
+        }
+        centroids_.assign(code_size_ * kProductQuantizerCentroids *
+                              sub_dimension_,
+                          0);
+        int num_parts = code_size_;
+#pragma omp parallel for schedule(dynamic)
+        for (int part = 0; part < num_parts; part++) {
+            TrainPart(samples, count, part);
+        }
+    }
+
+    template <typename T>
+    void Encode(const T* vector, uint8_t* code) const {
+        std::vector<float> sub(sub_dimension_);
+        for (size_t part = 0; part < code_size_; part++) {
+            for (size_t d = 0; d < sub_dimension_; d++) {
+                sub[d] = (float)vector[part * sub_dimension_ + d];
+            }
+            code[part] = (uint8_t)FindNearest(sub.data(), part);
+        }
+    }
+
+    // Fills table, of table_size() entries, with the squared distances from
+    // each part of query to the centroids of that part.
+    template <typename T>
+    void ComputeDistanceTable(const T* query, float* table) const {
+        for (size_t part = 0; part < code_size_; part++) {
+            for (size_t c = 0; c < kProductQuantizerCentroids; c++) {
+                const float* centroid = Centroid(part, c);
+                float dist = 0;
+                for (size_t d = 0; d < sub_dimension_; d++) {
+                    float diff =
+                        (float)query[part * sub_dimension_ + d] - centroid[d];
+                    dist += diff * diff;
+                }
+                table[part * kProductQuantizerCentroids + c] = dist;
+            }
+        }
+    }
+
+    inline float Distance(const float* table, const uint8_t* code) const {
+        float dist = 0;
+        for (size_t part = 0; part < code_size_; part++) {
+            dist += table[part * kProductQuantizerCentroids + code[part]];
+        }
+        return dist;
+    }
+
+    void Save(std::ostream& output) const {
+        hnswlib::writeBinaryPOD(output, dimension_);
+        hnswlib::writeBinaryPOD(output, code_size_);
+        output.write((const char*)centroids_.data(),
+                     centroids_.size() * sizeof(float));
+    }
+
+    void Load(std::istream& input) {
+        hnswlib::readBinaryPOD(input, dimension_);
+        hnswlib::readBinaryPOD(input, code_size_);
+        if (!input || code_size_ == 0 || dimension_ % code_size_ != 0) {
+            throw std::runtime_error("Invalid product quantizer");
+        }
+        sub_dimension_ = dimension_ / code_size_;
+        centroids_.resize(dimension_ * kProductQuantizerCentroids);
+        input.read((char*)centroids_.data(),
+                   centroids_.size() * sizeof(float));
+    }
+
+    inline DimensionType dimension() const { return dimension_; }
+
+    inline size_t code_size() const { return code_size_; }
+
+    inline size_t table_size() const {
+        return code_size_ * kProductQuantizerCentroids;
+    }
+
+    // Bytes of the centroids.
+    inline size_t memory_bytes() const {
+        return centroids_.capacity() * sizeof(float);
+    }
+
+   private:
+    inline const float* Centroid(size_t part, size_t c) const {
+        return centroids_.data() +
+               (part * kProductQuantizerCentroids + c) * sub_dimension_;
+    }
+
+    inline float* Centroid(size_t part, size_t c) {
+        return centroids_.data() +
+               (part * kProductQuantizerCentroids + c) * sub_dimension_;
+    }
+
+    size_t FindNearest(const float* sub, size_t part) const {
+        size_t nearest = 0;
+        float nearest_dist = std::numeric_limits<float>::max();
+        for (size_t c = 0; c < kProductQuantizerCentroids; c++) {
+            const float* centroid = Centroid(part, c);
+            float dist = 0;
+            for (size_t d = 0; d < sub_dimension_; d++) {
+                float diff = sub[d] - centroid[d];
+                dist += diff * diff;
+            }
+            if (dist < nearest_dist) {
+                nearest_dist = dist;
+                nearest = c;
+            }
+        }
+        return nearest;
+    }
+
+    // Lloyd iterations starting from samples spread over the training set.
+    // A centroid left without samples keeps its position.
+    void TrainPart(const std::vector<float>& samples, size_t count,
+                   size_t part) {
+        if (count == 0) {
+            return;
+        }
+        for (size_t c = 0; c < kProductQuantizerCentroids; c++) {
+            const float* sample =
+                samples.data() +
+                (c * count / kProductQuantizerCentroids) * dimension_ +
+                part * sub_dimension_;
+            std::copy(sample, sample + sub_dimension_, Centroid(part, c));
+        }
+        std::vector<float> sums(kProductQuantizerCentroids * sub_dimension_);
+        std::vector<size_t> counts(kProductQuantizerCentroids);
+        for (int iteration = 0; iteration < kProductQuantizerIterations;
+             iteration++) {
+            std::fill(sums.begin(), sums.end(), 0);
+            std::fill(counts.begin(), counts.end(), 0);
+            for (size_t i = 0; i < count; i++) {
+                const float* sub =
+                    samples.data() + i * dimension_ + part * sub_dimension_;
+                size_t c = FindNearest(sub, part);
+                counts[c]++;
+                for (size_t d = 0; d < sub_dimension_; d++) {
+                    sums[c * sub_dimension_ + d] += sub[d];
+                }
+            }
+            for (size_t c = 0; c < kProductQuantizerCentroids; c++) {
+                if (counts[c] == 0) {
+                    continue;
+                }
+                float* centroid = Centroid(part, c);
+                for (size_t d = 0; d < sub_dimension_; d++) {
+                    centroid[d] = sums[c * sub_dimension_ + d] / counts[c];
+                }
+            }
+        }
+    }
+
+    DimensionType dimension_;
+    size_t code_size_;
+    size_t sub_dimension_;
+    // code_size parts of 256 centroids of sub_dimension floats.
+    std::vector<float> centroids_;
+};
+
+}  // namespace fast_ann
+
+#endif  // FAST_ANN_QUANTIZERS_PRODUCT_QUANTIZER_H_
@@ -0,0 +1,152 @@
+#ifndef FAST_ANN_QUANTIZERS_SCALAR_QUANTIZER_H_
+#define FAST_ANN_QUANTIZERS_SCALAR_QUANTIZER_H_
+
+#include <stdint.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "fast_ann/dataset.h"
+#include "hnswlib/hnswlib.h"
+
+namespace fast_ann {
+
+const int kScalarQuantizerLevels = 255;
+
+// Per dimension 8 bit scalar quantizer. Each component is mapped linearly
+// from the [min, max] range observed during training onto [0, 255].
+class ScalarQuantizer {
+   public:
+    ScalarQuantizer() : dimension_(0) {}
+
+    template <typename T>
+    void Train(Dataset<T>& dataset) {
+        std::vector<float> max = StartTraining(dataset.dimension());
+        for (DatasetIndexType i = 0; i < dataset.size(); i++) {
+            Observe(dataset.item_at(i).second, max);
+        }
+        FinishTraining(max);
+    }
+
+    // The same over count vectors stored one after another.
+    void Train(const float* vectors, size_t count, DimensionType dimension) {
+        std::vector<float> max = StartTraining(dimension);
+        for (size_t i = 0; i < count; i++) {
+            Observe(vectors + i * dimension, max);
+        }
+        FinishTraining(max);
+    }
+
+    template <typename T>
+    void Encode(const T* vector, uint8_t* code) const {
+        for (DimensionType d = 0; d < dimension_; d++) {
+            if (scale_[d] == 0) {
+                code[d] = 0;
+                continue;
+            }
+            float level = std::round((vector[d] - min_[d]) / scale_[d]);
+            level = std::max(0.0f, std::min(level, (float)kScalarQuantizerLevels));
+            code[d] = (uint8_t)level;
+        }
+    }
+
+    void Decode(const uint8_t* code, float* vector) const {
+        for (DimensionType d = 0; d < dimension_; d++) {
+            vector[d] = min_[d] + code[d] * scale_[d];
+        }
+    }
+
+    void Save(std::ostream& output) const {
+        hnswlib::writeBinaryPOD(output, dimension_);
+        output.write((const char*)min_.data(), dimension_ * sizeof(float));
+        output.write((const char*)scale_.data(), dimension_ * sizeof(float));
+    }
+
+    void Load(std::istream& input) {
+        hnswlib::readBinaryPOD(input, dimension_);
+        min_.resize(dimension_);
+        scale_.resize(dimension_);
+        input.read((char*)min_.data(), dimension_ * sizeof(float));
+        input.read((char*)scale_.data(), dimension_ * sizeof(float));
+    }
+
+    inline DimensionType dimension() const { return dimension_; }
+
+    inline const float* scales() const { return scale_.data(); }
+
+    inline size_t code_size() const { return dimension_; }
+
+   private:
+    // Returns the running maximum per dimension.
+    std::vector<float> StartTraining(DimensionType dimension) {
+        dimension_ = dimension;
+        min_.assign(dimension_, std::numeric_limits<float>::max());
+        return std::vector<float>(dimension_,
+                                  std::numeric_limits<float>::lowest());
+    }
+
+    template <typename T>
+    void Observe(const T* ptr, std::vector<float>& max) {
+        for (DimensionType d = 0; d < dimension_; d++) {
+            min_[d] = std::min(min_[d], (float)ptr[d]);
+            max[d] = std::max(max[d], (float)ptr[d]);
+        }
+    }
+
+    void FinishTraining(const std::vector<float>& max) {
+        scale_.resize(dimension_);
+        for (DimensionType d = 0; d < dimension_; d++) {
+            scale_[d] = (max[d] - min_[d]) / kScalarQuantizerLevels;
+        }
+    }
+
+    DimensionType dimension_;
+    std::vector<float> min_;
+    std::vector<float> scale_;
+};
+
+// hnswlib space over codes produced by ScalarQuantizer. The minimum cancels
+// out in the difference, so only the per dimension scales are needed.
+class ScalarQuantizerL2Space : public hnswlib::SpaceInterface<float> {
+   public:
+    ScalarQuantizerL2Space(const ScalarQuantizer& quantizer) {
+        param_.dimension = quantizer.dimension();
+        param_.scales = quantizer.scales();
+    }
+
+    size_t get_data_size() { return param_.dimension; }
+
+    hnswlib::DISTFUNC<float> get_dist_func() { return L2SqrCodes; }
+
+    void* get_dist_func_param() { return &param_; }
+
+    hnswlib::METRICFUNC<float> get_metric_func() {
+        return hnswlib::L2SqrToMetric;
+    }
+
+   private:
+    struct Param {
+        size_t dimension;
+        const float* scales;
+    };
+
+    static float L2SqrCodes(const void* code_l, const void* code_r,
+                            const void* param_ptr) {
+        const Param* param = (const Param*)param_ptr;
+        const uint8_t* l = (const uint8_t*)code_l;
+        const uint8_t* r = (const uint8_t*)code_r;
+        float result = 0;
+        for (size_t d = 0; d < param->dimension; d++) {
+            float diff = ((int)l[d] - (int)r[d]) * param->scales[d];
+            result += diff * diff;
+        }
+        return result;
+    }
+
+    Param param_;
+};
+
+}  // namespace fast_ann
+
+#endif  // FAST_ANN_QUANTIZERS_SCALAR_QUANTIZER_H_
@@ -0,0 +1,239 @@
+#ifndef FAST_ANN_QUERY_CACHE_H_
+#define FAST_ANN_QUERY_CACHE_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "fast_ann/dataset.h"
+
+namespace fast_ann {
+
+// Counters of a QueryCache since it was created or its stats were reset.
+// Near hits are the hits on a different vector within the tolerance.
+struct QueryCacheStats {
+    QueryCacheStats()
+        : hits(0),
+          near_hits(0),
+          misses(0),
+          insertions(0),
+          evictions(0),
+          invalidations(0) {}
+
+    double HitRate() const {
+        return hits + misses == 0 ? 0 : (double)hits / (hits + misses);
+    }
+
+    size_t hits;
+    size_t near_hits;
+    size_t misses;
+    size_t insertions;
+    size_t evictions;
+    size_t invalidations;
+};
+
+// LRU cache of k-NN results, put in front of a search so that repeated
+// queries skip the traversal and, in the distributed search, the fan-out.
+// Queries are hashed after rounding their components to multiples of grid,
+// or bit for bit when grid is 0, and the entries are split over shards with
+// a lock each. A query hits an entry of its hash when it lies within
+// tolerance (L2) of the query cached there, or when it is the same vector if
+// tolerance is 0; near duplicates rounded into different cells miss. A near
+// hit returns the distances to the cached query. An entry for a larger k
+// also serves smaller ones.
+//
+// Invalidate, on any insertion or deletion in the index, drops every entry
+// at once by moving to a new epoch. Results are inserted with the epoch read
+// before they were searched, so that those of a search that overlapped an
+// invalidation are dropped.
+template <typename dist_t>
+class QueryCache {
+   public:
+    typedef std::priority_queue<std::pair<dist_t, DatasetIndexType> >
+        ResultType;
+
+    // capacity is the number of entries over all shards, 0 disables the
+    // cache.
+    QueryCache(DimensionType dimension, size_t capacity, dist_t grid = 0,
+               dist_t tolerance = 0, size_t num_shards = 16)
+        : dimension_(dimension),
+          grid_(grid),
+          tolerance_(tolerance),
+          shards_(std::max<size_t>(num_shards, 1)),
+          epoch_(0),
+          invalidations_(0) {
+        shard_capacity_ = (capacity + shards_.size() - 1) / shards_.size();
+        for (auto& shard : shards_) {
+            shard.reset(new Shard());
+        }
+    }
+
+    // Copies the cached result of query into result, keeping its k nearest.
+    bool Lookup(const dist_t* query, size_t k, ResultType& result) {
+        if (shard_capacity_ == 0) {
+            return false;
+        }
+        uint64_t hash = Hash(query);
+        Shard& shard = *shards_[hash % shards_.size()];
+        size_t epoch = epoch_.load(std::memory_order_acquire);
+        bool near = false;
+        {
+            std::unique_lock<std::mutex> lock(shard.guard);
+            auto found = shard.entries.find(hash);
+            if (found == shard.entries.end()) {
+                shard.stats.misses++;
+                return false;
+            }
+            Entry& entry = *found->second;
+            if (entry.epoch != epoch) {
+                shard.lru.erase(found->second);
+                shard.entries.erase(found);
+                shard.stats.misses++;
+                return false;
+            }
+            if (entry.k < k || !Matches(entry.query.data(), query, near)) {
+                shard.stats.misses++;
+                return false;
+            }
+            shard.lru.splice(shard.lru.begin(), shard.lru, found->second);
+            result = entry.result;
+            shard.stats.hits++;
+            shard.stats.near_hits += near;
+        }
+        while (result.size() > k) {
+            result.pop();
+        }
+        return true;
+    }
+
+    // The epoch to pass to Insert, read before searching.
+    size_t Epoch() const { return epoch_.load(std::memory_order_acquire); }
+
+    // Caches the result of the k-NN search of query started in epoch,
+    // replacing any entry of the same hash.
+    void Insert(const dist_t* query, size_t k, const ResultType& result,
+                size_t epoch) {
+        if (shard_capacity_ == 0 || epoch != Epoch()) {
+            return;
+        }
+        uint64_t hash = Hash(query);
+        Shard& shard = *shards_[hash % shards_.size()];
+        std::unique_lock<std::mutex> lock(shard.guard);
+        auto found = shard.entries.find(hash);
+        if (found != shard.entries.end()) {
+            shard.lru.erase(found->second);
+            shard.entries.erase(found);
+        } else if (shard.lru.size() >= shard_capacity_) {
+            shard.entries.erase(shard.lru.back().hash);
+            shard.lru.pop_back();
+            shard.stats.evictions++;
+        }
+        shard.lru.push_front(Entry());
+        Entry& entry = shard.lru.front();
+        entry.hash = hash;
+        entry.epoch = epoch;
+        entry.k = k;
+        entry.query.assign(query, query + dimension_);
+        entry.result = result;
+        shard.entries[hash] = shard.lru.begin();
+        shard.stats.insertions++;
+    }
+
+    // Drops every entry, their memory is reclaimed as they are evicted or
+    // looked up.
+    void Invalidate() {
+        epoch_.fetch_add(1, std::memory_order_acq_rel);
+        invalidations_++;
+    }
+
+    QueryCacheStats stats() const {
+        QueryCacheStats stats;
+        for (const auto& shard : shards_) {
+            std::unique_lock<std::mutex> lock(shard->guard);
+            stats.hits += shard->stats.hits;
+            stats.near_hits += shard->stats.near_hits;
+            stats.misses += shard->stats.misses;
+            stats.insertions += shard->stats.insertions;
+            stats.evictions += shard->stats.evictions;
+        }
+        stats.invalidations = invalidations_;
+        return stats;
+    }
+
+    void ResetStats() {
+        for (const auto& shard : shards_) {
+            std::unique_lock<std::mutex> lock(shard->guard);
+            shard->stats = QueryCacheStats();
+        }
+        invalidations_ = 0;
+    }
+
+   private:
+    struct Entry {
+        uint64_t hash;
+        size_t epoch;
+        size_t k;
+        std::vector<dist_t> query;
+        ResultType result;
+    };
+
+    // Counted under the lock of the shard, rather than in atomics shared by
+    // all threads.
+    struct Shard {
+        std::mutex guard;
+        QueryCacheStats stats;
+        std::list<Entry> lru;
+        std::unordered_map<uint64_t, typename std::list<Entry>::iterator>
+            entries;
+    };
+
+    uint64_t Hash(const dist_t* query) const {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (DimensionType d = 0; d < dimension_; d++) {
+            uint64_t cell;
+            if (grid_ > 0) {
+                cell = (uint64_t)(int64_t)std::floor(query[d] / grid_ + 0.5);
+            } else {
+                // -0 and 0 are the same query.
+                dist_t value = query[d] == 0 ? 0 : query[d];
+                cell = 0;
+                memcpy(&cell, &value, std::min(sizeof(value), sizeof(cell)));
+            }
+            hash = (hash ^ cell) * 0x100000001b3ULL;
+            hash ^= hash >> 29;
+        }
+        return hash;
+    }
+
+    bool Matches(const dist_t* cached, const dist_t* query,
+                 bool& near) const {
+        dist_t dist = 0;
+        for (DimensionType d = 0; d < dimension_; d++) {
+            dist_t diff = cached[d] - query[d];
+            dist += diff * diff;
+        }
+        near = dist > 0;
+        return dist <= tolerance_ * tolerance_;
+    }
+
+    DimensionType dimension_;
+    dist_t grid_;
+    dist_t tolerance_;
+    size_t shard_capacity_;
+    std::vector<std::unique_ptr<Shard> > shards_;
+    std::atomic<size_t> epoch_;
+    std::atomic<size_t> invalidations_;
+};
+
+}  // namespace fast_ann
+
+#endif  // FAST_ANN_QUERY_CACHE_H_
@@ -2,27 +2,52 @@
 #define FAST_ANN_SEARCH_ALGORITHM_H_
 
 #include <queue>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "fast_ann/dataset.h"
-#include "fast_ann/distance.h"
 
 namespace fast_ann {
 
-template <typename T, typename R, typename DIST>
+// Interface of the indexes built by CreateSearchAlgorithm, see
+// fast_ann/index_factory.h. Vectors and queries are float, stored one after
+// another, and are converted to the storage of the index. Calls are virtual
+// per batch only, the distances within a batch are inlined. Search can run
+// on several threads at once, the other calls need the index to themselves.
 class SearchAlgorithm {
    public:
-    typedef std::priority_queue<std::pair<R, DatasetIndexType> > ResultType;
+    typedef std::priority_queue<std::pair<float, DatasetIndexType> >
+        ResultType;
 
-    SearchAlgorithm(Dataset<T>& dataset, int k) : dataset_(dataset), k_(k) {
-        dist_func_ = new DIST();
-    }
+    virtual ~SearchAlgorithm() {}
 
-    virtual ResultType Search(const T* query_ptr) = 0;
+    // Adds count vectors with the given ids.
+    virtual void Add(const float* vectors, const DatasetIndexType* ids,
+                     size_t count) = 0;
 
-   protected:
-    Dataset<T> dataset_;
-    int k_;
-    Distance<T, R>* dist_func_;
+    // The k nearest neighbors of each of count queries.
+    virtual std::vector<ResultType> Search(const float* queries, size_t count,
+                                           size_t k) = 0;
+
+    virtual void Save(const std::string& file_name) = 0;
+
+    // Replaces the contents of the index by those saved by an index of the
+    // same description.
+    virtual void Load(const std::string& file_name) = 0;
+
+    // Sets a search option such as ef, returns false if the index has none
+    // of that name.
+    virtual bool SetOption(const std::string& name, size_t value) = 0;
+
+    virtual size_t size() const = 0;
+
+    virtual DimensionType dimension() const = 0;
+
+    // Bytes allocated by the index for its vectors or codes, ids and
+    // structure, over its whole capacity. Caches and scratch buffers of the
+    // searches are left out.
+    virtual size_t memory_bytes() const = 0;
 };
 
 }  // namespace fast_ann
@@ -0,0 +1,314 @@
+#ifndef FAST_ANN_SEARCH_ALGORITHMS_TIERED_HNSW_SEARCH_H_
+#define FAST_ANN_SEARCH_ALGORITHMS_TIERED_HNSW_SEARCH_H_
+
+#include <stdint.h>
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <queue>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "fast_ann/dataset.h"
+#include "fast_ann/quantizers/product_quantizer.h"
+#include "fast_ann/search_stats.h"
+#include "fast_ann/storage/vector_file.h"
+#include "hnswlib/hnswlib.h"
+
+namespace fast_ann {
+
+const size_t kTieredDefaultBeamWidth = 4;
+const size_t kTieredDefaultEf = 100;
+
+// Graph index split over two tiers, in the manner of DiskANN. Only product
+// quantized codes and dataset ids stay in memory. The level 0 graph of an
+// HNSW index built over the full vectors is stored on SSD, each node in the
+// VectorFile record of its vector, and the index is freed once written. The
+// vectors are stored as data_t, e.g. Float16 with a half precision space,
+// and queries are given as data_t.
+//
+// A search keeps the ef nearest nodes found by code distance. Each step
+// reads the records of the beam width nearest ones not read yet in one
+// batch, whose reads run concurrently, computes their exact distances and
+// adds their neighbors. It ends when the ef nearest nodes are all read, the
+// results are the k nearest read nodes.
+//
+// Memory per element is the code and the dataset id, 36 bytes with the
+// default code of a byte per 4 dimensions at 128 dimensions, 5% of the 712
+// bytes a float HNSW index with M = 16 takes, see memory_bytes.
+template <typename dist_t, typename data_t = dist_t>
+class TieredHNSWSearch {
+   public:
+    typedef std::priority_queue<std::pair<dist_t, DatasetIndexType> >
+        ResultType;
+
+    // A code_size of 0 takes the largest divisor of the dimension up to a
+    // quarter of it. Larger codes rank the nodes better and need a smaller ef
+    // for the same recall.
+    TieredHNSWSearch(hnswlib::SpaceInterface<dist_t>* s,
+                     Dataset<data_t> dataset,
+                     const std::string& vector_file_name, size_t M = 16,
+                     size_t ef_construction = 200, size_t code_size = 0)
+        : beam_width_(kTieredDefaultBeamWidth),
+          ef_(kTieredDefaultEf),
+          entry_point_(-1) {
+        fstdistfunc_ = s->get_dist_func();
+        dist_func_param_ = s->get_dist_func_param();
+        if (code_size == 0) {
+            code_size = GetDefaultCodeSize(dataset.dimension());
+        }
+        quantizer_.Train(dataset, code_size);
+        ids_.resize(dataset.size());
+        codes_.resize(dataset.size() * code_size);
+        for (DatasetIndexType i = 0; i < dataset.size(); i++) {
+            ids_[i] = dataset.item_at(i).first;
+            quantizer_.Encode(dataset.item_at(i).second,
+                              codes_.data() + i * code_size);
+        }
+        WriteGraph(s, dataset, vector_file_name, M, ef_construction);
+        vector_file_.reset(new VectorFile<data_t>(vector_file_name));
+    }
+
+    TieredHNSWSearch(hnswlib::SpaceInterface<dist_t>* s,
+                     const std::string& index_file_name,
+                     const std::string& vector_file_name)
+        : beam_width_(kTieredDefaultBeamWidth), ef_(kTieredDefaultEf) {
+        fstdistfunc_ = s->get_dist_func();
+        dist_func_param_ = s->get_dist_func_param();
+        std::ifstream input(index_file_name, std::ios::binary);
+        if (!input) {
+            throw std::runtime_error("Cannot open index file " +
+                                     index_file_name);
+        }
+        quantizer_.Load(input);
+        size_t size;
+        hnswlib::readBinaryPOD(input, size);
+        hnswlib::readBinaryPOD(input, entry_point_);
+        if (!input) {
+            throw std::runtime_error("Truncated index file " +
+                                     index_file_name);
+        }
+        ids_.resize(size);
+        codes_.resize(size * quantizer_.code_size());
+        input.read((char*)ids_.data(), size * sizeof(DatasetIndexType));
+        input.read((char*)codes_.data(), codes_.size());
+        if (!input) {
+            throw std::runtime_error("Truncated index file " +
+                                     index_file_name);
+        }
+        vector_file_.reset(new VectorFile<data_t>(vector_file_name));
+        if ((size_t)vector_file_->size() != size ||
+            (size > 0 && vector_file_->max_neighbors() == 0)) {
+            throw std::runtime_error("Vector file " + vector_file_name +
+                                     " does not match the index");
+        }
+    }
+
+    TieredHNSWSearch(const TieredHNSWSearch&) = delete;
+    TieredHNSWSearch& operator=(const TieredHNSWSearch&) = delete;
+
+    // The vector file, graph included, is written by the constructor and
+    // referenced by path, only the codes and id mapping are saved here.
+    void saveIndex(const std::string& index_file_name) {
+        std::ofstream output(index_file_name, std::ios::binary);
+        if (!output) {
+            throw std::runtime_error("Cannot create index file " +
+                                     index_file_name);
+        }
+        quantizer_.Save(output);
+        size_t size = ids_.size();
+        hnswlib::writeBinaryPOD(output, size);
+        hnswlib::writeBinaryPOD(output, entry_point_);
+        output.write((const char*)ids_.data(),
+                     size * sizeof(DatasetIndexType));
+        output.write((const char*)codes_.data(), codes_.size());
+        output.flush();
+        if (!output) {
+            throw std::runtime_error("Failed writing index file " +
+                                     index_file_name);
+        }
+    }
+
+    // The filter is applied to dataset ids, rejected nodes are still read to
+    // reach their neighbors. Choosing the beam and scoring codes is reported
+    // as routing, the record reads as remote wait and the exact distances as
+    // merge.
+    ResultType searchKnn(const data_t* query_ptr, size_t k,
+                         const hnswlib::BaseFilterFunctor* filter = nullptr,
+                         SearchStats* stats = nullptr) {
+        FAST_ANN_STATS_TIMER(timer);
+        ResultType result;
+        if (entry_point_ < 0 || k == 0) {
+            return result;
+        }
+        std::vector<float> table(quantizer_.table_size());
+        quantizer_.ComputeDistanceTable(query_ptr, table.data());
+        size_t list_size = std::max(ef_, k);
+        std::vector<Candidate> candidates;
+        std::unordered_set<DatasetIndexType> seen;
+        AddCandidate(table, entry_point_, list_size, candidates, seen);
+        DimensionType dim = vector_file_->dimension();
+        std::vector<DatasetIndexType> beam;
+        std::vector<data_t> vectors;
+        std::vector<std::vector<DatasetIndexType> > neighbors;
+        while (true) {
+            beam.clear();
+            for (Candidate& candidate : candidates) {
+                if (!candidate.read) {
+                    candidate.read = true;
+                    beam.push_back(candidate.position);
+                    if (beam.size() == beam_width_) {
+                        break;
+                    }
+                }
+            }
+            if (beam.empty()) {
+                break;
+            }
+            FAST_ANN_STATS_LAP(stats, routing_micros, timer);
+            vectors.resize(beam.size() * dim);
+            vector_file_->ReadBatch(beam, vectors.data(), &neighbors);
+            FAST_ANN_STATS_LAP(stats, remote_wait_micros, timer);
+            FAST_ANN_STATS_ADD(stats, base_layer_hops, 1);
+            FAST_ANN_STATS_ADD(stats, visited_nodes, beam.size());
+            FAST_ANN_STATS_ADD(stats, distance_computations, beam.size());
+
+            for (size_t i = 0; i < beam.size(); i++) {
+                DatasetIndexType id = ids_[beam[i]];
+                if (filter != nullptr && !(*filter)(id)) {
+                    continue;
+                }
+                dist_t dist = fstdistfunc_(query_ptr, vectors.data() + i * dim,
+                                           dist_func_param_);
+                if (result.size() < k || dist < result.top().first) {
+                    result.push({dist, id});
+                    if (result.size() > k) {
+                        result.pop();
+                    }
+                }
+            }
+            FAST_ANN_STATS_LAP(stats, merge_micros, timer);
+            for (const std::vector<DatasetIndexType>& list : neighbors) {
+                for (DatasetIndexType neighbor : list) {
+                    if (AddCandidate(table, neighbor, list_size, candidates,
+                                     seen)) {
+                        FAST_ANN_STATS_ADD(stats, distance_computations, 1);
+                    }
+                }
+            }
+        }
+        FAST_ANN_STATS_LAP(stats, routing_micros, timer);
+        return result;
+    }
+
+    // Records read per step, and so concurrently, by a search.
+    void set_beam_width(size_t beam_width) {
+        beam_width_ = std::max<size_t>(beam_width, 1);
+    }
+
+    // Nodes kept by a search, at least k.
+    void set_ef(size_t ef) { ef_ = ef; }
+
+    // Bytes kept in memory, the codes, ids and centroids. The graph and the
+    // vectors are on SSD.
+    size_t memory_bytes() const {
+        return codes_.capacity() +
+               ids_.capacity() * sizeof(DatasetIndexType) +
+               quantizer_.memory_bytes();
+    }
+
+   private:
+    // A node found by a search, nearest first by code distance.
+    struct Candidate {
+        float dist;
+        DatasetIndexType position;
+        bool read;
+
+        bool operator<(const Candidate& other) const {
+            return dist < other.dist;
+        }
+    };
+
+    static size_t GetDefaultCodeSize(DimensionType dimension) {
+        size_t code_size = std::max(dimension / 4, 1);
+        while (dimension % code_size != 0) {
+            code_size--;
+        }
+        return code_size;
+    }
+
+    // Builds the HNSW index over the vectors and writes them, each with its
+    // level 0 neighbors, in dataset order. Graph positions are the labels.
+    void WriteGraph(hnswlib::SpaceInterface<dist_t>* s,
+                    Dataset<data_t>& dataset,
+                    const std::string& vector_file_name, size_t M,
+                    size_t ef_construction) {
+        hnswlib::HierarchicalNSW<dist_t> graph(s, dataset.size(), M,
+                                               ef_construction);
+        for (DatasetIndexType i = 0; i < dataset.size(); i++) {
+            graph.addPoint(dataset.item_at(i).second, i);
+        }
+        std::vector<hnswlib::tableint> internal_ids(dataset.size());
+        for (size_t id = 0; id < graph.cur_element_count; id++) {
+            internal_ids[graph.getExternalLabel(id)] = id;
+        }
+        if (dataset.size() > 0) {
+            entry_point_ = graph.getExternalLabel(graph.getEnterPoint());
+        }
+        std::vector<hnswlib::tableint> links(graph.maxM0_ + 1);
+        VectorFile<data_t>::Write(
+            vector_file_name, dataset, graph.maxM0_,
+            [&](DatasetIndexType position,
+                std::vector<DatasetIndexType>& list) {
+                size_t size =
+                    graph.readLinkList(internal_ids[position], 0, links.data());
+                for (size_t i = 0; i < size; i++) {
+                    list.push_back(graph.getExternalLabel(links[i]));
+                }
+            });
+    }
+
+    // Adds the node if it was not seen and is among the list_size nearest,
+    // returns whether it was scored.
+    bool AddCandidate(const std::vector<float>& table,
+                      DatasetIndexType position, size_t list_size,
+                      std::vector<Candidate>& candidates,
+                      std::unordered_set<DatasetIndexType>& seen) const {
+        if (!seen.insert(position).second) {
+            return false;
+        }
+        Candidate candidate;
+        candidate.dist = quantizer_.Distance(
+            table.data(), codes_.data() + position * quantizer_.code_size());
+        candidate.position = position;
+        candidate.read = false;
+        if (candidates.size() == list_size &&
+            !(candidate < candidates.back())) {
+            return true;
+        }
+        candidates.insert(std::upper_bound(candidates.begin(),
+                                           candidates.end(), candidate),
+                          candidate);
+        if (candidates.size() > list_size) {
+            candidates.pop_back();
+        }
+        return true;
+    }
+
+    size_t beam_width_;
+    size_t ef_;
+    ProductQuantizer quantizer_;
+    // The codes of the vectors, in dataset order.
+    std::vector<uint8_t> codes_;
+    std::vector<DatasetIndexType> ids_;
+    // Position of the entry point of the HNSW index, -1 when empty.
+    DatasetIndexType entry_point_;
+    std::unique_ptr<VectorFile<data_t> > vector_file_;
+    hnswlib::DISTFUNC<dist_t> fstdistfunc_;
+    void* dist_func_param_;
+};
+
+}  // namespace fast_ann
+
+#endif  // FAST_ANN_SEARCH_ALGORITHMS_TIERED_HNSW_SEARCH_H_
@@ -2,71 +2,208 @@
 #define FAST_ANN_SEARCH_ALGORITHMS_VP_TREE_HNSW_SEARCH_H_
 
 #include <mpi.h>
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <vector>
 
 #include "fast_ann/dataset.h"
+#include "fast_ann/query_cache.h"
+#include "fast_ann/search_stats.h"
 #include "hnswlib/hnswlib.h"
 
 namespace fast_ann {
 
+// Number of results per message when shards stream range search results.
+const size_t kRangeChunkSize = 1024;
+
+// Messages from the last rank with this tag end the current query, the tags
+// above it carry a query for shard tag - kShardTagBase.
+const int kEndQueryTag = 1;
+const int kShardTagBase = 2;
+
+// A rank loaded above the mean by more than this factor is rebalanced.
+const double kRebalanceImbalance = 1.1;
+
+// How the last rank picks among the replicas of a shard: in turn, or the
+// rank it sent the fewest queries lately.
+enum ShardRouting { ROUND_ROBIN = 0, LEAST_LOADED = 1 };
+
+// The last rank holds the top of a vantage point tree whose leaves are
+// shards, HNSW indexes each held by one or more of the other ranks. Any
+// number of ranks and shards works, a single rank holds every shard itself.
+// The last rank counts the queries it routes to each shard, Rebalance then
+// moves shards from the busiest ranks to the idlest ones and copies those
+// too hot for any single rank.
 template <typename dist_t>
 class VPTreeHNSWSearch {
    public:
     typedef std::priority_queue<std::pair<dist_t, DatasetIndexType> >
         ResultType;
 
+    // M and ef_construction configure the HNSW index of each shard. There is
+    // one shard per rank but the last when num_shards is 0, they are spread
+    // round robin over those ranks.
     VPTreeHNSWSearch(hnswlib::SpaceInterface<dist_t>* s,
-                     Dataset<dist_t> dataset)
-        : dataset_(dataset) {
+                     Dataset<dist_t> dataset, size_t M = 16,
+                     size_t ef_construction = 200, size_t num_shards = 0)
+        : M_(M),
+          ef_construction_(ef_construction),
+          ef_(0),
+          dataset_(dataset),
+          space_(s),
+          root_(-1),
+          query_cache_(nullptr),
+          routing_(ROUND_ROBIN),
+          max_replicas_(1),
+          rebalance_interval_(0),
+          num_queries_(0) {
         std::random_device rd;
         rng_.seed(rd());
         fstdistfunc_ = s->get_dist_func();
         dist_func_param_ = s->get_dist_func_param();
+        metricfunc_ = s->get_metric_func();
         MPI_Comm_rank(MPI_COMM_WORLD, &rank_);
         MPI_Comm_size(MPI_COMM_WORLD, &num_procs_);
-        levels_ = std::log2(num_procs_ - 1);
-        if (rank_ == 0) {
-            LOG_DEBUG("Num levels : " << levels_);
-        }
         dim_ = dataset.dimension();
-        nodes_.reserve(2 * num_procs_ - 1);
-        ConstructVPTree(0, dataset_.size(), 0, 0);
+        num_shards_ =
+            num_shards > 0 ? (int)num_shards : std::max(num_procs_ - 1, 1);
+        int* tag_upper_bound;
+        int found;
+        MPI_Comm_get_attr(MPI_COMM_WORLD, MPI_TAG_UB, &tag_upper_bound,
+                          &found);
+        if (found && kShardTagBase + num_shards_ - 1 > *tag_upper_bound) {
+            throw std::runtime_error("Too many shards for the MPI tags");
+        }
+        shard_ranks_.resize(num_shards_);
+        shard_ranges_.assign(num_shards_, std::make_pair(0, 0));
+        shard_load_.assign(num_shards_, 0);
+        rank_load_.assign(num_procs_, 0);
+        next_replica_.assign(num_shards_, 0);
+        local_shards_.resize(num_shards_);
         if (rank_ == num_procs_ - 1) {
-            MPI_Waitall(mpi_reqs_.size(), mpi_reqs_.data(),
-                        new MPI_Status[mpi_reqs_.size()]);
-            mpi_reqs_.clear();
+            LOG_DEBUG("Num shards : " << num_shards_);
+            nodes_.reserve(2 * num_shards_ - 1);
+            root_ = ConstructVPTree(0, dataset_.size(), 0, num_shards_);
+            std::vector<int> hosts = Hosts();
+            for (int shard = 0; shard < num_shards_; shard++) {
+                shard_ranks_[shard].push_back(hosts[shard % hosts.size()]);
+            }
         }
+        BroadcastPlacement();
+        ApplyPlacement(std::vector<std::vector<int> >(num_shards_));
     }
 
-    ResultType searchKnn(const dist_t* query_ptr, size_t k) {
+    // Must be called on every rank for every query. The last rank routes the
+    // query through the top of the tree and returns the merged result, the
+    // other ranks search their shards when asked and return nothing. Stats
+    // cover the work done on the calling rank.
+    ResultType searchKnn(const dist_t* query_ptr, size_t k,
+                         SearchStats* stats = nullptr) {
         ResultType result;
-        tau_ = std::numeric_limits<dist_t>::max();
-        SearchNode(query_ptr, nodes_[0], result, 0, 0, k);
-        int num_sent = mpi_reqs_.size();
-        if (!mpi_reqs_.empty()) {
-            MPI_Waitall(mpi_reqs_.size(), mpi_reqs_.data(),
-                        new MPI_Status[mpi_reqs_.size()]);
+        if (rank_ != num_procs_ - 1) {
+            ServeQueries(k, stats);
+        } else {
+            RouteQuery(query_ptr, k, result, stats);
         }
-        mpi_reqs_.clear();
+        CountQuery();
+        return result;
+    }
+
+    // Range search counterpart of searchKnn, with the same calling rules.
+    // The last rank passes the items within radius of the query to
+    // callback(dist, id) as they arrive from the shards, at most
+    // max_results of them, and returns their number.
+    template <typename Callback>
+    size_t searchRange(const dist_t* query_ptr, dist_t radius,
+                       size_t max_results, Callback callback,
+                       SearchStats* stats = nullptr) {
+        size_t num_results = 0;
+        if (rank_ != num_procs_ - 1) {
+            ServeRangeQueries(radius, max_results, stats);
+        } else {
+            num_results = RouteRangeQuery(query_ptr, radius, max_results,
+                                          callback, stats);
+        }
+        CountQuery();
+        return num_results;
+    }
+
+    // Sets ef of the shard searches, only has an effect on the ranks
+    // holding shards.
+    void set_ef(size_t ef) {
+        ef_ = ef;
+        for (auto& shard : local_shards_) {
+            if (shard) {
+                shard->setEf(ef);
+            }
+        }
+        if (query_cache_ != nullptr) {
+            query_cache_->Invalidate();
+        }
+    }
+
+    // The last rank answers the k-NN queries found in cache without
+    // involving the shards, the other ranks are only told that the query is
+    // over. The cache is not owned, nullptr removes it.
+    void set_query_cache(QueryCache<dist_t>* cache) { query_cache_ = cache; }
+
+    // Only used by the last rank.
+    void set_routing(ShardRouting routing) { routing_ = routing; }
+
+    // Most ranks Rebalance copies a hot shard to, 1 only moves shards. Only
+    // used by the last rank.
+    void set_max_replicas(size_t max_replicas) {
+        max_replicas_ = std::max<size_t>(max_replicas, 1);
+    }
+
+    // Rebalances after every interval queries, never when 0. Must be the
+    // same on every rank.
+    void set_rebalance_interval(size_t interval) {
+        rebalance_interval_ = interval;
+    }
+
+    // Must be called on every rank between queries. The last rank plans
+    // with the load seen since the previous call, older load counting half
+    // as much each time, and sends the shards to their new ranks, which
+    // build their indexes before returning. Results stay the same.
+    void Rebalance() {
+        std::vector<std::vector<int> > old_ranks = shard_ranks_;
         if (rank_ == num_procs_ - 1) {
-            float dummy = 0;
-            for (int i = 0; i < rank_; i++) {
-                MPI_Send(&dummy, 1, MPI_FLOAT, i, 1, MPI_COMM_WORLD);
+            shard_ranks_ = PlanPlacement();
+            for (double& load : shard_load_) {
+                load /= 2;
             }
-            std::pair<dist_t, size_t>* data = new std::pair<dist_t, size_t>[k];
-            MPI_Status status;
-            while (num_sent--) {
-                MPI_Recv(data, sizeof(std::pair<dist_t, size_t>) * k, MPI_BYTE,
-                         MPI_ANY_SOURCE, 1, MPI_COMM_WORLD, &status);
-                for (int i = 0; i < k; i++) {
-                    result.push(*data);
-                    data += 1;
-                }
-                while (result.size() > k) {
-                    result.pop();
-                }
+            for (double& load : rank_load_) {
+                load /= 2;
             }
         }
-        return result;
+        BroadcastPlacement();
+        ApplyPlacement(old_ranks);
+    }
+
+    // Ranks holding each shard, the same on every rank.
+    const std::vector<std::vector<int> >& shard_ranks() const {
+        return shard_ranks_;
+    }
+
+    // Queries routed to each shard, decayed at every rebalance. Only counted
+    // by the last rank.
+    const std::vector<double>& shard_loads() const { return shard_load_; }
+
+    // Bytes allocated on this rank for the tree and the shard indexes held
+    // here, with the vectors of their items. The vectors routed from the
+    // dataset, owned by the caller, are left out.
+    size_t memory_bytes() const {
+        size_t bytes = nodes_.capacity() * sizeof(VPTreeNode);
+        for (const auto& shard : local_shards_) {
+            if (shard) {
+                bytes += shard->getMemoryBytes();
+            }
+        }
+        return bytes;
     }
 
    private:
@@ -75,6 +212,7 @@ class VPTreeHNSWSearch {
             : data_pos(data_pos_t), left(-1), right(-1) {}
 
         DatasetIndexType data_pos;
+        // In the metric of the space, as is tau_.
         dist_t threshold;
         DatasetIndexType left;
         DatasetIndexType right;
@@ -98,138 +236,585 @@ class VPTreeHNSWSearch {
                                      dist_func_param_);
     }
 
+    // Splits [lower, upper) into num_shards shards numbered from
+    // first_shard, children below -1 are shards. Each vantage point splits
+    // its items in proportion to the shards on either side. Shards left
+    // without items are never searched.
     DatasetIndexType ConstructVPTree(DatasetIndexType lower,
-                                     DatasetIndexType upper, int level,
-                                     int id) {
-        if (rank_ != num_procs_ - 1) {
-            Dataset<dist_t>* local_dataset_ =
-                Dataset<dist_t>::recvData(num_procs_ - 1, dim_);
-            local_algorithm_ = new hnswlib::HierarchicalNSW<dist_t>(
-                new hnswlib::L2Space(local_dataset_->dimension()),
-                local_dataset_->size());
-            for (int i = 0; i < local_dataset_->size(); i++) {
-                local_algorithm_->addPoint(local_dataset_->item_at(i).second,
-                                           i);
-            }
-            return 0;
-        }
+                                     DatasetIndexType upper, int first_shard,
+                                     int num_shards) {
         if (lower >= upper) {
             return -1;
+        } else if (num_shards == 1) {
+            shard_ranges_[first_shard] = std::make_pair(lower, upper);
+            return -2 - first_shard;
         } else if (lower + 1 == upper) {
             return MakeVPTreeNode(lower);
-        } else {
-            if (level == levels_) {
-                Dataset<dist_t>* local_dataset_ =
-                    dataset_.GetSubset(lower, upper);
-                MPI_Request req;
-                local_dataset_->sendData(id, req);
-                mpi_reqs_.push_back(req);
-                return -2 - id;
-                /**
-                if (rank_ == id) {
-                    Dataset<dist_t>* local_dataset_ = dataset_.GetSubset(lower,
-                upper); local_algorithm_ = new
-                hnswlib::HierarchicalNSW<dist_t>(new
-                hnswlib::L2Space(local_dataset_->dimension()),
-                local_dataset_->size()); for (int i=0; i<local_dataset_->size();
-                i++) {
-                        local_algorithm_->addPoint(local_dataset_->item_at(i).second,
-                i);
+        }
+        SelectVPTreeRoot(lower, upper);
+        int num_left = num_shards / 2;
+        DatasetIndexType pos =
+            lower + 1 +
+            (DatasetIndexType)((int64_t)(upper - lower - 1) * num_left /
+                               num_shards);
+        PartitionByDistance(lower, pos, upper);
+        auto node_pos = MakeVPTreeNode(lower);
+        nodes_[node_pos].threshold = ToMetric(
+            fstdistfunc_(dataset_.item_at(lower).second,
+                         dataset_.item_at(pos).second, dist_func_param_));
+        DatasetIndexType left =
+            ConstructVPTree(lower + 1, pos, first_shard, num_left);
+        nodes_[node_pos].left = left;
+        DatasetIndexType right = ConstructVPTree(
+            pos, upper, first_shard + num_left, num_shards - num_left);
+        nodes_[node_pos].right = right;
+        return node_pos;
+    }
+
+    // Ranks that hold shards, all but the last one unless it is alone.
+    std::vector<int> Hosts() const {
+        std::vector<int> hosts;
+        for (int rank = 0; rank < num_procs_ - 1; rank++) {
+            hosts.push_back(rank);
+        }
+        if (hosts.empty()) {
+            hosts.push_back(rank_);
+        }
+        return hosts;
+    }
+
+    // Sends shard_ranks_ from the last rank to the others.
+    void BroadcastPlacement() {
+        std::vector<int> placement;
+        if (rank_ == num_procs_ - 1) {
+            for (const auto& ranks : shard_ranks_) {
+                placement.push_back(ranks.size());
+                placement.insert(placement.end(), ranks.begin(), ranks.end());
+            }
+        }
+        int size = placement.size();
+        MPI_Bcast(&size, 1, MPI_INT, num_procs_ - 1, MPI_COMM_WORLD);
+        placement.resize(size);
+        MPI_Bcast(placement.data(), size, MPI_INT, num_procs_ - 1,
+                  MPI_COMM_WORLD);
+        if (rank_ != num_procs_ - 1) {
+            size_t pos = 0;
+            for (int shard = 0; shard < num_shards_; shard++) {
+                int num_ranks = placement[pos++];
+                shard_ranks_[shard].assign(placement.begin() + pos,
+                                           placement.begin() + pos + num_ranks);
+                pos += num_ranks;
+            }
+        }
+    }
+
+    // Brings the shards held here in line with shard_ranks_, which was
+    // old_ranks before. The last rank sends the items of every new replica
+    // in shard order, and each rank receives all of its own before building
+    // them, so that the builds on different ranks overlap.
+    void ApplyPlacement(const std::vector<std::vector<int> >& old_ranks) {
+        std::vector<std::pair<int, Dataset<dist_t>*> > received;
+        for (int shard = 0; shard < num_shards_; shard++) {
+            const std::vector<int>& ranks = shard_ranks_[shard];
+            const std::vector<int>& old = old_ranks[shard];
+            for (int rank : ranks) {
+                if (std::find(old.begin(), old.end(), rank) != old.end()) {
+                    continue;
+                }
+                if (rank_ == num_procs_ - 1) {
+                    Dataset<dist_t>* items =
+                        dataset_.GetSubset(shard_ranges_[shard].first,
+                                           shard_ranges_[shard].second);
+                    if (rank == rank_) {
+                        BuildShard(shard, items);
+                    } else {
+                        items->sendData(rank);
                     }
-                    return -2 - id;
+                    delete items;
+                } else if (rank == rank_) {
+                    received.push_back(std::make_pair(
+                        shard,
+                        Dataset<dist_t>::recvData(num_procs_ - 1, dim_)));
                 }
-                return -1;
-                **/
             }
-            SelectVPTreeRoot(lower, upper);
-            DatasetIndexType median = (upper + lower) / 2;
-            PartitionByDistance(lower, median, upper);
-            auto node_pos = MakeVPTreeNode(lower);
-            nodes_[node_pos].threshold =
-                fstdistfunc_(dataset_.item_at(lower).second,
-                             dataset_.item_at(median).second, dist_func_param_);
-            nodes_[node_pos].left =
-                ConstructVPTree(lower + 1, median, level + 1, 2 * id);
-            nodes_[node_pos].right =
-                ConstructVPTree(median, upper, level + 1, 2 * id + 1);
-            return node_pos;
+            if (std::find(ranks.begin(), ranks.end(), rank_) == ranks.end()) {
+                local_shards_[shard].reset();
+            }
+        }
+        for (auto& shard : received) {
+            BuildShard(shard.first, shard.second);
+            if (shard.second->size() > 0) {
+                delete[] shard.second->item_at(0).second;
+            }
+            delete shard.second;
         }
     }
 
-    void SearchNode(const dist_t* query_ptr, const VPTreeNode& node,
-                    ResultType& result, int level, int id, size_t k) {
-        /**
-        if (level == levels_ && id == rank_) {
-            auto lrs = local_algorithm_->searchKnn(query_ptr, k);
-            while (!lrs.empty()) {
-                result.push(lrs.top());
-                lrs.pop();
-            }
-            while (result.size() > k) {
-                result.pop();
-            }
+    void BuildShard(int shard, Dataset<dist_t>* items) {
+        if (items->size() == 0) {
             return;
         }
-        **/
-        if (rank_ != num_procs_ - 1) {
-            while (true) {
-                MPI_Status status;
-                int msg_size;
-                MPI_Probe(num_procs_ - 1, 1, MPI_COMM_WORLD, &status);
-                MPI_Get_count(&status, MPI_FLOAT, &msg_size);
-                if (msg_size < dim_) {
-                    return;
+        local_shards_[shard].reset(new hnswlib::HierarchicalNSW<dist_t>(
+            space_, items->size(), M_, ef_construction_));
+        // Labels are the global ids, so that results need no mapping.
+        for (int i = 0; i < items->size(); i++) {
+            local_shards_[shard]->addPoint(items->item_at(i).second,
+                                           items->item_at(i).first);
+        }
+        if (ef_ > 0) {
+            local_shards_[shard]->setEf(ef_);
+        }
+    }
+
+    // Greedy plan from the current placement, the load of a shard split
+    // evenly over its replicas. Replicas of shards that cooled down are
+    // dropped first. Then, while the busiest rank is above the mean, its
+    // hottest shard is copied to the idlest rank if it alone is above the
+    // mean, otherwise the shard that best evens out the two ranks moves.
+    std::vector<std::vector<int> > PlanPlacement() const {
+        std::vector<std::vector<int> > ranks = shard_ranks_;
+        std::vector<int> hosts = Hosts();
+        double total = 0;
+        for (double load : shard_load_) {
+            total += load;
+        }
+        if (hosts.size() < 2 || total == 0) {
+            return ranks;
+        }
+        double mean = total / hosts.size();
+        std::vector<double> rank_load(num_procs_);
+        auto share = [&](int shard) {
+            return shard_load_[shard] / ranks[shard].size();
+        };
+        auto compute_loads = [&]() {
+            std::fill(rank_load.begin(), rank_load.end(), 0);
+            for (int shard = 0; shard < num_shards_; shard++) {
+                for (int rank : ranks[shard]) {
+                    rank_load[rank] += share(shard);
+                }
+            }
+        };
+        compute_loads();
+        for (int shard = 0; shard < num_shards_; shard++) {
+            while (ranks[shard].size() > 1 &&
+                   shard_load_[shard] / (ranks[shard].size() - 1) <=
+                       mean / 2) {
+                ranks[shard].erase(std::max_element(
+                    ranks[shard].begin(), ranks[shard].end(),
+                    [&](int a, int b) { return rank_load[a] < rank_load[b]; }));
+                compute_loads();
+            }
+        }
+        for (int step = 0; step < num_shards_; step++) {
+            int hot = hosts[0], cold = hosts[0];
+            for (int rank : hosts) {
+                if (rank_load[rank] > rank_load[hot]) {
+                    hot = rank;
+                }
+                if (rank_load[rank] < rank_load[cold]) {
+                    cold = rank;
+                }
+            }
+            if (rank_load[hot] <= kRebalanceImbalance * mean) {
+                break;
+            }
+            double gap = rank_load[hot] - rank_load[cold];
+            int hottest = -1, best_move = -1;
+            for (int shard = 0; shard < num_shards_; shard++) {
+                const std::vector<int>& held = ranks[shard];
+                if (std::find(held.begin(), held.end(), hot) == held.end() ||
+                    std::find(held.begin(), held.end(), cold) != held.end()) {
+                    continue;
+                }
+                if (hottest == -1 || share(shard) > share(hottest)) {
+                    hottest = shard;
+                }
+                if (share(shard) < gap &&
+                    (best_move == -1 ||
+                     std::abs(share(shard) - gap / 2) <
+                         std::abs(share(best_move) - gap / 2))) {
+                    best_move = shard;
+                }
+            }
+            if (hottest != -1 && share(hottest) > mean &&
+                ranks[hottest].size() < max_replicas_) {
+                ranks[hottest].push_back(cold);
+            } else if (best_move != -1) {
+                std::replace(ranks[best_move].begin(), ranks[best_move].end(),
+                             hot, cold);
+            } else {
+                break;
+            }
+            compute_loads();
+        }
+        return ranks;
+    }
+
+    // Replica of shard to send the next query to.
+    int RouteToReplica(int shard) {
+        const std::vector<int>& ranks = shard_ranks_[shard];
+        int rank = ranks[0];
+        if (routing_ == LEAST_LOADED) {
+            for (int replica : ranks) {
+                if (rank_load_[replica] < rank_load_[rank]) {
+                    rank = replica;
                 }
-                dist_t* query_ptr = new dist_t[1];
-                MPI_Recv(query_ptr, dim_, MPI_FLOAT, num_procs_ - 1, 1,
-                         MPI_COMM_WORLD, &status);
-                auto lrs = local_algorithm_->searchKnn(query_ptr, k);
-                std::pair<dist_t, size_t>* data =
-                    new std::pair<dist_t, size_t>[k];
-                std::pair<dist_t, size_t>* cur_pos = data;
+            }
+        } else {
+            rank = ranks[next_replica_[shard]++ % ranks.size()];
+        }
+        shard_load_[shard] += 1;
+        rank_load_[rank] += 1;
+        return rank;
+    }
+
+    void CountQuery() {
+        num_queries_++;
+        if (rebalance_interval_ > 0 &&
+            num_queries_ % rebalance_interval_ == 0) {
+            Rebalance();
+        }
+    }
+
+    void RouteQuery(const dist_t* query_ptr, size_t k, ResultType& result,
+                    SearchStats* stats) {
+        FAST_ANN_STATS_TIMER(timer);
+        size_t cache_epoch = 0;
+        if (query_cache_ != nullptr) {
+            cache_epoch = query_cache_->Epoch();
+            if (query_cache_->Lookup(query_ptr, k, result)) {
+                EndQuery();
+                return;
+            }
+        }
+        tau_ = std::numeric_limits<dist_t>::max();
+        if (root_ != -1) {
+            SearchChild(query_ptr, root_, result, k, stats);
+        }
+        int num_sent = mpi_reqs_.size();
+        FAST_ANN_STATS_ADD(stats, partitions_probed, num_sent);
+        FAST_ANN_STATS_LAP(stats, routing_micros, timer);
+        std::vector<std::pair<dist_t, hnswlib::labeltype> > data(k);
+        while (num_sent--) {
+            MPI_Status status;
+            int num_bytes;
+            MPI_Recv(data.data(),
+                     sizeof(std::pair<dist_t, hnswlib::labeltype>) * k,
+                     MPI_BYTE, MPI_ANY_SOURCE, 1, MPI_COMM_WORLD, &status);
+            MPI_Get_count(&status, MPI_BYTE, &num_bytes);
+            FAST_ANN_STATS_LAP(stats, remote_wait_micros, timer);
+            int count =
+                num_bytes / sizeof(std::pair<dist_t, hnswlib::labeltype>);
+            for (int i = 0; i < count; i++) {
+                MergeResult(data[i].first, data[i].second, result, k);
+            }
+            FAST_ANN_STATS_LAP(stats, merge_micros, timer);
+        }
+        FinishQuerySends();
+        if (query_cache_ != nullptr) {
+            query_cache_->Insert(query_ptr, k, result, cache_epoch);
+        }
+    }
+
+    template <typename Callback>
+    size_t RouteRangeQuery(const dist_t* query_ptr, dist_t radius,
+                           size_t max_results, Callback callback,
+                           SearchStats* stats) {
+        FAST_ANN_STATS_TIMER(timer);
+        std::vector<std::pair<dist_t, DatasetIndexType> > local_results;
+        if (root_ != -1) {
+            SearchRangeChild(query_ptr, root_, radius, ToMetric(radius),
+                             max_results, local_results, stats);
+        }
+        int num_open = mpi_reqs_.size();
+        FAST_ANN_STATS_ADD(stats, partitions_probed, num_open);
+        FAST_ANN_STATS_LAP(stats, routing_micros, timer);
+        size_t num_results = 0;
+        for (size_t i = 0;
+             i < local_results.size() && num_results < max_results; i++) {
+            callback(local_results[i].first, local_results[i].second);
+            num_results++;
+        }
+        // Shards stream their results in chunks, a chunk that is not full
+        // is the last one of its shard. Chunks past max_results are still
+        // received, but dropped.
+        std::vector<std::pair<dist_t, hnswlib::labeltype> > data(
+            kRangeChunkSize);
+        while (num_open > 0) {
+            MPI_Status status;
+            int num_bytes;
+            MPI_Recv(data.data(),
+                     sizeof(std::pair<dist_t, hnswlib::labeltype>) *
+                         kRangeChunkSize,
+                     MPI_BYTE, MPI_ANY_SOURCE, 1, MPI_COMM_WORLD, &status);
+            MPI_Get_count(&status, MPI_BYTE, &num_bytes);
+            FAST_ANN_STATS_LAP(stats, remote_wait_micros, timer);
+            size_t count =
+                num_bytes / sizeof(std::pair<dist_t, hnswlib::labeltype>);
+            for (size_t i = 0; i < count && num_results < max_results; i++) {
+                callback(data[i].first, (DatasetIndexType)data[i].second);
+                num_results++;
+            }
+            if (count < kRangeChunkSize) {
+                num_open--;
+            }
+            FAST_ANN_STATS_LAP(stats, merge_micros, timer);
+        }
+        FinishQuerySends();
+        return num_results;
+    }
+
+    void MergeResult(dist_t dist, hnswlib::labeltype label,
+                     ResultType& result, size_t k) {
+        if (result.size() < k || dist < result.top().first) {
+            result.push({dist, (DatasetIndexType)label});
+            if (result.size() > k) {
+                result.pop();
+            }
+            if (result.size() == k) {
+                tau_ = ToMetric(result.top().first);
+            }
+        }
+    }
+
+    // Waits for the query sends and ends the query on the workers. Only
+    // called once every result arrived: a worker holding several queries of
+    // one search blocks sending the results of the first until they are
+    // received, and only then takes the next query, so waiting on the sends
+    // first deadlocks once messages are past the eager limit.
+    void FinishQuerySends() {
+        if (!mpi_reqs_.empty()) {
+            MPI_Waitall(mpi_reqs_.size(), mpi_reqs_.data(),
+                        MPI_STATUSES_IGNORE);
+        }
+        mpi_reqs_.clear();
+        EndQuery();
+    }
+
+    void EndQuery() {
+        char dummy = 0;
+        for (int i = 0; i < rank_; i++) {
+            MPI_Send(&dummy, 1, MPI_BYTE, i, kEndQueryTag, MPI_COMM_WORLD);
+        }
+    }
+
+    // Receives the next query from the last rank and the shard to search it
+    // in, returns false when it signals the end of the current query
+    // instead.
+    bool ReceiveQuery(std::vector<dist_t>& query, int& shard) {
+        MPI_Status status;
+        MPI_Probe(num_procs_ - 1, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
+        if (status.MPI_TAG == kEndQueryTag) {
+            char dummy;
+            MPI_Recv(&dummy, 1, MPI_BYTE, num_procs_ - 1, kEndQueryTag,
+                     MPI_COMM_WORLD, &status);
+            return false;
+        }
+        shard = status.MPI_TAG - kShardTagBase;
+        MPI_Recv(query.data(), dim_ * sizeof(dist_t), MPI_BYTE,
+                 num_procs_ - 1, status.MPI_TAG, MPI_COMM_WORLD, &status);
+        return true;
+    }
+
+    // Answers queries from the last rank until it signals the end of the
+    // current query.
+    void ServeQueries(size_t k, SearchStats* stats) {
+        std::vector<dist_t> query(dim_);
+        std::vector<std::pair<dist_t, hnswlib::labeltype> > data;
+        data.reserve(k);
+        int shard;
+        while (ReceiveQuery(query, shard)) {
+            data.clear();
+            if (local_shards_[shard]) {
+                auto lrs = local_shards_[shard]->searchKnn(query.data(), k,
+                                                           nullptr, stats);
                 while (!lrs.empty()) {
-                    *cur_pos = lrs.top();
+                    data.push_back(lrs.top());
                     lrs.pop();
-                    cur_pos += 1;
                 }
-                MPI_Request req;
-                MPI_ISend(data, sizeof(std::pair<dist_t, size_t>) * k, MPI_BYTE,
-                          num_procs_ - 1, MPI_COMM_WORLD, &req);
-                mpi_reqs_.push_back(req);
             }
+            MPI_Send(data.data(),
+                     sizeof(std::pair<dist_t, hnswlib::labeltype>) *
+                         data.size(),
+                     MPI_BYTE, num_procs_ - 1, 1, MPI_COMM_WORLD);
+        }
+    }
+
+    void ServeRangeQueries(dist_t radius, size_t max_results,
+                           SearchStats* stats) {
+        std::vector<dist_t> query(dim_);
+        std::vector<std::pair<dist_t, hnswlib::labeltype> > data;
+        data.reserve(kRangeChunkSize);
+        auto send_chunk = [this, &data]() {
+            MPI_Send(data.data(),
+                     sizeof(std::pair<dist_t, hnswlib::labeltype>) *
+                         data.size(),
+                     MPI_BYTE, num_procs_ - 1, 1, MPI_COMM_WORLD);
+            data.clear();
+        };
+        int shard;
+        while (ReceiveQuery(query, shard)) {
+            if (local_shards_[shard]) {
+                local_shards_[shard]->searchRange(
+                    query.data(), radius, max_results,
+                    [&data, &send_chunk](dist_t dist,
+                                         hnswlib::labeltype label) {
+                        data.emplace_back(dist, label);
+                        if (data.size() == kRangeChunkSize) {
+                            send_chunk();
+                        }
+                    },
+                    nullptr, stats);
+            }
+            send_chunk();
+        }
+    }
+
+    // Squared L2 and cosine distances are not metrics, pruning with them
+    // would skip shards holding neighbors.
+    inline dist_t ToMetric(dist_t dist) const {
+        return metricfunc_ == nullptr ? dist : metricfunc_(dist);
+    }
+
+    // Sends the query to every shard whose region intersects the ball and
+    // collects the vantage points held here that lie inside it. The ball is
+    // tested against the regions with metric_radius, the image of radius in
+    // the metric.
+    void SearchRangeNode(
+        const dist_t* query_ptr, const VPTreeNode& node, dist_t radius,
+        dist_t metric_radius, size_t max_results,
+        std::vector<std::pair<dist_t, DatasetIndexType> >& results,
+        SearchStats* stats) {
+        dist_t raw_dist = fstdistfunc_(
+            dataset_.item_at(node.data_pos).second, query_ptr,
+            dist_func_param_);
+        dist_t dist = ToMetric(raw_dist);
+        FAST_ANN_STATS_ADD(stats, visited_nodes, 1);
+        FAST_ANN_STATS_ADD(stats, distance_computations, 1);
+        if (raw_dist <= radius) {
+            results.push_back(
+                {raw_dist, dataset_.item_at(node.data_pos).first});
+        }
+        if (node.left != -1 && dist - metric_radius <= node.threshold) {
+            SearchRangeChild(query_ptr, node.left, radius, metric_radius,
+                             max_results, results, stats);
+        } else if (node.left != -1) {
+            FAST_ANN_STATS_ADD(stats, pruned_subtrees, 1);
+        }
+        if (node.right != -1 && dist + metric_radius >= node.threshold) {
+            SearchRangeChild(query_ptr, node.right, radius, metric_radius,
+                             max_results, results, stats);
+        } else if (node.right != -1) {
+            FAST_ANN_STATS_ADD(stats, pruned_subtrees, 1);
+        }
+    }
+
+    void SearchRangeChild(
+        const dist_t* query_ptr, DatasetIndexType child, dist_t radius,
+        dist_t metric_radius, size_t max_results,
+        std::vector<std::pair<dist_t, DatasetIndexType> >& results,
+        SearchStats* stats) {
+        if (child >= -1) {
+            SearchRangeNode(query_ptr, nodes_[child], radius, metric_radius,
+                            max_results, results, stats);
+            return;
+        }
+        int shard = -2 - child;
+        int rank = RouteToReplica(shard);
+        if (rank != rank_) {
+            SendQuery(query_ptr, shard, rank);
+            return;
         }
-        if (level == levels_) {
-            MPI_Request req;
-            MPI_ISend(query_ptr, dim_, MPI_FLOAT, id, 1, MPI_COMM_WORLD, &req);
-            mpi_reqs_.push_back(req);
+        local_shards_[shard]->searchRange(
+            query_ptr, radius, max_results,
+            [&results](dist_t dist, hnswlib::labeltype label) {
+                results.emplace_back(dist, (DatasetIndexType)label);
+            },
+            nullptr, stats);
+    }
+
+    void SendQuery(const dist_t* query_ptr, int shard, int rank) {
+        MPI_Request req;
+        MPI_Isend(query_ptr, dim_ * sizeof(dist_t), MPI_BYTE, rank,
+                  kShardTagBase + shard, MPI_COMM_WORLD, &req);
+        mpi_reqs_.push_back(req);
+    }
+
+    // Children below -1 are shards. The query is sent to a rank holding the
+    // shard and its results are merged once the traversal is done, a shard
+    // held here is searched right away.
+    void SearchChild(const dist_t* query_ptr, DatasetIndexType child,
+                     ResultType& result, size_t k, SearchStats* stats) {
+        if (child >= -1) {
+            SearchNode(query_ptr, nodes_[child], result, k, stats);
+            return;
         }
-        dist_t dist = fstdistfunc_(dataset_.item_at(node.data_pos).second,
-                                   query_ptr, dist_func_param_);
+        int shard = -2 - child;
+        int rank = RouteToReplica(shard);
+        if (rank != rank_) {
+            SendQuery(query_ptr, shard, rank);
+            return;
+        }
+        auto found =
+            local_shards_[shard]->searchKnn(query_ptr, k, nullptr, stats);
+        FAST_ANN_STATS_ADD(stats, partitions_probed, 1);
+        while (!found.empty()) {
+            MergeResult(found.top().first, found.top().second, result, k);
+            found.pop();
+        }
+    }
+
+    void SearchNode(const dist_t* query_ptr, const VPTreeNode& node,
+                    ResultType& result, size_t k, SearchStats* stats) {
+        dist_t raw_dist = fstdistfunc_(
+            dataset_.item_at(node.data_pos).second, query_ptr,
+            dist_func_param_);
+        dist_t dist = ToMetric(raw_dist);
+        FAST_ANN_STATS_ADD(stats, visited_nodes, 1);
+        FAST_ANN_STATS_ADD(stats, distance_computations, 1);
         if (dist < tau_) {
             if (result.size() == k) {
                 result.pop();
             }
-            result.push({dist, dataset_.item_at(node.data_pos).first});
+            result.push({raw_dist, dataset_.item_at(node.data_pos).first});
             if (result.size() == k) {
-                tau_ = result.top().first;
+                tau_ = ToMetric(result.top().first);
             }
         }
         if (dist < node.threshold) {
-            if (node.left != -1 && dist - tau_ <= node.threshold)
-                SearchNode(query_ptr, nodes_[node.left], result, level + 1,
-                           2 * id, k);
+            SearchLeft(query_ptr, node, dist, result, k, stats);
+            SearchRight(query_ptr, node, dist, result, k, stats);
+        } else {
+            SearchRight(query_ptr, node, dist, result, k, stats);
+            SearchLeft(query_ptr, node, dist, result, k, stats);
+        }
+    }
 
-            if (node.right != -1 && dist + tau_ >= node.threshold)
-                SearchNode(query_ptr, nodes_[node.right], result, level + 1,
-                           2 * id + 1, k);
+    // The bounds are checked after the sibling has been searched, which may
+    // have shrunk tau_.
+    void SearchLeft(const dist_t* query_ptr, const VPTreeNode& node,
+                    dist_t dist, ResultType& result, size_t k,
+                    SearchStats* stats) {
+        if (node.left == -1) {
+            return;
+        }
+        if (dist - tau_ <= node.threshold) {
+            SearchChild(query_ptr, node.left, result, k, stats);
         } else {
-            if (node.right != -1 && dist + tau_ >= node.threshold)
-                SearchNode(query_ptr, nodes_[node.right], result, level + 1,
-                           2 * id + 1, k);
+            FAST_ANN_STATS_ADD(stats, pruned_subtrees, 1);
+        }
+    }
 
-            if (node.left != -1 && dist - tau_ <= node.threshold)
-                SearchNode(query_ptr, nodes_[node.left], result, level + 1,
-                           2 * id, k);
+    void SearchRight(const dist_t* query_ptr, const VPTreeNode& node,
+                     dist_t dist, ResultType& result, size_t k,
+                     SearchStats* stats) {
+        if (node.right == -1) {
+            return;
+        }
+        if (dist + tau_ >= node.threshold) {
+            SearchChild(query_ptr, node.right, result, k, stats);
+        } else {
+            FAST_ANN_STATS_ADD(stats, pruned_subtrees, 1);
         }
     }
 
@@ -238,12 +823,33 @@ class VPTreeHNSWSearch {
     dist_t tau_;
     int num_procs_;
     int rank_;
-    int levels_;
+    int num_shards_;
     int dim_;
+    size_t M_;
+    size_t ef_construction_;
+    size_t ef_;
     Dataset<dist_t> dataset_;
-    hnswlib::HierarchicalNSW<dist_t>* local_algorithm_;
+    hnswlib::SpaceInterface<dist_t>* space_;
+    // Top of the tree on the last rank, a node, a shard when there is only
+    // one, or -1 when the dataset is empty.
+    DatasetIndexType root_;
+    // The HNSW index of each shard held here, null for the others.
+    std::vector<std::unique_ptr<hnswlib::HierarchicalNSW<dist_t> > >
+        local_shards_;
+    // Ranks holding each shard and, on the last rank, its items in dataset_.
+    std::vector<std::vector<int> > shard_ranks_;
+    std::vector<std::pair<DatasetIndexType, DatasetIndexType> > shard_ranges_;
+    std::vector<double> shard_load_;
+    std::vector<double> rank_load_;
+    std::vector<size_t> next_replica_;
+    QueryCache<dist_t>* query_cache_;
+    ShardRouting routing_;
+    size_t max_replicas_;
+    size_t rebalance_interval_;
+    size_t num_queries_;
     hnswlib::DISTFUNC<dist_t> fstdistfunc_;
     void* dist_func_param_;
+    hnswlib::METRICFUNC<dist_t> metricfunc_;
     std::vector<MPI_Request> mpi_reqs_;
 };
 
@@ -1,45 +1,249 @@
 #ifndef FAST_ANN_SEARCH_ALGORITHMS_VP_TREE_SEARCH_H_
 #define FAST_ANN_SEARCH_ALGORITHMS_VP_TREE_SEARCH_H_
 
+#include <algorithm>
+#include <limits>
 #include <random>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 #include "hnswlib/hnswlib.h"
 #include "fast_ann/dataset.h"
+#include "fast_ann/distances/space_distance.h"
+#include "fast_ann/search_stats.h"
 
 namespace fast_ann {
 
-template<typename dist_t>
+// Vectors are stored as data_t, which is dist_t unless they are kept at a
+// lower precision such as Float16, with queries converted to it. Distances
+// are computed by the Distance policy, see fast_ann/distance.h, which calls
+// the kernel of an hnswlib space by default. Searches keep their state on
+// their own stack, so that several threads can search one tree at once.
+template <typename dist_t, typename data_t = dist_t,
+          typename Distance = SpaceDistance<data_t, dist_t> >
 class VPTreeSearch {
    public:
     typedef std::priority_queue<std::pair<dist_t, DatasetIndexType> > ResultType;
+    typedef std::vector<std::pair<dist_t, DatasetIndexType> > RangeResultType;
 
-    VPTreeSearch(hnswlib::SpaceInterface <dist_t> *s, Dataset<dist_t> dataset) : dataset_(dataset) {
+    VPTreeSearch(hnswlib::SpaceInterface <dist_t> *s, Dataset<data_t> dataset)
+        : VPTreeSearch(dataset, Distance(s)) {}
+
+    VPTreeSearch(Dataset<data_t> dataset, const Distance& distance)
+        : dataset_(dataset), distance_(distance) {
         std::random_device rd;
         rng_.seed(rd());
         nodes_.reserve(dataset_.size());
-        fstdistfunc_ = s->get_dist_func();
-        dist_func_param_ = s->get_dist_func_param();
         ConstructVPTree(0, dataset_.size());
     }
 
-    ResultType searchKnn(const dist_t* query_ptr, size_t k) {
+    // Items whose id is rejected by filter are still used as vantage points
+    // for pruning but are never returned.
+    ResultType searchKnn(const data_t* query_ptr, size_t k,
+                         const hnswlib::BaseFilterFunctor* filter = nullptr,
+                         SearchStats* stats = nullptr) {
         ResultType result;
-        tau_ = std::numeric_limits<dist_t>::max();
-        SearchNode(query_ptr, nodes_[0], result, k);
+        dist_t tau = std::numeric_limits<dist_t>::max();
+        SearchNode(query_ptr, nodes_[0], result, tau, k, filter, stats);
+        return result;
+    }
+
+    // Searches num_queries queries, stored one after another, interleaving
+    // the traversals of group_size of them on the calling thread. Each step
+    // of a query visits one node and prefetches the vector of its next one,
+    // which arrives while the other queries of the group take their steps.
+    // Results are those of searchKnn. Stats, when given, holds one entry per
+    // query, of the type the array was declared with.
+    template <typename Stats = SearchStats>
+    std::vector<ResultType> searchKnnBatch(
+        const data_t* queries, size_t num_queries, size_t k,
+        size_t group_size = 8,
+        const hnswlib::BaseFilterFunctor* filter = nullptr,
+        Stats* stats = nullptr) {
+        static_assert(std::is_base_of<SearchStats, Stats>::value,
+                      "Stats must extend SearchStats");
+        std::vector<ResultType> results(num_queries);
+        if (nodes_.empty() || num_queries == 0) {
+            return results;
+        }
+        std::vector<BatchSearchState> group(
+            std::min(std::max(group_size, (size_t)1), num_queries));
+        size_t next_query = 0;
+        size_t active = group.size();
+        for (BatchSearchState& state : group) {
+            StartBatchSearch(state, next_query, queries,
+                             stats == nullptr ? nullptr : stats + next_query);
+            next_query++;
+        }
+        while (active > 0) {
+            for (BatchSearchState& state : group) {
+                if (state.done) {
+                    continue;
+                }
+                if (!StepBatchSearch(state, k, filter)) {
+                    std::swap(results[state.query_id], state.result);
+                    if (next_query < num_queries) {
+                        StartBatchSearch(state, next_query, queries,
+                                         stats == nullptr
+                                             ? nullptr
+                                             : stats + next_query);
+                        next_query++;
+                    } else {
+                        state.done = true;
+                        active--;
+                    }
+                }
+            }
+        }
+        return results;
+    }
+
+    // Passes the items within radius of the query to callback(dist, id) as
+    // they are found, at most max_results of them. The traversal is the k-NN
+    // one with tau fixed to radius, it is exact when the space maps its
+    // distances to a metric. Returns the number of results.
+    template <typename Callback,
+              typename = typename std::enable_if<
+                  hnswlib::isRangeCallback<Callback>::value>::type>
+    size_t searchRange(const data_t* query_ptr, dist_t radius,
+                       size_t max_results, Callback callback,
+                       const hnswlib::BaseFilterFunctor* filter = nullptr,
+                       SearchStats* stats = nullptr) {
+        size_t num_results = 0;
+        if (!nodes_.empty() && max_results > 0) {
+            SearchRangeNode(query_ptr, nodes_[0], radius, ToMetric(radius),
+                            max_results, num_results, callback, filter,
+                            stats);
+        }
+        return num_results;
+    }
+
+    // Items within radius of the query, nearest first.
+    RangeResultType searchRange(
+        const data_t* query_ptr, dist_t radius, size_t max_results,
+        const hnswlib::BaseFilterFunctor* filter = nullptr,
+        SearchStats* stats = nullptr) {
+        RangeResultType result;
+        searchRange(query_ptr, radius, max_results,
+                    [&result](dist_t dist, DatasetIndexType id) {
+                        result.emplace_back(dist, id);
+                    },
+                    filter, stats);
+        std::sort(result.begin(), result.end());
         return result;
     }
 
+    // Bytes allocated for the nodes and the item table, the vectors are not
+    // owned and left out.
+    size_t memory_bytes() const {
+        return nodes_.capacity() * sizeof(VPTreeNode) +
+               dataset_.size() *
+                   sizeof(typename Dataset<data_t>::DataType);
+    }
+
    private:
     struct VPTreeNode {
         VPTreeNode(size_t data_pos_t)
             : data_pos(data_pos_t), left(-1), right(-1) {}
 
         size_t data_pos;
+        // In the metric of the space, as is tau.
         dist_t threshold;
         size_t left;
         size_t right;
     };
 
+    // Traversal of one query of searchKnnBatch. The stack holds the nodes
+    // still to visit with a lower bound on the metric distance from the
+    // query to their subtree, they are pruned once tau drops below it.
+    struct BatchSearchState {
+        size_t query_id;
+        const data_t* query_ptr;
+        SearchStats* stats;
+        ResultType result;
+        dist_t tau;
+        std::vector<std::pair<size_t, dist_t> > stack;
+        size_t node;
+        bool done;
+    };
+
+    static void PrefetchBytes(const void* ptr, size_t size) {
+#ifdef USE_SSE
+        for (size_t offset = 0; offset < size; offset += 64) {
+            _mm_prefetch((const char*)ptr + offset, _MM_HINT_T0);
+        }
+#endif
+    }
+
+    // Stats is that of the query, or nullptr.
+    void StartBatchSearch(BatchSearchState& state, size_t query_id,
+                          const data_t* queries, SearchStats* stats) {
+        state.query_id = query_id;
+        state.query_ptr = queries + query_id * dataset_.dimension();
+        state.stats = stats;
+        state.result = ResultType();
+        state.tau = std::numeric_limits<dist_t>::max();
+        state.stack.clear();
+        state.node = 0;
+        state.done = false;
+        PrefetchBytes(dataset_.item_at(nodes_[0].data_pos).second,
+                      dataset_.dimension() * sizeof(data_t));
+    }
+
+    // Visits the prefetched node, as SearchNode does, and moves to the next
+    // node that cannot be pruned, prefetching its vector. Returns false when
+    // the traversal is over.
+    bool StepBatchSearch(BatchSearchState& state, size_t k,
+                         const hnswlib::BaseFilterFunctor* filter) {
+        const VPTreeNode& node = nodes_[state.node];
+        auto item = dataset_.item_at(node.data_pos);
+        dist_t raw_dist =
+            distance_(item.second, state.query_ptr, dataset_.dimension());
+        dist_t dist = ToMetric(raw_dist);
+        FAST_ANN_STATS_ADD(state.stats, visited_nodes, 1);
+        FAST_ANN_STATS_ADD(state.stats, distance_computations, 1);
+        if (dist < state.tau &&
+            (filter == nullptr || (*filter)(item.first))) {
+            if (state.result.size() == k) {
+                state.result.pop();
+            }
+            state.result.push({raw_dist, item.first});
+            if (state.result.size() == k) {
+                state.tau = ToMetric(state.result.top().first);
+            }
+        }
+        // The query is on the side of the nearer child, which is never
+        // pruned and is visited next. The farther one waits on the stack.
+        bool left_first = dist < node.threshold;
+        size_t near_child = left_first ? node.left : node.right;
+        size_t far_child = left_first ? node.right : node.left;
+        if (far_child != (size_t)-1) {
+            state.stack.push_back(std::make_pair(
+                far_child, left_first ? node.threshold - dist
+                                      : dist - node.threshold));
+        }
+        if (near_child != (size_t)-1) {
+            return MoveBatchSearch(state, near_child);
+        }
+        while (!state.stack.empty()) {
+            std::pair<size_t, dist_t> next = state.stack.back();
+            state.stack.pop_back();
+            if (next.second <= state.tau) {
+                return MoveBatchSearch(state, next.first);
+            }
+            FAST_ANN_STATS_ADD(state.stats, pruned_subtrees, 1);
+        }
+        return false;
+    }
+
+    bool MoveBatchSearch(BatchSearchState& state, size_t node) {
+        state.node = node;
+        PrefetchBytes(dataset_.item_at(nodes_[node].data_pos).second,
+                      dataset_.dimension() * sizeof(data_t));
+        return true;
+    }
+
     DatasetIndexType MakeVPTreeNode(size_t data_pos) {
         nodes_.push_back(VPTreeNode(data_pos));
         return ((size_t)nodes_.size()) - 1;
@@ -54,7 +258,7 @@ class VPTreeSearch {
 
     void PartitionByDistance(DatasetIndexType lower, DatasetIndexType pos,
                              DatasetIndexType upper) {
-        dataset_.PartitionByDistance(lower, pos, upper, fstdistfunc_, dist_func_param_);
+        dataset_.PartitionByDistance(lower, pos, upper, distance_);
     }
 
     DatasetIndexType ConstructVPTree(size_t lower, size_t upper) {
@@ -67,49 +271,114 @@ class VPTreeSearch {
             size_t median = (upper + lower) / 2;
             PartitionByDistance(lower, median, upper);
             auto node_pos = MakeVPTreeNode(lower);
-            nodes_[node_pos].threshold = fstdistfunc_(
-                dataset_.item_at(lower).second, dataset_.item_at(median).second,
-                dist_func_param_);
+            nodes_[node_pos].threshold = ToMetric(
+                distance_(dataset_.item_at(lower).second,
+                          dataset_.item_at(median).second,
+                          dataset_.dimension()));
             nodes_[node_pos].left = ConstructVPTree(lower + 1, median);
             nodes_[node_pos].right = ConstructVPTree(median, upper);
             return node_pos;
         }
     }
 
-    void SearchNode(const dist_t* query_ptr, const VPTreeNode& node,
-                    ResultType& result, size_t k) {
-        dist_t dist = fstdistfunc_(dataset_.item_at(node.data_pos).second,
-                                        query_ptr, dist_func_param_);
-        if (dist < tau_) {
+    // Squared L2 and cosine distances are not metrics, pruning with them
+    // would skip subtrees holding neighbors.
+    inline dist_t ToMetric(dist_t dist) const {
+        return distance_.ToMetric(dist);
+    }
+
+    void SearchNode(const data_t* query_ptr, const VPTreeNode& node,
+                    ResultType& result, dist_t& tau, size_t k,
+                    const hnswlib::BaseFilterFunctor* filter,
+                    SearchStats* stats) {
+        auto item = dataset_.item_at(node.data_pos);
+        dist_t raw_dist =
+            distance_(item.second, query_ptr, dataset_.dimension());
+        dist_t dist = ToMetric(raw_dist);
+        FAST_ANN_STATS_ADD(stats, visited_nodes, 1);
+        FAST_ANN_STATS_ADD(stats, distance_computations, 1);
+        if (dist < tau && (filter == nullptr || (*filter)(item.first))) {
             if (result.size() == k) {
                 result.pop();
             }
-            result.push({dist, dataset_.item_at(node.data_pos).first});
+            result.push({raw_dist, item.first});
             if (result.size() == k) {
-                tau_ = result.top().first;
+                tau = ToMetric(result.top().first);
             }
         }
         if (dist < node.threshold) {
-            if (node.left != -1 && dist - tau_ <= node.threshold)
-                SearchNode(query_ptr, nodes_[node.left], result, k);
+            if (node.left != -1 && dist - tau <= node.threshold)
+                SearchNode(query_ptr, nodes_[node.left], result, tau, k,
+                           filter, stats);
+            else if (node.left != -1)
+                FAST_ANN_STATS_ADD(stats, pruned_subtrees, 1);
 
-            if (node.right != -1 && dist + tau_ >= node.threshold)
-                SearchNode(query_ptr, nodes_[node.right], result, k);
+            if (node.right != -1 && dist + tau >= node.threshold)
+                SearchNode(query_ptr, nodes_[node.right], result, tau, k,
+                           filter, stats);
+            else if (node.right != -1)
+                FAST_ANN_STATS_ADD(stats, pruned_subtrees, 1);
         } else {
-            if (node.right != -1 && dist + tau_ >= node.threshold)
-                SearchNode(query_ptr, nodes_[node.right], result, k);
+            if (node.right != -1 && dist + tau >= node.threshold)
+                SearchNode(query_ptr, nodes_[node.right], result, tau, k,
+                           filter, stats);
+            else if (node.right != -1)
+                FAST_ANN_STATS_ADD(stats, pruned_subtrees, 1);
+
+            if (node.left != -1 && dist - tau <= node.threshold)
+                SearchNode(query_ptr, nodes_[node.left], result, tau, k,
+                           filter, stats);
+            else if (node.left != -1)
+                FAST_ANN_STATS_ADD(stats, pruned_subtrees, 1);
+        }
+    }
 
-            if (node.left != -1 && dist - tau_ <= node.threshold)
-                SearchNode(query_ptr, nodes_[node.left], result, k);
+    // Results are selected with radius, subtrees pruned with metric_radius,
+    // its image in the metric. Returns false once max_results items have
+    // been reported, which ends the traversal.
+    template <typename Callback>
+    bool SearchRangeNode(const data_t* query_ptr, const VPTreeNode& node,
+                         dist_t radius, dist_t metric_radius,
+                         size_t max_results, size_t& num_results,
+                         Callback& callback,
+                         const hnswlib::BaseFilterFunctor* filter,
+                         SearchStats* stats) {
+        auto item = dataset_.item_at(node.data_pos);
+        dist_t raw_dist =
+            distance_(item.second, query_ptr, dataset_.dimension());
+        dist_t dist = ToMetric(raw_dist);
+        FAST_ANN_STATS_ADD(stats, visited_nodes, 1);
+        FAST_ANN_STATS_ADD(stats, distance_computations, 1);
+        if (raw_dist <= radius &&
+            (filter == nullptr || (*filter)(item.first))) {
+            callback(raw_dist, item.first);
+            if (++num_results == max_results) {
+                return false;
+            }
+        }
+        if (node.left != -1 && dist - metric_radius <= node.threshold) {
+            if (!SearchRangeNode(query_ptr, nodes_[node.left], radius,
+                                 metric_radius, max_results, num_results,
+                                 callback, filter, stats)) {
+                return false;
+            }
+        } else if (node.left != -1) {
+            FAST_ANN_STATS_ADD(stats, pruned_subtrees, 1);
+        }
+        if (node.right != -1 && dist + metric_radius >= node.threshold) {
+            return SearchRangeNode(query_ptr, nodes_[node.right], radius,
+                                   metric_radius, max_results, num_results,
+                                   callback, filter, stats);
+        } else if (node.right != -1) {
+            FAST_ANN_STATS_ADD(stats, pruned_subtrees, 1);
         }
+        return true;
     }
 
     std::vector<VPTreeNode> nodes_;
     std::mt19937 rng_;
-    dist_t tau_;
-    Dataset<dist_t> dataset_;
-    hnswlib::DISTFUNC <dist_t> fstdistfunc_;
-    void *dist_func_param_;
+    Dataset<data_t> dataset_;
+    Distance distance_;
 };
 
 }  // namespace fast_ann
@@ -0,0 +1,193 @@
+#ifndef FAST_ANN_SEARCH_STATS_H_
+#define FAST_ANN_SEARCH_STATS_H_
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "hnswlib/hnswlib.h"
+
+namespace fast_ann {
+
+// Four buckets per power of two up to 2^64, past any count of size_t.
+const int kHistogramBuckets = 4 * 64 + 1;
+
+// Work and time spent on one query. The counters shared with hnswlib cover
+// the graph searches, the rest cover tree traversal and the distributed
+// search phases. Remote wait is time spent waiting for data held elsewhere,
+// other ranks or the SSD. Counting is compiled in only when
+// FAST_ANN_SEARCH_STATS (and HNSWLIB_SEARCH_STATS) are defined.
+struct SearchStats : public hnswlib::SearchStats {
+    SearchStats() { reset(); }
+
+    void reset() {
+        hnswlib::SearchStats::reset();
+        pruned_subtrees = 0;
+        partitions_probed = 0;
+        routing_micros = 0;
+        remote_wait_micros = 0;
+        merge_micros = 0;
+    }
+
+    size_t pruned_subtrees;
+    size_t partitions_probed;
+    double routing_micros;
+    double remote_wait_micros;
+    double merge_micros;
+};
+
+// Measures the phases of a query one after another, each Lap returns the
+// time since the previous one.
+class StatsTimer {
+   public:
+    StatsTimer() : last_(std::chrono::steady_clock::now()) {}
+
+    double Lap() {
+        std::chrono::steady_clock::time_point now =
+            std::chrono::steady_clock::now();
+        double micros =
+            std::chrono::duration<double, std::micro>(now - last_).count();
+        last_ = now;
+        return micros;
+    }
+
+   private:
+    std::chrono::steady_clock::time_point last_;
+};
+
+#ifdef FAST_ANN_SEARCH_STATS
+#define FAST_ANN_STATS_ADD(Stats_, Field_, Value_) \
+    do {                                           \
+        if (Stats_) (Stats_)->Field_ += (Value_);  \
+    } while (0)
+#define FAST_ANN_STATS_TIMER(Timer_) fast_ann::StatsTimer Timer_
+#define FAST_ANN_STATS_LAP(Stats_, Field_, Timer_) \
+    FAST_ANN_STATS_ADD(Stats_, Field_, (Timer_).Lap())
+#else
+// Stats_ is still evaluated, so that parameters only passed here are used.
+#define FAST_ANN_STATS_ADD(Stats_, Field_, Value_) \
+    do {                                           \
+        (void)(Stats_);                            \
+    } while (0)
+#define FAST_ANN_STATS_TIMER(Timer_) \
+    do {                             \
+    } while (0)
+#define FAST_ANN_STATS_LAP(Stats_, Field_, Timer_) \
+    do {                                           \
+        (void)(Stats_);                            \
+    } while (0)
+#endif
+
+// Histogram with logarithmic buckets, four per power of two, so percentiles
+// are accurate to about 20% for values up to 2^64, larger ones land in the
+// last bucket.
+class Histogram {
+   public:
+    Histogram()
+        : buckets_(kHistogramBuckets, 0), count_(0), sum_(0), max_(0) {}
+
+    void Add(double value) {
+        buckets_[GetBucket(value)]++;
+        count_++;
+        sum_ += value;
+        max_ = std::max(max_, value);
+    }
+
+    // Upper bound of the bucket holding the given percentile, in [0, 100].
+    double Percentile(double percentile) const {
+        if (count_ == 0) {
+            return 0;
+        }
+        size_t rank = std::ceil(percentile / 100 * count_);
+        size_t seen = 0;
+        for (int i = 0; i < kHistogramBuckets; i++) {
+            seen += buckets_[i];
+            if (seen >= rank && seen > 0) {
+                return std::min(GetBucketUpperBound(i), max_);
+            }
+        }
+        return max_;
+    }
+
+    inline size_t count() const { return count_; }
+
+    inline double mean() const { return count_ == 0 ? 0 : sum_ / count_; }
+
+    inline double max() const { return max_; }
+
+   private:
+    static int GetBucket(double value) {
+        if (value < 1) {
+            return 0;
+        }
+        int bucket = 1 + (int)(4 * std::log2(value));
+        return std::min(bucket, kHistogramBuckets - 1);
+    }
+
+    static double GetBucketUpperBound(int bucket) {
+        return bucket == 0 ? 1 : std::exp2(bucket / 4.0);
+    }
+
+    std::vector<size_t> buckets_;
+    size_t count_;
+    double sum_;
+    double max_;
+};
+
+// Aggregates the stats of many queries into one histogram per metric.
+class SearchStatsSummary {
+   public:
+    void Add(const SearchStats& stats) {
+        distance_computations_.Add(stats.distance_computations);
+        visited_nodes_.Add(stats.visited_nodes);
+        upper_layer_hops_.Add(stats.upper_layer_hops);
+        base_layer_hops_.Add(stats.base_layer_hops);
+        early_terminations_.Add(stats.early_terminations);
+        pruned_subtrees_.Add(stats.pruned_subtrees);
+        partitions_probed_.Add(stats.partitions_probed);
+        routing_micros_.Add(stats.routing_micros);
+        remote_wait_micros_.Add(stats.remote_wait_micros);
+        merge_micros_.Add(stats.merge_micros);
+    }
+
+    void Print(std::ostream& output) const {
+        output << "metric mean p50 p90 p99 max\n";
+        PrintHistogram(output, "distance_computations", distance_computations_);
+        PrintHistogram(output, "visited_nodes", visited_nodes_);
+        PrintHistogram(output, "upper_layer_hops", upper_layer_hops_);
+        PrintHistogram(output, "base_layer_hops", base_layer_hops_);
+        PrintHistogram(output, "early_terminations", early_terminations_);
+        PrintHistogram(output, "pruned_subtrees", pruned_subtrees_);
+        PrintHistogram(output, "partitions_probed", partitions_probed_);
+        PrintHistogram(output, "routing_micros", routing_micros_);
+        PrintHistogram(output, "remote_wait_micros", remote_wait_micros_);
+        PrintHistogram(output, "merge_micros", merge_micros_);
+    }
+
+   private:
+    static void PrintHistogram(std::ostream& output, const std::string& name,
+                               const Histogram& histogram) {
+        output << name << " " << histogram.mean() << " "
+               << histogram.Percentile(50) << " " << histogram.Percentile(90)
+               << " " << histogram.Percentile(99) << " " << histogram.max()
+               << "\n";
+    }
+
+    Histogram distance_computations_;
+    Histogram visited_nodes_;
+    Histogram upper_layer_hops_;
+    Histogram base_layer_hops_;
+    Histogram early_terminations_;
+    Histogram pruned_subtrees_;
+    Histogram partitions_probed_;
+    Histogram routing_micros_;
+    Histogram remote_wait_micros_;
+    Histogram merge_micros_;
+};
+
+}  // namespace fast_ann
+
+#endif  // FAST_ANN_SEARCH_STATS_H_
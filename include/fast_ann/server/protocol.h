@@ -0,0 +1,177 @@
+#ifndef FAST_ANN_SERVER_PROTOCOL_H_
+#define FAST_ANN_SERVER_PROTOCOL_H_
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <stdexcept>
+#include <string>
+
+namespace fast_ann {
+
+// Wire format of SearchServer, in host byte order since both ends run on the
+// same machine. A client sends any number of requests on a connection
+// without waiting, each a RequestHeader followed by dimension floats, and
+// the server answers each with a ResponseHeader followed by count
+// ResultEntry, nearest first. Responses can come out of order, they are
+// matched to requests by id.
+struct RequestHeader {
+    uint32_t id;
+    uint32_t k;
+    uint32_t dimension;
+    // Time the request may wait in the server before it is searched, the
+    // server default when 0.
+    uint32_t deadline_micros;
+};
+
+struct ResponseHeader {
+    uint32_t id;
+    uint32_t status;
+    uint32_t count;
+};
+
+struct ResultEntry {
+    float distance;
+    int32_t id;
+};
+
+enum ResponseStatus {
+    STATUS_OK = 0,
+    // Refused on arrival, the queue was full or would not be served within
+    // the deadline.
+    STATUS_OVERLOADED = 1,
+    // Admitted but still queued when its deadline passed.
+    STATUS_DEADLINE_EXCEEDED = 2,
+    // Wrong dimension or k, the server closes the connection after it.
+    STATUS_BAD_REQUEST = 3,
+    // The search failed on the server.
+    STATUS_ERROR = 4
+};
+
+// Largest k a request may ask for.
+const uint32_t kMaxRequestK = 4096;
+
+// Reads or writes exactly size bytes, false on error or end of stream.
+inline bool ReadFully(int fd, void* buffer, size_t size) {
+    char* pos = static_cast<char*>(buffer);
+    while (size > 0) {
+        ssize_t done = recv(fd, pos, size, 0);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            return false;
+        }
+        pos += done;
+        size -= done;
+    }
+    return true;
+}
+
+inline bool WriteFully(int fd, const void* buffer, size_t size) {
+    const char* pos = static_cast<const char*>(buffer);
+    while (size > 0) {
+        // A peer that went away is reported here rather than by SIGPIPE.
+        ssize_t done = send(fd, pos, size, MSG_NOSIGNAL);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            return false;
+        }
+        pos += done;
+        size -= done;
+    }
+    return true;
+}
+
+// Small requests and responses go out at once rather than being held back
+// by Nagle's algorithm, TCP only.
+inline void SetNoDelay(int fd) {
+    int no_delay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+}
+
+// Sends that block longer than micros fail, so that WriteFully returns false
+// instead of waiting on a peer that stopped reading. None when 0.
+inline void SetSendTimeout(int fd, double micros) {
+    timeval timeout;
+    timeout.tv_sec = (time_t)(micros / 1e6);
+    timeout.tv_usec = (suseconds_t)(micros - timeout.tv_sec * 1e6);
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+// Addresses are "unix:<path>" for a Unix domain socket or "tcp:<port>" for
+// the TCP loopback interface. Fills addr and returns a new socket of its
+// family.
+inline int OpenSocket(const std::string& address, sockaddr_storage& addr,
+                      socklen_t& length) {
+    memset(&addr, 0, sizeof(addr));
+    if (address.compare(0, 5, "unix:") == 0) {
+        std::string path = address.substr(5);
+        sockaddr_un* unix_addr = (sockaddr_un*)&addr;
+        if (path.empty() || path.size() >= sizeof(unix_addr->sun_path)) {
+            throw std::runtime_error("Invalid socket path " + path);
+        }
+        unix_addr->sun_family = AF_UNIX;
+        strcpy(unix_addr->sun_path, path.c_str());
+        length = sizeof(sockaddr_un);
+    } else if (address.compare(0, 4, "tcp:") == 0) {
+        sockaddr_in* inet = (sockaddr_in*)&addr;
+        inet->sin_family = AF_INET;
+        inet->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        inet->sin_port = htons(std::stoi(address.substr(4)));
+        length = sizeof(sockaddr_in);
+    } else {
+        throw std::runtime_error("Unknown address " + address +
+                                 ", expected unix:<path> or tcp:<port>");
+    }
+    int fd = socket(addr.ss_family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot create a socket for " + address);
+    }
+    return fd;
+}
+
+// Both return a socket descriptor and throw std::runtime_error on failure.
+inline int ListenOn(const std::string& address, int backlog = 128) {
+    sockaddr_storage addr;
+    socklen_t length;
+    int fd = OpenSocket(address, addr, length);
+    if (addr.ss_family == AF_UNIX) {
+        // A socket file left by a previous run would fail the bind.
+        unlink(((sockaddr_un*)&addr)->sun_path);
+    } else {
+        int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    }
+    if (bind(fd, (sockaddr*)&addr, length) < 0 || listen(fd, backlog) < 0) {
+        close(fd);
+        throw std::runtime_error("Cannot listen on " + address);
+    }
+    return fd;
+}
+
+inline int ConnectTo(const std::string& address) {
+    sockaddr_storage addr;
+    socklen_t length;
+    int fd = OpenSocket(address, addr, length);
+    if (connect(fd, (sockaddr*)&addr, length) < 0) {
+        close(fd);
+        throw std::runtime_error("Cannot connect to " + address);
+    }
+    if (addr.ss_family == AF_INET) {
+        SetNoDelay(fd);
+    }
+    return fd;
+}
+
+}  // namespace fast_ann
+
+#endif  // FAST_ANN_SERVER_PROTOCOL_H_
@@ -0,0 +1,66 @@
+#ifndef FAST_ANN_SERVER_SEARCH_CLIENT_H_
+#define FAST_ANN_SERVER_SEARCH_CLIENT_H_
+
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "fast_ann/dataset.h"
+#include "fast_ann/server/protocol.h"
+
+namespace fast_ann {
+
+// One connection to a SearchServer. Requests can be pipelined, Send and
+// Receive may run on different threads but neither on several at once.
+class SearchClient {
+   public:
+    // Throws std::runtime_error when the server cannot be reached.
+    explicit SearchClient(const std::string& address)
+        : fd_(ConnectTo(address)) {}
+
+    ~SearchClient() { close(fd_); }
+
+    SearchClient(const SearchClient&) = delete;
+    SearchClient& operator=(const SearchClient&) = delete;
+
+    // Returns false if the connection was lost.
+    bool Send(uint32_t id, const float* query, DimensionType dimension,
+              uint32_t k, uint32_t deadline_micros = 0) {
+        message_.resize(sizeof(RequestHeader) + dimension * sizeof(float));
+        RequestHeader header;
+        header.id = id;
+        header.k = k;
+        header.dimension = dimension;
+        header.deadline_micros = deadline_micros;
+        memcpy(message_.data(), &header, sizeof(header));
+        memcpy(message_.data() + sizeof(header), query,
+               dimension * sizeof(float));
+        return WriteFully(fd_, message_.data(), message_.size());
+    }
+
+    // Waits for the next response, its results nearest first. Returns false
+    // if the connection was lost.
+    bool Receive(ResponseHeader& header, std::vector<ResultEntry>& results) {
+        if (!ReadFully(fd_, &header, sizeof(header)) ||
+            header.count > kMaxRequestK) {
+            return false;
+        }
+        results.resize(header.count);
+        return ReadFully(fd_, results.data(),
+                         header.count * sizeof(ResultEntry));
+    }
+
+    // Tells the server no more requests will come, the pending responses
+    // still arrive.
+    void Finish() { shutdown(fd_, SHUT_WR); }
+
+   private:
+    int fd_;
+    std::vector<char> message_;
+};
+
+}  // namespace fast_ann
+
+#endif  // FAST_ANN_SERVER_SEARCH_CLIENT_H_
@@ -0,0 +1,531 @@
+#ifndef FAST_ANN_SERVER_SEARCH_SERVER_H_
+#define FAST_ANN_SERVER_SEARCH_SERVER_H_
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "fast_ann/logger.h"
+#include "fast_ann/search_algorithm.h"
+#include "fast_ann/search_stats.h"
+#include "fast_ann/server/protocol.h"
+#include "fast_ann/thread_pool.h"
+
+namespace fast_ann {
+
+// The batch size limit follows the p99 of the latest latencies, shrinking
+// only once this many were seen at the current limit.
+const size_t kLatencyWindowSize = 512;
+const size_t kMinLatencySamples = 100;
+
+struct SearchServerOptions {
+    SearchServerOptions()
+        : max_batch_size(64),
+          max_batch_delay_micros(1000),
+          latency_target_micros(10000),
+          default_deadline_micros(0),
+          max_queue_size(8192),
+          send_timeout_micros(1000000),
+          num_threads(0) {}
+
+    size_t max_batch_size;
+    // Longest the oldest queued request waits for others to join its batch.
+    double max_batch_delay_micros;
+    // p99 of the time from arrival to response that batches are sized for.
+    double latency_target_micros;
+    // Deadline of the requests that do not set one, none when 0.
+    double default_deadline_micros;
+    // Requests arriving when this many are queued are refused.
+    size_t max_queue_size;
+    // Connections whose client takes longer than this to accept a response
+    // are dropped, a blocked send would hold up the rest of the batch. No
+    // limit when 0.
+    double send_timeout_micros;
+    // Threads searching each batch, hardware concurrency when 0.
+    int num_threads;
+};
+
+// Counters since the server was created. Latencies, in microseconds, run
+// from the arrival of a request to its response and cover those answered.
+struct SearchServerStats {
+    SearchServerStats()
+        : requests(0),
+          rejected(0),
+          expired(0),
+          bad_requests(0),
+          failed(0),
+          dropped_connections(0),
+          errors(0),
+          batches(0),
+          batch_limit(0) {}
+
+    size_t requests;
+    size_t rejected;
+    size_t expired;
+    size_t bad_requests;
+    size_t failed;
+    // Connections closed because a response could not be sent.
+    size_t dropped_connections;
+    // Failed searches and accepts, the last one described by last_error.
+    size_t errors;
+    std::string last_error;
+    size_t batches;
+    // Current limit on the batch size.
+    size_t batch_limit;
+    Histogram batch_sizes;
+    Histogram latencies;
+};
+
+// Serves k-NN requests over a socket, see protocol.h, from one or more
+// shards, indexes over disjoint parts of the data whose results are merged.
+// A thread per connection reads its requests into a queue, a scheduler
+// thread takes micro-batches off the queue and searches every shard with
+// them on a ThreadPool. A batch starts once it is full or its oldest request
+// waited max_batch_delay_micros. The batch size limit grows by one while the
+// recent p99 latency is within target and is cut by a tenth when it is not,
+// as in Clipper. Requests are refused on arrival when the queue is full, or
+// when the queue ahead of them, at the recent cost per query, would outlast
+// their deadline.
+class SearchServer {
+   public:
+    // The shards are not owned and must outlive the server, which only
+    // searches them.
+    SearchServer(const std::vector<SearchAlgorithm*>& shards,
+                 const SearchServerOptions& options = SearchServerOptions())
+        : shards_(shards),
+          options_(options),
+          pool_(options.num_threads),
+          listen_fd_(-1),
+          stop_(false),
+          batch_limit_(1),
+          query_cost_micros_(0),
+          window_(kLatencyWindowSize),
+          window_pos_(0),
+          window_count_(0) {
+        if (shards_.empty()) {
+            throw std::runtime_error("A server needs at least one shard");
+        }
+        dimension_ = shards_[0]->dimension();
+        for (SearchAlgorithm* shard : shards_) {
+            if (shard->dimension() != dimension_) {
+                throw std::runtime_error("Shards of different dimensions");
+            }
+        }
+        options_.max_batch_size = std::max<size_t>(options_.max_batch_size, 1);
+    }
+
+    ~SearchServer() { Stop(); }
+
+    SearchServer(const SearchServer&) = delete;
+    SearchServer& operator=(const SearchServer&) = delete;
+
+    // Listens on address, see ListenOn, and serves from background threads
+    // until Stop.
+    void Start(const std::string& address) {
+        if (listen_fd_ >= 0) {
+            throw std::runtime_error("Server already started");
+        }
+        listen_fd_ = ListenOn(address);
+        stop_ = false;
+        scheduler_ = std::thread(&SearchServer::Schedule, this);
+        acceptor_ = std::thread(&SearchServer::Accept, this);
+        LOG_INFO("Serving " << shards_.size() << " shards on " << address);
+    }
+
+    // Closes every connection, the requests still queued are dropped.
+    void Stop() {
+        if (listen_fd_ < 0) {
+            return;
+        }
+        {
+            std::unique_lock<std::mutex> lock(queue_guard_);
+            stop_ = true;
+        }
+        queue_ready_.notify_all();
+        // Wakes the acceptor up from accept.
+        shutdown(listen_fd_, SHUT_RDWR);
+        acceptor_.join();
+        // Wakes the readers up and fails the sends of the batch being served,
+        // so that the scheduler does not wait on a client.
+        for (auto& connection : connections_) {
+            shutdown(connection->fd, SHUT_RDWR);
+        }
+        scheduler_.join();
+        close(listen_fd_);
+        listen_fd_ = -1;
+        for (auto& connection : connections_) {
+            connection->reader.join();
+        }
+        connections_.clear();
+        queue_.clear();
+    }
+
+    SearchServerStats stats() const {
+        std::unique_lock<std::mutex> lock(queue_guard_);
+        SearchServerStats stats = stats_;
+        stats.batch_limit = batch_limit_;
+        return stats;
+    }
+
+   private:
+    typedef std::chrono::steady_clock Clock;
+
+    // Closed once the last request holding it is answered.
+    struct Connection : public std::enable_shared_from_this<Connection> {
+        explicit Connection(int fd_t) : fd(fd_t), done(false), broken(false) {}
+
+        ~Connection() { close(fd); }
+
+        int fd;
+        std::thread reader;
+        std::atomic<bool> done;
+        // Set under write_guard once a send failed, the later responses
+        // are dropped.
+        bool broken;
+        std::mutex write_guard;
+    };
+
+    struct Request {
+        std::shared_ptr<Connection> connection;
+        uint32_t id;
+        uint32_t k;
+        double deadline_micros;
+        Clock::time_point arrival;
+        std::vector<float> query;
+    };
+
+    static double MicrosSince(Clock::time_point start) {
+        return std::chrono::duration<double, std::micro>(Clock::now() - start)
+            .count();
+    }
+
+    void Accept() {
+        while (true) {
+            int fd = accept(listen_fd_, nullptr, nullptr);
+            if (stop_) {
+                if (fd >= 0) {
+                    close(fd);
+                }
+                return;
+            }
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                ReportError(std::string("accept failed : ") + strerror(errno));
+                return;
+            }
+            SetNoDelay(fd);
+            if (options_.send_timeout_micros > 0) {
+                SetSendTimeout(fd, options_.send_timeout_micros);
+            }
+            std::shared_ptr<Connection> connection(new Connection(fd));
+            ReapConnections();
+            connections_.push_back(connection);
+            connection->reader =
+                std::thread(&SearchServer::Read, this, connection.get());
+        }
+    }
+
+    // Forgets the connections whose client hung up, only run by the
+    // acceptor.
+    void ReapConnections() {
+        for (auto it = connections_.begin(); it != connections_.end();) {
+            if ((*it)->done) {
+                (*it)->reader.join();
+                it = connections_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    void Read(Connection* connection) {
+        RequestHeader header;
+        while (ReadFully(connection->fd, &header, sizeof(header))) {
+            Clock::time_point arrival = Clock::now();
+            if (header.dimension != (uint32_t)dimension_ || header.k == 0 ||
+                header.k > kMaxRequestK) {
+                // The rest of the stream cannot be framed any more.
+                {
+                    std::unique_lock<std::mutex> lock(queue_guard_);
+                    stats_.bad_requests++;
+                }
+                Respond(*connection, header.id, STATUS_BAD_REQUEST, nullptr,
+                        0);
+                break;
+            }
+            Request request;
+            request.query.resize(dimension_);
+            if (!ReadFully(connection->fd, request.query.data(),
+                           dimension_ * sizeof(float))) {
+                break;
+            }
+            request.connection = connection->shared_from_this();
+            request.id = header.id;
+            request.k = header.k;
+            request.deadline_micros = header.deadline_micros > 0
+                                          ? header.deadline_micros
+                                          : options_.default_deadline_micros;
+            request.arrival = arrival;
+            if (!Admit(request)) {
+                Respond(*connection, header.id, STATUS_OVERLOADED, nullptr, 0);
+            }
+        }
+        connection->done = true;
+    }
+
+    bool Admit(Request& request) {
+        std::unique_lock<std::mutex> lock(queue_guard_);
+        stats_.requests++;
+        if (stop_ || queue_.size() >= options_.max_queue_size ||
+            (request.deadline_micros > 0 &&
+             queue_.size() * query_cost_micros_ > request.deadline_micros)) {
+            stats_.rejected++;
+            return false;
+        }
+        queue_.push_back(std::move(request));
+        if (queue_.size() == 1 || queue_.size() >= batch_limit_) {
+            queue_ready_.notify_one();
+        }
+        return true;
+    }
+
+    void Schedule() {
+        std::vector<Request> batch;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(queue_guard_);
+                queue_ready_.wait(lock,
+                                  [this]() { return stop_ || !queue_.empty(); });
+                Clock::time_point batch_deadline =
+                    queue_.empty()
+                        ? Clock::now()
+                        : queue_.front().arrival +
+                              std::chrono::microseconds(
+                                  (int64_t)options_.max_batch_delay_micros);
+                queue_ready_.wait_until(lock, batch_deadline, [this]() {
+                    return stop_ || queue_.size() >= batch_limit_;
+                });
+                if (stop_) {
+                    return;
+                }
+                size_t size = std::min(batch_limit_, queue_.size());
+                batch.assign(std::make_move_iterator(queue_.begin()),
+                             std::make_move_iterator(queue_.begin() + size));
+                queue_.erase(queue_.begin(), queue_.begin() + size);
+            }
+            Serve(batch);
+            batch.clear();
+        }
+    }
+
+    void Serve(std::vector<Request>& batch) {
+        Clock::time_point start = Clock::now();
+        std::vector<Request*> live;
+        size_t num_expired = 0;
+        for (Request& request : batch) {
+            if (request.deadline_micros > 0 &&
+                MicrosSince(request.arrival) > request.deadline_micros) {
+                Respond(*request.connection, request.id,
+                        STATUS_DEADLINE_EXCEEDED, nullptr, 0);
+                num_expired++;
+            } else {
+                live.push_back(&request);
+            }
+        }
+        std::vector<double> latencies(live.size());
+        bool failed = false;
+        if (!live.empty()) {
+            size_t k = 0;
+            std::vector<float> queries(live.size() * dimension_);
+            for (size_t i = 0; i < live.size(); i++) {
+                k = std::max<size_t>(k, live[i]->k);
+                std::copy(live[i]->query.begin(), live[i]->query.end(),
+                          queries.begin() + i * dimension_);
+            }
+            // Every shard searches the batch in chunks, one per thread, so
+            // that a single shard keeps all threads busy too.
+            size_t num_chunks = std::min<size_t>(live.size(), pool_.size());
+            std::vector<std::vector<SearchAlgorithm::ResultType> > found(
+                shards_.size() * num_chunks);
+            try {
+                pool_.ParallelFor(
+                    0, found.size(), [&](size_t task, int /*thread*/) {
+                        size_t begin = ChunkBegin(task % num_chunks,
+                                                  num_chunks, live.size());
+                        size_t end = ChunkBegin(task % num_chunks + 1,
+                                                num_chunks, live.size());
+                        found[task] = shards_[task / num_chunks]->Search(
+                            queries.data() + begin * dimension_, end - begin,
+                            k);
+                    });
+            } catch (const std::exception& e) {
+                ReportError(std::string("Search failed : ") + e.what());
+                failed = true;
+            }
+            pool_.ParallelFor(0, live.size(), [&](size_t i, int /*thread*/) {
+                if (failed) {
+                    Respond(*live[i]->connection, live[i]->id, STATUS_ERROR,
+                            nullptr, 0);
+                    return;
+                }
+                size_t chunk = 0;
+                while (ChunkBegin(chunk + 1, num_chunks, live.size()) <= i) {
+                    chunk++;
+                }
+                size_t offset = i - ChunkBegin(chunk, num_chunks, live.size());
+                SearchAlgorithm::ResultType merged;
+                for (size_t shard = 0; shard < shards_.size(); shard++) {
+                    SearchAlgorithm::ResultType& result =
+                        found[shard * num_chunks + chunk][offset];
+                    while (!result.empty()) {
+                        if (merged.size() < live[i]->k ||
+                            result.top().first < merged.top().first) {
+                            merged.push(result.top());
+                            if (merged.size() > live[i]->k) {
+                                merged.pop();
+                            }
+                        }
+                        result.pop();
+                    }
+                }
+                std::vector<ResultEntry> entries(merged.size());
+                for (size_t j = entries.size(); j > 0; j--) {
+                    entries[j - 1].distance = merged.top().first;
+                    entries[j - 1].id = merged.top().second;
+                    merged.pop();
+                }
+                Respond(*live[i]->connection, live[i]->id, STATUS_OK,
+                        entries.data(), entries.size());
+                latencies[i] = MicrosSince(live[i]->arrival);
+            });
+        }
+        Adapt(batch.size(), num_expired, failed, latencies, MicrosSince(start));
+    }
+
+    // Counts an error and keeps its message for stats(), besides logging it.
+    void ReportError(const std::string& message) {
+        LOG_ERROR(message);
+        std::unique_lock<std::mutex> lock(queue_guard_);
+        stats_.errors++;
+        stats_.last_error = message;
+    }
+
+    // Start of chunk in [0, size) split into num_chunks near equal parts.
+    static size_t ChunkBegin(size_t chunk, size_t num_chunks, size_t size) {
+        return size * chunk / num_chunks;
+    }
+
+    // Counts the batch and sizes the next one.
+    void Adapt(size_t batch_size, size_t num_expired, bool failed,
+               const std::vector<double>& latencies, double batch_micros) {
+        std::unique_lock<std::mutex> lock(queue_guard_);
+        stats_.batches++;
+        stats_.batch_sizes.Add(batch_size);
+        stats_.expired += num_expired;
+        if (failed) {
+            stats_.failed += latencies.size();
+            return;
+        }
+        if (latencies.empty()) {
+            return;
+        }
+        double cost = batch_micros / latencies.size();
+        query_cost_micros_ = query_cost_micros_ == 0
+                                 ? cost
+                                 : 0.9 * query_cost_micros_ + 0.1 * cost;
+        for (double latency : latencies) {
+            stats_.latencies.Add(latency);
+            window_[window_pos_] = latency;
+            window_pos_ = (window_pos_ + 1) % window_.size();
+            window_count_ = std::min(window_count_ + 1, window_.size());
+        }
+        std::vector<double> recent(window_.begin(),
+                                   window_.begin() + window_count_);
+        size_t rank = recent.size() * 99 / 100;
+        std::nth_element(recent.begin(), recent.begin() + rank, recent.end());
+        double p99 = recent[rank];
+        if (p99 > options_.latency_target_micros) {
+            if (window_count_ >= kMinLatencySamples && batch_limit_ > 1) {
+                batch_limit_ = std::max<size_t>(
+                    std::min(batch_limit_ - 1, batch_limit_ * 9 / 10), 1);
+                window_pos_ = 0;
+                window_count_ = 0;
+            }
+        } else if (batch_size >= batch_limit_ &&
+                   batch_limit_ < options_.max_batch_size) {
+            // Only grown when demand filled the batch.
+            batch_limit_++;
+        }
+    }
+
+    void Respond(Connection& connection, uint32_t id, ResponseStatus status,
+                 const ResultEntry* entries, size_t count) {
+        std::vector<char> message(sizeof(ResponseHeader) +
+                                  count * sizeof(ResultEntry));
+        ResponseHeader header;
+        header.id = id;
+        header.status = status;
+        header.count = count;
+        memcpy(message.data(), &header, sizeof(header));
+        if (count > 0) {
+            memcpy(message.data() + sizeof(header), entries,
+                   count * sizeof(ResultEntry));
+        }
+        // A client that hung up or stopped reading misses its responses. A
+        // send that timed out may have written part of one, so the
+        // connection cannot be used any more and is shut down, which also
+        // ends its reader.
+        std::unique_lock<std::mutex> lock(connection.write_guard);
+        if (connection.broken) {
+            return;
+        }
+        if (!WriteFully(connection.fd, message.data(), message.size())) {
+            connection.broken = true;
+            shutdown(connection.fd, SHUT_RDWR);
+            std::unique_lock<std::mutex> stats_lock(queue_guard_);
+            stats_.dropped_connections++;
+        }
+    }
+
+    std::vector<SearchAlgorithm*> shards_;
+    SearchServerOptions options_;
+    DimensionType dimension_;
+    ThreadPool pool_;
+    int listen_fd_;
+    std::thread acceptor_;
+    std::thread scheduler_;
+    // Only touched by the acceptor while serving.
+    std::list<std::shared_ptr<Connection> > connections_;
+
+    // Guards the queue, the stats and the batch size controller.
+    mutable std::mutex queue_guard_;
+    std::condition_variable queue_ready_;
+    std::deque<Request> queue_;
+    std::atomic<bool> stop_;
+    size_t batch_limit_;
+    double query_cost_micros_;
+    std::vector<double> window_;
+    size_t window_pos_;
+    size_t window_count_;
+    SearchServerStats stats_;
+};
+
+}  // namespace fast_ann
+
+#endif  // FAST_ANN_SERVER_SEARCH_SERVER_H_
@@ -0,0 +1,247 @@
+#ifndef FAST_ANN_STORAGE_VECTOR_FILE_H_
+#define FAST_ANN_STORAGE_VECTOR_FILE_H_
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "fast_ann/dataset.h"
+
+namespace fast_ann {
+
+const size_t kVectorFileHeaderBytes = 4096;
+const size_t kVectorFileSectorBytes = 512;
+const uint64_t kVectorFileMagic = 0x314345564e4e4146ULL;  // "FANNVEC1"
+
+// Read only, SSD resident store of full precision vectors. Records are padded
+// to whole sectors and start at a page aligned offset, so that they can be
+// read with O_DIRECT. Vectors are addressed by their position in the dataset
+// used to write the file. A record can also hold the positions of up to
+// max_neighbors other vectors, its neighbors in a graph, so that a graph
+// search reads a node in one request.
+template <typename T>
+class VectorFile {
+   public:
+    static void Write(const std::string& file_name, Dataset<T>& dataset) {
+        Write(file_name, dataset, 0,
+              [](DatasetIndexType, std::vector<DatasetIndexType>&) {});
+    }
+
+    // neighbors(position, list) fills list with the neighbors of the vector
+    // at position, at most max_neighbors of them.
+    template <typename Neighbors>
+    static void Write(const std::string& file_name, Dataset<T>& dataset,
+                      size_t max_neighbors, Neighbors neighbors) {
+        std::ofstream output(file_name, std::ios::binary);
+        if (!output) {
+            throw std::runtime_error("Cannot create vector file " + file_name);
+        }
+        uint64_t dimension = dataset.dimension();
+        uint64_t size = dataset.size();
+        uint64_t stride = GetStride(dimension, max_neighbors);
+        uint64_t header_neighbors = max_neighbors;
+        std::vector<char> page(kVectorFileHeaderBytes, 0);
+        memcpy(page.data(), &kVectorFileMagic, sizeof(uint64_t));
+        memcpy(page.data() + sizeof(uint64_t), &dimension, sizeof(uint64_t));
+        memcpy(page.data() + 2 * sizeof(uint64_t), &size, sizeof(uint64_t));
+        memcpy(page.data() + 3 * sizeof(uint64_t), &stride, sizeof(uint64_t));
+        memcpy(page.data() + 4 * sizeof(uint64_t), &header_neighbors,
+               sizeof(uint64_t));
+        output.write(page.data(), kVectorFileHeaderBytes);
+        std::vector<char> record(stride, 0);
+        std::vector<DatasetIndexType> list;
+        for (DatasetIndexType i = 0; i < dataset.size(); i++) {
+            memcpy(record.data(), dataset.item_at(i).second,
+                   dimension * sizeof(T));
+            if (max_neighbors > 0) {
+                list.clear();
+                neighbors(i, list);
+                uint32_t count = std::min(list.size(), max_neighbors);
+                char* links = record.data() + dimension * sizeof(T);
+                memcpy(links, &count, sizeof(uint32_t));
+                memcpy(links + sizeof(uint32_t), list.data(),
+                       count * sizeof(DatasetIndexType));
+            }
+            output.write(record.data(), stride);
+        }
+        if (!output) {
+            throw std::runtime_error("Failed writing vector file " + file_name);
+        }
+    }
+
+    VectorFile(const std::string& file_name, bool direct_io = true)
+        : direct_io_(direct_io) {
+        fd_ = -1;
+        max_neighbors_ = 0;
+#ifdef O_DIRECT
+        if (direct_io_) {
+            fd_ = open(file_name.c_str(), O_RDONLY | O_DIRECT);
+        }
+#endif
+        if (fd_ < 0) {
+            // Not every file system supports O_DIRECT, use the page cache.
+            direct_io_ = false;
+            fd_ = open(file_name.c_str(), O_RDONLY);
+        }
+        if (fd_ < 0) {
+            throw std::runtime_error("Cannot open vector file " + file_name);
+        }
+        char* page = AllocateAligned(kVectorFileHeaderBytes);
+        if (page == nullptr) {
+            close(fd_);
+            throw std::runtime_error("Not enough memory to open vector file");
+        }
+        ssize_t n = pread(fd_, page, kVectorFileHeaderBytes, 0);
+        uint64_t magic = 0;
+        if (n == (ssize_t)kVectorFileHeaderBytes) {
+            memcpy(&magic, page, sizeof(uint64_t));
+            memcpy(&dimension_, page + sizeof(uint64_t), sizeof(uint64_t));
+            memcpy(&size_, page + 2 * sizeof(uint64_t), sizeof(uint64_t));
+            memcpy(&stride_, page + 3 * sizeof(uint64_t), sizeof(uint64_t));
+            // Zero in files written before records held neighbors.
+            memcpy(&max_neighbors_, page + 4 * sizeof(uint64_t),
+                   sizeof(uint64_t));
+        }
+        free(page);
+        if (magic != kVectorFileMagic) {
+            close(fd_);
+            throw std::runtime_error("Not a vector file " + file_name);
+        }
+    }
+
+    ~VectorFile() { close(fd_); }
+
+    VectorFile(const VectorFile&) = delete;
+    VectorFile& operator=(const VectorFile&) = delete;
+
+    // Reads the vectors at the given positions into out, one after another in
+    // the order of positions. Reads of adjacent records are coalesced and the
+    // resulting runs are issued concurrently to keep the device queue deep.
+    // The neighbors of each vector, in the same order, are read as well when
+    // neighbors is given.
+    void ReadBatch(const std::vector<DatasetIndexType>& positions, T* out,
+                   std::vector<std::vector<DatasetIndexType> >* neighbors =
+                       nullptr) const {
+        if (neighbors != nullptr) {
+            neighbors->resize(positions.size());
+        }
+        std::vector<std::pair<DatasetIndexType, size_t> > sorted;
+        sorted.reserve(positions.size());
+        for (size_t i = 0; i < positions.size(); i++) {
+            if (positions[i] < 0 || (uint64_t)positions[i] >= size_) {
+                throw std::runtime_error("Vector file position out of range");
+            }
+            sorted.push_back({positions[i], i});
+        }
+        std::sort(sorted.begin(), sorted.end());
+
+        std::vector<size_t> run_starts;
+        for (size_t i = 0; i < sorted.size(); i++) {
+            if (i == 0 || sorted[i].first > sorted[i - 1].first + 1) {
+                run_starts.push_back(i);
+            }
+        }
+        run_starts.push_back(sorted.size());
+
+        int num_runs = run_starts.size() - 1;
+        bool failed = false;
+#pragma omp parallel for schedule(dynamic) reduction(|| : failed)
+        for (int r = 0; r < num_runs; r++) {
+            size_t first = run_starts[r];
+            size_t last = run_starts[r + 1];
+            DatasetIndexType first_pos = sorted[first].first;
+            DatasetIndexType last_pos = sorted[last - 1].first;
+            size_t bytes = (last_pos - first_pos + 1) * stride_;
+            char* buffer = AllocateAligned(bytes);
+            if (buffer == nullptr ||
+                !ReadFully(buffer, bytes,
+                           kVectorFileHeaderBytes + first_pos * stride_)) {
+                failed = true;
+            } else {
+                for (size_t i = first; i < last; i++) {
+                    const char* record =
+                        buffer + (sorted[i].first - first_pos) * stride_;
+                    memcpy(out + sorted[i].second * dimension_, record,
+                           dimension_ * sizeof(T));
+                    if (neighbors != nullptr) {
+                        ReadNeighbors(record,
+                                      (*neighbors)[sorted[i].second]);
+                    }
+                }
+            }
+            free(buffer);
+        }
+        if (failed) {
+            throw std::runtime_error("Failed reading from vector file");
+        }
+    }
+
+    inline DimensionType dimension() const { return dimension_; }
+
+    inline DatasetIndexType size() const { return size_; }
+
+    inline size_t max_neighbors() const { return max_neighbors_; }
+
+   private:
+    static uint64_t GetStride(uint64_t dimension, size_t max_neighbors) {
+        uint64_t bytes = dimension * sizeof(T);
+        if (max_neighbors > 0) {
+            bytes += sizeof(uint32_t) +
+                     max_neighbors * sizeof(DatasetIndexType);
+        }
+        return (bytes + kVectorFileSectorBytes - 1) / kVectorFileSectorBytes *
+               kVectorFileSectorBytes;
+    }
+
+    static char* AllocateAligned(size_t bytes) {
+        void* ptr = nullptr;
+        if (posix_memalign(&ptr, kVectorFileHeaderBytes, bytes) != 0) {
+            return nullptr;
+        }
+        return (char*)ptr;
+    }
+
+    void ReadNeighbors(const char* record,
+                       std::vector<DatasetIndexType>& list) const {
+        uint32_t count = 0;
+        if (max_neighbors_ > 0) {
+            memcpy(&count, record + dimension_ * sizeof(T), sizeof(uint32_t));
+            count = std::min<uint64_t>(count, max_neighbors_);
+        }
+        list.resize(count);
+        memcpy(list.data(),
+               record + dimension_ * sizeof(T) + sizeof(uint32_t),
+               count * sizeof(DatasetIndexType));
+    }
+
+    bool ReadFully(char* buffer, size_t bytes, off_t offset) const {
+        while (bytes > 0) {
+            ssize_t n = pread(fd_, buffer, bytes, offset);
+            if (n <= 0) {
+                return false;
+            }
+            buffer += n;
+            bytes -= n;
+            offset += n;
+        }
+        return true;
+    }
+
+    int fd_;
+    bool direct_io_;
+    uint64_t dimension_;
+    uint64_t size_;
+    uint64_t stride_;
+    uint64_t max_neighbors_;
+};
+
+}  // namespace fast_ann
+
+#endif  // FAST_ANN_STORAGE_VECTOR_FILE_H_
@@ -0,0 +1,149 @@
+#ifndef FAST_ANN_THREAD_POOL_H_
+#define FAST_ANN_THREAD_POOL_H_
+
+#include <stddef.h>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "fast_ann/numa.h"
+
+namespace fast_ann {
+
+// Threads started once and reused by every ParallelFor, for callers issuing
+// many small batches, where starting threads per batch as hnswlib's
+// ParallelFor does would cost as much as the searches. The calling thread
+// takes part in the work. As in NumaParallelFor, thread t is pinned to node t
+// modulo the node count on multi-socket hosts.
+class ThreadPool {
+   public:
+    // Hardware concurrency if num_threads is not positive.
+    explicit ThreadPool(int num_threads = 0)
+        : num_threads_(num_threads > 0 ? num_threads
+                                       : std::thread::hardware_concurrency()),
+          generation_(0),
+          num_busy_(0),
+          stop_(false) {
+        if (num_threads_ < 1) {
+            num_threads_ = 1;
+        }
+        for (int t = 1; t < num_threads_; t++) {
+            workers_.push_back(std::thread(&ThreadPool::Work, this, t));
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::unique_lock<std::mutex> lock(guard_);
+            stop_ = true;
+        }
+        start_.notify_all();
+        for (std::thread& worker : workers_) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const { return num_threads_; }
+
+    // Runs fn(i, thread) for i in [begin, end) and returns once all are done,
+    // thread being the index in [0, size()) of the thread running it.
+    // Rethrows the last exception raised by any of them. Calls from
+    // different threads run one after another.
+    template <typename Function>
+    void ParallelFor(size_t begin, size_t end, Function fn) {
+        if (begin >= end) {
+            return;
+        }
+        std::unique_lock<std::mutex> call_lock(call_guard_);
+        if (num_threads_ == 1 || end - begin == 1) {
+            for (size_t i = begin; i < end; i++) {
+                fn(i, 0);
+            }
+            return;
+        }
+        {
+            std::unique_lock<std::mutex> lock(guard_);
+            job_ = fn;
+            next_ = begin;
+            end_ = end;
+            last_exception_ = nullptr;
+            num_busy_ = num_threads_ - 1;
+            generation_++;
+        }
+        start_.notify_all();
+        RunJob(0);
+        std::unique_lock<std::mutex> lock(guard_);
+        done_.wait(lock, [this]() { return num_busy_ == 0; });
+        job_ = nullptr;
+        if (last_exception_) {
+            std::rethrow_exception(last_exception_);
+        }
+    }
+
+   private:
+    void Work(int thread) {
+        if (NumaNodeCount() > 1) {
+            PinThreadToNumaNode(thread % NumaNodeCount());
+        }
+        size_t generation = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(guard_);
+                start_.wait(lock, [&]() {
+                    return stop_ || generation_ != generation;
+                });
+                if (stop_) {
+                    return;
+                }
+                generation = generation_;
+            }
+            RunJob(thread);
+            std::unique_lock<std::mutex> lock(guard_);
+            if (--num_busy_ == 0) {
+                done_.notify_one();
+            }
+        }
+    }
+
+    void RunJob(int thread) {
+        while (true) {
+            size_t i = next_.fetch_add(1);
+            if (i >= end_) {
+                break;
+            }
+            try {
+                job_(i, thread);
+            } catch (...) {
+                std::unique_lock<std::mutex> lock(guard_);
+                last_exception_ = std::current_exception();
+                next_ = end_;
+                break;
+            }
+        }
+    }
+
+    int num_threads_;
+    std::vector<std::thread> workers_;
+    std::mutex call_guard_;
+    std::mutex guard_;
+    std::condition_variable start_;
+    std::condition_variable done_;
+    std::function<void(size_t, int)> job_;
+    std::atomic<size_t> next_;
+    size_t end_;
+    size_t generation_;
+    int num_busy_;
+    bool stop_;
+    std::exception_ptr last_exception_;
+};
+
+}  // namespace fast_ann
+
+#endif  // FAST_ANN_THREAD_POOL_H_
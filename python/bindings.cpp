@@ -0,0 +1,362 @@
+#include <mpi.h>
+#include <pybind11/numpy.h>
+#include <pybind11/pybind11.h>
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "fast_ann/dataset.h"
+#include "fast_ann/index_factory.h"
+#include "fast_ann/search_algorithm.h"
+#include "fast_ann/search_algorithms/vp_tree_hnsw_search.h"
+#include "fast_ann/thread_pool.h"
+#include "hnswlib/hnswlib.h"
+
+namespace py = pybind11;
+
+namespace {
+
+typedef py::array_t<float, py::array::c_style> FloatArray;
+typedef py::array_t<fast_ann::DatasetIndexType, py::array::c_style>
+    LabelArray;
+
+// Fewest queries per task of a batch, so that interleaved searches have
+// groups to work on and tasks outweigh the cost of handing them out.
+const size_t kMinQueriesPerTask = 32;
+
+// Tasks per thread, to even out queries of different costs.
+const size_t kTasksPerThread = 4;
+
+// Rows of a (rows, dimension) array, a one dimensional array is one row.
+size_t CheckRows(const FloatArray& array, fast_ann::DimensionType dimension) {
+    if (array.ndim() == 1 && array.shape(0) == dimension) {
+        return 1;
+    }
+    if (array.ndim() != 2 || array.shape(1) != dimension) {
+        throw std::runtime_error("Expected an array of shape (n, " +
+                                 std::to_string(dimension) + ")");
+    }
+    return array.shape(0);
+}
+
+// The output array passed by the caller, which must have the given shape,
+// or a new one if it passed None. Arrays of another type, layout or shape
+// are rejected rather than copied, results written to a copy would be lost.
+template <typename Array>
+Array OutputArray(py::object output, size_t rows, size_t k,
+                  const std::string& name, const std::string& type_name) {
+    if (output.is_none()) {
+        return Array(std::vector<size_t>{rows, k});
+    }
+    Array array;
+    if (Array::check_(output)) {
+        array = output.cast<Array>();
+    }
+    if (!Array::check_(output) || array.ndim() != 2 ||
+        (size_t)array.shape(0) != rows || (size_t)array.shape(1) != k) {
+        throw std::runtime_error(name + " must be a C contiguous " +
+                                 type_name + " array of shape (" +
+                                 std::to_string(rows) + ", " +
+                                 std::to_string(k) + ")");
+    }
+    return array;
+}
+
+// Writes a result in increasing distance, padding the row with -1 and
+// infinity when it holds fewer than k neighbors.
+template <typename ResultType>
+void WriteResult(ResultType& result, size_t k,
+                 fast_ann::DatasetIndexType* labels, float* distances) {
+    for (size_t j = result.size(); j < k; j++) {
+        labels[j] = -1;
+        distances[j] = std::numeric_limits<float>::infinity();
+    }
+    while (result.size() > k) {
+        result.pop();
+    }
+    for (size_t j = result.size(); j-- > 0;) {
+        labels[j] = result.top().second;
+        distances[j] = result.top().first;
+        result.pop();
+    }
+}
+
+// MPI is initialized on first use, unless the caller did it already, e.g.
+// through mpi4py, and then finalized at exit.
+void EnsureMpiInitialized() {
+    int initialized;
+    MPI_Initialized(&initialized);
+    if (initialized) {
+        return;
+    }
+    MPI_Init(nullptr, nullptr);
+    py::module::import("atexit").attr("register")(py::cpp_function([]() {
+        int finalized;
+        MPI_Finalized(&finalized);
+        if (!finalized) {
+            MPI_Finalize();
+        }
+    }));
+}
+
+// An index of fast_ann/index_factory.h. Arrays are read and written in place
+// and the GIL is released for the whole of each call. Batches of queries are
+// split over a thread pool that persists across calls.
+class Index {
+   public:
+    Index(const std::string& description, fast_ann::DimensionType dimension)
+        : algorithm_(
+              fast_ann::CreateSearchAlgorithm(description, dimension)),
+          num_threads_(0) {}
+
+    void Add(const FloatArray& data, py::object ids) {
+        size_t rows = CheckRows(data, algorithm_->dimension());
+        std::vector<fast_ann::DatasetIndexType> ids_buffer;
+        LabelArray ids_array;
+        const fast_ann::DatasetIndexType* ids_ptr = nullptr;
+        if (!ids.is_none()) {
+            if (!LabelArray::check_(ids)) {
+                throw std::runtime_error(
+                    "ids must be a C contiguous array of int32");
+            }
+            ids_array = ids.cast<LabelArray>();
+            if ((size_t)ids_array.size() != rows) {
+                throw std::runtime_error("Expected one id per vector");
+            }
+            ids_ptr = ids_array.data();
+        }
+        const float* data_ptr = data.data();
+        py::gil_scoped_release release;
+        std::unique_lock<std::mutex> lock(guard_);
+        // Numbered under the lock, so that concurrent calls get distinct ids.
+        if (ids_ptr == nullptr) {
+            ids_buffer.resize(rows);
+            for (size_t i = 0; i < rows; i++) {
+                ids_buffer[i] = algorithm_->size() + i;
+            }
+            ids_ptr = ids_buffer.data();
+        }
+        algorithm_->Add(data_ptr, ids_ptr, rows);
+    }
+
+    // Writes the k nearest neighbors of each query into labels and
+    // distances, allocated when not given, and returns both.
+    py::tuple Search(const FloatArray& queries, size_t k, py::object labels,
+                     py::object distances) {
+        fast_ann::DimensionType dimension = algorithm_->dimension();
+        size_t rows = CheckRows(queries, dimension);
+        LabelArray labels_array =
+            OutputArray<LabelArray>(labels, rows, k, "labels", "int32");
+        FloatArray distances_array =
+            OutputArray<FloatArray>(distances, rows, k, "distances",
+                                    "float32");
+        const float* query_ptr = queries.data();
+        fast_ann::DatasetIndexType* label_ptr = labels_array.mutable_data();
+        float* distance_ptr = distances_array.mutable_data();
+        {
+            py::gil_scoped_release release;
+            std::unique_lock<std::mutex> lock(guard_);
+            fast_ann::ThreadPool& pool = Pool();
+            size_t task_size = std::max(
+                kMinQueriesPerTask,
+                (rows + pool.size() * kTasksPerThread - 1) /
+                    (pool.size() * kTasksPerThread));
+            size_t num_tasks = (rows + task_size - 1) / task_size;
+            pool.ParallelFor(0, num_tasks, [&](size_t task, int) {
+                size_t begin = task * task_size;
+                size_t count = std::min(task_size, rows - begin);
+                auto results = algorithm_->Search(
+                    query_ptr + begin * dimension, count, k);
+                for (size_t i = 0; i < count; i++) {
+                    WriteResult(results[i], k, label_ptr + (begin + i) * k,
+                                distance_ptr + (begin + i) * k);
+                }
+            });
+        }
+        return py::make_tuple(labels_array, distances_array);
+    }
+
+    bool SetOption(const std::string& name, size_t value) {
+        py::gil_scoped_release release;
+        std::unique_lock<std::mutex> lock(guard_);
+        return algorithm_->SetOption(name, value);
+    }
+
+    // Threads of searches and of HNSW insertions, hardware concurrency when
+    // not positive.
+    void SetNumThreads(int num_threads) {
+        py::gil_scoped_release release;
+        std::unique_lock<std::mutex> lock(guard_);
+        num_threads_ = num_threads;
+        pool_.reset();
+        algorithm_->SetOption("threads", std::max(num_threads, 0));
+    }
+
+    int num_threads() {
+        py::gil_scoped_release release;
+        std::unique_lock<std::mutex> lock(guard_);
+        return Pool().size();
+    }
+
+    void Save(const std::string& file_name) {
+        py::gil_scoped_release release;
+        std::unique_lock<std::mutex> lock(guard_);
+        algorithm_->Save(file_name);
+    }
+
+    void Load(const std::string& file_name) {
+        py::gil_scoped_release release;
+        std::unique_lock<std::mutex> lock(guard_);
+        algorithm_->Load(file_name);
+    }
+
+    size_t size() {
+        py::gil_scoped_release release;
+        std::unique_lock<std::mutex> lock(guard_);
+        return algorithm_->size();
+    }
+
+    fast_ann::DimensionType dimension() {
+        py::gil_scoped_release release;
+        std::unique_lock<std::mutex> lock(guard_);
+        return algorithm_->dimension();
+    }
+
+   private:
+    fast_ann::ThreadPool& Pool() {
+        if (!pool_) {
+            pool_.reset(new fast_ann::ThreadPool(num_threads_));
+        }
+        return *pool_;
+    }
+
+    std::unique_ptr<fast_ann::SearchAlgorithm> algorithm_;
+    // Held by every call once the GIL is released, searches already use
+    // every thread of the pool.
+    std::mutex guard_;
+    std::unique_ptr<fast_ann::ThreadPool> pool_;
+    int num_threads_;
+};
+
+// VPTreeHNSWSearch over squared L2. Every rank builds it from the same data,
+// which it keeps a reference to instead of a copy, and calls search with the
+// same number of queries. The last rank returns the results, the other ranks
+// serve its partition searches and return rows of -1. Queries are searched
+// one after another, as the protocol between the ranks expects.
+class VPTreeHNSWIndex {
+   public:
+    VPTreeHNSWIndex(const FloatArray& data, size_t M,
+                    size_t ef_construction)
+        : data_(data) {
+        EnsureMpiInitialized();
+        if (data.ndim() != 2) {
+            throw std::runtime_error("Expected an array of shape (n, dim)");
+        }
+        size_t rows = data.shape(0);
+        dimension_ = data.shape(1);
+        std::vector<fast_ann::DatasetIndexType> ids(rows);
+        for (size_t i = 0; i < rows; i++) {
+            ids[i] = i;
+        }
+        space_.reset(new hnswlib::L2Space(dimension_));
+        // Only the order of the items is changed while building, never the
+        // vectors.
+        fast_ann::Dataset<float> dataset = fast_ann::Dataset<float>::FromBuffer(
+            const_cast<float*>(data.data()), ids.data(), rows, dimension_);
+        py::gil_scoped_release release;
+        search_.reset(new fast_ann::VPTreeHNSWSearch<float>(
+            space_.get(), dataset, M, ef_construction));
+        int rank, num_procs;
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+        MPI_Comm_size(MPI_COMM_WORLD, &num_procs);
+        is_client_ = rank == num_procs - 1;
+    }
+
+    py::tuple Search(const FloatArray& queries, size_t k, py::object labels,
+                     py::object distances) {
+        size_t rows = CheckRows(queries, dimension_);
+        LabelArray labels_array =
+            OutputArray<LabelArray>(labels, rows, k, "labels", "int32");
+        FloatArray distances_array =
+            OutputArray<FloatArray>(distances, rows, k, "distances",
+                                    "float32");
+        const float* query_ptr = queries.data();
+        fast_ann::DatasetIndexType* label_ptr = labels_array.mutable_data();
+        float* distance_ptr = distances_array.mutable_data();
+        {
+            py::gil_scoped_release release;
+            for (size_t i = 0; i < rows; i++) {
+                auto result =
+                    search_->searchKnn(query_ptr + i * dimension_, k);
+                WriteResult(result, k, label_ptr + i * k,
+                            distance_ptr + i * k);
+            }
+        }
+        return py::make_tuple(labels_array, distances_array);
+    }
+
+    void SetEf(size_t ef) { search_->set_ef(ef); }
+
+    bool is_client() const { return is_client_; }
+
+    fast_ann::DimensionType dimension() const { return dimension_; }
+
+   private:
+    FloatArray data_;
+    fast_ann::DimensionType dimension_;
+    std::unique_ptr<hnswlib::L2Space> space_;
+    std::unique_ptr<fast_ann::VPTreeHNSWSearch<float> > search_;
+    bool is_client_;
+};
+
+}  // namespace
+
+PYBIND11_MODULE(fast_ann, m) {
+    m.doc() = "Batched approximate nearest neighbor search over fast_ann";
+
+    py::class_<Index>(m, "Index")
+        .def(py::init<const std::string&, fast_ann::DimensionType>(),
+             py::arg("description"), py::arg("dim"),
+             "Index built from a description such as "
+             "'HNSW32,SQ8,ef_construction=100', see index_factory.h")
+        .def("add", &Index::Add, py::arg("data").noconvert(),
+             py::arg("ids") = py::none(),
+             "Adds the float32 rows of data, with ids 0, 1, ... after the "
+             "current size unless int32 ids are given")
+        .def("search", &Index::Search, py::arg("queries").noconvert(),
+             py::arg("k") = 1, py::arg("labels") = py::none(),
+             py::arg("distances") = py::none(),
+             "Writes the k nearest neighbors of each float32 query row into "
+             "labels (int32) and distances (float32) of shape (n, k), "
+             "allocated when not given, and returns both")
+        .def("set_option", &Index::SetOption, py::arg("name"),
+             py::arg("value"),
+             "Sets a search option such as ef, returns False if the index "
+             "has none of that name")
+        .def("set_num_threads", &Index::SetNumThreads, py::arg("num_threads"))
+        .def_property_readonly("num_threads", &Index::num_threads)
+        .def("save", &Index::Save, py::arg("path"))
+        .def("load", &Index::Load, py::arg("path"))
+        .def_property_readonly("dim", &Index::dimension)
+        .def("__len__", &Index::size);
+
+    py::class_<VPTreeHNSWIndex>(m, "VPTreeHNSWIndex")
+        .def(py::init<const FloatArray&, size_t, size_t>(),
+             py::arg("data").noconvert(), py::arg("M") = 16,
+             py::arg("ef_construction") = 200,
+             "Distributed index over the MPI ranks, built on every rank from "
+             "the same float32 data, which must outlive it unchanged")
+        .def("search", &VPTreeHNSWIndex::Search,
+             py::arg("queries").noconvert(), py::arg("k") = 1,
+             py::arg("labels") = py::none(),
+             py::arg("distances") = py::none(),
+             "Must be called on every rank, only the last one gets results")
+        .def("set_ef", &VPTreeHNSWIndex::SetEf, py::arg("ef"))
+        .def_property_readonly("is_client", &VPTreeHNSWIndex::is_client)
+        .def_property_readonly("dim", &VPTreeHNSWIndex::dimension);
+}
@@ -0,0 +1,32 @@
+# Smoke test of the fast_ann module, run by ctest with the module directory
+# on PYTHONPATH: builds an index, searches into arrays owned by the caller and
+# checks each base vector finds itself.
+import numpy
+
+import fast_ann
+
+dim, n, k = 16, 2000, 5
+rng = numpy.random.default_rng(7)
+base = rng.random((n, dim), dtype=numpy.float32)
+
+index = fast_ann.Index("HNSW16,ef_construction=100,ef=64", dim)
+index.add(base)
+assert len(index) == n and index.dim == dim
+
+queries = base[:100]
+labels = numpy.full((len(queries), k), -1, dtype=numpy.int32)
+distances = numpy.full((len(queries), k), -1, dtype=numpy.float32)
+returned_labels, returned_distances = index.search(queries, k, labels,
+                                                   distances)
+# The results are written in place, not into copies.
+assert numpy.shares_memory(returned_labels, labels)
+assert numpy.shares_memory(returned_distances, distances)
+assert (labels[:, 0] == numpy.arange(len(queries))).mean() >= 0.99
+assert (distances[:, 0] <= 1e-5).mean() >= 0.99
+assert (numpy.diff(distances, axis=1) >= 0).all()
+
+ids = numpy.arange(n, n + 10, dtype=numpy.int32)
+index.add(base[:10] + 1, ids)
+assert len(index) == n + 10
+
+print("ok")
@@ -0,0 +1,107 @@
+#include <omp.h>
+#include <unistd.h>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include "fast_ann/benchmark/timer.h"
+#include "fast_ann/data_readers/xvecs_stream_reader.h"
+#include "fast_ann/knn_graph.h"
+#include "fast_ann/log_sinks/scoped_log_sink.h"
+#include "fast_ann/logger.h"
+#include "hnswlib/hnswlib.h"
+
+int main(int argc, char **argv) {
+    std::string base_vectors_file_name, graph_file_name, distances_file_name,
+        log_file_name;
+    size_t k = 32;
+    size_t M = 16;
+    size_t ef_construction = 100;
+    size_t ef = 0;
+    size_t max_iterations = 2;
+    int num_threads = 0;
+    bool async_logging = false;
+    int cmd_flag;
+    while ((cmd_flag = getopt(argc, argv, "Ab:g:d:l:k:m:c:e:i:t:")) != -1) {
+        switch (cmd_flag) {
+            case 'b':
+                base_vectors_file_name.assign(optarg);
+                break;
+            case 'g':
+                graph_file_name.assign(optarg);
+                break;
+            case 'd':
+                distances_file_name.assign(optarg);
+                break;
+            case 'A':
+                async_logging = true;
+                break;
+            case 'l':
+                log_file_name.assign(optarg);
+                break;
+            case 'k':
+                k = std::stoul(optarg);
+                break;
+            case 'm':
+                M = std::stoul(optarg);
+                break;
+            case 'c':
+                ef_construction = std::stoul(optarg);
+                break;
+            case 'e':
+                ef = std::stoul(optarg);
+                break;
+            case 'i':
+                max_iterations = std::stoul(optarg);
+                break;
+            case 't':
+                num_threads = std::stoi(optarg);
+                break;
+            default:
+                std::cerr << "main() : Invalid command line argument"
+                          << std::endl;
+                exit(1);
+        }
+    }
+    if (base_vectors_file_name.empty() || graph_file_name.empty()) {
+        std::cerr << "main() : Base vector file and graph output file must be "
+                     "specified (use -b -g flags)\n";
+        exit(1);
+    }
+    fast_ann::ScopedLogSink log_sink(log_file_name, async_logging);
+    if (!log_sink.is_open()) {
+        std::cerr << "main() : Error opening log file\n";
+        exit(1);
+    }
+    fast_ann::SetLogLevel(fast_ann::LogLevel::INFO);
+    if (num_threads > 0) {
+        omp_set_num_threads(num_threads);
+    }
+
+    fast_ann::XvecsStreamReader<float> reader(base_vectors_file_name);
+    fast_ann::DimensionType dimension = reader.dimension();
+    size_t base_size = reader.size();
+    std::vector<float> base(base_size * dimension);
+    reader.ReadBlock(base.data(), base_size);
+    std::vector<hnswlib::labeltype> labels(base_size);
+    for (size_t i = 0; i < base_size; i++) {
+        labels[i] = i;
+    }
+
+    fast_ann::Timer timer;
+    hnswlib::L2Space l2space(dimension);
+    hnswlib::HierarchicalNSW<float> index(&l2space, base_size, M,
+                                          ef_construction);
+    index.addPoints(base.data(), labels.data(), base_size, num_threads);
+    std::cout << "Built the index in " << timer.GetElapsedTime() << " ms"
+              << std::endl;
+
+    timer.reset();
+    fast_ann::KnnGraph<float> graph(&index, k);
+    graph.Build(ef, max_iterations);
+    std::cout << "Built the k-NN graph in " << timer.GetElapsedTime() << " ms"
+              << std::endl;
+
+    graph.WriteIvecs(graph_file_name, distances_file_name);
+    return 0;
+}
@@ -0,0 +1,291 @@
+#include <mpi.h>
+#include <omp.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include "fast_ann/data_readers/xvecs_stream_reader.h"
+#include "fast_ann/data_writers/xvecs_writer.h"
+#include "fast_ann/log_sinks/scoped_log_sink.h"
+#include "fast_ann/logger.h"
+#include "hnswlib/hnswlib.h"
+
+// Queries and base vectors are compared tile by tile, so that a tile of base
+// vectors stays in cache while every query of a tile is compared to it.
+const size_t kQueryTile = 16;
+const size_t kBaseTile = 256;
+const size_t kDefaultBlockSize = 1 << 18;
+
+typedef std::pair<float, int> Neighbor;
+typedef std::priority_queue<Neighbor> NeighborHeap;
+
+// Cosine distances compare the vectors normalized, as the indexes store them.
+void Normalize(float *data, size_t count, fast_ann::DimensionType dimension) {
+    for (size_t i = 0; i < count; i++) {
+        hnswlib::normalizeVector(data + i * dimension, data + i * dimension,
+                                 dimension);
+    }
+}
+
+template <typename T>
+std::vector<float> ReadAll(const std::string &file_name,
+                           fast_ann::DimensionType &dimension,
+                           bool normalize) {
+    fast_ann::XvecsStreamReader<T> reader(file_name);
+    dimension = reader.dimension();
+    std::vector<float> data(reader.size() * dimension);
+    reader.ReadBlock(data.data(), reader.size());
+    if (normalize) {
+        Normalize(data.data(), reader.size(), dimension);
+    }
+    return data;
+}
+
+// Streams the base vectors in [begin, end) and keeps the k nearest of them
+// for every query. The next block is read while the current one is searched.
+template <typename T>
+void SearchShard(const std::string &file_name, size_t begin, size_t end,
+                 const std::vector<float> &queries,
+                 fast_ann::DimensionType dimension, size_t k,
+                 size_t block_size, hnswlib::SpaceInterface<float> *space,
+                 bool normalize, std::vector<NeighborHeap> &heaps) {
+    fast_ann::XvecsStreamReader<T> reader(file_name);
+    if (reader.dimension() != dimension) {
+        throw std::runtime_error("Base and query dimensions differ");
+    }
+    hnswlib::DISTFUNC<float> fstdistfunc = space->get_dist_func();
+    void *dist_func_param = space->get_dist_func_param();
+    size_t num_queries = heaps.size();
+    size_t num_query_tiles = (num_queries + kQueryTile - 1) / kQueryTile;
+
+    std::vector<float> current(block_size * dimension);
+    std::vector<float> next(block_size * dimension);
+    reader.Seek(begin);
+    size_t current_begin = begin;
+    size_t current_count =
+        reader.ReadBlock(current.data(), std::min(block_size, end - begin));
+    if (normalize) {
+        Normalize(current.data(), current_count, dimension);
+    }
+    while (current_count > 0) {
+        size_t next_begin = current_begin + current_count;
+        size_t next_count = 0;
+        std::thread prefetch([&]() {
+            next_count = reader.ReadBlock(
+                next.data(), std::min(block_size, end - next_begin));
+            if (normalize) {
+                Normalize(next.data(), next_count, dimension);
+            }
+        });
+
+#pragma omp parallel for schedule(dynamic)
+        for (size_t query_tile = 0; query_tile < num_query_tiles;
+             query_tile++) {
+            size_t query_begin = query_tile * kQueryTile;
+            size_t query_end =
+                std::min(query_begin + kQueryTile, num_queries);
+            for (size_t base_tile = 0; base_tile < current_count;
+                 base_tile += kBaseTile) {
+                size_t base_end =
+                    std::min(base_tile + kBaseTile, current_count);
+                for (size_t q = query_begin; q < query_end; q++) {
+                    const float *query_ptr = queries.data() + q * dimension;
+                    NeighborHeap &heap = heaps[q];
+                    for (size_t b = base_tile; b < base_end; b++) {
+                        float dist = fstdistfunc(
+                            query_ptr, current.data() + b * dimension,
+                            dist_func_param);
+                        Neighbor neighbor(dist, current_begin + b);
+                        if (heap.size() < k) {
+                            heap.push(neighbor);
+                        } else if (neighbor < heap.top()) {
+                            heap.pop();
+                            heap.push(neighbor);
+                        }
+                    }
+                }
+            }
+        }
+
+        prefetch.join();
+        LOG_INFO("Searched base vectors up to " << next_begin);
+        current.swap(next);
+        current_begin = next_begin;
+        current_count = next_count;
+    }
+}
+
+int main(int argc, char **argv) {
+    MPI_Init(&argc, &argv);
+    int rank, count;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &count);
+
+    std::string base_vectors_file_name, query_vectors_file_name,
+        ground_truth_file_name, distances_file_name, log_file_name,
+        metric_name = "l2";
+    size_t k = 100;
+    size_t block_size = kDefaultBlockSize;
+    bool bvecs = false;
+    int num_threads = 0;
+    bool async_logging = false;
+    int cmd_flag;
+    while ((cmd_flag = getopt(argc, argv, "Ab:q:g:d:l:k:m:n:t:u")) != -1) {
+        switch (cmd_flag) {
+            case 'b':
+                base_vectors_file_name.assign(optarg);
+                break;
+            case 'q':
+                query_vectors_file_name.assign(optarg);
+                break;
+            case 'g':
+                ground_truth_file_name.assign(optarg);
+                break;
+            case 'd':
+                distances_file_name.assign(optarg);
+                break;
+            case 'A':
+                async_logging = true;
+                break;
+            case 'l':
+                log_file_name.assign(optarg);
+                break;
+            case 'k':
+                k = std::stoul(optarg);
+                break;
+            case 'm':
+                metric_name.assign(optarg);
+                break;
+            case 'n':
+                block_size = std::stoul(optarg);
+                break;
+            case 't':
+                num_threads = std::stoi(optarg);
+                break;
+            case 'u':
+                bvecs = true;
+                break;
+            default:
+                std::cerr << "main() : Invalid command line argument"
+                          << std::endl;
+                exit(1);
+        }
+    }
+    if (base_vectors_file_name.empty() || query_vectors_file_name.empty() ||
+        ground_truth_file_name.empty()) {
+        std::cerr << "main() : Base vector file, query vector file and ground"
+                     " truth output file must be specified (use -b -q -g "
+                     "flags)\n";
+        exit(1);
+    }
+    if (metric_name != "l2" && metric_name != "ip" &&
+        metric_name != "cosine") {
+        std::cerr << "main() : Metric must be l2, ip or cosine\n";
+        exit(1);
+    }
+    bool cosine = metric_name == "cosine";
+    fast_ann::ScopedLogSink log_sink(log_file_name, async_logging);
+    if (!log_sink.is_open()) {
+        std::cerr << "main() : Error opening log file\n";
+        exit(1);
+    }
+    fast_ann::SetLogLevel(fast_ann::LogLevel::INFO);
+    if (num_threads > 0) {
+        omp_set_num_threads(num_threads);
+    }
+
+    fast_ann::DimensionType dimension;
+    std::vector<float> queries =
+        bvecs ? ReadAll<unsigned char>(query_vectors_file_name, dimension,
+                                       cosine)
+              : ReadAll<float>(query_vectors_file_name, dimension, cosine);
+    size_t num_queries = queries.size() / dimension;
+    size_t base_size =
+        bvecs ? fast_ann::XvecsStreamReader<unsigned char>(
+                    base_vectors_file_name)
+                    .size()
+              : fast_ann::XvecsStreamReader<float>(base_vectors_file_name)
+                    .size();
+    k = std::min(k, base_size);
+
+    hnswlib::SpaceInterface<float> *space;
+    if (metric_name == "l2") {
+        space = new hnswlib::L2Space(dimension);
+    } else if (cosine) {
+        space = new hnswlib::CosineSpace(dimension);
+    } else {
+        space = new hnswlib::InnerProductSpace(dimension);
+    }
+
+    // Every rank searches a contiguous shard of the base vectors.
+    size_t shard_begin = base_size * rank / count;
+    size_t shard_end = base_size * (rank + 1) / count;
+    std::vector<NeighborHeap> heaps(num_queries);
+    if (bvecs) {
+        SearchShard<unsigned char>(base_vectors_file_name, shard_begin,
+                                   shard_end, queries, dimension, k,
+                                   block_size, space, cosine, heaps);
+    } else {
+        SearchShard<float>(base_vectors_file_name, shard_begin, shard_end,
+                           queries, dimension, k, block_size, space, cosine,
+                           heaps);
+    }
+
+    // Shards with fewer than k vectors are padded with entries that lose
+    // every comparison.
+    std::vector<Neighbor> local(num_queries * k,
+                                {std::numeric_limits<float>::max(), -1});
+    for (size_t q = 0; q < num_queries; q++) {
+        for (size_t i = heaps[q].size(); i > 0; i--) {
+            local[q * k + i - 1] = heaps[q].top();
+            heaps[q].pop();
+        }
+    }
+    std::vector<Neighbor> gathered;
+    if (rank == 0) {
+        gathered.resize(local.size() * count);
+    }
+    MPI_Gather(local.data(), local.size() * sizeof(Neighbor), MPI_BYTE,
+               gathered.data(), local.size() * sizeof(Neighbor), MPI_BYTE, 0,
+               MPI_COMM_WORLD);
+
+    if (rank == 0) {
+        fast_ann::XvecsWriter<int> ids_writer(ground_truth_file_name);
+        fast_ann::XvecsWriter<float> *distances_writer = nullptr;
+        if (!distances_file_name.empty()) {
+            distances_writer =
+                new fast_ann::XvecsWriter<float>(distances_file_name);
+        }
+        std::vector<Neighbor> merged;
+        std::vector<int> ids(k);
+        std::vector<float> distances(k);
+        for (size_t q = 0; q < num_queries; q++) {
+            merged.clear();
+            for (int r = 0; r < count; r++) {
+                auto first = gathered.begin() + (r * num_queries + q) * k;
+                merged.insert(merged.end(), first, first + k);
+            }
+            std::partial_sort(merged.begin(), merged.begin() + k,
+                              merged.end());
+            for (size_t i = 0; i < k; i++) {
+                distances[i] = merged[i].first;
+                ids[i] = merged[i].second;
+            }
+            ids_writer.Write(ids.data(), k);
+            if (distances_writer != nullptr) {
+                distances_writer->Write(distances.data(), k);
+            }
+        }
+        delete distances_writer;
+        LOG_INFO("Wrote ground truth of " << num_queries << " queries");
+    }
+
+    delete space;
+    MPI_Finalize();
+    return 0;
+}
@@ -0,0 +1,277 @@
+#include <stdint.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "fast_ann/data_writers/xvecs_writer.h"
+#include "fast_ann/log_sinks/scoped_log_sink.h"
+#include "fast_ann/logger.h"
+
+// Vectors are generated in chunks with their own random engine, seeded from
+// the dataset seed and the chunk number, so that the output does not depend
+// on the number of threads.
+const size_t kChunkSize = 4096;
+const size_t kChunksPerBatch = 256;
+const uint64_t kBaseStream = 0;
+const uint64_t kQueryStream = 1;
+const uint64_t kModelStream = 2;
+
+// Seed of the random engine of a stream and chunk. std::seed_seq keeps the
+// low 32 bits of each value, so the 64 bit ones are split in halves.
+std::vector<uint32_t> GetSeedWords(uint64_t seed, uint64_t stream,
+                                   uint64_t chunk) {
+    return {(uint32_t)seed, (uint32_t)(seed >> 32), (uint32_t)stream,
+            (uint32_t)chunk, (uint32_t)(chunk >> 32)};
+}
+
+enum Distribution { UNIFORM, GAUSSIAN, SKEWED, LOW_RANK };
+
+struct GeneratorOptions {
+    Distribution distribution;
+    fast_ann::DimensionType dimension;
+    uint64_t seed;
+    size_t num_clusters;
+    float sigma;
+    float skew;
+    float duplicate_fraction;
+    size_t intrinsic_dimension;
+};
+
+// Parameters shared by every vector of a dataset: cluster centers and their
+// popularity for the mixtures, the projection for the low rank data.
+class DatasetModel {
+   public:
+    DatasetModel(const GeneratorOptions &options) : options_(options) {
+        std::vector<uint32_t> words =
+            GetSeedWords(options.seed, kModelStream, 0);
+        std::seed_seq seed_seq(words.begin(), words.end());
+        std::mt19937_64 rng(seed_seq);
+        std::uniform_real_distribution<float> uniform(0, 1);
+        std::normal_distribution<float> normal(0, 1);
+        if (options.distribution == GAUSSIAN ||
+            options.distribution == SKEWED) {
+            centers_.resize(options.num_clusters * options.dimension);
+            for (float &value : centers_) {
+                value = uniform(rng);
+            }
+            // Cluster i is picked with probability proportional to
+            // 1 / (i + 1)^skew, a plain mixture has skew 0.
+            float skew = options.distribution == SKEWED ? options.skew : 0;
+            double total = 0;
+            for (size_t i = 0; i < options.num_clusters; i++) {
+                total += std::pow(i + 1, -skew);
+                cluster_cdf_.push_back(total);
+            }
+            for (double &value : cluster_cdf_) {
+                value /= total;
+            }
+        } else if (options.distribution == LOW_RANK) {
+            projection_.resize(options.dimension *
+                               options.intrinsic_dimension);
+            float scale = 1 / std::sqrt((float)options.intrinsic_dimension);
+            for (float &value : projection_) {
+                value = normal(rng) * scale;
+            }
+        }
+    }
+
+    void Generate(uint64_t stream, size_t chunk, size_t count,
+                  float *out) const {
+        std::vector<uint32_t> words =
+            GetSeedWords(options_.seed, stream, chunk);
+        std::seed_seq seed_seq(words.begin(), words.end());
+        std::mt19937_64 rng(seed_seq);
+        std::uniform_real_distribution<float> uniform(0, 1);
+        std::normal_distribution<float> normal(0, 1);
+        fast_ann::DimensionType dimension = options_.dimension;
+        std::vector<float> latent(options_.intrinsic_dimension);
+        for (size_t i = 0; i < count; i++) {
+            float *vector = out + i * dimension;
+            switch (options_.distribution) {
+                case UNIFORM:
+                    for (int j = 0; j < dimension; j++) {
+                        vector[j] = uniform(rng);
+                    }
+                    break;
+                case GAUSSIAN:
+                case SKEWED: {
+                    size_t cluster =
+                        std::lower_bound(cluster_cdf_.begin(),
+                                         cluster_cdf_.end(), uniform(rng)) -
+                        cluster_cdf_.begin();
+                    cluster = std::min(cluster, options_.num_clusters - 1);
+                    const float *center =
+                        centers_.data() + cluster * dimension;
+                    // Exact copies of the centers make duplicate heavy data.
+                    bool duplicate = options_.distribution == SKEWED &&
+                                     uniform(rng) < options_.duplicate_fraction;
+                    for (int j = 0; j < dimension; j++) {
+                        vector[j] = center[j];
+                        if (!duplicate) {
+                            vector[j] += options_.sigma * normal(rng);
+                        }
+                    }
+                    break;
+                }
+                case LOW_RANK:
+                    for (float &value : latent) {
+                        value = normal(rng);
+                    }
+                    for (int j = 0; j < dimension; j++) {
+                        const float *row = projection_.data() +
+                                           j * options_.intrinsic_dimension;
+                        float value = options_.sigma * normal(rng);
+                        for (size_t l = 0; l < latent.size(); l++) {
+                            value += row[l] * latent[l];
+                        }
+                        vector[j] = value;
+                    }
+                    break;
+            }
+        }
+    }
+
+   private:
+    GeneratorOptions options_;
+    std::vector<float> centers_;
+    std::vector<double> cluster_cdf_;
+    std::vector<float> projection_;
+};
+
+// Generates the vectors batch by batch, each batch in parallel, and appends
+// them to the file so that memory use does not grow with the dataset size.
+void WriteDataset(const DatasetModel &model, uint64_t stream, size_t size,
+                  fast_ann::DimensionType dimension,
+                  const std::string &file_name) {
+    fast_ann::XvecsWriter<float> writer(file_name);
+    std::vector<float> batch(std::min(size, kChunksPerBatch * kChunkSize) *
+                             dimension);
+    size_t num_chunks = (size + kChunkSize - 1) / kChunkSize;
+    for (size_t first = 0; first < num_chunks; first += kChunksPerBatch) {
+        size_t last = std::min(first + kChunksPerBatch, num_chunks);
+#pragma omp parallel for schedule(dynamic)
+        for (size_t chunk = first; chunk < last; chunk++) {
+            size_t count = std::min(kChunkSize, size - chunk * kChunkSize);
+            model.Generate(stream, chunk, count,
+                           batch.data() +
+                               (chunk - first) * kChunkSize * dimension);
+        }
+        size_t count = std::min(size, last * kChunkSize) - first * kChunkSize;
+        for (size_t i = 0; i < count; i++) {
+            writer.Write(batch.data() + i * dimension, dimension);
+        }
+        LOG_INFO("Wrote " << first * kChunkSize + count << " vectors to "
+                          << file_name);
+    }
+}
+
+int main(int argc, char **argv) {
+    std::string base_vectors_file_name, query_vectors_file_name,
+        log_file_name, distribution_name = "uniform";
+    size_t base_size = 1000000;
+    size_t query_size = 10000;
+    GeneratorOptions options;
+    options.dimension = 128;
+    options.seed = 1;
+    options.num_clusters = 1000;
+    options.sigma = 0.05;
+    options.skew = 1;
+    options.duplicate_fraction = 0.1;
+    options.intrinsic_dimension = 16;
+    bool async_logging = false;
+    int cmd_flag;
+    while ((cmd_flag = getopt(argc, argv, "Aa:b:q:n:m:d:s:c:v:z:p:r:l:")) !=
+           -1) {
+        switch (cmd_flag) {
+            case 'a':
+                distribution_name.assign(optarg);
+                break;
+            case 'b':
+                base_vectors_file_name.assign(optarg);
+                break;
+            case 'q':
+                query_vectors_file_name.assign(optarg);
+                break;
+            case 'n':
+                base_size = std::stoull(optarg);
+                break;
+            case 'm':
+                query_size = std::stoull(optarg);
+                break;
+            case 'd':
+                options.dimension = std::stoi(optarg);
+                break;
+            case 's':
+                options.seed = std::stoull(optarg);
+                break;
+            case 'c':
+                options.num_clusters = std::stoul(optarg);
+                break;
+            case 'v':
+                options.sigma = std::stof(optarg);
+                break;
+            case 'z':
+                options.skew = std::stof(optarg);
+                break;
+            case 'p':
+                options.duplicate_fraction = std::stof(optarg);
+                break;
+            case 'r':
+                options.intrinsic_dimension = std::stoul(optarg);
+                break;
+            case 'A':
+                async_logging = true;
+                break;
+            case 'l':
+                log_file_name.assign(optarg);
+                break;
+            default:
+                std::cerr << "main() : Invalid command line argument"
+                          << std::endl;
+                exit(1);
+        }
+    }
+    if (base_vectors_file_name.empty()) {
+        std::cerr << "main() : Base vector output file must be specified "
+                     "(use -b flag)\n";
+        exit(1);
+    }
+    if (distribution_name == "uniform") {
+        options.distribution = UNIFORM;
+    } else if (distribution_name == "gaussian") {
+        options.distribution = GAUSSIAN;
+    } else if (distribution_name == "skewed") {
+        options.distribution = SKEWED;
+    } else if (distribution_name == "lowrank") {
+        options.distribution = LOW_RANK;
+    } else {
+        std::cerr << "main() : Distribution must be one of uniform, gaussian, "
+                     "skewed, lowrank\n";
+        exit(1);
+    }
+    if (options.dimension <= 0 || options.num_clusters == 0 ||
+        options.intrinsic_dimension == 0) {
+        std::cerr << "main() : Dimension, cluster count and intrinsic "
+                     "dimension must be positive\n";
+        exit(1);
+    }
+    fast_ann::ScopedLogSink log_sink(log_file_name, async_logging);
+    if (!log_sink.is_open()) {
+        std::cerr << "main() : Error opening log file\n";
+        exit(1);
+    }
+    fast_ann::SetLogLevel(fast_ann::LogLevel::INFO);
+
+    DatasetModel model(options);
+    WriteDataset(model, kBaseStream, base_size, options.dimension,
+                 base_vectors_file_name);
+    if (!query_vectors_file_name.empty()) {
+        WriteDataset(model, kQueryStream, query_size, options.dimension,
+                     query_vectors_file_name);
+    }
+    return 0;
+}
@@ -0,0 +1,214 @@
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "fast_ann/benchmark/recall.h"
+#include "fast_ann/data_readers/xvecs_reader.h"
+#include "fast_ann/data_readers/xvecs_stream_reader.h"
+#include "fast_ann/log_sinks/scoped_log_sink.h"
+#include "fast_ann/logger.h"
+#include "fast_ann/server/search_client.h"
+
+typedef std::chrono::steady_clock Clock;
+
+// Exact percentile of sorted values, in [0, 100], rather than the bucket
+// bound fast_ann::Histogram gives.
+double Percentile(const std::vector<double> &sorted, double percentile) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t rank = std::ceil(percentile / 100 * sorted.size());
+    return sorted[std::max<size_t>(rank, 1) - 1];
+}
+
+int main(int argc, char **argv) {
+    std::string query_vectors_file_name, ground_truth_file_name,
+        log_file_name;
+    std::string address = "unix:/tmp/fast_ann.sock";
+    double qps = 0;
+    size_t num_requests = 0;
+    uint32_t k = 10;
+    uint32_t deadline_micros = 0;
+    size_t num_connections = 1;
+    bool async_logging = false;
+    int cmd_flag;
+    while ((cmd_flag = getopt(argc, argv, "Aa:q:g:r:n:k:e:c:l:")) != -1) {
+        switch (cmd_flag) {
+            case 'a':
+                address.assign(optarg);
+                break;
+            case 'q':
+                query_vectors_file_name.assign(optarg);
+                break;
+            case 'g':
+                ground_truth_file_name.assign(optarg);
+                break;
+            case 'r':
+                qps = std::stod(optarg);
+                break;
+            case 'n':
+                num_requests = std::stoul(optarg);
+                break;
+            case 'k':
+                k = std::stoul(optarg);
+                break;
+            case 'e':
+                deadline_micros = std::stoul(optarg);
+                break;
+            case 'c':
+                num_connections = std::stoul(optarg);
+                break;
+            case 'A':
+                async_logging = true;
+                break;
+            case 'l':
+                log_file_name.assign(optarg);
+                break;
+            default:
+                std::cerr << "main() : Invalid command line argument"
+                          << std::endl;
+                exit(1);
+        }
+    }
+    if (query_vectors_file_name.empty() || qps <= 0 || num_connections == 0) {
+        std::cerr << "main() : Query vector file and a positive rate must be "
+                     "specified (use -q -r flags)\n";
+        exit(1);
+    }
+    fast_ann::ScopedLogSink log_sink(log_file_name, async_logging);
+    if (!log_sink.is_open()) {
+        std::cerr << "main() : Error opening log file\n";
+        exit(1);
+    }
+    fast_ann::SetLogLevel(fast_ann::LogLevel::INFO);
+
+    fast_ann::XvecsStreamReader<float> reader(query_vectors_file_name);
+    fast_ann::DimensionType dimension = reader.dimension();
+    size_t num_queries = reader.size();
+    std::vector<float> queries(num_queries * dimension);
+    reader.ReadBlock(queries.data(), num_queries);
+    if (num_queries == 0) {
+        std::cerr << "main() : Empty query file\n";
+        exit(1);
+    }
+    if (num_requests == 0) {
+        num_requests = num_queries;
+    }
+
+    std::vector<std::unique_ptr<fast_ann::SearchClient> > clients;
+    for (size_t c = 0; c < num_connections; c++) {
+        clients.emplace_back(new fast_ann::SearchClient(address));
+    }
+
+    // Request i replays query i modulo their number on connection i modulo
+    // num_connections, at start + i / qps whether or not the earlier ones
+    // were answered. Latencies run from that planned time, so that a late
+    // sender does not hide the wait from the report.
+    Clock::time_point start = Clock::now() + std::chrono::milliseconds(10);
+    auto planned = [&](size_t i) {
+        return start + std::chrono::duration_cast<Clock::duration>(
+                           std::chrono::duration<double>(i / qps));
+    };
+    std::vector<uint32_t> statuses(num_requests, fast_ann::STATUS_ERROR);
+    std::vector<double> latencies(num_requests, 0);
+    std::vector<std::vector<fast_ann::DatasetIndexType> > results(
+        std::min(num_requests, num_queries));
+    std::vector<Clock::time_point> last_response(num_connections, start);
+    std::vector<std::thread> threads;
+    for (size_t c = 0; c < num_connections; c++) {
+        threads.push_back(std::thread([&, c]() {
+            for (size_t i = c; i < num_requests; i += num_connections) {
+                std::this_thread::sleep_until(planned(i));
+                const float *query =
+                    queries.data() + (i % num_queries) * dimension;
+                if (!clients[c]->Send(i, query, dimension, k,
+                                      deadline_micros)) {
+                    break;
+                }
+            }
+            clients[c]->Finish();
+        }));
+        // The server keeps the connection open, every request sent on it is
+        // answered once.
+        size_t num_expected =
+            c < num_requests
+                ? (num_requests - c + num_connections - 1) / num_connections
+                : 0;
+        threads.push_back(std::thread([&, c, num_expected]() {
+            fast_ann::ResponseHeader header;
+            std::vector<fast_ann::ResultEntry> entries;
+            for (size_t received = 0; received < num_expected &&
+                                      clients[c]->Receive(header, entries);
+                 received++) {
+                if (header.id >= num_requests) {
+                    continue;
+                }
+                Clock::time_point now = Clock::now();
+                statuses[header.id] = header.status;
+                latencies[header.id] =
+                    std::chrono::duration<double, std::micro>(
+                        now - planned(header.id))
+                        .count();
+                if (header.id < results.size()) {
+                    for (const fast_ann::ResultEntry &entry : entries) {
+                        results[header.id].push_back(entry.id);
+                    }
+                }
+                last_response[c] = now;
+            }
+        }));
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+
+    std::vector<double> answered;
+    size_t num_status[5] = {0, 0, 0, 0, 0};
+    Clock::time_point end = start;
+    for (size_t c = 0; c < num_connections; c++) {
+        end = std::max(end, last_response[c]);
+    }
+    for (size_t i = 0; i < num_requests; i++) {
+        num_status[std::min<uint32_t>(statuses[i], 4)]++;
+        if (statuses[i] == fast_ann::STATUS_OK) {
+            answered.push_back(latencies[i]);
+        }
+    }
+    std::sort(answered.begin(), answered.end());
+    double sum = 0;
+    for (double latency : answered) {
+        sum += latency;
+    }
+    double seconds = std::chrono::duration<double>(end - start).count();
+    std::cout << "Requests : " << num_requests << ", answered "
+              << num_status[fast_ann::STATUS_OK] << ", overloaded "
+              << num_status[fast_ann::STATUS_OVERLOADED] << ", expired "
+              << num_status[fast_ann::STATUS_DEADLINE_EXCEEDED]
+              << ", failed or lost "
+              << num_status[fast_ann::STATUS_BAD_REQUEST] +
+                     num_status[fast_ann::STATUS_ERROR]
+              << "\n";
+    std::cout << "Offered QPS : " << qps << ", answered QPS : "
+              << (seconds > 0 ? num_status[fast_ann::STATUS_OK] / seconds : 0)
+              << "\n";
+    std::cout << "Latency us mean p50 p90 p99 p99.9 max : "
+              << (answered.empty() ? 0 : sum / answered.size()) << " "
+              << Percentile(answered, 50) << " " << Percentile(answered, 90)
+              << " " << Percentile(answered, 99) << " "
+              << Percentile(answered, 99.9) << " " << Percentile(answered, 100)
+              << "\n";
+    if (!ground_truth_file_name.empty()) {
+        fast_ann::XvecsReader<int> gt_reader;
+        fast_ann::Dataset<int> gt_dataset =
+            gt_reader.read(ground_truth_file_name);
+        std::cout << "Recall@" << k << " of the first pass : "
+                  << fast_ann::ComputeRecall(results, gt_dataset, k) << "\n";
+    }
+    return 0;
+}
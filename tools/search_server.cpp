@@ -0,0 +1,149 @@
+#include <signal.h>
+#include <unistd.h>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include "fast_ann/benchmark/timer.h"
+#include "fast_ann/data_readers/xvecs_stream_reader.h"
+#include "fast_ann/index_factory.h"
+#include "fast_ann/log_sinks/scoped_log_sink.h"
+#include "fast_ann/logger.h"
+#include "fast_ann/server/search_server.h"
+
+// Seconds between two reports of the server stats.
+const int kStatsIntervalSeconds = 10;
+
+void PrintStats(const fast_ann::SearchServerStats &stats) {
+    std::cout << "Requests : " << stats.requests << ", rejected "
+              << stats.rejected << ", expired " << stats.expired << ", bad "
+              << stats.bad_requests << ", failed " << stats.failed
+              << ", dropped connections " << stats.dropped_connections << "\n";
+    if (stats.errors > 0) {
+        std::cout << "Errors : " << stats.errors << ", last : "
+                  << stats.last_error << "\n";
+    }
+    std::cout << "Batches : " << stats.batches << ", mean size "
+              << stats.batch_sizes.mean() << ", size limit "
+              << stats.batch_limit << "\n";
+    std::cout << "Latency us mean p50 p99 max : " << stats.latencies.mean()
+              << " " << stats.latencies.Percentile(50) << " "
+              << stats.latencies.Percentile(99) << " " << stats.latencies.max()
+              << std::endl;
+}
+
+int main(int argc, char **argv) {
+    std::string base_vectors_file_name, log_file_name;
+    std::string address = "unix:/tmp/fast_ann.sock";
+    std::string description = "HNSW16,ef=64";
+    size_t num_shards = 1;
+    fast_ann::SearchServerOptions options;
+    bool async_logging = false;
+    int cmd_flag;
+    while ((cmd_flag = getopt(argc, argv, "Ab:a:d:s:t:m:w:p:e:q:o:l:")) != -1) {
+        switch (cmd_flag) {
+            case 'b':
+                base_vectors_file_name.assign(optarg);
+                break;
+            case 'a':
+                address.assign(optarg);
+                break;
+            case 'd':
+                description.assign(optarg);
+                break;
+            case 's':
+                num_shards = std::stoul(optarg);
+                break;
+            case 't':
+                options.num_threads = std::stoi(optarg);
+                break;
+            case 'm':
+                options.max_batch_size = std::stoul(optarg);
+                break;
+            case 'w':
+                options.max_batch_delay_micros = std::stod(optarg);
+                break;
+            case 'p':
+                options.latency_target_micros = std::stod(optarg);
+                break;
+            case 'e':
+                options.default_deadline_micros = std::stod(optarg);
+                break;
+            case 'q':
+                options.max_queue_size = std::stoul(optarg);
+                break;
+            case 'o':
+                options.send_timeout_micros = std::stod(optarg);
+                break;
+            case 'A':
+                async_logging = true;
+                break;
+            case 'l':
+                log_file_name.assign(optarg);
+                break;
+            default:
+                std::cerr << "main() : Invalid command line argument"
+                          << std::endl;
+                exit(1);
+        }
+    }
+    if (base_vectors_file_name.empty() || num_shards == 0) {
+        std::cerr << "main() : Base vector file must be specified (use -b "
+                     "flag) and there must be at least one shard\n";
+        exit(1);
+    }
+    fast_ann::ScopedLogSink log_sink(log_file_name, async_logging);
+    if (!log_sink.is_open()) {
+        std::cerr << "main() : Error opening log file\n";
+        exit(1);
+    }
+    fast_ann::SetLogLevel(fast_ann::LogLevel::INFO);
+
+    // Blocked before any thread starts, so that only sigtimedwait below
+    // receives them.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    fast_ann::XvecsStreamReader<float> reader(base_vectors_file_name);
+    fast_ann::DimensionType dimension = reader.dimension();
+    size_t base_size = reader.size();
+    std::vector<float> base(base_size * dimension);
+    reader.ReadBlock(base.data(), base_size);
+
+    // Shard s holds the base vectors in [s * size / num_shards,
+    // (s + 1) * size / num_shards), under their position in the file.
+    fast_ann::Timer timer;
+    std::vector<std::unique_ptr<fast_ann::SearchAlgorithm> > shards;
+    std::vector<fast_ann::SearchAlgorithm *> shard_ptrs;
+    for (size_t s = 0; s < num_shards; s++) {
+        size_t begin = base_size * s / num_shards;
+        size_t end = base_size * (s + 1) / num_shards;
+        std::vector<fast_ann::DatasetIndexType> ids(end - begin);
+        for (size_t i = begin; i < end; i++) {
+            ids[i - begin] = i;
+        }
+        shards.emplace_back(
+            fast_ann::CreateSearchAlgorithm(description, dimension));
+        shards.back()->Add(base.data() + begin * dimension, ids.data(),
+                           end - begin);
+        shard_ptrs.push_back(shards.back().get());
+    }
+    std::cout << "Built " << num_shards << " shards of " << description
+              << " in " << timer.GetElapsedTime() << " ms" << std::endl;
+
+    fast_ann::SearchServer server(shard_ptrs, options);
+    server.Start(address);
+    std::cout << "Serving on " << address << std::endl;
+    timespec timeout = {kStatsIntervalSeconds, 0};
+    while (sigtimedwait(&signals, nullptr, &timeout) < 0) {
+        PrintStats(server.stats());
+    }
+    server.Stop();
+    std::cout << "Stopped\n";
+    PrintStats(server.stats());
+    return 0;
+}